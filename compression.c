@@ -0,0 +1,443 @@
+#include "compression.h"
+
+#include "shared.h"
+#include "configuration.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#ifdef WEBDAVD_ZSTD
+#include <zstd.h>
+#endif
+
+#ifdef WEBDAVD_BROTLI
+#include <brotli/encode.h>
+#endif
+
+////////////////
+// Structures //
+////////////////
+
+typedef struct CompressionStream {
+	ContentEncoding encoding;
+	int sourceFd;
+	int targetFd;
+	char * prefix;
+	size_t prefixSize;
+	size_t prefixUsed;
+} CompressionStream;
+
+////////////////////
+// End Structures //
+////////////////////
+
+static sem_t compressionWorkers;
+
+////////////////
+// Stream I/O //
+////////////////
+
+// Reads the next chunk of uncompressed data.  The prefix (bytes already read while deciding whether to
+// compress at all) is returned before anything is read from the source.
+static ssize_t readSource(CompressionStream * stream, char * buffer, size_t bufferSize) {
+	if (stream->prefixUsed < stream->prefixSize) {
+		size_t size = stream->prefixSize - stream->prefixUsed;
+		if (size > bufferSize) {
+			size = bufferSize;
+		}
+		memcpy(buffer, stream->prefix + stream->prefixUsed, size);
+		stream->prefixUsed += size;
+		return size;
+	}
+	ssize_t bytesRead;
+	do {
+		bytesRead = read(stream->sourceFd, buffer, bufferSize);
+	} while (bytesRead < 0 && errno == EINTR);
+	if (bytesRead < 0) {
+		stdLogError(errno, "Could not read content to compress");
+	}
+	return bytesRead;
+}
+
+// The target is a socket so that a client disconnecting gives EPIPE rather than killing the daemon with SIGPIPE.
+static int writeTarget(CompressionStream * stream, const unsigned char * buffer, size_t size) {
+	while (size > 0) {
+		ssize_t bytesWritten = send(stream->targetFd, buffer, size, MSG_NOSIGNAL);
+		if (bytesWritten < 0) {
+			if (errno == EINTR) continue;
+			// EPIPE just means the response was abandoned, typically a HEAD request or the client going away.
+			if (errno != EPIPE && errno != ECONNRESET) {
+				stdLogError(errno, "Could not write compressed content");
+			}
+			return 0;
+		}
+		buffer += bytesWritten;
+		size -= bytesWritten;
+	}
+	return 1;
+}
+
+////////////////////
+// End Stream I/O //
+////////////////////
+
+////////////
+// Codecs //
+////////////
+
+static void compressGzip(CompressionStream * stream, char * in, unsigned char * out) {
+	z_stream z;
+	memset(&z, 0, sizeof(z));
+	int level = config.compressionLevel ? config.compressionLevel : Z_DEFAULT_COMPRESSION;
+	if (level > Z_BEST_COMPRESSION) {
+		level = Z_BEST_COMPRESSION;
+	}
+	// windowBits + 16 produces a gzip header and trailer rather than a raw zlib stream
+	if (deflateInit2(&z, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		stdLogError(0, "Could not initialise gzip: %s", z.msg ? z.msg : "");
+		return;
+	}
+	int flush;
+	do {
+		ssize_t bytesRead = readSource(stream, in, BUFFER_SIZE);
+		if (bytesRead < 0) break;
+		flush = bytesRead ? Z_NO_FLUSH : Z_FINISH;
+		z.next_in = (unsigned char *) in;
+		z.avail_in = bytesRead;
+		do {
+			z.next_out = out;
+			z.avail_out = BUFFER_SIZE;
+			deflate(&z, flush);
+			if (!writeTarget(stream, out, BUFFER_SIZE - z.avail_out)) {
+				flush = Z_FINISH;
+				break;
+			}
+		} while (z.avail_out == 0);
+	} while (flush != Z_FINISH);
+	deflateEnd(&z);
+}
+
+#ifdef WEBDAVD_ZSTD
+static void compressZstd(CompressionStream * stream, char * in, unsigned char * out) {
+	ZSTD_CCtx * context = ZSTD_createCCtx();
+	if (!context) {
+		stdLogError(0, "Could not initialise zstd");
+		return;
+	}
+	int level = config.compressionLevel ? config.compressionLevel : ZSTD_CLEVEL_DEFAULT;
+	if (level > ZSTD_maxCLevel()) {
+		level = ZSTD_maxCLevel();
+	}
+	ZSTD_CCtx_setParameter(context, ZSTD_c_compressionLevel, level);
+	ZSTD_EndDirective mode;
+	do {
+		ssize_t bytesRead = readSource(stream, in, BUFFER_SIZE);
+		if (bytesRead < 0) break;
+		mode = bytesRead ? ZSTD_e_continue : ZSTD_e_end;
+		ZSTD_inBuffer input = { .src = in, .size = bytesRead, .pos = 0 };
+		size_t remaining;
+		do {
+			ZSTD_outBuffer output = { .dst = out, .size = BUFFER_SIZE, .pos = 0 };
+			remaining = ZSTD_compressStream2(context, &output, &input, mode);
+			if (ZSTD_isError(remaining)) {
+				stdLogError(0, "Could not compress with zstd: %s", ZSTD_getErrorName(remaining));
+				mode = ZSTD_e_end;
+				break;
+			}
+			if (!writeTarget(stream, out, output.pos)) {
+				mode = ZSTD_e_end;
+				break;
+			}
+		} while (mode == ZSTD_e_end ? remaining != 0 : input.pos < input.size);
+	} while (mode != ZSTD_e_end);
+	ZSTD_freeCCtx(context);
+}
+#endif
+
+#ifdef WEBDAVD_BROTLI
+static void compressBrotli(CompressionStream * stream, char * in, unsigned char * out) {
+	BrotliEncoderState * state = BrotliEncoderCreateInstance(NULL, NULL, NULL);
+	if (!state) {
+		stdLogError(0, "Could not initialise brotli");
+		return;
+	}
+	// Brotli's default quality (11) is far too slow for on-the-fly compression
+	int quality = config.compressionLevel ? config.compressionLevel : 5;
+	if (quality > BROTLI_MAX_QUALITY) {
+		quality = BROTLI_MAX_QUALITY;
+	}
+	BrotliEncoderSetParameter(state, BROTLI_PARAM_QUALITY, quality);
+	BrotliEncoderOperation operation;
+	do {
+		ssize_t bytesRead = readSource(stream, in, BUFFER_SIZE);
+		if (bytesRead < 0) break;
+		operation = bytesRead ? BROTLI_OPERATION_PROCESS : BROTLI_OPERATION_FINISH;
+		size_t availableIn = bytesRead;
+		const uint8_t * nextIn = (const uint8_t *) in;
+		do {
+			size_t availableOut = BUFFER_SIZE;
+			uint8_t * nextOut = out;
+			if (!BrotliEncoderCompressStream(state, operation, &availableIn, &nextIn, &availableOut, &nextOut,
+					NULL)) {
+				stdLogError(0, "Could not compress with brotli");
+				operation = BROTLI_OPERATION_FINISH;
+				break;
+			}
+			if (!writeTarget(stream, out, BUFFER_SIZE - availableOut)) {
+				operation = BROTLI_OPERATION_FINISH;
+				break;
+			}
+		} while (availableIn > 0 || BrotliEncoderHasMoreOutput(state)
+				|| (operation == BROTLI_OPERATION_FINISH && !BrotliEncoderIsFinished(state)));
+	} while (operation != BROTLI_OPERATION_FINISH);
+	BrotliEncoderDestroyInstance(state);
+}
+#endif
+
+////////////////
+// End Codecs //
+////////////////
+
+////////////////////////
+// Compression Worker //
+////////////////////////
+
+static void * compressionWorker(void * data) {
+	CompressionStream * stream = data;
+	char * in = mallocSafe(BUFFER_SIZE);
+	unsigned char * out = mallocSafe(BUFFER_SIZE);
+
+	switch (stream->encoding) {
+#ifdef WEBDAVD_ZSTD
+	case CONTENT_ENCODING_ZSTD:
+		compressZstd(stream, in, out);
+		break;
+#endif
+#ifdef WEBDAVD_BROTLI
+	case CONTENT_ENCODING_BROTLI:
+		compressBrotli(stream, in, out);
+		break;
+#endif
+	default:
+		compressGzip(stream, in, out);
+		break;
+	}
+
+	freeSafe(in);
+	freeSafe(out);
+	close(stream->sourceFd);
+	close(stream->targetFd);
+	if (stream->prefix) {
+		freeSafe(stream->prefix);
+	}
+	freeSafe(stream);
+	releaseCompressionWorker();
+	return NULL;
+}
+
+// Compression is CPU bound so it is limited to a fixed number of workers.  Responses which can't get a worker
+// are simply sent uncompressed rather than waiting.
+int reserveCompressionWorker() {
+	return sem_trywait(&compressionWorkers) == 0;
+}
+
+void releaseCompressionWorker() {
+	sem_post(&compressionWorkers);
+}
+
+// Starts compressing sourceFd (after first sending prefix) on a worker thread.  The worker must already have been
+// reserved with reserveCompressionWorker().  Ownership of sourceFd and prefix passes to the worker even on
+// failure. Returns the fd to read the compressed content from or -1 on failure.
+int startCompressionWorker(ContentEncoding encoding, int sourceFd, char * prefix, size_t prefixSize) {
+	int sockFd[2];
+	if (socketpair(PF_LOCAL, SOCK_STREAM | SOCK_CLOEXEC, 0, sockFd) != 0) {
+		stdLogError(errno, "Could not create socket pair for compression");
+		goto FAIL;
+	}
+	shutdown(sockFd[PIPE_READ], SHUT_WR);
+	shutdown(sockFd[PIPE_WRITE], SHUT_RD);
+
+	CompressionStream * stream = mallocSafe(sizeof(*stream));
+	stream->encoding = encoding;
+	stream->sourceFd = sourceFd;
+	stream->targetFd = sockFd[PIPE_WRITE];
+	stream->prefix = prefix;
+	stream->prefixSize = prefixSize;
+	stream->prefixUsed = 0;
+
+	pthread_t thread;
+	pthread_attr_t attributes;
+	pthread_attr_init(&attributes);
+	pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+	int result = pthread_create(&thread, &attributes, &compressionWorker, stream);
+	pthread_attr_destroy(&attributes);
+	if (result != 0) {
+		stdLogError(result, "Could not start compression worker");
+		freeSafe(stream);
+		close(sockFd[PIPE_READ]);
+		close(sockFd[PIPE_WRITE]);
+		goto FAIL;
+	}
+	return sockFd[PIPE_READ];
+
+	FAIL: close(sourceFd);
+	if (prefix) {
+		freeSafe(prefix);
+	}
+	releaseCompressionWorker();
+	return -1;
+}
+
+////////////////////////////
+// End Compression Worker //
+////////////////////////////
+
+/////////////////
+// Negotiation //
+/////////////////
+
+const char * contentEncodingName(ContentEncoding encoding) {
+	switch (encoding) {
+	case CONTENT_ENCODING_GZIP:
+		return "gzip";
+	case CONTENT_ENCODING_BROTLI:
+		return "br";
+	case CONTENT_ENCODING_ZSTD:
+		return "zstd";
+	default:
+		return "identity";
+	}
+}
+
+static int isSupportedEncoding(ContentEncoding encoding) {
+	switch (encoding) {
+	case CONTENT_ENCODING_GZIP:
+		return 1;
+#ifdef WEBDAVD_BROTLI
+	case CONTENT_ENCODING_BROTLI:
+		return 1;
+#endif
+#ifdef WEBDAVD_ZSTD
+	case CONTENT_ENCODING_ZSTD:
+		return 1;
+#endif
+	default:
+		return 0;
+	}
+}
+
+int isCompressibleType(const char * mimeType) {
+	if (config.disableCompression || !mimeType) {
+		return 0;
+	}
+	for (int i = 0; i < config.compressionMimeTypeCount; i++) {
+		if (mimeTypeMatches(config.compressionMimeTypes[i], mimeType)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// Reads the q-value of each content coding we know from an Accept-Encoding header (RFC 9110 section 12.5.3).
+// Codings not mentioned are only acceptable through "*".  Any coding with a q-value of 0 is not acceptable.
+static void parseAcceptEncoding(const char * acceptEncoding, double * quality) {
+	double wildcard = 0;
+	for (int i = 0; i <= CONTENT_ENCODING_ZSTD; i++) {
+		quality[i] = -1;
+	}
+	const char * ptr = acceptEncoding;
+	while (*ptr) {
+		while (*ptr == ' ' || *ptr == '\t' || *ptr == ',') {
+			ptr++;
+		}
+		if (!*ptr) break;
+
+		size_t tokenLength = strcspn(ptr, " \t,;");
+		const char * token = ptr;
+		ptr += tokenLength;
+
+		double q = 1;
+		const char * end = ptr + strcspn(ptr, ",");
+		const char * parameter = memchr(ptr, ';', end - ptr);
+		if (parameter) {
+			parameter++;
+			while (*parameter == ' ' || *parameter == '\t') {
+				parameter++;
+			}
+			if ((*parameter == 'q' || *parameter == 'Q') && parameter[1] == '=') {
+				q = strtod(parameter + 2, NULL);
+			}
+		}
+		ptr = end;
+
+		if (tokenLength == 1 && *token == '*') {
+			wildcard = q;
+		} else if ((tokenLength == 4 && !strncasecmp(token, "gzip", 4))
+				|| (tokenLength == 6 && !strncasecmp(token, "x-gzip", 6))) {
+			quality[CONTENT_ENCODING_GZIP] = q;
+		} else if (tokenLength == 2 && !strncasecmp(token, "br", 2)) {
+			quality[CONTENT_ENCODING_BROTLI] = q;
+		} else if (tokenLength == 4 && !strncasecmp(token, "zstd", 4)) {
+			quality[CONTENT_ENCODING_ZSTD] = q;
+		}
+	}
+	for (int i = 0; i <= CONTENT_ENCODING_ZSTD; i++) {
+		if (quality[i] < 0) {
+			quality[i] = wildcard;
+		}
+	}
+}
+
+// Picks the best content coding we can compress with.  The highest q-value wins, ties go to the best compression.
+ContentEncoding negotiateContentEncoding(const char * acceptEncoding) {
+	if (!acceptEncoding || config.disableCompression) {
+		return CONTENT_ENCODING_IDENTITY;
+	}
+	double quality[CONTENT_ENCODING_ZSTD + 1];
+	parseAcceptEncoding(acceptEncoding, quality);
+
+	ContentEncoding best = CONTENT_ENCODING_IDENTITY;
+	double bestQuality = 0;
+	for (ContentEncoding encoding = CONTENT_ENCODING_GZIP; encoding <= CONTENT_ENCODING_ZSTD; encoding++) {
+		if (isSupportedEncoding(encoding) && quality[encoding] > 0 && quality[encoding] >= bestQuality) {
+			best = encoding;
+			bestQuality = quality[encoding];
+		}
+	}
+	return best;
+}
+
+// All content codings the client accepts as a mask of CONTENT_ENCODING_BIT().  This doesn't depend on what
+// webdavd can compress with since it's used to pick precompressed files.
+int acceptedContentEncodings(const char * acceptEncoding) {
+	if (!acceptEncoding) {
+		return 0;
+	}
+	double quality[CONTENT_ENCODING_ZSTD + 1];
+	parseAcceptEncoding(acceptEncoding, quality);
+
+	int accepted = 0;
+	for (ContentEncoding encoding = CONTENT_ENCODING_GZIP; encoding <= CONTENT_ENCODING_ZSTD; encoding++) {
+		if (quality[encoding] > 0) {
+			accepted |= CONTENT_ENCODING_BIT(encoding);
+		}
+	}
+	return accepted;
+}
+
+/////////////////////
+// End Negotiation //
+/////////////////////
+
+void initializeCompression() {
+	if (sem_init(&compressionWorkers, 0, config.compressionWorkers) == -1) {
+		stdLogError(errno, "Could not create compression worker semaphore");
+		exit(255);
+	}
+}
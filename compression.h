@@ -0,0 +1,19 @@
+#ifndef WEBDAV_COMPRESSION_H
+#define WEBDAV_COMPRESSION_H
+
+#include "shared.h"
+
+#include <stddef.h>
+
+void initializeCompression();
+
+int isCompressibleType(const char * mimeType);
+ContentEncoding negotiateContentEncoding(const char * acceptEncoding);
+int acceptedContentEncodings(const char * acceptEncoding);
+const char * contentEncodingName(ContentEncoding encoding);
+
+int reserveCompressionWorker();
+void releaseCompressionWorker();
+int startCompressionWorker(ContentEncoding encoding, int sourceFd, char * prefix, size_t prefixSize);
+
+#endif
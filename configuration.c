@@ -29,6 +29,42 @@ static int readConfigInt(xmlTextReaderPtr reader, int * value, const char * conf
 	return result;
 }
 
+static int readConfigSize(xmlTextReaderPtr reader, size_t * value, const char * configFile) {
+	const char * nodeName = xmlTextReaderConstLocalName(reader);
+	const char * valueString;
+	int result = stepOverText(reader, &valueString);
+	if (valueString) {
+		char * endPtr;
+		long long int tmp = strtoll(valueString, &endPtr, 10);
+		int shift = 0;
+		switch (*endPtr) {
+		case 'k':
+		case 'K':
+			shift = 10;
+			endPtr++;
+			break;
+		case 'm':
+		case 'M':
+			shift = 20;
+			endPtr++;
+			break;
+		case 'g':
+		case 'G':
+			shift = 30;
+			endPtr++;
+			break;
+		}
+		if (*endPtr || endPtr == valueString || tmp < 0 || tmp > (0x7FFFFFFFFFFFLL >> shift)) {
+			stdLogError(0, "Invalid %s value %s - should be a size eg: 512K, 64M in %s", nodeName, valueString,
+					configFile);
+			exit(1);
+		}
+		*value = tmp << shift;
+		xmlFree((char *) valueString);
+	}
+	return result;
+}
+
 static int readConfigString(xmlTextReaderPtr reader, const char ** value) {
 	if (*value) {
 		xmlFree((char *) *value);
@@ -90,6 +126,8 @@ static int configListen(WebdavdConfiguration * config, xmlTextReaderPtr reader,
 				result = readConfigInt(reader, &config->daemons[index].port, configFile);
 			} else if (!strcmp(xmlTextReaderConstLocalName(reader), "host")) {
 				result = readConfigString(reader, &config->daemons[index].host);
+			} else if (!strcmp(xmlTextReaderConstLocalName(reader), "event-stream-port")) {
+				result = readConfigInt(reader, &config->daemons[index].eventStreamPort, configFile);
 			} else if (!strcmp(xmlTextReaderConstLocalName(reader), "encryption")) {
 				const char * encryptionString;
 				result = stepOverText(reader, &encryptionString);
@@ -172,6 +210,11 @@ static int configRapTimeout(WebdavdConfiguration * config, xmlTextReaderPtr read
 	return readConfigTime(reader, &config->rapTimeoutRead, configFile);
 }
 
+static int configUploadExpiry(WebdavdConfiguration * config, xmlTextReaderPtr reader, const char * configFile) {
+	// <upload-expiry>24:00:00</upload-expiry>
+	return readConfigTime(reader, &config->uploadExpiry, configFile);
+}
+
 static int configRestricted(WebdavdConfiguration * config, xmlTextReaderPtr reader, const char * configFile) {
 	//<restricted>nobody</restricted>
 	return readConfigString(reader, &config->restrictedUser);
@@ -182,6 +225,26 @@ static int configMimeFile(WebdavdConfiguration * config, xmlTextReaderPtr reader
 	return readConfigString(reader, &config->mimeTypesFile);
 }
 
+static int configPutDurability(WebdavdConfiguration * config, xmlTextReaderPtr reader, const char * configFile) {
+	// <put-durability>close-sync</put-durability>
+	const char * durabilityString;
+	int result = stepOverText(reader, &durabilityString);
+	if (durabilityString) {
+		if (!strcmp(durabilityString, "none")) {
+			config->putDurability = PUT_DURABILITY_NONE;
+		} else if (!strcmp(durabilityString, "close-sync")) {
+			config->putDurability = PUT_DURABILITY_CLOSE_SYNC;
+		} else if (!strcmp(durabilityString, "write-behind")) {
+			config->putDurability = PUT_DURABILITY_WRITE_BEHIND;
+		} else {
+			stdLogError(0, "invalid put-durability %s in %s", durabilityString, configFile);
+			exit(1);
+		}
+		xmlFree((char *) durabilityString);
+	}
+	return result;
+}
+
 static int configRapBinary(WebdavdConfiguration * config, xmlTextReaderPtr reader, const char * configFile) {
 	//<rap-binary>/usr/sbin/rap</rap-binary>
 	return readConfigString(reader, &config->rapBinary);
@@ -308,6 +371,100 @@ static int configUnprotectOptions(WebdavdConfiguration * config, xmlTextReaderPt
 	return result;
 }
 
+static int configSequentialReadSize(WebdavdConfiguration * config, xmlTextReaderPtr reader,
+		const char * configFile) {
+	// <sequential-read-size>8M</sequential-read-size>
+	return readConfigSize(reader, &config->sequentialReadSize, configFile);
+}
+
+static int configReadaheadSize(WebdavdConfiguration * config, xmlTextReaderPtr reader, const char * configFile) {
+	// <readahead-size>2M</readahead-size>
+	return readConfigSize(reader, &config->readaheadSize, configFile);
+}
+
+static int configDropBehindSize(WebdavdConfiguration * config, xmlTextReaderPtr reader, const char * configFile) {
+	// <drop-behind-size>64M</drop-behind-size>
+	return readConfigSize(reader, &config->dropBehindSize, configFile);
+}
+
+static int configMaxReadBufferSize(WebdavdConfiguration * config, xmlTextReaderPtr reader,
+		const char * configFile) {
+	// <max-read-buffer-size>256K</max-read-buffer-size>
+	return readConfigSize(reader, &config->maxReadBufferSize, configFile);
+}
+
+static int configDisableCompression(WebdavdConfiguration * config, xmlTextReaderPtr reader,
+		const char * configFile) {
+	// <disable-compression>true</disable-compression>
+	const char * valueString;
+	int result = stepOverText(reader, &valueString);
+	if (valueString) {
+		config->disableCompression = !strcmp(valueString, "true");
+		xmlFree((char *) valueString);
+	}
+	return result;
+}
+
+static int configCompressionLevel(WebdavdConfiguration * config, xmlTextReaderPtr reader,
+		const char * configFile) {
+	// <compression-level>6</compression-level>
+	return readConfigInt(reader, &config->compressionLevel, configFile);
+}
+
+static int configCompressionWorkers(WebdavdConfiguration * config, xmlTextReaderPtr reader,
+		const char * configFile) {
+	// <compression-workers>4</compression-workers>
+	return readConfigInt(reader, &config->compressionWorkers, configFile);
+}
+
+static int configCompressionMinSize(WebdavdConfiguration * config, xmlTextReaderPtr reader,
+		const char * configFile) {
+	// <compression-min-size>1K</compression-min-size>
+	return readConfigSize(reader, &config->compressionMinSize, configFile);
+}
+
+static int configCompressionMimeType(WebdavdConfiguration * config, xmlTextReaderPtr reader,
+		const char * configFile) {
+	// <compression-mime-type>text/*</compression-mime-type>
+	const char * mimeType;
+	int result = stepOverText(reader, &mimeType);
+	if (mimeType) {
+		int index = config->compressionMimeTypeCount++;
+		config->compressionMimeTypes = reallocSafe(config->compressionMimeTypes,
+				config->compressionMimeTypeCount * sizeof(*config->compressionMimeTypes));
+		config->compressionMimeTypes[index] = mimeType;
+	}
+	return result;
+}
+
+static int configPrecompressMinSize(WebdavdConfiguration * config, xmlTextReaderPtr reader,
+		const char * configFile) {
+	// <precompress-min-size>10M</precompress-min-size>
+	return readConfigSize(reader, &config->precompressMinSize, configFile);
+}
+
+static int configStatThreads(WebdavdConfiguration * config, xmlTextReaderPtr reader, const char * configFile) {
+	// <stat-threads>8</stat-threads>
+	return readConfigInt(reader, &config->statThreads, configFile);
+}
+
+static int configDirectoryCacheSize(WebdavdConfiguration * config, xmlTextReaderPtr reader,
+		const char * configFile) {
+	// <directory-cache-size>4M</directory-cache-size>
+	return readConfigSize(reader, &config->directoryCacheSize, configFile);
+}
+
+static int configDirectoryCacheDirectories(WebdavdConfiguration * config, xmlTextReaderPtr reader,
+		const char * configFile) {
+	// <directory-cache-directories>256</directory-cache-directories>
+	return readConfigInt(reader, &config->directoryCacheDirectories, configFile);
+}
+
+static int configTreeThreads(WebdavdConfiguration * config, xmlTextReaderPtr reader, const char * configFile) {
+	// <tree-threads>8</tree-threads>
+	return readConfigInt(reader, &config->treeThreads, configFile);
+}
+
 ///////////////////////////
 // End Handler Functions //
 ///////////////////////////
@@ -330,10 +487,19 @@ static int compareConfigFunction(const void * a, const void * b) {
 static const ConfigurationFunction configFunctions[] = {
 		{ .nodeName = "access-log", .func = &configAccessLog },                // <access-log />
 		{ .nodeName = "chroot-path", .func = &configChroot },                  // <chroot />
+		{ .nodeName = "compression-level", .func = &configCompressionLevel },  // <compression-level />
+		{ .nodeName = "compression-mime-type", .func = &configCompressionMimeType }, // <compression-mime-type />
+		{ .nodeName = "compression-min-size", .func = &configCompressionMinSize }, // <compression-min-size />
+		{ .nodeName = "compression-workers", .func = &configCompressionWorkers }, // <compression-workers />
+		{ .nodeName = "directory-cache-directories", .func = &configDirectoryCacheDirectories }, // <directory-cache-directories />
+		{ .nodeName = "directory-cache-size", .func = &configDirectoryCacheSize }, // <directory-cache-size />
+		{ .nodeName = "disable-compression", .func = &configDisableCompression }, // <disable-compression />
+		{ .nodeName = "drop-behind-size", .func = &configDropBehindSize },     // <drop-behind-size />
 		{ .nodeName = "error-log", .func = &configErrorLog },                  // <error-log />
 		{ .nodeName = "listen", .func = &configListen },                       // <listen />
 		{ .nodeName = "max-ip-connections", .func = &configMaxIpConnections }, // <max-ip-connections />
 		{ .nodeName = "max-lock-time", .func = &configMaxLockTime },           // <max-lock-time />
+		{ .nodeName = "max-read-buffer-size", .func = &configMaxReadBufferSize }, // <max-read-buffer-size />
 		{ .nodeName = "mime-file", .func = &configMimeFile },                  // <mime-file />
 		{ .nodeName = "pam-service", .func = &configPamService },              // <pam-service />
 		{ .nodeName = "pgsql-database", .func = &configPgsqlDatabase },        // <pgsql-database />
@@ -341,13 +507,20 @@ static const ConfigurationFunction configFunctions[] = {
 		{ .nodeName = "pgsql-password", .func = &configPgsqlPassword },        // <pgsql-password />
 		{ .nodeName = "pgsql-port", .func = &configPgsqlPort },                // <pgsql-port />
 		{ .nodeName = "pgsql-user", .func = &configPgsqlUser },                // <pgsql-user />
+		{ .nodeName = "precompress-min-size", .func = &configPrecompressMinSize }, // <precompress-min-size />
+		{ .nodeName = "put-durability", .func = &configPutDurability },        // <put-durability />
 		{ .nodeName = "rap-binary", .func = &configRapBinary },                // <rap-binary />
 		{ .nodeName = "rap-timeout", .func = &configRapTimeout },              // <rap-timeout />
+		{ .nodeName = "readahead-size", .func = &configReadaheadSize },        // <readahead-size />
 		{ .nodeName = "restricted", .func = &configRestricted },               // <restricted />
+		{ .nodeName = "sequential-read-size", .func = &configSequentialReadSize }, // <sequential-read-size />
 		{ .nodeName = "session-timeout", .func = &configSessionTimeout },      // <session-timeout />
 		{ .nodeName = "ssl-cert", .func = &configConfigSSLCert },              // <ssl-cert />
+		{ .nodeName = "stat-threads", .func = &configStatThreads },            // <stat-threads />
 		{ .nodeName = "static-response-dir", .func = &configResponseDir },      // <static-response-dir />
-		{ .nodeName = "unprotect-options", .func = &configUnprotectOptions }   // <unprotect-options />
+		{ .nodeName = "tree-threads", .func = &configTreeThreads },            // <tree-threads />
+		{ .nodeName = "unprotect-options", .func = &configUnprotectOptions },  // <unprotect-options />
+		{ .nodeName = "upload-expiry", .func = &configUploadExpiry }           // <upload-expiry />
 };
 
 static int configFunctionCount = sizeof(configFunctions) / sizeof(*configFunctions);
@@ -418,6 +591,52 @@ static int configureServer(WebdavdConfiguration * config, xmlTextReaderPtr reade
 	if (!config->restrictedUser) {
 		config->restrictedUser = "root";
 	}
+	if (!config->sequentialReadSize) {
+		config->sequentialReadSize = 8 * 1024 * 1024;
+	}
+	if (!config->readaheadSize) {
+		config->readaheadSize = 2 * 1024 * 1024;
+	}
+	if (!config->dropBehindSize) {
+		config->dropBehindSize = 64 * 1024 * 1024;
+	}
+	if (!config->maxReadBufferSize) {
+		config->maxReadBufferSize = 256 * 1024;
+	}
+	if (!config->compressionWorkers) {
+		config->compressionWorkers = 4;
+	}
+	if (!config->compressionMinSize) {
+		config->compressionMinSize = 1024;
+	}
+	if (!config->statThreads) {
+		config->statThreads = 8;
+	}
+	if (!config->directoryCacheSize) {
+		config->directoryCacheSize = 4 * 1024 * 1024;
+	}
+	if (!config->directoryCacheDirectories) {
+		config->directoryCacheDirectories = 256;
+	}
+	if (!config->treeThreads) {
+		config->treeThreads = 8;
+	}
+	if (!config->uploadExpiry) {
+		config->uploadExpiry = 24 * 60 * 60;
+	}
+	if (!config->compressionMimeTypeCount) {
+		static const char * defaultTypes[] = {
+				"text/*",
+				"application/xml",
+				"application/json",
+				"application/javascript",
+				"image/svg+xml" };
+		config->compressionMimeTypeCount = sizeof(defaultTypes) / sizeof(*defaultTypes);
+		config->compressionMimeTypes = mallocSafe(sizeof(defaultTypes));
+		for (int i = 0; i < config->compressionMimeTypeCount; i++) {
+			config->compressionMimeTypes[i] = (const char *) xmlStrdup((const xmlChar *) defaultTypes[i]);
+		}
+	}
 	return result;
 }
 
@@ -486,6 +705,10 @@ void freeConfigurationData(WebdavdConfiguration * configData) {
 		freeIfNotNull(configData->sslCerts[i].chainFiles);
 	}
 	freeIfNotNull(configData->sslCerts);
+	for (int i = 0; i < configData->compressionMimeTypeCount; i++) {
+		xmlFreeIfNotNull(configData->compressionMimeTypes[i]);
+	}
+	freeIfNotNull(configData->compressionMimeTypes);
 }
 
 ///////////////////////
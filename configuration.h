@@ -2,6 +2,7 @@
 #define WEBDAV_CONFIGURATION_H
 
 #include <time.h>
+#include <stddef.h>
 
 //////////////////////////////////////
 // Webdavd Configuration Structures //
@@ -14,6 +15,7 @@ typedef struct DaemonConfig {
 	int forwardToIsEncrypted;
 	int forwardToPort;
 	const char * forwardToHost;
+	int eventStreamPort;
 } DaemonConfig;
 
 typedef struct SSLConfig {
@@ -62,6 +64,33 @@ typedef struct WebdavdConfiguration {
 	// OPTIONS Requests
 	int unprotectOptions;
 
+	// GET I/O policy
+	size_t sequentialReadSize;
+	size_t readaheadSize;
+	size_t dropBehindSize;
+	size_t maxReadBufferSize;
+
+	// Response compression
+	int disableCompression;
+	int compressionLevel;
+	int compressionWorkers;
+	size_t compressionMinSize;
+	int compressionMimeTypeCount;
+	const char ** compressionMimeTypes;
+	size_t precompressMinSize;
+
+	// PROPFIND and directory listings
+	int statThreads;
+	size_t directoryCacheSize;
+	int directoryCacheDirectories;
+
+	// COPY, MOVE and DELETE of collections
+	int treeThreads;
+
+	// PUT
+	int putDurability;
+	time_t uploadExpiry;
+
 } WebdavdConfiguration;
 
 extern WebdavdConfiguration config;
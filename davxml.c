@@ -0,0 +1,514 @@
+#include "davxml.h"
+
+#include "shared.h"
+#include "xml.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Request bodies for PROPFIND, LOCK and PROPPATCH are tiny and only ever use a handful of names from the DAV:
+// namespace.  So rather than set up a full libxml2 reader for each one, the body is read into a fixed buffer and
+// walked by hand.  Names are turned into DavName/DavNamespace values as they are read so the RAP only compares
+// integers.  DTDs are refused outright so there is nothing to expand entities from.  Anything too big for the
+// buffer, or not obviously UTF-8, goes to libxml2 instead (without entity expansion).
+
+////////////////////
+// Interned Names //
+////////////////////
+
+typedef struct DavNameEntry {
+	const char * text;
+	DavName name;
+} DavNameEntry;
+
+// Sorted for bsearch
+static const DavNameEntry DAV_NAMES[] = { //
+		{ "Win32FileAttributes", DAV_NAME_WIN32_FILE_ATTRIBUTES }, //
+				{ "allprop", DAV_NAME_ALLPROP }, //
+				{ "creationdate", DAV_NAME_CREATION_DATE }, //
+				{ "displayname", DAV_NAME_DISPLAY_NAME }, //
+				{ "exclusive", DAV_NAME_EXCLUSIVE }, //
+				{ "getcontentlength", DAV_NAME_GET_CONTENT_LENGTH }, //
+				{ "getcontenttype", DAV_NAME_GET_CONTENT_TYPE }, //
+				{ "getctag", DAV_NAME_GET_CTAG }, //
+				{ "getetag", DAV_NAME_GET_ETAG }, //
+				{ "getlastmodified", DAV_NAME_GET_LAST_MODIFIED }, //
+				{ "include", DAV_NAME_INCLUDE }, //
+				{ "limit", DAV_NAME_LIMIT }, //
+				{ "lockinfo", DAV_NAME_LOCKINFO }, //
+				{ "lockscope", DAV_NAME_LOCKSCOPE }, //
+				{ "locktype", DAV_NAME_LOCKTYPE }, //
+				{ "owner", DAV_NAME_OWNER }, //
+				{ "prop", DAV_NAME_PROP }, //
+				{ "propertyupdate", DAV_NAME_PROPERTYUPDATE }, //
+				{ "propfind", DAV_NAME_PROPFIND }, //
+				{ "propname", DAV_NAME_PROPNAME }, //
+				{ "quota-available-bytes", DAV_NAME_QUOTA_AVAILABLE_BYTES }, //
+				{ "quota-used-bytes", DAV_NAME_QUOTA_USED_BYTES }, //
+				{ "read", DAV_NAME_READ }, //
+				{ "remove", DAV_NAME_REMOVE }, //
+				{ "resourcetype", DAV_NAME_RESOURCETYPE }, //
+				{ "set", DAV_NAME_SET }, //
+				{ "shared", DAV_NAME_SHARED }, //
+				{ "sync-collection", DAV_NAME_SYNC_COLLECTION }, //
+				{ "sync-level", DAV_NAME_SYNC_LEVEL }, //
+				{ "sync-token", DAV_NAME_SYNC_TOKEN }, //
+				{ "write", DAV_NAME_WRITE } };
+
+typedef struct NameKey {
+	const char * text;
+	size_t size;
+} NameKey;
+
+static int compareName(const void * a, const void * b) {
+	const NameKey * key = a;
+	const char * text = ((const DavNameEntry *) b)->text;
+	size_t textSize = strlen(text);
+	int result = memcmp(key->text, text, key->size < textSize ? key->size : textSize);
+	if (result) return result;
+	return (key->size > textSize) - (key->size < textSize);
+}
+
+static DavName internName(const char * text, size_t size) {
+	NameKey key = { .text = text, .size = size };
+	DavNameEntry * found = bsearch(&key, DAV_NAMES, sizeof(DAV_NAMES) / sizeof(*DAV_NAMES), sizeof(*DAV_NAMES),
+			&compareName);
+	return found ? found->name : DAV_NAME_OTHER;
+}
+
+#define textMatches(text, size, literal) ((size) == sizeof(literal) - 1 && !memcmp(text, literal, size))
+
+static DavNamespace internNamespace(const char * text, size_t size) {
+	if (textMatches(text, size, "DAV:")) return DAV_NS_DAV;
+	if (textMatches(text, size, "urn:schemas-microsoft-com:")) return DAV_NS_MICROSOFT;
+	if (textMatches(text, size, "http://calendarserver.org/ns/")) return DAV_NS_CALENDARSERVER;
+	return DAV_NS_OTHER;
+}
+
+////////////////////////
+// End Interned Names //
+////////////////////////
+
+////////////
+// Parser //
+////////////
+
+#define isSpace(c) ((c) == ' ' || (c) == '\t' || (c) == '\r' || (c) == '\n')
+#define isNameEnd(c) (isSpace(c) || (c) == '>' || (c) == '/' || (c) == '=' || (c) == '<' || (c) == '"' \
+		|| (c) == '\'')
+
+static const char * skipSpace(const char * position, const char * end) {
+	while (position < end && isSpace(*position)) {
+		position++;
+	}
+	return position;
+}
+
+static const char * skipName(const char * position, const char * end) {
+	while (position < end && !isNameEnd(*position)) {
+		position++;
+	}
+	return position;
+}
+
+static const char * findText(const char * position, const char * end, const char * text, size_t size) {
+	while (end - position >= size) {
+		const char * found = memchr(position, text[0], end - position - size + 1);
+		if (!found) return NULL;
+		if (!memcmp(found, text, size)) return found;
+		position = found + 1;
+	}
+	return NULL;
+}
+
+// Only the predefined entities and character references are allowed.  Returns the character after the ';'
+static const char * skipReference(const char * position, const char * end) {
+	const char * semicolon = memchr(position, ';', end - position < 12 ? end - position : 12);
+	if (!semicolon) return NULL;
+	const char * name = position + 1;
+	size_t size = semicolon - name;
+	if (textMatches(name, size, "lt") || textMatches(name, size, "gt") || textMatches(name, size, "amp")
+			|| textMatches(name, size, "quot") || textMatches(name, size, "apos")) {
+		return semicolon + 1;
+	}
+	if (size < 2 || *name != '#') return NULL;
+	if (name[1] == 'x') {
+		if (size < 3) return NULL;
+		for (const char * c = name + 2; c < semicolon; c++) {
+			if (!((*c >= '0' && *c <= '9') || (*c >= 'a' && *c <= 'f') || (*c >= 'A' && *c <= 'F'))) return NULL;
+		}
+	} else {
+		for (const char * c = name + 1; c < semicolon; c++) {
+			if (*c < '0' || *c > '9') return NULL;
+		}
+	}
+	return semicolon + 1;
+}
+
+// Text between tags is not needed, it only has to be well formed
+static const char * skipText(DavXmlReader * reader, const char * position) {
+	const char * end = reader->end;
+	while (position < end && *position != '<') {
+		if (*position == '&') {
+			if (!reader->elementCount || !(position = skipReference(position, end))) return NULL;
+		} else if (!reader->elementCount && !isSpace(*position)) {
+			return NULL;
+		} else {
+			position++;
+		}
+	}
+	return position;
+}
+
+static DavXmlNode parseError(DavXmlReader * reader) {
+	reader->node = DAV_XML_ERROR;
+	return DAV_XML_ERROR;
+}
+
+static DavXmlNode endElement(DavXmlReader * reader) {
+	reader->elementCount--;
+	DavXmlElement * element = &reader->elements[reader->elementCount];
+	reader->ns = element->ns;
+	reader->name = element->name;
+	reader->depth = reader->elementCount;
+	while (reader->bindingCount && reader->bindings[reader->bindingCount - 1].depth >= reader->elementCount) {
+		reader->bindingCount--;
+	}
+	reader->node = DAV_XML_END;
+	return DAV_XML_END;
+}
+
+static DavNamespace findNamespace(DavXmlReader * reader, const char * prefix, size_t prefixSize, int * found) {
+	for (int i = reader->bindingCount - 1; i >= 0; i--) {
+		if (reader->bindings[i].prefixSize == prefixSize && !memcmp(reader->bindings[i].prefix, prefix, prefixSize)) {
+			*found = 1;
+			return reader->bindings[i].ns;
+		}
+	}
+	*found = (prefixSize == 0 || textMatches(prefix, prefixSize, "xml"));
+	return DAV_NS_OTHER;
+}
+
+static DavXmlNode startElement(DavXmlReader * reader, const char * position) {
+	const char * end = reader->end;
+	int depth = reader->elementCount;
+	if (depth == DAV_XML_MAX_DEPTH || (depth == 0 && reader->rootSeen)) return parseError(reader);
+
+	const char * qName = position;
+	position = skipName(position, end);
+	size_t qNameSize = position - qName;
+	if (!qNameSize) return parseError(reader);
+
+	// Attributes.  Only namespace declarations are kept.
+	for (;;) {
+		const char * attributeStart = position;
+		position = skipSpace(position, end);
+		if (position == end) return parseError(reader);
+		if (*position == '>') {
+			position++;
+			break;
+		}
+		if (*position == '/') {
+			if (end - position < 2 || position[1] != '>') return parseError(reader);
+			position += 2;
+			reader->pendingEnd = 1;
+			break;
+		}
+		if (position == attributeStart) return parseError(reader);
+
+		const char * attribute = position;
+		position = skipName(position, end);
+		size_t attributeSize = position - attribute;
+		position = skipSpace(position, end);
+		if (!attributeSize || position == end || *position != '=') return parseError(reader);
+		position = skipSpace(position + 1, end);
+		if (position == end || (*position != '"' && *position != '\'')) return parseError(reader);
+		char quote = *position;
+		const char * value = ++position;
+		while (position < end && *position != quote) {
+			if (*position == '<') return parseError(reader);
+			if (*position == '&') {
+				if (!(position = skipReference(position, end))) return parseError(reader);
+			} else {
+				position++;
+			}
+		}
+		if (position == end) return parseError(reader);
+		size_t valueSize = position - value;
+		position++;
+
+		if (attributeSize >= 5 && !memcmp(attribute, "xmlns", 5) && (attributeSize == 5 || attribute[5] == ':')) {
+			if (reader->bindingCount == DAV_XML_MAX_NAMESPACES) return parseError(reader);
+			DavXmlBinding * binding = &reader->bindings[reader->bindingCount++];
+			binding->prefix = attributeSize == 5 ? attribute : attribute + 6;
+			binding->prefixSize = attributeSize == 5 ? 0 : attributeSize - 6;
+			binding->depth = depth;
+			binding->ns = internNamespace(value, valueSize);
+		}
+	}
+
+	const char * localName = memchr(qName, ':', qNameSize);
+	const char * prefix = qName;
+	size_t prefixSize = 0;
+	if (localName) {
+		prefixSize = localName - qName;
+		localName++;
+	} else {
+		localName = qName;
+	}
+	int found;
+	DavXmlElement * element = &reader->elements[depth];
+	element->qName = qName;
+	element->qNameSize = qNameSize;
+	element->ns = findNamespace(reader, prefix, prefixSize, &found);
+	element->name = internName(localName, qName + qNameSize - localName);
+	if (!found) return parseError(reader);
+
+	reader->position = position;
+	reader->elementCount++;
+	reader->rootSeen = 1;
+	reader->ns = element->ns;
+	reader->name = element->name;
+	reader->depth = depth;
+	reader->node = DAV_XML_START;
+	return DAV_XML_START;
+}
+
+static DavXmlNode readNode(DavXmlReader * reader) {
+	if (reader->node == DAV_XML_ERROR || reader->node == DAV_XML_END_OF_DOCUMENT) return reader->node;
+
+	if (reader->pendingEnd) {
+		reader->pendingEnd = 0;
+		return endElement(reader);
+	}
+
+	const char * end = reader->end;
+	for (;;) {
+		const char * position = skipText(reader, reader->position);
+		if (!position) return parseError(reader);
+		if (position == end) {
+			if (reader->elementCount) return parseError(reader);
+			reader->position = position;
+			reader->node = DAV_XML_END_OF_DOCUMENT;
+			return DAV_XML_END_OF_DOCUMENT;
+		}
+
+		position++;
+		if (position == end) return parseError(reader);
+		if (*position == '?') {
+			// XML declaration or processing instruction
+			position = findText(position, end, "?>", 2);
+			if (!position) return parseError(reader);
+			reader->position = position + 2;
+		} else if (*position == '!') {
+			if (end - position >= 3 && !memcmp(position, "!--", 3)) {
+				position = findText(position + 3, end, "-->", 3);
+				if (!position) return parseError(reader);
+				reader->position = position + 3;
+			} else if (reader->elementCount && end - position >= 8 && !memcmp(position, "![CDATA[", 8)) {
+				position = findText(position + 8, end, "]]>", 3);
+				if (!position) return parseError(reader);
+				reader->position = position + 3;
+			} else {
+				// DOCTYPE (and so entity declarations) are refused
+				return parseError(reader);
+			}
+		} else if (*position == '/') {
+			if (!reader->elementCount) return parseError(reader);
+			DavXmlElement * element = &reader->elements[reader->elementCount - 1];
+			position++;
+			if (end - position < element->qNameSize || memcmp(position, element->qName, element->qNameSize)) {
+				return parseError(reader);
+			}
+			position = skipSpace(position + element->qNameSize, end);
+			if (position == end || *position != '>') return parseError(reader);
+			reader->position = position + 1;
+			return endElement(reader);
+		} else {
+			return startElement(reader, position);
+		}
+	}
+}
+
+////////////////
+// End Parser //
+////////////////
+
+//////////////
+// Fallback //
+//////////////
+
+static int fallbackRead(void * context, char * buffer, int len) {
+	DavXmlReader * reader = context;
+	if (reader->fallbackSent < reader->size) {
+		size_t size = reader->size - reader->fallbackSent;
+		if (size > len) size = len;
+		memcpy(buffer, reader->buffer + reader->fallbackSent, size);
+		reader->fallbackSent += size;
+		return size;
+	}
+	ssize_t bytesRead = read(reader->fd, buffer, len);
+	return bytesRead < 0 ? -1 : bytesRead;
+}
+
+static int fallbackClose(void * context) {
+	return 0;
+}
+
+static DavXmlNode readFallbackNode(DavXmlReader * reader) {
+	if (reader->node == DAV_XML_ERROR || reader->node == DAV_XML_END_OF_DOCUMENT) return reader->node;
+
+	if (reader->pendingEnd) {
+		reader->pendingEnd = 0;
+		reader->node = DAV_XML_END;
+		return DAV_XML_END;
+	}
+
+	int result;
+	while ((result = xmlTextReaderRead(reader->fallback)) == 1) {
+		int nodeType = xmlTextReaderNodeType(reader->fallback);
+		if (nodeType == XML_READER_TYPE_ELEMENT || nodeType == XML_READER_TYPE_END_ELEMENT) {
+			const char * namespace = xmlTextReaderConstNamespaceUri(reader->fallback);
+			const char * localName = xmlTextReaderConstLocalName(reader->fallback);
+			reader->ns = namespace ? internNamespace(namespace, strlen(namespace)) : DAV_NS_OTHER;
+			reader->name = internName(localName, strlen(localName));
+			reader->depth = xmlTextReaderDepth(reader->fallback);
+			if (nodeType == XML_READER_TYPE_ELEMENT) {
+				reader->pendingEnd = xmlTextReaderIsEmptyElement(reader->fallback);
+				reader->node = DAV_XML_START;
+			} else {
+				reader->node = DAV_XML_END;
+			}
+			return reader->node;
+		} else if (nodeType == XML_READER_TYPE_DOCUMENT_TYPE) {
+			return parseError(reader);
+		}
+	}
+
+	reader->node = result ? DAV_XML_ERROR : DAV_XML_END_OF_DOCUMENT;
+	return reader->node;
+}
+
+//////////////////
+// End Fallback //
+//////////////////
+
+////////////
+// Reader //
+////////////
+
+// Reads the request body from fd.  fd is owned by the reader from here on and closed by davXmlClose().
+int davXmlOpen(DavXmlReader * reader, int fd) {
+	reader->fd = fd;
+	reader->node = DAV_XML_START;
+	reader->pendingEnd = 0;
+	reader->rootSeen = 0;
+	reader->elementCount = 0;
+	reader->bindingCount = 0;
+	reader->fallback = NULL;
+	reader->fallbackSent = 0;
+	reader->size = 0;
+
+	ssize_t bytesRead;
+	while (reader->size < sizeof(reader->buffer)
+			&& (bytesRead = read(fd, reader->buffer + reader->size, sizeof(reader->buffer) - reader->size)) != 0) {
+		if (bytesRead < 0) {
+			if (errno == EINTR) continue;
+			stdLogError(errno, "Could not read request body");
+			return 0;
+		}
+		reader->size += bytesRead;
+	}
+
+	reader->position = reader->buffer;
+	reader->end = reader->buffer + reader->size;
+	if (reader->size >= 3 && !memcmp(reader->buffer, "\xEF\xBB\xBF", 3)) {
+		reader->position += 3;
+	}
+
+	// The buffer is full (so there's probably more) or this is UTF-16 or some other encoding we can't read directly
+	const char * start = skipSpace(reader->position, reader->end);
+	if (reader->size == sizeof(reader->buffer) || (start < reader->end && *start != '<')) {
+		reader->fallback = xmlReaderForIO(&fallbackRead, &fallbackClose, reader, NULL, NULL, XML_PARSE_NONET);
+		if (!reader->fallback) {
+			stdLogError(0, "could not create xml reader");
+			return 0;
+		}
+		xmlReaderSuppressErrors(reader->fallback);
+	}
+
+	return 1;
+}
+
+DavXmlNode davXmlRead(DavXmlReader * reader) {
+	return reader->fallback ? readFallbackNode(reader) : readNode(reader);
+}
+
+static int copyText(char * buffer, size_t size, const char * text, size_t textSize) {
+	while (textSize && isSpace(*text)) {
+		text++;
+		textSize--;
+	}
+	while (textSize && isSpace(text[textSize - 1])) {
+		textSize--;
+	}
+	if (textSize >= size) return 0;
+	memcpy(buffer, text, textSize);
+	buffer[textSize] = '\0';
+	return 1;
+}
+
+// Copies the text of the element just started into buffer, without leading or trailing white space.  Returns false if
+// the element holds anything other than text, or the text doesn't fit.  Of the references only the predefined
+// entities are understood.
+int davXmlReadText(DavXmlReader * reader, char * buffer, size_t size) {
+	if (reader->node != DAV_XML_START) return 0;
+	if (reader->pendingEnd) return copyText(buffer, size, "", 0);
+
+	if (reader->fallback) {
+		xmlChar * text = xmlTextReaderReadString(reader->fallback);
+		int result = text && copyText(buffer, size, (const char *) text, strlen((const char *) text));
+		xmlFree(text);
+		return result;
+	}
+
+	char text[size];
+	size_t textSize = 0;
+	const char * position = reader->position;
+	while (position < reader->end && *position != '<') {
+		char c = *position++;
+		if (c == '&') {
+			const char * semicolon = memchr(position, ';', reader->end - position < 5 ? reader->end - position : 5);
+			if (!semicolon) return 0;
+			size_t nameSize = semicolon - position;
+			if (textMatches(position, nameSize, "lt")) c = '<';
+			else if (textMatches(position, nameSize, "gt")) c = '>';
+			else if (textMatches(position, nameSize, "amp")) c = '&';
+			else if (textMatches(position, nameSize, "quot")) c = '"';
+			else if (textMatches(position, nameSize, "apos")) c = '\'';
+			else return 0;
+			position = semicolon + 1;
+		}
+		if (textSize == size) return 0;
+		text[textSize++] = c;
+	}
+	if (reader->end - position < 2 || position[1] != '/') return 0;
+	return copyText(buffer, size, text, textSize);
+}
+
+void davXmlClose(DavXmlReader * reader) {
+	if (reader->fallback) {
+		xmlFreeTextReader(reader->fallback);
+		// Leave nothing unread in the pipe
+		char buffer[BUFFER_SIZE];
+		while (read(reader->fd, buffer, sizeof(buffer)) > 0)
+			;
+	}
+	close(reader->fd);
+}
+
+////////////////
+// End Reader //
+////////////////
@@ -0,0 +1,98 @@
+#ifndef WEBDAV_DAVXML_H
+#define WEBDAV_DAVXML_H
+
+#include <libxml/xmlreader.h>
+#include <stddef.h>
+
+// Request bodies which fit in this are parsed without libxml2
+#define DAV_XML_BUFFER_SIZE (16 * 1024)
+#define DAV_XML_MAX_DEPTH 32
+#define DAV_XML_MAX_NAMESPACES 32
+
+typedef enum DavNamespace {
+	DAV_NS_OTHER = 0, DAV_NS_DAV, DAV_NS_MICROSOFT, DAV_NS_CALENDARSERVER
+} DavNamespace;
+
+// Every element name the RAP looks for.  Names are interned regardless of namespace so check both.
+typedef enum DavName {
+	DAV_NAME_OTHER = 0,
+	DAV_NAME_WIN32_FILE_ATTRIBUTES,
+	DAV_NAME_ALLPROP,
+	DAV_NAME_CREATION_DATE,
+	DAV_NAME_DISPLAY_NAME,
+	DAV_NAME_EXCLUSIVE,
+	DAV_NAME_GET_CONTENT_LENGTH,
+	DAV_NAME_GET_CONTENT_TYPE,
+	DAV_NAME_GET_CTAG,
+	DAV_NAME_GET_ETAG,
+	DAV_NAME_GET_LAST_MODIFIED,
+	DAV_NAME_INCLUDE,
+	DAV_NAME_LIMIT,
+	DAV_NAME_LOCKINFO,
+	DAV_NAME_LOCKSCOPE,
+	DAV_NAME_LOCKTYPE,
+	DAV_NAME_OWNER,
+	DAV_NAME_PROP,
+	DAV_NAME_PROPERTYUPDATE,
+	DAV_NAME_PROPFIND,
+	DAV_NAME_PROPNAME,
+	DAV_NAME_QUOTA_AVAILABLE_BYTES,
+	DAV_NAME_QUOTA_USED_BYTES,
+	DAV_NAME_READ,
+	DAV_NAME_REMOVE,
+	DAV_NAME_RESOURCETYPE,
+	DAV_NAME_SET,
+	DAV_NAME_SHARED,
+	DAV_NAME_SYNC_COLLECTION,
+	DAV_NAME_SYNC_LEVEL,
+	DAV_NAME_SYNC_TOKEN,
+	DAV_NAME_WRITE
+} DavName;
+
+typedef enum DavXmlNode {
+	DAV_XML_ERROR = -1, DAV_XML_END_OF_DOCUMENT = 0, DAV_XML_START, DAV_XML_END
+} DavXmlNode;
+
+typedef struct DavXmlBinding {
+	const char * prefix;
+	size_t prefixSize;
+	int depth;
+	DavNamespace ns;
+} DavXmlBinding;
+
+typedef struct DavXmlElement {
+	const char * qName;
+	size_t qNameSize;
+	DavNamespace ns;
+	DavName name;
+} DavXmlElement;
+
+// The current node.  depth is 0 for the root element and is the same for an element's start and end.
+typedef struct DavXmlReader {
+	DavXmlNode node;
+	DavNamespace ns;
+	DavName name;
+	int depth;
+
+	int fd;
+	int pendingEnd;
+	int rootSeen;
+	int elementCount;
+	int bindingCount;
+	const char * position;
+	const char * end;
+	xmlTextReaderPtr fallback;
+	size_t fallbackSent;
+	size_t size;
+	DavXmlElement elements[DAV_XML_MAX_DEPTH];
+	DavXmlBinding bindings[DAV_XML_MAX_NAMESPACES];
+	char buffer[DAV_XML_BUFFER_SIZE];
+} DavXmlReader;
+
+int davXmlOpen(DavXmlReader * reader, int fd);
+DavXmlNode davXmlRead(DavXmlReader * reader);
+int davXmlReadText(DavXmlReader * reader, char * buffer, size_t size);
+void davXmlClose(DavXmlReader * reader);
+#define davXmlIs(reader, namespace, elementName) ((reader)->ns == (namespace) && (reader)->name == (elementName))
+
+#endif
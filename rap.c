@@ -1,23 +1,46 @@
+#define _GNU_SOURCE
+
 #include "shared.h"
+#include "davxml.h"
+#include "uring.h"
 #include "xml.h"
 
 //#include <stdio.h>
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <stddef.h>
 #include <string.h>
 #include <time.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/statvfs.h>
+#include <sys/vfs.h>
+#include <sys/xattr.h>
 #include <dirent.h>
+#include <endian.h>
 #include <locale.h>
+#include <pwd.h>
 #include <security/pam_appl.h>
 #include <libpq-fe.h>
+#include <gnutls/crypto.h>
 #include <stdlib.h>
+#include <signal.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <zlib.h>
+#ifdef WEBDAVD_ZSTD
+#include <zstd.h>
+#endif
+#include <linux/fs.h>
+#include <linux/limits.h>
 
 #define WEBDAV_NAMESPACE "DAV:"
 #define EXTENSIONS_NAMESPACE "urn:couling-webdav:"
 #define MICROSOFT_NAMESPACE "urn:schemas-microsoft-com:"
+#define CALENDARSERVER_NAMESPACE "http://calendarserver.org/ns/"
 
 #define NEW_FILE_PERMISSIONS 0666
 #define NEW_DIR_PREMISSIONS  0777
@@ -45,6 +68,12 @@ static char * mimeFileBuffer;
 static MimeType * mimeTypes = NULL;
 static int mimeTypeCount = 0;
 
+// Precompressed sidecar files
+static off_t precompressMinSize = 0;
+static int compressibleTypeCount = 0;
+static char ** compressibleTypes = NULL;
+static pid_t precompressPid = 0;
+
 static MimeType UNKNOWN_MIME_TYPE = {
 		.fileExtension = "",
 		.type = "application/octet-stream",
@@ -55,7 +84,89 @@ static MimeType XML_MIME_TYPE = {
 		.type = "application/xml; charset=utf-8",
 		.typeStringSize = sizeof("application/xml; charset=utf-8") };
 
+//////////////
+// Progress //
+//////////////
+
+// COPY, MOVE and DELETE of a large collection can take longer than the daemon will wait for a response before it
+// gives up on the RAP.  While one runs a second thread sends RAP_INTERIM_PROGRESS every progressInterval seconds
+// with the number of files handled so far.  It stops as soon as the response is sent.
+
+static int progressInterval = 30;
+static size_t progressCount = 0;
+static int progressRunning = 0;
+static pthread_t progressThread;
+static sem_t progressStop;
+
+static void initializeProgress() {
+	const char * interval = getenv("WEBDAVD_PROGRESS_INTERVAL");
+	if (interval && atoi(interval) > 0) progressInterval = atoi(interval);
+	if (sem_init(&progressStop, 0, 0) == -1) {
+		stdLogError(errno, "Could not initialize progress reporting");
+		progressInterval = 0;
+	}
+}
+
+static void * progressReporter(void * ignored) {
+	struct timespec wakeTime;
+	clock_gettime(CLOCK_REALTIME, &wakeTime);
+	for (;;) {
+		wakeTime.tv_sec += progressInterval;
+		int result;
+		while ((result = sem_timedwait(&progressStop, &wakeTime)) == -1 && errno == EINTR)
+			;
+		if (result == 0 || errno != ETIMEDOUT) return NULL;
+
+		size_t count = __atomic_load_n(&progressCount, __ATOMIC_RELAXED);
+		Message message = { .mID = RAP_INTERIM_PROGRESS, .fd = -1, .paramCount = 1 };
+		message.params[RAP_PARAM_PROGRESS_COUNT] = toMessageParam(count);
+		if (sendMessage(RAP_CONTROL_SOCKET, &message) <= 0) return NULL;
+	}
+}
+
+static void startProgress() {
+	if (progressRunning || !progressInterval) return;
+	progressCount = 0;
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, 64 * 1024);
+	int result = pthread_create(&progressThread, &attr, &progressReporter, NULL);
+	if (result) {
+		stdLogError(result, "Could not create progress thread");
+	} else {
+		progressRunning = 1;
+	}
+	pthread_attr_destroy(&attr);
+}
+
+static void addProgress(size_t count) {
+	__atomic_fetch_add(&progressCount, count, __ATOMIC_RELAXED);
+}
+
+// Must be called before the response is sent so that no progress message can follow it
+static void finishProgress() {
+	if (progressRunning) {
+		sem_post(&progressStop);
+		pthread_join(progressThread, NULL);
+		progressRunning = 0;
+	}
+}
+
+//////////////////
+// End Progress //
+//////////////////
+
+// What the current request was answered with, so that a request which changes something only records the change when
+// it succeeded
+static RapConstant lastResponse;
+
+static int lastResponseSucceeded() {
+	return lastResponse >= RAP_RESPOND_OK && lastResponse < 300;
+}
+
 static ssize_t respond(RapConstant result) {
+	finishProgress();
+	lastResponse = result;
 	Message message = { .mID = result, .fd = -1, .paramCount = 0 };
 	return sendMessage(RAP_CONTROL_SOCKET, &message);
 }
@@ -217,6 +328,8 @@ static void initializeMimeTypes(const char * mimeTypesFile) {
 
 static ssize_t writeErrorResponse(RapConstant responseCode, const char * textError, const char * error,
 		const char * file) {
+	finishProgress();
+	lastResponse = responseCode;
 	int pipeEnds[2];
 	if (pipe(pipeEnds)) {
 		stdLogError(errno, "Could not create pipe to write content");
@@ -276,64 +389,54 @@ typedef struct LockRequest {
 	LockType type;
 } LockRequest;
 
-static void parseLockRequest(int fd, LockRequest * lockRequest) {
+static int parseLockRequest(int fd, LockRequest * lockRequest) {
 	memset(lockRequest, 0, sizeof(LockRequest));
-	if (fd == -1) return;
-	xmlTextReaderPtr reader = xmlReaderForFd(fd, NULL, NULL, XML_PARSE_NOENT);
-	xmlReaderSuppressErrors(reader);
+	if (fd == -1) return 1;
 
-	if (!reader || !stepInto(reader) || !elementMatches(reader, WEBDAV_NAMESPACE, "lockinfo")) {
-		if (reader) xmlFreeTextReader(reader);
-		close(fd);
-		return;
+	DavXmlReader reader;
+	if (!davXmlOpen(&reader, fd)) {
+		davXmlClose(&reader);
+		return 0;
+	}
+
+	// Anything but a <d:lockinfo> is a refresh of an existing lock
+	DavXmlNode node = davXmlRead(&reader);
+	if (node == DAV_XML_START && davXmlIs(&reader, DAV_NS_DAV, DAV_NAME_LOCKINFO)) {
+		lockRequest->isNewLock = 1;
 	}
 
-	lockRequest->isNewLock = 1;
-	int readResult = stepInto(reader);
-	while (readResult && xmlTextReaderDepth(reader) == 1) {
-		if (isNamespaceElement(reader, WEBDAV_NAMESPACE)) {
-			const char * nodeName = xmlTextReaderConstLocalName(reader);
-			if (!strcmp(nodeName, "lockscope")) {
-				readResult = stepInto(reader);
-				while (readResult && xmlTextReaderDepth(reader) == 2) {
-					if (isNamespaceElement(reader, WEBDAV_NAMESPACE)) {
-						nodeName = xmlTextReaderConstLocalName(reader);
-						if (!strcmp(nodeName, "shared")) {
-							if (lockRequest->type != LOCK_TYPE_EXCLUSIVE) {
-								lockRequest->type = LOCK_TYPE_SHARED;
-							}
-						} else if (!strcmp(nodeName, "exclusive")) {
-							lockRequest->type = LOCK_TYPE_EXCLUSIVE;
-						}
+	DavName section = DAV_NAME_OTHER;
+	while (node > DAV_XML_END_OF_DOCUMENT) {
+		node = davXmlRead(&reader);
+		if (!lockRequest->isNewLock) continue;
+
+		if (reader.depth == 1) {
+			section = (node == DAV_XML_START && reader.ns == DAV_NS_DAV ? reader.name : DAV_NAME_OTHER);
+		} else if (node == DAV_XML_START && reader.depth == 2 && reader.ns == DAV_NS_DAV) {
+			if (section == DAV_NAME_LOCKSCOPE) {
+				if (reader.name == DAV_NAME_SHARED) {
+					if (lockRequest->type != LOCK_TYPE_EXCLUSIVE) {
+						lockRequest->type = LOCK_TYPE_SHARED;
 					}
-					readResult = stepOver(reader);
+				} else if (reader.name == DAV_NAME_EXCLUSIVE) {
+					lockRequest->type = LOCK_TYPE_EXCLUSIVE;
 				}
-			} else if (!strcmp(nodeName, "locktype")) {
-				readResult = stepInto(reader);
-				while (readResult && xmlTextReaderDepth(reader) == 2) {
-					if (isNamespaceElement(reader, WEBDAV_NAMESPACE)) {
-						nodeName = xmlTextReaderConstLocalName(reader);
-						if (!strcmp(nodeName, "read") && lockRequest->type != LOCK_TYPE_EXCLUSIVE) {
-							lockRequest->type = LOCK_TYPE_SHARED;
-						} else if (!strcmp(nodeName, "write")) {
-							lockRequest->type = LOCK_TYPE_EXCLUSIVE;
-						}
-					}
-					readResult = stepOver(reader);
+			} else if (section == DAV_NAME_LOCKTYPE) {
+				if (reader.name == DAV_NAME_READ && lockRequest->type != LOCK_TYPE_EXCLUSIVE) {
+					lockRequest->type = LOCK_TYPE_SHARED;
+				} else if (reader.name == DAV_NAME_WRITE) {
+					lockRequest->type = LOCK_TYPE_EXCLUSIVE;
 				}
-			} else {
-				readResult = stepOver(reader);
 			}
 		}
 	}
 
-	// finish up
-	while (readResult) {
-		readResult = stepOver(reader);
+	davXmlClose(&reader);
+	if (node == DAV_XML_ERROR) {
+		stdLogError(0, "Request body was not a well formed lock request");
+		return 0;
 	}
-
-	xmlFreeTextReader(reader);
-	close(fd);
+	return 1;
 }
 
 static ssize_t writeLockResponse(const char * fileName, LockRequest * request, const char * lockToken,
@@ -411,7 +514,9 @@ static ssize_t lockFile(Message * message) {
 	respond(RAP_RESPOND_CONTINUE);
 
 	LockRequest lockRequest;
-	parseLockRequest(message->fd, &lockRequest);
+	if (!parseLockRequest(message->fd, &lockRequest)) {
+		return writeErrorResponse(RAP_RESPOND_BAD_CLIENT_REQUEST, "Malformed lock request", NULL, file);
+	}
 
 	Message interimMessage;
 	char incomingBuffer[INCOMING_BUFFER_SIZE];
@@ -492,6 +597,585 @@ static ssize_t lockFile(Message * message) {
 // End Lock //
 //////////////
 
+///////////////////
+// Parallel Stat //
+///////////////////
+
+// On network filesystems each stat is a round trip to the server.  Listing a directory one stat at a time then
+// takes as many round trips as there are files.  So for these the names are collected in batches and stat'ed by a
+// small pool of threads while the RAP thread writes out the results, in directory order, as they arrive.  The RAP
+// thread takes entries off the batch itself whenever it would otherwise wait.  On local filesystems stat is cheap
+// enough that handing it to another thread costs more than it saves, so it's all done inline.
+
+#define STAT_BATCH_SIZE 256
+
+typedef struct StatEntry {
+	const char * name;
+	int done;
+	int result;
+	struct stat stat;
+} StatEntry;
+
+typedef struct StatBatch {
+	int dirFd;
+	int parallel;
+	size_t count;
+	size_t next;
+	size_t namesSize;
+	StatEntry entries[STAT_BATCH_SIZE];
+	char names[STAT_BATCH_SIZE * 256];
+} StatBatch;
+
+static int statThreadCount = 0;
+static pthread_t * statThreads = NULL;
+static StatBatch * statPoolBatch;
+static sem_t statPoolWork;
+static sem_t statPoolFinished;
+static sem_t statPoolDone;
+
+// Filesystems where stat goes over the network (from linux/magic.h and the filesystems' own sources)
+static const unsigned long REMOTE_FILESYSTEMS[] = { //
+		0x6969, // NFS
+				0x00C36400, // Ceph
+				0x65735546, // FUSE (sshfs, glusterfs, s3fs ...)
+				0x517B, // SMB
+				0xFE534D42, // SMB2
+				0xFF534D42, // CIFS
+				0x01021997, // 9P
+				0x5346414F, // AFS
+				0x73757245, // Coda
+				0x01161970, // GFS2
+				0x7461636F, // OCFS2
+				0x0BD00BD0 // Lustre
+		};
+
+static void statBatchEntries(StatBatch * batch) {
+	size_t index;
+	while ((index = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED)) < batch->count) {
+		StatEntry * entry = &batch->entries[index];
+		entry->result = fstatat(batch->dirFd, entry->name, &entry->stat, 0);
+		__atomic_store_n(&entry->done, 1, __ATOMIC_RELEASE);
+		sem_post(&statPoolDone);
+	}
+}
+
+static void * statWorker(void * ignored) {
+	for (;;) {
+		sem_wait(&statPoolWork);
+		statBatchEntries(statPoolBatch);
+		sem_post(&statPoolFinished);
+	}
+	return NULL;
+}
+
+static void initializeStatPool() {
+	const char * threads = getenv("WEBDAVD_STAT_THREADS");
+	int threadCount = threads ? atoi(threads) - 1 : 0;
+	if (threadCount <= 0) return;
+
+	if (sem_init(&statPoolWork, 0, 0) == -1 || sem_init(&statPoolFinished, 0, 0) == -1
+			|| sem_init(&statPoolDone, 0, 0) == -1) {
+		stdLogError(errno, "Could not initialize stat pool");
+		return;
+	}
+
+	// Stat threads only ever wait or stat so they don't need much stack
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, 64 * 1024);
+	statThreads = mallocSafe(sizeof(*statThreads) * threadCount);
+	for (int i = 0; i < threadCount; i++) {
+		int result = pthread_create(&statThreads[statThreadCount], &attr, &statWorker, NULL);
+		if (result) {
+			stdLogError(result, "Could not create stat thread");
+			break;
+		}
+		statThreadCount++;
+	}
+	pthread_attr_destroy(&attr);
+}
+
+static int isRemoteFilesystem(int fd) {
+	struct statfs fsStat;
+	if (fstatfs(fd, &fsStat) == -1) return 0;
+	for (int i = 0; i < sizeof(REMOTE_FILESYSTEMS) / sizeof(*REMOTE_FILESYSTEMS); i++) {
+		if ((unsigned long) fsStat.f_type == REMOTE_FILESYSTEMS[i]) return 1;
+	}
+	return 0;
+}
+
+static void startStatBatch(StatBatch * batch, int dirFd) {
+	batch->dirFd = dirFd;
+	batch->count = 0;
+	batch->next = 0;
+	batch->namesSize = 0;
+	batch->parallel = statThreadCount && isRemoteFilesystem(dirFd);
+}
+
+// Returns true once the batch is full
+static int addToStatBatch(StatBatch * batch, const char * name) {
+	size_t nameSize = strlen(name) + 1;
+	StatEntry * entry = &batch->entries[batch->count++];
+	entry->name = memcpy(batch->names + batch->namesSize, name, nameSize);
+	entry->done = 0;
+	batch->namesSize += nameSize;
+	return batch->count == STAT_BATCH_SIZE;
+}
+
+// Hands the batch to the pool.  Call getStatEntry() for each entry in order then finishStatBatch().
+static void runStatBatch(StatBatch * batch) {
+	if (batch->parallel && batch->count > 1) {
+		statPoolBatch = batch;
+		for (int i = 0; i < statThreadCount; i++) {
+			sem_post(&statPoolWork);
+		}
+	}
+}
+
+// Waits for the given entry. Returns NULL if it could not be stat'ed.
+static StatEntry * getStatEntry(StatBatch * batch, size_t index) {
+	StatEntry * entry = &batch->entries[index];
+	while (!__atomic_load_n(&entry->done, __ATOMIC_ACQUIRE)) {
+		if (__atomic_load_n(&batch->next, __ATOMIC_RELAXED) <= index) {
+			// Nobody has started on it yet so help out
+			size_t claimed = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED);
+			if (claimed < batch->count) {
+				StatEntry * claimedEntry = &batch->entries[claimed];
+				claimedEntry->result = fstatat(batch->dirFd, claimedEntry->name, &claimedEntry->stat, 0);
+				__atomic_store_n(&claimedEntry->done, 1, __ATOMIC_RELEASE);
+			}
+		} else {
+			sem_wait(&statPoolDone);
+		}
+	}
+	return entry->result ? NULL : entry;
+}
+
+// Waits for the workers to leave the batch so that it can be reused
+static void finishStatBatch(StatBatch * batch) {
+	if (batch->parallel && batch->count > 1) {
+		for (int i = 0; i < statThreadCount; i++) {
+			sem_wait(&statPoolFinished);
+		}
+		while (!sem_trywait(&statPoolDone))
+			;
+	}
+	batch->count = 0;
+	batch->next = 0;
+	batch->namesSize = 0;
+}
+
+///////////////////////
+// End Parallel Stat //
+///////////////////////
+
+/////////////////////
+// Collection Tags //
+/////////////////////
+
+// Sync clients can skip a whole subtree if they can tell that nothing under it has changed.  Each collection's
+// getctag is its mtime followed by the stamp in its COLLECTION_TAG_XATTR.  Every request that changes something stamps
+// the collection it changed and each one above it.  The directory cache's inotify watches stamp changes made by other
+// programs in the directories they watch.  A change made by another program in a directory which isn't watched only
+// shows on that directory's mtime.  A collection which has never been stamped, or which the user can't stamp (eg: one
+// they can't write to or a filesystem without user extended attributes), has no getctag at all, since a change deeper
+// down wouldn't show on it.
+
+#define COLLECTION_TAG_XATTR "user.webdavd.ctag"
+#define COLLECTION_TAG_SIZE 64
+
+static char collectionTagStamp[COLLECTION_TAG_SIZE];
+static size_t collectionTagStampSize;
+
+// Every change a request makes gets the same stamp
+static void newCollectionTagStamp() {
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	collectionTagStampSize = snprintf(collectionTagStamp, sizeof(collectionTagStamp), "%lld.%09ld-%d",
+			(long long) now.tv_sec, now.tv_nsec, (int) getpid());
+}
+
+// Stamps the collection holding file and every collection above it.  A collection that already has this request's
+// stamp has had everything above it stamped too, so that is as far as it goes.  If a stamp can't be replaced it is
+// removed so that the collection's old getctag can't be given out again.
+static void changeCollectionTags(const char * file) {
+	size_t size = strlen(file);
+	char path[size + 1];
+	memcpy(path, file, size + 1);
+	char existing[COLLECTION_TAG_SIZE];
+	while (size > 1) {
+		while (size > 0 && path[size - 1] == '/') {
+			size--;
+		}
+		while (size > 0 && path[size - 1] != '/') {
+			size--;
+		}
+		if (!size) break;
+		path[size] = '\0';
+		ssize_t existingSize = getxattr(path, COLLECTION_TAG_XATTR, existing, sizeof(existing));
+		if (existingSize == collectionTagStampSize && !memcmp(existing, collectionTagStamp, existingSize)) break;
+		// Collections the user can't write to (eg: those above their home directory) get no getctag
+		if (setxattr(path, COLLECTION_TAG_XATTR, collectionTagStamp, collectionTagStampSize, 0) == -1
+				&& existingSize > 0) {
+			removexattr(path, COLLECTION_TAG_XATTR);
+		}
+	}
+}
+
+/////////////////////////
+// End Collection Tags //
+/////////////////////////
+
+////////////////////
+// Change Journal //
+////////////////////
+
+// Sync clients can ask what has changed since they last looked (RFC 6578 sync-collection) rather than list every
+// folder.  Each path a request changes, and each change the directory cache's watches see, is appended to the user's
+// change journal: CHANGE_JOURNAL_NAME in their home directory or at the top of their chroot.  A sync token is the
+// journal's id and an offset into it, so answering a token only reads the changes made since.  Once the journal grows
+// beyond CHANGE_JOURNAL_MAX_SIZE it is replaced by an empty one with a new id.  Tokens for the old one are refused and
+// those clients start again from scratch.
+
+// The journal is CHANGE_JOURNAL_HEADER, the id and '\n', then each changed path ending in '\0'.  Writers hold an
+// exclusive flock so that the journal can't be replaced part way through a write.
+
+#define CHANGE_JOURNAL_NAME ".webdavd-changes"
+#define CHANGE_JOURNAL_HEADER "webdavd-changes "
+#define CHANGE_JOURNAL_MAX_HEADER 128
+#define CHANGE_JOURNAL_MAX_SIZE (16 * 1024 * 1024)
+
+static char * changeJournalPath = NULL;
+static size_t changeJournalPathSize;
+static char * pendingChanges = NULL;
+static size_t pendingChangesSize = 0;
+static size_t pendingChangesUsed = 0;
+
+// The user's home directory or, if the RAP will chroot, "" since the top of the chroot is theirs.  NULL if there's
+// no such user.  This must be worked out before the RAP chroots.
+static const char * userRootDirectory(const char * user) {
+	if (chrootPath) return "";
+	struct passwd * pw = getpwnam(user);
+	return pw ? pw->pw_dir : NULL;
+}
+
+static void initializeChangeJournal(const char * user) {
+	const char * home = userRootDirectory(user);
+	if (!home) return;
+	size_t pathSize = strlen(home) + sizeof("/" CHANGE_JOURNAL_NAME);
+	changeJournalPath = mallocSafe(pathSize);
+	changeJournalPathSize = snprintf(changeJournalPath, pathSize, "%s/" CHANGE_JOURNAL_NAME, home);
+}
+
+// The journal (and the temporary "journal.pid" files it is made from) are not changes anyone needs to know about
+// Whether any name along the path is one of the server's own files, the journal among them.  Changes to these are not
+// recorded and they're left out of listings and reports.
+static int isServerPath(const char * file) {
+	const char * name = file;
+	for (;;) {
+		while (*name == '/') name++;
+		if (isServerFile(name)) return 1;
+		name = strchr(name, '/');
+		if (!name) return 0;
+	}
+}
+
+// Puts an empty journal with a new id in place.  Unless replace is set an existing journal is kept instead.
+static void startChangeJournal(int replace) {
+	char temporaryName[changeJournalPathSize + 20];
+	snprintf(temporaryName, sizeof(temporaryName), "%s.%d", changeJournalPath, (int) getpid());
+	int fd = open(temporaryName, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd == -1) {
+		stdLogError(errno, "Could not create change journal %s", temporaryName);
+		return;
+	}
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	char header[CHANGE_JOURNAL_MAX_HEADER];
+	int headerSize = snprintf(header, sizeof(header), CHANGE_JOURNAL_HEADER "%lld.%09ld-%d\n",
+			(long long) now.tv_sec, now.tv_nsec, (int) getpid());
+	if (write(fd, header, headerSize) != headerSize) {
+		stdLogError(errno, "Could not write change journal %s", temporaryName);
+	} else if ((replace ? rename(temporaryName, changeJournalPath) : link(temporaryName, changeJournalPath))
+			&& errno != EEXIST) {
+		stdLogError(errno, "Could not start change journal %s", changeJournalPath);
+	}
+	close(fd);
+	unlink(temporaryName);
+}
+
+// Opens and flocks the journal, starting one if there isn't one yet.  Returns -1 if that isn't possible.
+static int openChangeJournal(int flags, int lockType) {
+	for (int attempt = 0; attempt < 3; attempt++) {
+		int fd = open(changeJournalPath, flags | O_CLOEXEC);
+		if (fd == -1) {
+			if (errno != ENOENT) return -1;
+			startChangeJournal(0);
+			continue;
+		}
+		struct stat fileStat;
+		if (flock(fd, lockType) == 0 && fstat(fd, &fileStat) == 0 && fileStat.st_nlink) return fd;
+		// Replaced while waiting for the lock
+		close(fd);
+	}
+	return -1;
+}
+
+// Writes the changes recorded by this request to the journal
+static void flushChangeJournal() {
+	if (!pendingChangesUsed) return;
+	int fd = openChangeJournal(O_WRONLY | O_APPEND, LOCK_EX);
+	struct stat fileStat;
+	if (fd != -1 && fstat(fd, &fileStat) == 0 && fileStat.st_size + pendingChangesUsed > CHANGE_JOURNAL_MAX_SIZE) {
+		startChangeJournal(1);
+		close(fd);
+		fd = openChangeJournal(O_WRONLY | O_APPEND, LOCK_EX);
+	}
+	if (fd != -1) {
+		if (write(fd, pendingChanges, pendingChangesUsed) != pendingChangesUsed) {
+			stdLogError(errno, "Could not write change journal %s", changeJournalPath);
+		}
+		close(fd);
+	}
+	pendingChangesUsed = 0;
+}
+
+// Starts the journal again when changes may have been missed, so that every sync token handed out so far is refused
+// and clients fall back to a full sync
+static void restartChangeJournal() {
+	if (!changeJournalPath) return;
+	int fd = openChangeJournal(O_WRONLY | O_APPEND, LOCK_EX);
+	startChangeJournal(1);
+	if (fd != -1) close(fd);
+}
+
+// Notes that file has changed, for sync clients and in the collection tags above it
+static void recordChange(const char * file) {
+	if (isServerPath(file)) return;
+	changeCollectionTags(file);
+	if (!changeJournalPath) return;
+	size_t size = strlen(file);
+	while (size > 1 && file[size - 1] == '/') {
+		size--;
+	}
+	if (pendingChangesUsed + size + 1 > pendingChangesSize) {
+		pendingChangesSize = (pendingChangesUsed + size + 1) * 2;
+		pendingChanges = reallocSafe(pendingChanges, pendingChangesSize);
+	}
+	memcpy(pendingChanges + pendingChangesUsed, file, size);
+	pendingChanges[pendingChangesUsed + size] = '\0';
+	pendingChangesUsed += size + 1;
+}
+
+// Records the request's file and, for COPY and MOVE, its target as changed
+static void recordRequestChanges(Message * requestMessage, int hasTarget) {
+	recordChange(messageParamToString(&requestMessage->params[RAP_PARAM_REQUEST_FILE]));
+	if (hasTarget) {
+		recordChange(messageParamToString(&requestMessage->params[RAP_PARAM_REQUEST_TARGET]));
+	}
+}
+
+////////////////////////
+// End Change Journal //
+////////////////////////
+
+/////////////////////
+// Directory Cache //
+/////////////////////
+
+// Clients poll the same folders with PROPFIND every few seconds.  Rather than read and stat a whole directory each
+// time, what was found is kept and reused until inotify reports a change in the directory.  The watch is added before
+// the directory is read so that nothing changed while it's being read can be missed.  Changes inside a subdirectory
+// are not reported on its parent so subdirectories are still stat'ed each time.  Directories on network filesystems
+// are never cached since changes made by other machines aren't reported at all.  The least recently used directories
+// are dropped to stay within WEBDAVD_DIRECTORY_CACHE_SIZE bytes and WEBDAVD_DIRECTORY_CACHE_DIRECTORIES directories,
+// which is also the number of watches used.
+
+#define DIRECTORY_WATCH_EVENTS (IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_DELETE_SELF | IN_MODIFY \
+		| IN_MOVE_SELF | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR)
+
+typedef struct CachedEntry {
+	size_t nameOffset;
+	struct stat stat;
+} CachedEntry;
+
+typedef struct CachedDirectory {
+	struct CachedDirectory * newer;
+	struct CachedDirectory * older;
+	char * path;
+	int watch;
+	int overflowed;
+	size_t size;
+	size_t count;
+	size_t entriesSize;
+	CachedEntry * entries;
+	size_t namesUsed;
+	size_t namesSize;
+	char * names;
+} CachedDirectory;
+
+static int directoryWatchFd = -1;
+static size_t directoryCacheMaxSize;
+static size_t directoryCacheMaxCount;
+static size_t directoryCacheSize = 0;
+static size_t directoryCacheCount = 0;
+static CachedDirectory * newestDirectory = NULL;
+static CachedDirectory * oldestDirectory = NULL;
+
+static void initializeDirectoryCache() {
+	const char * size = getenv("WEBDAVD_DIRECTORY_CACHE_SIZE");
+	const char * count = getenv("WEBDAVD_DIRECTORY_CACHE_DIRECTORIES");
+	directoryCacheMaxSize = size ? strtoull(size, NULL, 10) : 0;
+	directoryCacheMaxCount = count ? strtoull(count, NULL, 10) : 0;
+	if (!directoryCacheMaxSize || !directoryCacheMaxCount) return;
+	directoryWatchFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (directoryWatchFd == -1) stdLogError(errno, "Could not start directory cache");
+}
+
+static void freeCachedDirectory(CachedDirectory * directory) {
+	freeSafe(directory->path);
+	freeSafe(directory->entries);
+	freeSafe(directory->names);
+	freeSafe(directory);
+}
+
+// The same directory may be cached under two paths (eg: through a symlink) and so share a watch
+static void releaseDirectoryWatch(int watch) {
+	CachedDirectory * other = newestDirectory;
+	while (other && other->watch != watch) {
+		other = other->older;
+	}
+	if (!other) inotify_rm_watch(directoryWatchFd, watch);
+}
+
+static void uncacheDirectory(CachedDirectory * directory, int removeWatch) {
+	if (directory->newer) directory->newer->older = directory->older;
+	else newestDirectory = directory->older;
+	if (directory->older) directory->older->newer = directory->newer;
+	else oldestDirectory = directory->newer;
+	directoryCacheSize -= directory->size;
+	directoryCacheCount--;
+	if (removeWatch) releaseDirectoryWatch(directory->watch);
+	freeCachedDirectory(directory);
+}
+
+// Drops every directory inotify has reported a change in since last time and updates its collection tags.  A
+// directory's own attributes and those of its subdirectories aren't cached, and change whenever a collection tag is
+// stamped, so those events are ignored.
+static void readDirectoryEvents() {
+	char buffer[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	ssize_t size;
+	while ((size = read(directoryWatchFd, buffer, sizeof(buffer))) > 0) {
+		const struct inotify_event * event;
+		for (char * next = buffer; next < buffer + size; next += sizeof(*event) + event->len) {
+			event = (const struct inotify_event *) next;
+			if ((event->mask & IN_ATTRIB) && (!event->len || (event->mask & IN_ISDIR))) continue;
+			// The changes lost in the overflow will never reach the journal
+			if (event->mask & IN_Q_OVERFLOW) restartChangeJournal();
+			CachedDirectory * directory = newestDirectory;
+			while (directory) {
+				CachedDirectory * older = directory->older;
+				if (directory->watch == event->wd && !(event->mask & IN_IGNORED)) {
+					size_t pathSize = strlen(directory->path);
+					char changed[pathSize + event->len + 1];
+					memcpy(changed, directory->path, pathSize);
+					strcpy(changed + pathSize, event->len ? event->name : "");
+					recordChange(changed);
+				}
+				if (directory->watch == event->wd || (event->mask & IN_Q_OVERFLOW)) {
+					uncacheDirectory(directory, !(event->mask & IN_IGNORED));
+				}
+				directory = older;
+			}
+		}
+	}
+}
+
+// Returns the cached listing of path or NULL if there isn't an up to date one
+static CachedDirectory * findCachedDirectory(const char * path) {
+	if (directoryWatchFd == -1) return NULL;
+	readDirectoryEvents();
+	CachedDirectory * directory = newestDirectory;
+	while (directory && strcmp(directory->path, path)) {
+		directory = directory->older;
+	}
+	if (directory && directory->newer) {
+		// Move it to the front
+		directory->newer->older = directory->older;
+		if (directory->older) directory->older->newer = directory->newer;
+		else oldestDirectory = directory->newer;
+		directory->newer = NULL;
+		directory->older = newestDirectory;
+		newestDirectory->newer = directory;
+		newestDirectory = directory;
+	}
+	return directory;
+}
+
+// Starts watching the directory ready to cache what is read from it.  Returns NULL if it can't be cached.
+static CachedDirectory * startCachedDirectory(const char * path, int dirFd) {
+	if (directoryWatchFd == -1 || isRemoteFilesystem(dirFd)) return NULL;
+	int watch = inotify_add_watch(directoryWatchFd, path, DIRECTORY_WATCH_EVENTS);
+	if (watch == -1) return NULL;
+	CachedDirectory * directory = mallocSafe(sizeof(*directory));
+	memset(directory, 0, sizeof(*directory));
+	directory->path = copyString(path);
+	directory->watch = watch;
+	directory->size = sizeof(*directory) + strlen(path) + 1;
+	return directory;
+}
+
+static void addCachedEntry(CachedDirectory * directory, const char * name, struct stat * fileStat) {
+	if (directory->overflowed) return;
+	size_t nameSize = strlen(name) + 1;
+	directory->size += sizeof(CachedEntry) + nameSize;
+	if (directory->size > directoryCacheMaxSize) {
+		// Too big to ever cache
+		directory->overflowed = 1;
+		return;
+	}
+	if (directory->count == directory->entriesSize) {
+		directory->entriesSize = directory->entriesSize ? directory->entriesSize * 2 : 64;
+		directory->entries = reallocSafe(directory->entries, directory->entriesSize * sizeof(CachedEntry));
+	}
+	if (directory->namesUsed + nameSize > directory->namesSize) {
+		directory->namesSize = directory->namesSize ? directory->namesSize * 2 : 4096;
+		if (directory->namesSize < directory->namesUsed + nameSize) {
+			directory->namesSize = directory->namesUsed + nameSize;
+		}
+		directory->names = reallocSafe(directory->names, directory->namesSize);
+	}
+	CachedEntry * entry = &directory->entries[directory->count++];
+	entry->nameOffset = directory->namesUsed;
+	entry->stat = *fileStat;
+	memcpy(directory->names + directory->namesUsed, name, nameSize);
+	directory->namesUsed += nameSize;
+}
+
+// Adds the finished directory to the cache, making room for it if need be
+static void cacheDirectory(CachedDirectory * directory) {
+	if (directory->overflowed) {
+		releaseDirectoryWatch(directory->watch);
+		freeCachedDirectory(directory);
+		return;
+	}
+	while (oldestDirectory && (directoryCacheCount >= directoryCacheMaxCount
+			|| directoryCacheSize + directory->size > directoryCacheMaxSize)) {
+		// The new entry isn't linked in yet so its watch (the same inode cached under another path) must be kept here
+		uncacheDirectory(oldestDirectory, oldestDirectory->watch != directory->watch);
+	}
+	directory->older = newestDirectory;
+	if (newestDirectory) newestDirectory->newer = directory;
+	else oldestDirectory = directory;
+	newestDirectory = directory;
+	directoryCacheSize += directory->size;
+	directoryCacheCount++;
+}
+
+/////////////////////////
+// End Directory Cache //
+/////////////////////////
+
 //////////////
 // PROPFIND //
 //////////////
@@ -506,6 +1190,7 @@ static ssize_t lockFile(Message * message) {
 #define PROPFIND_AVAILABLE_BYTES "quota-available-bytes"
 #define PROPFIND_ETAG "getetag"
 #define PROPFIND_WINDOWS_ATTRIBUTES "Win32FileAttributes"
+#define PROPFIND_COLLECTION_TAG "getctag"
 
 typedef struct PropertySet {
 	char creationDate;
@@ -518,179 +1203,356 @@ typedef struct PropertySet {
 	char usedBytes;
 	char availableBytes;
 	char windowsHidden;
+	char collectionTag;
 } PropertySet;
 
-static int parsePropFind(int fd, PropertySet * properties) {
-	xmlTextReaderPtr reader = xmlReaderForFd(fd, NULL, NULL, XML_PARSE_NOENT);
-	xmlReaderSuppressErrors(reader);
+// Notes the property the reader is on, if it's one we know, as asked for
+static void addRequestedProperty(DavXmlReader * reader, PropertySet * properties) {
+	if (reader->ns == DAV_NS_DAV) {
+		switch (reader->name) {
+		case DAV_NAME_RESOURCETYPE:
+			properties->resourceType = 1;
+			break;
+		case DAV_NAME_CREATION_DATE:
+			properties->creationDate = 1;
+			break;
+		case DAV_NAME_GET_CONTENT_LENGTH:
+			properties->contentLength = 1;
+			break;
+		case DAV_NAME_GET_LAST_MODIFIED:
+			properties->lastModified = 1;
+			break;
+		case DAV_NAME_DISPLAY_NAME:
+			properties->displayName = 1;
+			break;
+		case DAV_NAME_GET_CONTENT_TYPE:
+			properties->contentType = 1;
+			break;
+		case DAV_NAME_QUOTA_AVAILABLE_BYTES:
+			properties->availableBytes = 1;
+			break;
+		case DAV_NAME_QUOTA_USED_BYTES:
+			properties->usedBytes = 1;
+			break;
+		case DAV_NAME_GET_ETAG:
+			properties->etag = 1;
+			break;
+		default:
+			break;
+		}
+	} else if (davXmlIs(reader, DAV_NS_MICROSOFT, DAV_NAME_WIN32_FILE_ATTRIBUTES)) {
+		properties->windowsHidden = 1;
+	} else if (davXmlIs(reader, DAV_NS_CALENDARSERVER, DAV_NAME_GET_CTAG)) {
+		properties->collectionTag = 1;
+	}
+}
 
-	int readResult;
-	if (!reader || !stepInto(reader)) {
-		stdLogError(0, "could not create xml reader");
-		if (reader) xmlFreeTextReader(reader);
-		close(fd);
+static int parsePropFind(int fd, PropertySet * properties) {
+	DavXmlReader reader;
+	if (!davXmlOpen(&reader, fd)) {
+		davXmlClose(&reader);
 		return 0;
 	}
 
-	if (xmlTextReaderNodeType(reader) == XML_READER_TYPE_NONE) {
+	DavXmlNode node = davXmlRead(&reader);
+	if (node == DAV_XML_END_OF_DOCUMENT) {
 		// No body has been sent
 		// so assume the client is asking for everything.
 		memset(properties, 1, sizeof(*properties));
-		xmlFreeTextReader(reader);
-		close(fd);
+		davXmlClose(&reader);
 		return 1;
 	} else {
 		memset(properties, 0, sizeof(PropertySet));
 	}
 
-	if (!elementMatches(reader, WEBDAV_NAMESPACE, "propfind")) {
+	if (node != DAV_XML_START || !davXmlIs(&reader, DAV_NS_DAV, DAV_NAME_PROPFIND)) {
 		stdLogError(0, "Request body was not a propfind document");
-		xmlFreeTextReader(reader);
-		close(fd);
+		davXmlClose(&reader);
 		return 0;
 	}
 
-	readResult = stepInto(reader);
-	while (readResult && xmlTextReaderDepth(reader) > 0 && !elementMatches(reader, WEBDAV_NAMESPACE, "prop")) {
-		stepOver(reader);
-	}
-
-	if (!readResult) {
-		xmlFreeTextReader(reader);
-		close(fd);
-		return 0;
-	}
-
-	readResult = stepInto(reader);
-	while (readResult && xmlTextReaderDepth(reader) > 1) {
-		if (!strcmp(xmlTextReaderConstNamespaceUri(reader), WEBDAV_NAMESPACE)) {
-			const char * nodeName = xmlTextReaderConstLocalName(reader);
-			if (!strcmp(nodeName, PROPFIND_RESOURCE_TYPE)) {
-				properties->resourceType = 1;
-			} else if (!strcmp(nodeName, PROPFIND_CREATION_DATE)) {
-				properties->creationDate = 1;
-			} else if (!strcmp(nodeName, PROPFIND_CONTENT_LENGTH)) {
-				properties->contentLength = 1;
-			} else if (!strcmp(nodeName, PROPFIND_LAST_MODIFIED)) {
-				properties->lastModified = 1;
-			} else if (!strcmp(nodeName, PROPFIND_DISPLAY_NAME)) {
-				properties->displayName = 1;
-			} else if (!strcmp(nodeName, PROPFIND_CONTENT_TYPE)) {
-				properties->contentType = 1;
-			} else if (!strcmp(nodeName, PROPFIND_AVAILABLE_BYTES)) {
-				properties->availableBytes = 1;
-			} else if (!strcmp(nodeName, PROPFIND_USED_BYTES)) {
-				properties->usedBytes = 1;
-			} else if (!strcmp(nodeName, PROPFIND_ETAG)) {
-				properties->etag = 1;
-			}
-		} else if (!strcmp(xmlTextReaderConstNamespaceUri(reader), MICROSOFT_NAMESPACE)) {
-			const char * nodeName = xmlTextReaderConstLocalName(reader);
-			if (!strcmp(nodeName, PROPFIND_WINDOWS_ATTRIBUTES)) {
-				properties->windowsHidden = 1;
+	int inProp = 0;
+	while ((node = davXmlRead(&reader)) > DAV_XML_END_OF_DOCUMENT) {
+		if (reader.depth == 1) {
+			inProp = (node == DAV_XML_START && davXmlIs(&reader, DAV_NS_DAV, DAV_NAME_PROP));
+			if (node == DAV_XML_START && reader.ns == DAV_NS_DAV
+					&& (reader.name == DAV_NAME_ALLPROP || reader.name == DAV_NAME_PROPNAME)) {
+				// Every property is cheap so propname gets the values too
+				memset(properties, 1, sizeof(*properties));
 			}
+		} else if (inProp && node == DAV_XML_START && reader.depth == 2) {
+			addRequestedProperty(&reader, properties);
 		}
-		readResult = stepOver(reader);
 	}
 
-	readResult = 1;
-
-	// finish up
-	while (stepOver(reader))
-		// consume the rest of the input
-		;
+	davXmlClose(&reader);
+	if (node == DAV_XML_ERROR) {
+		stdLogError(0, "Request body was not a well formed propfind document");
+		return 0;
+	}
+	return 1;
+}
 
-	xmlFreeTextReader(reader);
-	close(fd);
-	return readResult;
+// Every <d:response> in a multistatus is the same text with a handful of values dropped in.  So the text is worked
+// out once per PROPFIND for each kind of resource and only the values are written for each file.
+
+#define PROPFIND_BUFFER_SIZE (128 * 1024)
+#define MAX_TEMPLATE_PARTS 16
+
+typedef enum PropertyValue {
+	PROPERTY_VALUE_NONE = 0,
+	PROPERTY_VALUE_HREF,
+	PROPERTY_VALUE_ETAG,
+	PROPERTY_VALUE_CREATION_DATE,
+	PROPERTY_VALUE_LAST_MODIFIED,
+	PROPERTY_VALUE_AVAILABLE_BYTES,
+	PROPERTY_VALUE_USED_BYTES,
+	PROPERTY_VALUE_CONTENT_LENGTH,
+	PROPERTY_VALUE_CONTENT_TYPE,
+	PROPERTY_VALUE_DIR_ATTRIBUTES,
+	PROPERTY_VALUE_FILE_ATTRIBUTES,
+	PROPERTY_VALUE_COLLECTION_TAG
+} PropertyValue;
+
+typedef struct TemplatePart {
+	size_t textOffset;
+	size_t textSize;
+	PropertyValue value; // written after the text
+} TemplatePart;
+
+typedef struct ResponseTemplate {
+	int partCount;
+	TemplatePart parts[MAX_TEMPLATE_PARTS];
+	size_t textSize;
+	char text[1024];
+} ResponseTemplate;
+
+typedef struct PropFindTemplates {
+	ResponseTemplate file;
+	ResponseTemplate directory;
+	ResponseTemplate quotaDirectory; // Only the first directory with quota properties gets these
+	int quotaPending;
+} PropFindTemplates;
+
+static void addTemplateText(ResponseTemplate * template, const char * text) {
+	size_t size = strlen(text);
+	memcpy(template->text + template->textSize, text, size);
+	template->textSize += size;
+	template->parts[template->partCount - 1].textSize += size;
 }
 
-static void writePropFindResponsePart(const char * fileName, const char * displayName,
-		PropertySet * properties, struct stat * fileStat, xmlTextWriterPtr writer) {
+static void addTemplateValue(ResponseTemplate * template, PropertyValue value) {
+	template->parts[template->partCount - 1].value = value;
+	TemplatePart * next = &template->parts[template->partCount++];
+	next->textOffset = template->textSize;
+	next->textSize = 0;
+	next->value = PROPERTY_VALUE_NONE;
+}
 
-	xmlTextWriterStartElementNS(writer, "d", "response", NULL);
-	xmlTextWriterStartElementNS(writer, "d", "href", NULL);
-	xmlTextWriterWriteURL(writer, fileName);
-	xmlTextWriterEndElement(writer);
-	xmlTextWriterStartElementNS(writer, "d", "propstat", NULL);
-	xmlTextWriterStartElementNS(writer, "d", "prop", NULL);
+static void addTemplateProperty(ResponseTemplate * template, const char * prefix, const char * name,
+		PropertyValue value) {
+	char buffer[100];
+	snprintf(buffer, sizeof(buffer), "<%s:%s>", prefix, name);
+	addTemplateText(template, buffer);
+	addTemplateValue(template, value);
+	snprintf(buffer, sizeof(buffer), "</%s:%s>", prefix, name);
+	addTemplateText(template, buffer);
+}
 
+static void buildResponseTemplate(ResponseTemplate * template, PropertySet * properties, int isDir,
+		int hasQuota) {
+	template->partCount = 1;
+	template->textSize = 0;
+	template->parts[0].textOffset = 0;
+	template->parts[0].textSize = 0;
+	template->parts[0].value = PROPERTY_VALUE_NONE;
+
+	addTemplateText(template, "<d:response><d:href>");
+	addTemplateValue(template, PROPERTY_VALUE_HREF);
+	addTemplateText(template, "</d:href><d:propstat><d:prop>");
 	if (properties->etag) {
-		char buffer[200];
-		snprintf(buffer, sizeof(buffer), "%lld-%lld", (long long) fileStat->st_size,
-				(long long) fileStat->st_mtime);
-		xmlTextWriterWriteElementString(writer, "d", PROPFIND_ETAG, buffer);
+		addTemplateProperty(template, "d", PROPFIND_ETAG, PROPERTY_VALUE_ETAG);
 	}
 	if (properties->creationDate) {
-		char buffer[100];
-		getWebDate(fileStat->st_ctime, buffer, 100);
-		xmlTextWriterWriteElementString(writer, "d", PROPFIND_CREATION_DATE, buffer);
+		addTemplateProperty(template, "d", PROPFIND_CREATION_DATE, PROPERTY_VALUE_CREATION_DATE);
 	}
 	if (properties->lastModified) {
-		char buffer[100];
-		getWebDate(fileStat->st_ctime, buffer, 100);
-		xmlTextWriterWriteElementString(writer, "d", PROPFIND_LAST_MODIFIED, buffer);
+		addTemplateProperty(template, "d", PROPFIND_LAST_MODIFIED, PROPERTY_VALUE_LAST_MODIFIED);
 	}
 	if (properties->resourceType) {
-		xmlTextWriterStartElementNS(writer, "d", PROPFIND_RESOURCE_TYPE, NULL);
-		if ((fileStat->st_mode & S_IFMT) == S_IFDIR) {
-			xmlTextWriterStartElementNS(writer, "d", "collection", NULL);
-			xmlTextWriterEndElement(writer);
-		}
-		xmlTextWriterEndElement(writer);
+		addTemplateText(template, isDir ? "<d:" PROPFIND_RESOURCE_TYPE "><d:collection/></d:"
+				PROPFIND_RESOURCE_TYPE ">" : "<d:" PROPFIND_RESOURCE_TYPE "/>");
 	}
-	//if (properties->displayName) {
-	//	xmlTextWriterWriteElementString(writer, PROPFIND_DISPLAY_NAME, displayName);
-	//}
-	if ((fileStat->st_mode & S_IFMT) == S_IFDIR) {
-		struct statvfs fsStat;
-		if ((properties->availableBytes || properties->usedBytes) && statvfs(fileName, &fsStat) != -1) {
+	if (isDir) {
+		if (hasQuota) {
 			if (properties->availableBytes) {
-				char buffer[100];
-				unsigned long long size = fsStat.f_bavail * fsStat.f_bsize;
-				snprintf(buffer, sizeof(buffer), "%llu", size);
-				xmlTextWriterWriteElementString(writer, "d", PROPFIND_AVAILABLE_BYTES, buffer);
+				addTemplateProperty(template, "d", PROPFIND_AVAILABLE_BYTES, PROPERTY_VALUE_AVAILABLE_BYTES);
+				// Yes used bytes is sent twice when both are asked for.  Clients have always seen it this way.
 				if (properties->usedBytes) {
-					size = (fsStat.f_blocks - fsStat.f_bfree) * fsStat.f_bsize;
-					snprintf(buffer, sizeof(buffer), "%llu", size);
-					xmlTextWriterWriteElementString(writer, "d", PROPFIND_USED_BYTES, buffer);
+					addTemplateProperty(template, "d", PROPFIND_USED_BYTES, PROPERTY_VALUE_USED_BYTES);
 				}
 			}
 			if (properties->usedBytes) {
-				char buffer[100];
-				unsigned long long size = (fsStat.f_blocks - fsStat.f_bfree) * fsStat.f_bsize;
-				snprintf(buffer, sizeof(buffer), "%llu", size);
-				xmlTextWriterWriteElementString(writer, "d", PROPFIND_USED_BYTES, buffer);
+				addTemplateProperty(template, "d", PROPFIND_USED_BYTES, PROPERTY_VALUE_USED_BYTES);
 			}
-			// When listing directories we only list this FS space in the directory not its children.
-			// It's not technically standards compliant but is is not likely to cause a problem in practice.
-			properties->availableBytes = 0;
-			properties->usedBytes = 0;
 		}
 		if (properties->windowsHidden) {
-			xmlTextWriterWriteElementString(writer, "z", PROPFIND_WINDOWS_ATTRIBUTES,
-					displayName[0] == '.' ? "00000012" : "00000010");
+			addTemplateProperty(template, "z", PROPFIND_WINDOWS_ATTRIBUTES, PROPERTY_VALUE_DIR_ATTRIBUTES);
+		}
+		if (properties->collectionTag) {
+			// Written whole, since it is left out for collections without a stamp
+			addTemplateValue(template, PROPERTY_VALUE_COLLECTION_TAG);
 		}
 	} else {
 		if (properties->contentLength) {
-			char buffer[100];
-			snprintf(buffer, sizeof(buffer), "%lld", (long long) fileStat->st_size);
-			xmlTextWriterWriteElementString(writer, "d", PROPFIND_CONTENT_LENGTH, buffer);
+			addTemplateProperty(template, "d", PROPFIND_CONTENT_LENGTH, PROPERTY_VALUE_CONTENT_LENGTH);
 		}
 		if (properties->contentType) {
-			xmlTextWriterWriteElementString(writer, "d", PROPFIND_CONTENT_TYPE, findMimeType(fileName)->type);
+			addTemplateProperty(template, "d", PROPFIND_CONTENT_TYPE, PROPERTY_VALUE_CONTENT_TYPE);
 		}
 		if (properties->windowsHidden) {
-			xmlTextWriterWriteElementString(writer, "z", PROPFIND_WINDOWS_ATTRIBUTES,
-					displayName[0] == '.' ? "00000022" : "00000020");
+			addTemplateProperty(template, "z", PROPFIND_WINDOWS_ATTRIBUTES, PROPERTY_VALUE_FILE_ATTRIBUTES);
 		}
+	}
+	addTemplateText(template, "</d:prop><d:status>HTTP/1.1 200 OK</d:status></d:propstat></d:response>");
+}
+
+static void buildPropFindTemplates(PropFindTemplates * templates, PropertySet * properties) {
+	buildResponseTemplate(&templates->file, properties, 0, 0);
+	buildResponseTemplate(&templates->directory, properties, 1, 0);
+	buildResponseTemplate(&templates->quotaDirectory, properties, 1, 1);
+	templates->quotaPending = properties->availableBytes || properties->usedBytes;
+}
 
+static void writeWebDate(FdWriter * writer, time_t date) {
+	// Most files in a directory share only a few distinct times
+	static time_t cachedDate = -1;
+	static char cachedDateString[100];
+	static size_t cachedDateSize;
+	if (date != cachedDate) {
+		cachedDateSize = getWebDate(date, cachedDateString, sizeof(cachedDateString));
+		cachedDate = date;
 	}
-	xmlTextWriterEndElement(writer);
-	xmlTextWriterWriteElementString(writer, "d", "status", "HTTP/1.1 200 OK");
-	xmlTextWriterEndElement(writer);
-	xmlTextWriterEndElement(writer);
+	fdWriterWrite(writer, cachedDateString, cachedDateSize);
+}
+
+static void writeSignedNumber(FdWriter * writer, long long number) {
+	if (number < 0) {
+		fdWriterWriteLiteral(writer, "-");
+		fdWriterWriteNumber(writer, -(unsigned long long) number);
+	} else {
+		fdWriterWriteNumber(writer, number);
+	}
+}
+
+// A stamp on a collection the user can no longer stamp may be out of date, so it is only used while it can be kept up
+// to date.  Sticky collections can only be stamped by their owner.
+static void writeCollectionTag(FdWriter * writer, const char * fileName, struct stat * fileStat) {
+	char stamp[COLLECTION_TAG_SIZE + 1];
+	ssize_t stampSize = getxattr(fileName, COLLECTION_TAG_XATTR, stamp, COLLECTION_TAG_SIZE);
+	if (stampSize <= 0 || faccessat(AT_FDCWD, fileName, W_OK, AT_EACCESS) == -1
+			|| ((fileStat->st_mode & S_ISVTX) && fileStat->st_uid != geteuid())) {
+		return;
+	}
+	stamp[stampSize] = '\0';
+	fdWriterWriteLiteral(writer, "<cs:" PROPFIND_COLLECTION_TAG ">");
+	writeSignedNumber(writer, fileStat->st_mtim.tv_sec);
+	fdWriterWriteLiteral(writer, ".");
+	fdWriterWriteNumber(writer, fileStat->st_mtim.tv_nsec);
+	fdWriterWriteLiteral(writer, "-");
+	fdWriterWriteEscaped(writer, stamp);
+	fdWriterWriteLiteral(writer, "</cs:" PROPFIND_COLLECTION_TAG ">");
+}
+
+static void writePropFindResponsePart(const char * fileName, const char * displayName,
+		PropFindTemplates * templates, struct stat * fileStat, FdWriter * writer) {
+
+	ResponseTemplate * template;
+	struct statvfs fsStat;
+	if ((fileStat->st_mode & S_IFMT) == S_IFDIR) {
+		// When listing directories we only list this FS space in the directory not its children.
+		// It's not technically standards compliant but is is not likely to cause a problem in practice.
+		if (templates->quotaPending && statvfs(fileName, &fsStat) != -1) {
+			template = &templates->quotaDirectory;
+			templates->quotaPending = 0;
+		} else {
+			template = &templates->directory;
+		}
+	} else {
+		template = &templates->file;
+	}
+
+	for (int i = 0; i < template->partCount; i++) {
+		TemplatePart * part = &template->parts[i];
+		fdWriterWrite(writer, template->text + part->textOffset, part->textSize);
+		switch (part->value) {
+		case PROPERTY_VALUE_HREF:
+			fdWriterWriteURL(writer, fileName);
+			break;
+		case PROPERTY_VALUE_ETAG:
+			writeSignedNumber(writer, fileStat->st_size);
+			fdWriterWriteLiteral(writer, "-");
+			writeSignedNumber(writer, fileStat->st_mtime);
+			break;
+		case PROPERTY_VALUE_CREATION_DATE:
+		case PROPERTY_VALUE_LAST_MODIFIED:
+			writeWebDate(writer, fileStat->st_ctime);
+			break;
+		case PROPERTY_VALUE_AVAILABLE_BYTES:
+			fdWriterWriteNumber(writer, fsStat.f_bavail * fsStat.f_bsize);
+			break;
+		case PROPERTY_VALUE_USED_BYTES:
+			fdWriterWriteNumber(writer, (fsStat.f_blocks - fsStat.f_bfree) * fsStat.f_bsize);
+			break;
+		case PROPERTY_VALUE_CONTENT_LENGTH:
+			writeSignedNumber(writer, fileStat->st_size);
+			break;
+		case PROPERTY_VALUE_CONTENT_TYPE:
+			fdWriterWriteEscaped(writer, findMimeType(fileName)->type);
+			break;
+		case PROPERTY_VALUE_DIR_ATTRIBUTES:
+			fdWriterWrite(writer, displayName[0] == '.' ? "00000012" : "00000010", 8);
+			break;
+		case PROPERTY_VALUE_FILE_ATTRIBUTES:
+			fdWriterWrite(writer, displayName[0] == '.' ? "00000022" : "00000020", 8);
+			break;
+		case PROPERTY_VALUE_COLLECTION_TAG:
+			writeCollectionTag(writer, fileName, fileStat);
+			break;
+		case PROPERTY_VALUE_NONE:
+			break;
+		}
+	}
+}
 
+static void writeCachedPropFind(CachedDirectory * cached, int dirFd, const char * filePath, size_t filePathSize,
+		PropFindTemplates * templates, FdWriter * writer) {
+	char * childFileName = mallocSafe(filePathSize + 257);
+	size_t maxSize = 255;
+	memcpy(childFileName, filePath, filePathSize);
+	for (size_t i = 0; i < cached->count; i++) {
+		CachedEntry * entry = &cached->entries[i];
+		const char * name = cached->names + entry->nameOffset;
+		struct stat * fileStat = &entry->stat;
+		struct stat dirStat;
+		if ((fileStat->st_mode & S_IFMT) == S_IFDIR) {
+			// Whatever has changed inside it isn't reported on this directory
+			if (fstatat(dirFd, name, &dirStat, 0) == -1) continue;
+			fileStat = &dirStat;
+		}
+		size_t nameSize = strlen(name);
+		if (nameSize > maxSize) {
+			childFileName = reallocSafe(childFileName, filePathSize + nameSize + 2);
+			maxSize = nameSize;
+		}
+		strcpy(childFileName + filePathSize, name);
+		if ((fileStat->st_mode & S_IFMT) == S_IFDIR) {
+			childFileName[filePathSize + nameSize] = '/';
+			childFileName[filePathSize + nameSize + 1] = '\0';
+		}
+		if (!isServerFile(name)) writePropFindResponsePart(childFileName, name, templates, fileStat, writer);
+	}
+	freeSafe(childFileName);
 }
 
 static int respondToPropFind(const char * file, LockType lockProvided, PropertySet * properties, int depth) {
@@ -742,48 +1604,66 @@ static int respondToPropFind(const char * file, LockType lockProvided, PropertyS
 	message.params[RAP_PARAM_RESPONSE_LOCATION] = makeMessageParam(filePath, filePathSize + 1);
 	ssize_t messageResult = sendMessage(RAP_CONTROL_SOCKET, &message);
 	if (messageResult <= 0) {
-		freeSafe(filePath);
 		close(pipeEnds[PIPE_WRITE]);
 		close(fd);
 		return messageResult;
 	}
 
 	// We've set up the pipe and sent read end across so now write the result
-	xmlTextWriterPtr writer = xmlNewFdTextWriter(pipeEnds[PIPE_WRITE]);
+	PropFindTemplates templates;
+	buildPropFindTemplates(&templates, properties);
+	FdWriter * writer = fdWriterNew(pipeEnds[PIPE_WRITE], PROPFIND_BUFFER_SIZE);
 	DIR * dir;
-	xmlTextWriterStartDocument(writer, "1.0", "utf-8", NULL);
-	xmlTextWriterStartElementNS(writer, "d", "multistatus", WEBDAV_NAMESPACE);
-	xmlTextWriterWriteAttribute(writer, "xmlns:z", MICROSOFT_NAMESPACE);
-	writePropFindResponsePart(filePath, displayName, properties, &fileStat, writer);
-	if (depth > 1 && (fileStat.st_mode & S_IFMT) == S_IFDIR && (dir = fdopendir(fd))) {
+	fdWriterWriteLiteral(writer, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<d:multistatus xmlns:z=\""
+			MICROSOFT_NAMESPACE "\" xmlns:cs=\"" CALENDARSERVER_NAMESPACE "\" xmlns:d=\"" WEBDAV_NAMESPACE "\">");
+	writePropFindResponsePart(filePath, displayName, &templates, &fileStat, writer);
+	CachedDirectory * cached = NULL;
+	if (depth > 1 && (fileStat.st_mode & S_IFMT) == S_IFDIR && (cached = findCachedDirectory(filePath))) {
+		writeCachedPropFind(cached, fd, filePath, filePathSize, &templates, writer);
+		close(fd);
+	} else if (depth > 1 && (fileStat.st_mode & S_IFMT) == S_IFDIR && (dir = fdopendir(fd))) {
 		struct dirent * dp;
 		char * childFileName = mallocSafe(filePathSize + 257);
 		size_t maxSize = 255;
 		memcpy(childFileName, filePath, filePathSize);
-		while ((dp = readdir(dir)) != NULL) {
-			if (IS_DIR_CHILD(dp->d_name)) {
-				size_t nameSize = strlen(dp->d_name);
-				if (nameSize > maxSize) {
-					childFileName = reallocSafe(childFileName, filePathSize + nameSize + 2);
-					maxSize = nameSize;
-				}
-				strcpy(childFileName + filePathSize, dp->d_name);
-				if (!stat(childFileName, &fileStat)) {
-					if ((fileStat.st_mode & S_IFMT) == S_IFDIR) {
+		cached = startCachedDirectory(filePath, fd);
+		StatBatch * batch = mallocSafe(sizeof(*batch));
+		startStatBatch(batch, fd);
+		do {
+			while ((dp = readdir(dir)) != NULL) {
+				if (IS_DIR_CHILD(dp->d_name) && addToStatBatch(batch, dp->d_name)) break;
+			}
+			runStatBatch(batch);
+			for (size_t i = 0; i < batch->count; i++) {
+				StatEntry * entry = getStatEntry(batch, i);
+				if (entry) {
+					size_t nameSize = strlen(entry->name);
+					if (nameSize > maxSize) {
+						childFileName = reallocSafe(childFileName, filePathSize + nameSize + 2);
+						maxSize = nameSize;
+					}
+					strcpy(childFileName + filePathSize, entry->name);
+					if ((entry->stat.st_mode & S_IFMT) == S_IFDIR) {
 						childFileName[filePathSize + nameSize] = '/';
 						childFileName[filePathSize + nameSize + 1] = '\0';
 					}
-					writePropFindResponsePart(childFileName, dp->d_name, properties, &fileStat, writer);
+					if (!isServerFile(entry->name)) {
+						writePropFindResponsePart(childFileName, entry->name, &templates, &entry->stat, writer);
+					}
+					if (cached) addCachedEntry(cached, entry->name, &entry->stat);
 				}
 			}
-		}
+			finishStatBatch(batch);
+		} while (dp);
+		if (cached) cacheDirectory(cached);
+		freeSafe(batch);
 		closedir(dir);
 		freeSafe(childFileName);
 	} else {
 		close(fd);
 	}
-	xmlTextWriterEndElement(writer);
-	xmlFreeTextWriter(writer);
+	fdWriterWriteLiteral(writer, "</d:multistatus>");
+	fdWriterFree(writer);
 	return messageResult;
 
 }
@@ -822,6 +1702,385 @@ static ssize_t propfind(Message * requestMessage) {
 // End PROPFIND //
 //////////////////
 
+/////////////////////
+// Sync Collection //
+/////////////////////
+
+// REPORT sync-collection (RFC 6578).  Without a token every member of the collection is listed.  With one only the
+// paths the change journal has recorded since are, each as it is now: with its properties if it still exists,
+// otherwise as 404.  A directory that has been created, copied or moved in is listed with everything under it
+// for sync-level infinite since nothing was recorded for what it brought with it.
+
+#define SYNC_TOKEN_PREFIX EXTENSIONS_NAMESPACE "sync:"
+#define SYNC_TOKEN_SIZE 200
+
+typedef struct SyncRequest {
+	char token[SYNC_TOKEN_SIZE];
+	int infinite;
+	int limited;
+	PropertySet properties;
+} SyncRequest;
+
+// Returns 1 for a sync-collection, -1 for any other report and 0 if the request is malformed
+static int parseSyncCollection(int fd, SyncRequest * request) {
+	memset(request, 0, sizeof(*request));
+	DavXmlReader reader;
+	if (!davXmlOpen(&reader, fd)) {
+		davXmlClose(&reader);
+		return 0;
+	}
+
+	DavXmlNode node = davXmlRead(&reader);
+	if (node != DAV_XML_START || !davXmlIs(&reader, DAV_NS_DAV, DAV_NAME_SYNC_COLLECTION)) {
+		davXmlClose(&reader);
+		return node == DAV_XML_START ? -1 : 0;
+	}
+
+	char level[20] = "";
+	int valid = 1;
+	int inProp = 0;
+	while ((node = davXmlRead(&reader)) > DAV_XML_END_OF_DOCUMENT) {
+		if (reader.depth == 1) {
+			inProp = (node == DAV_XML_START && davXmlIs(&reader, DAV_NS_DAV, DAV_NAME_PROP));
+			if (node == DAV_XML_START && reader.ns == DAV_NS_DAV) {
+				if (reader.name == DAV_NAME_SYNC_TOKEN) {
+					valid &= davXmlReadText(&reader, request->token, sizeof(request->token));
+				} else if (reader.name == DAV_NAME_SYNC_LEVEL) {
+					valid &= davXmlReadText(&reader, level, sizeof(level));
+				} else if (reader.name == DAV_NAME_LIMIT) {
+					request->limited = 1;
+				}
+			}
+		} else if (inProp && node == DAV_XML_START && reader.depth == 2) {
+			addRequestedProperty(&reader, &request->properties);
+		}
+	}
+
+	davXmlClose(&reader);
+	if (node == DAV_XML_ERROR || !valid) {
+		stdLogError(0, "Request body was not a well formed sync-collection document");
+		return 0;
+	}
+	if (!strcmp(level, "infinite")) {
+		request->infinite = 1;
+	} else if (strcmp(level, "1")) {
+		stdLogError(0, "Unknown sync-level %s", level);
+		return 0;
+	}
+	return 1;
+}
+
+// Reads the changes recorded since token into changes and sets newToken to the end of the journal.  With no token
+// there are no changes, only the new token.  Returns false if the token isn't for the current journal.
+static int readChangeJournal(const char * token, char ** changes, size_t * changesSize, char * newToken,
+		size_t newTokenSize) {
+	*changes = NULL;
+	*changesSize = 0;
+	int fd = changeJournalPath ? openChangeJournal(O_RDONLY, LOCK_SH) : -1;
+	char header[CHANGE_JOURNAL_MAX_HEADER + 1];
+	ssize_t headerSize = fd == -1 ? -1 : pread(fd, header, CHANGE_JOURNAL_MAX_HEADER, 0);
+	char * headerEnd = headerSize > 0 ? memchr(header, '\n', headerSize) : NULL;
+	struct stat fileStat;
+	if (!headerEnd || strncmp(header, CHANGE_JOURNAL_HEADER, sizeof(CHANGE_JOURNAL_HEADER) - 1)
+			|| fstat(fd, &fileStat) == -1) {
+		// Without a journal every token is refused and clients always get the whole collection
+		if (fd != -1) close(fd);
+		snprintf(newToken, newTokenSize, SYNC_TOKEN_PREFIX "none/0");
+		return !token;
+	}
+	*headerEnd = '\0';
+	const char * id = header + sizeof(CHANGE_JOURNAL_HEADER) - 1;
+	off_t start = headerEnd + 1 - header;
+	off_t end = fileStat.st_size;
+	snprintf(newToken, newTokenSize, SYNC_TOKEN_PREFIX "%s/%lld", id, (long long) end);
+	if (!token) {
+		close(fd);
+		return 1;
+	}
+
+	// Anything appended after end belongs to the next token so the lock isn't needed while reading
+	flock(fd, LOCK_UN);
+	size_t idSize = strlen(id);
+	const char * offset = token + sizeof(SYNC_TOKEN_PREFIX) - 1;
+	if (strncmp(token, SYNC_TOKEN_PREFIX, sizeof(SYNC_TOKEN_PREFIX) - 1) || strncmp(offset, id, idSize)
+			|| offset[idSize] != '/') {
+		close(fd);
+		return 0;
+	}
+	char * offsetEnd;
+	long long from = strtoll(offset + idSize + 1, &offsetEnd, 10);
+	if (*offsetEnd || from < start || from > end) {
+		close(fd);
+		return 0;
+	}
+	*changesSize = end - from;
+	*changes = mallocSafe(*changesSize + 1);
+	size_t bytesRead = 0;
+	ssize_t result;
+	while (bytesRead < *changesSize
+			&& (result = pread(fd, *changes + bytesRead, *changesSize - bytesRead, from + bytesRead)) > 0) {
+		bytesRead += result;
+	}
+	close(fd);
+	// A record cut short can only be the last, make sure it's terminated
+	*changesSize = bytesRead;
+	(*changes)[bytesRead] = '\0';
+	return 1;
+}
+
+// Sorts every path straight after its parent directory and before anything else
+static int compareChangedPaths(const void * a, const void * b) {
+	const unsigned char * x = *(const unsigned char **) a;
+	const unsigned char * y = *(const unsigned char **) b;
+	while (*x && *x == *y) {
+		x++;
+		y++;
+	}
+	return (*x == '/' ? 1 : *x) - (*y == '/' ? 1 : *y);
+}
+
+// Writes the member at path, which must have room for PATH_MAX, adding a '/' for directories.  Returns false if the
+// member doesn't exist.
+static int writeSyncMember(char * path, size_t pathSize, PropFindTemplates * templates, struct stat * fileStat,
+		FdWriter * writer) {
+	if (stat(path, fileStat) == -1) return 0;
+	if ((fileStat->st_mode & S_IFMT) == S_IFDIR && pathSize + 1 < PATH_MAX) {
+		path[pathSize] = '/';
+		path[pathSize + 1] = '\0';
+	}
+	const char * displayName = path + pathSize;
+	while (displayName > path && displayName[-1] != '/') {
+		displayName--;
+	}
+	writePropFindResponsePart(path, displayName, templates, fileStat, writer);
+	path[pathSize] = '\0';
+	return 1;
+}
+
+// Writes everything in the directory at path, which must have room for PATH_MAX and end in '/', and with infinite
+// everything beneath it too.  Only real directories are descended into so symlinks can't lead round in circles.
+static void writeSyncMembers(char * path, size_t pathSize, int infinite, PropFindTemplates * templates,
+		FdWriter * writer) {
+	DIR * dir = opendir(path);
+	if (!dir) return;
+	struct dirent * dp;
+	while ((dp = readdir(dir)) != NULL) {
+		size_t nameSize = strlen(dp->d_name);
+		if (!IS_DIR_CHILD(dp->d_name) || pathSize + nameSize + 2 > PATH_MAX) continue;
+		memcpy(path + pathSize, dp->d_name, nameSize + 1);
+		struct stat fileStat;
+		if (isServerFile(dp->d_name) || !writeSyncMember(path, pathSize + nameSize, templates, &fileStat, writer)) {
+			continue;
+		}
+		if (infinite && (dp->d_type == DT_DIR || (dp->d_type == DT_UNKNOWN
+				&& lstat(path, &fileStat) == 0 && (fileStat.st_mode & S_IFMT) == S_IFDIR))) {
+			path[pathSize + nameSize] = '/';
+			path[pathSize + nameSize + 1] = '\0';
+			writeSyncMembers(path, pathSize + nameSize + 1, 1, templates, writer);
+		}
+	}
+	path[pathSize] = '\0';
+	closedir(dir);
+}
+
+// Writes each changed member of the collection at path once
+static void writeSyncChanges(char * path, size_t pathSize, int infinite, char * changes, size_t changesSize,
+		PropFindTemplates * templates, FdWriter * writer) {
+	size_t changeCount = 0;
+	for (size_t i = 0; i < changesSize; i += strlen(changes + i) + 1) {
+		changeCount++;
+	}
+	char ** changed = mallocSafe(changeCount * sizeof(*changed) + 1);
+	changeCount = 0;
+	for (size_t i = 0; i < changesSize; i += strlen(changes + i) + 1) {
+		char * change = changes + i;
+		// Only members of this collection (and with infinite their descendants) and not the collection itself
+		if (strncmp(change, path, pathSize) || !change[pathSize] || isServerPath(change + pathSize)) continue;
+		if (!infinite && strchr(change + pathSize, '/')) continue;
+		changed[changeCount++] = change;
+	}
+	qsort(changed, changeCount, sizeof(*changed), &compareChangedPaths);
+
+	char * member = mallocSafe(PATH_MAX);
+	const char * walked = NULL;
+	size_t walkedSize = 0;
+	for (size_t i = 0; i < changeCount; i++) {
+		size_t memberSize = strlen(changed[i]);
+		if ((i && !strcmp(changed[i], changed[i - 1])) || memberSize + 2 > PATH_MAX) continue;
+		// Already listed with a directory that was walked
+		if (walked && !strncmp(changed[i], walked, walkedSize) && changed[i][walkedSize] == '/') continue;
+		memcpy(member, changed[i], memberSize + 1);
+		struct stat fileStat;
+		if (writeSyncMember(member, memberSize, templates, &fileStat, writer)) {
+			if (infinite && (fileStat.st_mode & S_IFMT) == S_IFDIR) {
+				member[memberSize] = '/';
+				member[memberSize + 1] = '\0';
+				writeSyncMembers(member, memberSize + 1, 1, templates, writer);
+				walked = changed[i];
+				walkedSize = memberSize;
+			}
+		} else if (errno == ENOENT || errno == ENOTDIR) {
+			fdWriterWriteLiteral(writer, "<d:response><d:href>");
+			fdWriterWriteURL(writer, member);
+			fdWriterWriteLiteral(writer, "</d:href><d:status>HTTP/1.1 404 Not Found</d:status></d:response>");
+		}
+	}
+	freeSafe(member);
+	freeSafe(changed);
+}
+
+static ssize_t report(Message * requestMessage) {
+	if (requestMessage->paramCount != 3 || requestMessage->fd == -1) {
+		stdLogError(0, "REPORT request did not provide correct buffers: %d buffer(s)", requestMessage->paramCount);
+		if (requestMessage->fd != -1) close(requestMessage->fd);
+		return respond(RAP_RESPOND_BAD_CLIENT_REQUEST);
+	}
+	char * file = messageParamToString(&requestMessage->params[RAP_PARAM_REQUEST_FILE]);
+	int ret = respond(RAP_RESPOND_CONTINUE);
+	if (ret < 0) {
+		return ret;
+	}
+
+	SyncRequest request;
+	int parsed = parseSyncCollection(requestMessage->fd, &request);
+	if (parsed < 0) {
+		return writeErrorResponse(RAP_RESPOND_ACCESS_DENIED, "Only sync-collection reports are supported",
+				"supported-report", file);
+	} else if (!parsed) {
+		return respond(RAP_RESPOND_BAD_CLIENT_REQUEST);
+	} else if (request.limited) {
+		return writeErrorResponse(RAP_RESPOND_INSUFFICIENT_STORAGE, "Limits on sync-collection are not supported",
+				"number-of-matches-within-limits", file);
+	}
+
+	size_t fileNameSize = strlen(file);
+	struct stat fileStat;
+	if (fileNameSize + 2 > PATH_MAX) {
+		return writeErrorResponse(RAP_RESPOND_URI_TOO_LARGE, "URI was too large to process", NULL, file);
+	} else if (stat(file, &fileStat) == -1) {
+		return writeErrorResponse(errno == EACCES ? RAP_RESPOND_ACCESS_DENIED : RAP_RESPOND_NOT_FOUND,
+				strerror(errno), NULL, file);
+	} else if ((fileStat.st_mode & S_IFMT) != S_IFDIR) {
+		return writeErrorResponse(RAP_RESPOND_ACCESS_DENIED, "Only collections can be synchronized",
+				"supported-report", file);
+	}
+	char * filePath = mallocSafe(PATH_MAX);
+	size_t filePathSize = fileNameSize;
+	normalizeDirName(filePath, file, &filePathSize, 1);
+
+	// Changes made by other programs which the directory cache has seen but not yet recorded
+	if (directoryWatchFd != -1) readDirectoryEvents();
+	flushChangeJournal();
+
+	char * changes;
+	size_t changesSize;
+	char newToken[SYNC_TOKEN_SIZE];
+	if (!readChangeJournal(request.token[0] ? request.token : NULL, &changes, &changesSize, newToken,
+			sizeof(newToken))) {
+		freeSafe(filePath);
+		return writeErrorResponse(RAP_RESPOND_ACCESS_DENIED, "The sync token has expired", "valid-sync-token",
+				file);
+	}
+
+	int pipeEnds[2];
+	if (pipe(pipeEnds)) {
+		stdLogError(errno, "Could not create pipe to write content");
+		freeSafe(changes);
+		freeSafe(filePath);
+		return respond(RAP_RESPOND_INTERNAL_ERROR);
+	}
+	time_t fileTime;
+	time(&fileTime);
+	Message message = { .mID = RAP_RESPOND_MULTISTATUS, .fd = pipeEnds[PIPE_READ], .paramCount = 2 };
+	message.params[RAP_PARAM_RESPONSE_DATE] = toMessageParam(fileTime);
+	message.params[RAP_PARAM_RESPONSE_MIME] = makeMessageParam(XML_MIME_TYPE.type,
+			XML_MIME_TYPE.typeStringSize);
+	message.params[RAP_PARAM_RESPONSE_LOCATION] = makeMessageParam(filePath, filePathSize + 1);
+	ssize_t messageResult = sendMessage(RAP_CONTROL_SOCKET, &message);
+	if (messageResult <= 0) {
+		close(pipeEnds[PIPE_WRITE]);
+		freeSafe(changes);
+		freeSafe(filePath);
+		return messageResult;
+	}
+
+	PropFindTemplates templates;
+	buildPropFindTemplates(&templates, &request.properties);
+	FdWriter * writer = fdWriterNew(pipeEnds[PIPE_WRITE], PROPFIND_BUFFER_SIZE);
+	fdWriterWriteLiteral(writer, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<d:multistatus xmlns:z=\""
+			MICROSOFT_NAMESPACE "\" xmlns:cs=\"" CALENDARSERVER_NAMESPACE "\" xmlns:d=\"" WEBDAV_NAMESPACE "\">");
+	if (changes) {
+		writeSyncChanges(filePath, filePathSize, request.infinite, changes, changesSize, &templates, writer);
+	} else {
+		writeSyncMembers(filePath, filePathSize, request.infinite, &templates, writer);
+	}
+	fdWriterWriteLiteral(writer, "<d:sync-token>");
+	fdWriterWriteEscaped(writer, newToken);
+	fdWriterWriteLiteral(writer, "</d:sync-token></d:multistatus>");
+	fdWriterFree(writer);
+	freeSafe(changes);
+	freeSafe(filePath);
+	return messageResult;
+}
+
+/////////////////////////
+// End Sync Collection //
+/////////////////////////
+
+/////////////////////////
+// Change Notification //
+/////////////////////////
+
+// webdavd streams a collection's changes to clients that would otherwise poll it.  It can't watch the user's files
+// itself so the RAP adds the watch to the user's inotify instance, which webdavd passes in and reads.  For the user's
+// first stream there is no instance yet and the RAP creates one.  Changes to the collection's members show directly.
+// Changes further down show as the getctag stamp (an IN_ATTRIB) on the collection itself.
+
+#define CHANGE_WATCH_EVENTS (IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO \
+		| IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+static ssize_t watchCollection(Message * requestMessage) {
+	const char * file = messageParamToString(&requestMessage->params[RAP_PARAM_REQUEST_FILE]);
+	int inotifyFd = requestMessage->fd;
+	if (inotifyFd == -1) {
+		inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (inotifyFd == -1) {
+			int e = errno;
+			stdLogError(e, "Could not create inotify instance to watch %s", file);
+			return writeErrorResponse(RAP_RESPOND_INTERNAL_ERROR, strerror(e), NULL, file);
+		}
+	}
+
+	int watch = inotify_add_watch(inotifyFd, file, CHANGE_WATCH_EVENTS);
+	if (watch == -1) {
+		int e = errno;
+		close(inotifyFd);
+		stdLogError(e, "Could not watch %s", file);
+		switch (e) {
+		case EACCES:
+			return writeErrorResponse(RAP_RESPOND_ACCESS_DENIED, strerror(e), NULL, file);
+		case ENOENT:
+			return writeErrorResponse(RAP_RESPOND_NOT_FOUND, strerror(e), NULL, file);
+		case ENOTDIR:
+			return writeErrorResponse(RAP_RESPOND_BAD_CLIENT_REQUEST, "Only collections can be watched", NULL,
+					file);
+		case ENOSPC:
+			return writeErrorResponse(RAP_RESPOND_INSUFFICIENT_STORAGE, strerror(e), NULL, file);
+		default:
+			return writeErrorResponse(RAP_RESPOND_INTERNAL_ERROR, strerror(e), NULL, file);
+		}
+	}
+
+	finishProgress();
+	Message message = { .mID = RAP_RESPOND_OK, .fd = inotifyFd, .paramCount = 1 };
+	message.params[RAP_PARAM_WATCH_DESCRIPTOR] = toMessageParam(watch);
+	return sendMessage(RAP_CONTROL_SOCKET, &message);
+}
+
+/////////////////////////////
+// End Change Notification //
+/////////////////////////////
+
 ///////////////
 // PROPPATCH //
 ///////////////
@@ -829,18 +2088,24 @@ static ssize_t propfind(Message * requestMessage) {
 static ssize_t proppatch(Message * requestMessage) {
 	if (requestMessage->fd != -1) {
 		respond(RAP_RESPOND_CONTINUE);
-		char buffer[BUFFER_SIZE];
-		ssize_t bytesRead;
-		while ((bytesRead = read(requestMessage->fd, buffer, sizeof(buffer))) > 0) {
-			//ssize_t __attribute__ ((unused)) ignored = write(STDERR_FILENO, buffer, bytesRead);
+		const char * file = messageParamToString(&requestMessage->params[RAP_PARAM_REQUEST_FILE]);
+
+		// Dead properties are not stored so the update is only checked and then the current properties are returned
+		DavXmlReader reader;
+		int valid = davXmlOpen(&reader, requestMessage->fd);
+		DavXmlNode node = valid ? davXmlRead(&reader) : DAV_XML_ERROR;
+		valid = (node == DAV_XML_START && davXmlIs(&reader, DAV_NS_DAV, DAV_NAME_PROPERTYUPDATE));
+		while (node > DAV_XML_END_OF_DOCUMENT) {
+			node = davXmlRead(&reader);
+		}
+		davXmlClose(&reader);
+		if (!valid || node == DAV_XML_ERROR) {
+			stdLogError(0, "Request body was not a well formed propertyupdate document");
+			return writeErrorResponse(RAP_RESPOND_BAD_CLIENT_REQUEST, "Malformed propertyupdate request", NULL, file);
 		}
 
-		//char c = '\n';
-		//ssize_t __attribute__ ((unused)) ignored = write(STDOUT_FILENO, &c, 1);
-		close(requestMessage->fd);
 		PropertySet p;
 		memset(&p, 1, sizeof(p));
-		const char * file = messageParamToString(&requestMessage->params[RAP_PARAM_REQUEST_FILE]);
 		return respondToPropFind(file, LOCK_TYPE_SHARED, &p, 1);
 
 	} else {
@@ -888,26 +2153,259 @@ static ssize_t mkcol(Message * requestMessage) {
 // End MKCOL //
 ///////////////
 
-//////////
-// COPY //
-//////////
+///////////////
+// Tree Walk //
+///////////////
+
+// COPY, MOVE and DELETE of a collection walk every file under it.  Each directory is one piece of work: whoever
+// picks it up deals with all of its files using calls relative to the directory's fd, and queues its subdirectories
+// for the next free thread.  Up to WEBDAVD_TREE_THREADS threads, counting the RAP's own, share the queue.  Everything
+// a walk creates or finds is kept on its results list, newest first, so a child always comes before its parent.
 
-typedef struct FileCopyData {
-	struct FileCopyData * next;
+typedef struct TreeEntry {
+	struct TreeEntry * next;
+	struct TreeEntry * queued;
 	const char * source;
 	const char * target;
 	size_t sourceNameLength;
 	size_t targetNameLength;
 	int type;
-} FileCopyData;
+	mode_t mode;
+	uid_t uid;
+	gid_t gid;
+} TreeEntry;
+
+typedef struct TreeWalk TreeWalk;
+
+typedef void (*TreeWalkFunction)(TreeWalk * walk, TreeEntry * directory);
+
+struct TreeWalk {
+	sem_t lock;
+	sem_t workAvailable;
+	TreeWalkFunction walkDirectory;
+	const char * action;
+	TreeEntry * queue;
+	TreeEntry * results;
+	int active;
+	int error;
+};
+
+static int treeThreadCount = 1;
+
+static void initializeTreeWalk() {
+	const char * threads = getenv("WEBDAVD_TREE_THREADS");
+	if (threads) treeThreadCount = atoi(threads);
+	if (treeThreadCount < 1) treeThreadCount = 1;
+	if (treeThreadCount > 64) treeThreadCount = 64;
+}
+
+// Builds the entry for name inside parent.  The target is only filled in if the parent has one.
+static TreeEntry * newTreeEntry(TreeEntry * parent, const char * name) {
+	size_t nameLength = strlen(name);
+	size_t sourceSize = parent->sourceNameLength + nameLength + 1;
+	size_t targetSize = parent->target ? parent->targetNameLength + nameLength + 1 : 0;
+	TreeEntry * entry = mallocSafe(sizeof(TreeEntry) + sourceSize + targetSize);
+
+	// store the source right after the structure
+	char * ptr = (char *) (entry + 1);
+	memcpy(ptr, parent->source, parent->sourceNameLength);
+	ptr[parent->sourceNameLength - 1] = '/';
+	memcpy(ptr + parent->sourceNameLength, name, nameLength + 1);
+	entry->source = ptr;
+	entry->sourceNameLength = sourceSize;
+
+	if (parent->target) {
+		ptr += sourceSize;
+		memcpy(ptr, parent->target, parent->targetNameLength);
+		ptr[parent->targetNameLength - 1] = '/';
+		memcpy(ptr + parent->targetNameLength, name, nameLength + 1);
+		entry->target = ptr;
+	} else {
+		entry->target = NULL;
+	}
+	entry->targetNameLength = targetSize;
+	return entry;
+}
+
+static int treeWalkFailing(TreeWalk * walk) {
+	return __atomic_load_n(&walk->error, __ATOMIC_RELAXED);
+}
+
+// Records errno as the reason the walk failed.  Only the first failure is kept, the rest of the walk is abandoned.
+static void treeWalkFailed(TreeWalk * walk, const char * directory, const char * name) {
+	int e = errno;
+	if (name) stdLogError(e, "Could not %s %s/%s", walk->action, directory, name);
+	else stdLogError(e, "Could not %s %s", walk->action, directory);
+	int expected = 0;
+	__atomic_compare_exchange_n(&walk->error, &expected, e, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+// Adds the entry to the results and, if walkChildren is set, queues it to have its children walked
+static void treeWalkAdd(TreeWalk * walk, TreeEntry * entry, int walkChildren) {
+	addProgress(1);
+	sem_wait(&walk->lock);
+	entry->next = walk->results;
+	walk->results = entry;
+	if (walkChildren) {
+		entry->queued = walk->queue;
+		walk->queue = entry;
+		walk->active++;
+	}
+	sem_post(&walk->lock);
+	if (walkChildren) sem_post(&walk->workAvailable);
+}
+
+static void * treeWalker(void * walkPtr) {
+	TreeWalk * walk = walkPtr;
+	for (;;) {
+		sem_wait(&walk->workAvailable);
+		sem_wait(&walk->lock);
+		TreeEntry * directory = walk->queue;
+		if (!directory) {
+			// Every directory is done.  Pass the wake up on to the next thread.
+			sem_post(&walk->lock);
+			sem_post(&walk->workAvailable);
+			return NULL;
+		}
+		walk->queue = directory->queued;
+		sem_post(&walk->lock);
+
+		if (!treeWalkFailing(walk)) walk->walkDirectory(walk, directory);
+
+		sem_wait(&walk->lock);
+		int finished = (--walk->active == 0);
+		sem_post(&walk->lock);
+		if (finished) sem_post(&walk->workAvailable);
+	}
+}
+
+static void startTreeWalk(TreeWalk * walk, TreeWalkFunction walkDirectory, const char * action) {
+	sem_init(&walk->lock, 0, 1);
+	sem_init(&walk->workAvailable, 0, 0);
+	walk->walkDirectory = walkDirectory;
+	walk->action = action;
+	walk->queue = NULL;
+	walk->results = NULL;
+	walk->active = 0;
+	walk->error = 0;
+}
+
+// Walks every directory queued so far, and everything they queue, then returns.  Returns false with errno set if
+// anything failed.  The results are left on walk->results for the caller.
+static int finishTreeWalk(TreeWalk * walk) {
+	if (walk->active) {
+		pthread_t threads[treeThreadCount];
+		int threadCount = 0;
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+		pthread_attr_setstacksize(&attr, 256 * 1024);
+		while (threadCount < treeThreadCount - 1) {
+			int result = pthread_create(&threads[threadCount], &attr, &treeWalker, walk);
+			if (result) {
+				stdLogError(result, "Could not create tree walk thread");
+				break;
+			}
+			threadCount++;
+		}
+		pthread_attr_destroy(&attr);
+		treeWalker(walk);
+		for (int i = 0; i < threadCount; i++) {
+			pthread_join(threads[i], NULL);
+		}
+	}
+	sem_destroy(&walk->lock);
+	sem_destroy(&walk->workAvailable);
+	if (walk->error) {
+		errno = walk->error;
+		return 0;
+	}
+	return 1;
+}
+
+static void freeTreeEntries(TreeEntry * entries) {
+	while (entries) {
+		TreeEntry * next = entries->next;
+		freeSafe(entries);
+		entries = next;
+	}
+}
 
-static ssize_t copyErrorCleanup(FileCopyData * files, const char * action, const char * source,
+static void deleteDirectory(TreeWalk * walk, TreeEntry * directory) {
+	int dirFd = open(directory->source, O_RDONLY | O_DIRECTORY);
+	DIR * dir = dirFd == -1 ? NULL : fdopendir(dirFd);
+	if (!dir) {
+		treeWalkFailed(walk, directory->source, NULL);
+		if (dirFd != -1) close(dirFd);
+		return;
+	}
+	struct dirent * dp;
+	while (!treeWalkFailing(walk) && (dp = readdir(dir)) != NULL) {
+		if (!IS_DIR_CHILD(dp->d_name)) continue;
+		// TODO lock
+		int isDirectory = (dp->d_type == DT_DIR);
+		if (dp->d_type == DT_UNKNOWN) {
+			struct stat fileStat;
+			if (fstatat(dirFd, dp->d_name, &fileStat, AT_SYMLINK_NOFOLLOW) == -1) {
+				treeWalkFailed(walk, directory->source, dp->d_name);
+				break;
+			}
+			isDirectory = S_ISDIR(fileStat.st_mode);
+		}
+		if (isDirectory) {
+			TreeEntry * child = newTreeEntry(directory, dp->d_name);
+			child->type = S_IFDIR;
+			treeWalkAdd(walk, child, 1);
+		} else if (unlinkat(dirFd, dp->d_name, 0) == -1) {
+			treeWalkFailed(walk, directory->source, dp->d_name);
+		} else {
+			addProgress(1);
+		}
+	}
+	closedir(dir);
+}
+
+// Deletes the directory and everything in it.  Returns false with errno set on failure.
+static int deleteTree(const char * path, size_t pathSize) {
+	TreeWalk walk;
+	startTreeWalk(&walk, &deleteDirectory, "delete");
+	TreeEntry * root = mallocSafe(sizeof(TreeEntry));
+	root->source = path;
+	root->sourceNameLength = pathSize;
+	root->target = NULL;
+	root->targetNameLength = 0;
+	root->type = S_IFDIR;
+	treeWalkAdd(&walk, root, 1);
+	int result = finishTreeWalk(&walk);
+	int e = errno;
+
+	// Directories are emptied child first so each is empty by the time its parent is removed
+	for (TreeEntry * entry = walk.results; result && entry; entry = entry->next) {
+		if (rmdir(entry->source) == -1) {
+			e = errno;
+			stdLogError(e, "Could not delete %s", entry->source);
+			result = 0;
+		}
+	}
+	freeTreeEntries(walk.results);
+	errno = e;
+	return result;
+}
+
+///////////////////
+// End Tree Walk //
+///////////////////
+
+//////////
+// COPY //
+//////////
+
+static ssize_t copyErrorCleanup(TreeEntry * files, const char * action, const char * source,
 		const char * target) {
 	int e = errno;
 	while (files) {
 		if (files->type == S_IFDIR) rmdir(files->target);
 		else unlink(files->target);
-		FileCopyData * next = files->next;
+		TreeEntry * next = files->next;
 		freeSafe(files);
 		files = next;
 	}
@@ -929,155 +2427,2246 @@ static ssize_t copyErrorCleanup(FileCopyData * files, const char * action, const
 	}
 }
 
-// Copies the head of the copied list and pushes more onto this is a direcory.
-// If the copy fails the item is popped of the head of the list
-// If the copy succeeds and is a file then the list is unchanged except that ->type will be set.
-// If the copy succeeds and is a directory then copied child members are added to the head.
-static int copyFileRecursive(FileCopyData ** copied) {
-// We are given the file to copy at the head of the "copied" list.
-	FileCopyData * toCopy = *copied;
+static int uringBusy = 0;
+
+// Copies from offset up to end with pread and pwrite
+static int copyFileReadWrite(int sourceFd, int targetFd, off_t offset, off_t end) {
+	char buffer[BUFFER_SIZE];
+	while (offset < end) {
+		ssize_t bytesRead = pread(sourceFd, buffer, end - offset < BUFFER_SIZE ? end - offset : BUFFER_SIZE,
+				offset);
+		if (bytesRead <= 0) return bytesRead;
+		ssize_t bytesWritten = pwrite(targetFd, buffer, bytesRead, offset);
+		if (bytesWritten < bytesRead) {
+			if (bytesWritten >= 0) errno = ENOSPC;
+			return -1;
+		}
+		offset += bytesRead;
+	}
+	return 0;
+}
+
+// Copies the content of a regular file as cheaply as the filesystem allows.  A reflink shares the
+// source's extents outright, otherwise copy_file_range lets the kernel (or the server on NFS and SMB)
+// do the copy, otherwise it goes through userspace.  Holes in the source are skipped over so sparse
+// files stay sparse.
+static int copyFileData(int sourceFd, int targetFd, off_t size) {
+	if (ioctl(targetFd, FICLONE, sourceFd) == 0) return 0;
+
+	int kernelCopy = 1;
+	off_t offset = 0;
+	while (offset < size) {
+		off_t dataStart = lseek(sourceFd, offset, SEEK_DATA);
+		if (dataStart == -1) {
+			if (errno == ENXIO) break; // Nothing but a hole left
+			if (errno != EINVAL) return -1;
+			// No hole support so the whole file is data
+			dataStart = offset;
+		}
+		off_t dataEnd = lseek(sourceFd, dataStart, SEEK_HOLE);
+		if (dataEnd == -1 || dataEnd > size) dataEnd = size;
+
+		offset = dataStart;
+		while (kernelCopy && offset < dataEnd) {
+			off_t sourceOffset = offset;
+			off_t targetOffset = offset;
+			ssize_t copied = copy_file_range(sourceFd, &sourceOffset, targetFd, &targetOffset,
+					dataEnd - offset, 0);
+			if (copied > 0) {
+				offset += copied;
+			} else if (copied == 0) {
+				// The source has shrunk
+				dataEnd = offset;
+				size = offset;
+			} else if (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP) {
+				kernelCopy = 0;
+			} else {
+				return -1;
+			}
+		}
+		if (!kernelCopy) {
+			// There's only one ring so threads in a tree walk take turns with it
+			if (offset == 0 && dataEnd == size && uringAvailable()
+					&& !__atomic_exchange_n(&uringBusy, 1, __ATOMIC_ACQUIRE)) {
+				int failedFd;
+				ssize_t copied = uringCopy(sourceFd, targetFd, &failedFd);
+				__atomic_store_n(&uringBusy, 0, __ATOMIC_RELEASE);
+				if (copied != URING_NOT_STARTED) return copied < 0 ? -1 : 0;
+			}
+			if (copyFileReadWrite(sourceFd, targetFd, offset, dataEnd) == -1) return -1;
+		}
+		offset = dataEnd;
+	}
+
+	// Trailing holes are not written above so they are recreated by setting the size
+	return offset < size ? ftruncate(targetFd, size) : 0;
+}
+
+// Copies size bytes from sourceOffset in sourceFd to targetOffset in targetFd.  As with copyFileData the extents are
+// shared or copied by the kernel where possible.  Reflinks need both offsets to be multiples of the filesystem's block
+// size.
+static int copyFileSpan(int sourceFd, off_t sourceOffset, int targetFd, off_t targetOffset, off_t size) {
+	struct file_clone_range clone = { .src_fd = sourceFd, .src_offset = sourceOffset, .src_length = size,
+			.dest_offset = targetOffset };
+	if (size == 0 || ioctl(targetFd, FICLONERANGE, &clone) == 0) return 0;
+
+	off_t offset = 0;
+	while (offset < size) {
+		off_t copySource = sourceOffset + offset;
+		off_t copyTarget = targetOffset + offset;
+		ssize_t copied = copy_file_range(sourceFd, &copySource, targetFd, &copyTarget, size - offset, 0);
+		if (copied == 0) {
+			// The source has shrunk
+			errno = EIO;
+			return -1;
+		} else if (copied == -1) {
+			if (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP) break;
+			return -1;
+		}
+		offset += copied;
+	}
+
+	char buffer[BUFFER_SIZE];
+	while (offset < size) {
+		ssize_t bytesRead = pread(sourceFd, buffer, size - offset < BUFFER_SIZE ? size - offset : BUFFER_SIZE,
+				sourceOffset + offset);
+		if (bytesRead <= 0) {
+			if (bytesRead == 0) errno = EIO;
+			return -1;
+		}
+		if (pwrite(targetFd, buffer, bytesRead, targetOffset + offset) < bytesRead) return -1;
+		offset += bytesRead;
+	}
+	return 0;
+}
+
+// Copies one file, directory, link or fifo from sourceName (relative to sourceDirFd) to targetName (relative to
+// targetDirFd).  Once the target exists the entry is added to the walk's results so that it can be rolled back.
+// Directories are queued to have their children copied.
+static void copyTreeEntry(TreeWalk * walk, int sourceDirFd, const char * sourceName, int targetDirFd,
+		const char * targetName, TreeEntry * entry) {
 	struct stat fileStat;
-	if (lstat(toCopy->source, &fileStat) == -1) goto error_exit;
-	toCopy->type = fileStat.st_mode & S_IFMT;
-	int mode = fileStat.st_mode & 0777;
+	if (fstatat(sourceDirFd, sourceName, &fileStat, AT_SYMLINK_NOFOLLOW) == -1) goto error_exit;
+	entry->type = fileStat.st_mode & S_IFMT;
+	entry->mode = fileStat.st_mode & 0777;
+	entry->uid = fileStat.st_uid;
+	entry->gid = fileStat.st_gid;
 
-	switch (toCopy->type) {
+	switch (entry->type) {
 	case S_IFREG: {
-		int oldFd = open(toCopy->source, O_RDONLY);
+		int oldFd = openat(sourceDirFd, sourceName, O_RDONLY);
 		if (oldFd == -1) goto error_exit;
-		int newFd = open(toCopy->target, O_WRONLY | O_CREAT | O_EXCL, 0600);
+		int newFd = openat(targetDirFd, targetName, O_WRONLY | O_CREAT | O_EXCL, 0600);
 		if (newFd == -1) {
 			close(oldFd);
 			goto error_exit;
 		}
-		char readBuffer[BUFFER_SIZE];
-		ssize_t bytesRead = 0;
-		ssize_t bytesWritten = 0;
-		while ((bytesRead == bytesWritten) && ((bytesRead = read(oldFd, readBuffer, BUFFER_SIZE)) > 0)) {
-			bytesWritten = write(newFd, readBuffer, bytesRead);
+		treeWalkAdd(walk, entry, 0);
+		int result = copyFileData(oldFd, newFd, fileStat.st_size);
+		if (result == -1) {
+			treeWalkFailed(walk, entry->source, NULL);
+		} else {
+			fchmod(newFd, entry->mode);
+			fchown(newFd, entry->uid, entry->gid);
 		}
 		close(oldFd);
 		close(newFd);
-		if (bytesRead != 0) return 0;
-		chmod(toCopy->target, mode);
+		return;
+	}
+
+	case S_IFDIR:
+		// The mode and owner are set once everything in it has been copied
+		if (mkdirat(targetDirFd, targetName, 0700) == -1) goto error_exit;
+		treeWalkAdd(walk, entry, 1);
+		return;
+
+	case S_IFLNK: {
+		char linkTarget[4096];
+		ssize_t linkSize = readlinkat(sourceDirFd, sourceName, linkTarget, sizeof(linkTarget) - 1);
+		if (linkSize == -1) goto error_exit;
+		linkTarget[linkSize] = '\0';
+		if (symlinkat(linkTarget, targetDirFd, targetName) == -1) goto error_exit;
+		treeWalkAdd(walk, entry, 0);
 		break;
 	}
 
-	case S_IFDIR: {
-		if (mkdir(toCopy->target, 0700) == -1) {
-			goto error_exit;
-		} else {
-			DIR * dir = opendir(toCopy->source);
-			if (!dir) return 0;
-			for (struct dirent * entry = readdir(dir); entry; entry = readdir(dir)) {
-				if (!IS_DIR_CHILD(entry->d_name)) continue;
-
-				size_t childNameLength = strlen(entry->d_name);
-				FileCopyData * childToCopy = mallocSafe(
-						sizeof(FileCopyData) + toCopy->sourceNameLength + childNameLength
-								+ toCopy->targetNameLength + childNameLength + 2);
-
-				// store the source right after the structure
-				size_t size = toCopy->sourceNameLength + childNameLength + 1;
-				char * ptr = (char *) (childToCopy + 1);
-				memcpy(ptr, toCopy->source, toCopy->sourceNameLength);
-				ptr[toCopy->sourceNameLength - 1] = '/';
-				memcpy(ptr + toCopy->sourceNameLength, entry->d_name, childNameLength + 1);
-				childToCopy->source = ptr;
-				childToCopy->sourceNameLength = size;
-
-				size = toCopy->targetNameLength + childNameLength + 1;
-				ptr += childToCopy->sourceNameLength;
-				memcpy(ptr, toCopy->target, toCopy->targetNameLength);
-				ptr[toCopy->targetNameLength - 1] = '/';
-				memcpy(ptr + toCopy->targetNameLength, entry->d_name, childNameLength + 1);
-				childToCopy->target = ptr;
-				childToCopy->targetNameLength = size;
-
-				childToCopy->next = *copied;
-				*copied = childToCopy;
-
-				if (!copyFileRecursive(copied)) {
-					closedir(dir);
-					return 0;
+	case S_IFIFO:
+		if (mkfifoat(targetDirFd, targetName, 0600) == -1) goto error_exit;
+		treeWalkAdd(walk, entry, 0);
+		fchmodat(targetDirFd, targetName, entry->mode, 0);
+		break;
+
+		// TODO other file types
+	case S_IFBLK:
+	case S_IFCHR:
+	case S_IFSOCK:
+	default:
+		errno = ENOTSUP;
+		goto error_exit;
+	}
+
+	fchownat(targetDirFd, targetName, entry->uid, entry->gid, AT_SYMLINK_NOFOLLOW);
+	return;
+
+	error_exit: treeWalkFailed(walk, entry->source, NULL);
+	freeSafe(entry);
+}
+
+static void copyDirectory(TreeWalk * walk, TreeEntry * directory) {
+	int sourceDirFd = open(directory->source, O_RDONLY | O_DIRECTORY);
+	DIR * dir = sourceDirFd == -1 ? NULL : fdopendir(sourceDirFd);
+	if (!dir) {
+		treeWalkFailed(walk, directory->source, NULL);
+		if (sourceDirFd != -1) close(sourceDirFd);
+		return;
+	}
+	int targetDirFd = open(directory->target, O_RDONLY | O_DIRECTORY);
+	if (targetDirFd == -1) {
+		treeWalkFailed(walk, directory->target, NULL);
+		closedir(dir);
+		return;
+	}
+	struct dirent * dp;
+	while (!treeWalkFailing(walk) && (dp = readdir(dir)) != NULL) {
+		if (IS_DIR_CHILD(dp->d_name)) {
+			copyTreeEntry(walk, sourceDirFd, dp->d_name, targetDirFd, dp->d_name,
+					newTreeEntry(directory, dp->d_name));
+		}
+	}
+	close(targetDirFd);
+	closedir(dir);
+}
+
+// Copies source to target and everything under it.  Returns false with errno set if anything failed.  Either way
+// copied is set to everything that was created, child first, so that it can be rolled back.
+static int copyTree(const char * source, size_t sourceSize, const char * target, size_t targetSize,
+		TreeEntry ** copied) {
+	TreeWalk walk;
+	startTreeWalk(&walk, &copyDirectory, "copy");
+	TreeEntry * root = mallocSafe(sizeof(TreeEntry));
+	root->source = source;
+	root->target = target;
+	root->sourceNameLength = sourceSize;
+	root->targetNameLength = targetSize;
+	copyTreeEntry(&walk, AT_FDCWD, source, AT_FDCWD, target, root);
+	int result = finishTreeWalk(&walk);
+	*copied = walk.results;
+	if (result) {
+		// Directories were created writable so that they could be filled
+		for (TreeEntry * entry = walk.results; entry; entry = entry->next) {
+			if (entry->type == S_IFDIR) {
+				chmod(entry->target, entry->mode);
+				lchown(entry->target, entry->uid, entry->gid);
+			}
+		}
+	}
+	return result;
+}
+
+static ssize_t copyFile(Message * requestMessage) {
+	if (requestMessage->fd != -1) {
+		// stdLogError(0, "MKCOL request sent incoming data!");
+		close(requestMessage->fd);
+	}
+
+	const char * source = messageParamToString(&requestMessage->params[RAP_PARAM_REQUEST_FILE]);
+	const char * target = messageParamToString(&requestMessage->params[RAP_PARAM_REQUEST_TARGET]);
+
+	if (!target) {
+		return writeErrorResponse(RAP_RESPOND_BAD_CLIENT_REQUEST, "No target header specified", NULL, source);
+	}
+
+	TreeEntry * copied;
+	startProgress();
+	if (copyTree(source, messageParamSize(requestMessage->params[RAP_PARAM_REQUEST_FILE]), target,
+			messageParamSize(requestMessage->params[RAP_PARAM_REQUEST_TARGET]), &copied)) {
+		freeTreeEntries(copied);
+		return respond(RAP_RESPOND_CREATED);
+	} else {
+		return copyErrorCleanup(copied, "copy", source, target);
+	}
+
+}
+
+//////////////
+// End COPY //
+//////////////
+
+///////////////////
+// Sidecar Files //
+///////////////////
+
+// A sidecar is a compressed copy of a file, stored beside it, which GET serves instead when the client accepts its
+// encoding.  Users may store their own as file.zst, file.br or file.gz.  These are only served while they're regular
+// files belonging to the file's owner and are at least as new as the file, so that an unrelated file.gz isn't passed
+// off as the file.  webdavd makes its own as hidden files named ".name.webdavd-gz", so they can't overwrite a file.gz
+// the user stored.  They're given the exact mtime of the file they were made from, so any change to the file, or
+// another file moved into its place, makes them stale.  DELETE and MOVE of the file take its generated sidecar with it.
+
+typedef struct Sidecar {
+	ContentEncoding encoding;
+	const char * suffix;
+	const char * name;
+	int generated;
+} Sidecar;
+
+#define GENERATED_SIDECAR_SUFFIX ".webdavd-gz"
+
+// In order of preference
+static const Sidecar SIDECARS[] = {
+		{ .encoding = CONTENT_ENCODING_ZSTD, .suffix = ".zst", .name = "zstd", .generated = 0 },
+		{ .encoding = CONTENT_ENCODING_BROTLI, .suffix = ".br", .name = "br", .generated = 0 },
+		{ .encoding = CONTENT_ENCODING_GZIP, .suffix = ".gz", .name = "gzip", .generated = 0 },
+		{ .encoding = CONTENT_ENCODING_GZIP, .suffix = GENERATED_SIDECAR_SUFFIX, .name = "gzip", .generated = 1 } };
+
+#define GENERATED_SIDECAR (&SIDECARS[sizeof(SIDECARS) / sizeof(*SIDECARS) - 1])
+#define SIDECAR_SUFFIX_MAX (sizeof(GENERATED_SIDECAR_SUFFIX) + 1)
+
+static void sidecarName(char * buffer, const char * file, const Sidecar * sidecar) {
+	if (!sidecar->generated) {
+		sprintf(buffer, "%s%s", file, sidecar->suffix);
+		return;
+	}
+	const char * baseName = strrchr(file, '/');
+	baseName = baseName ? baseName + 1 : file;
+	sprintf(buffer, "%.*s.%s%s", (int) (baseName - file), file, baseName, sidecar->suffix);
+}
+
+static int isSidecarFresh(const Sidecar * sidecar, struct stat * sidecarStat, struct stat * fileStat) {
+	if (sidecar->generated) {
+		return sidecarStat->st_mtim.tv_sec == fileStat->st_mtim.tv_sec
+				&& sidecarStat->st_mtim.tv_nsec == fileStat->st_mtim.tv_nsec;
+	}
+	return sidecarStat->st_uid == fileStat->st_uid && (sidecarStat->st_mtim.tv_sec > fileStat->st_mtim.tv_sec
+			|| (sidecarStat->st_mtim.tv_sec == fileStat->st_mtim.tv_sec
+					&& sidecarStat->st_mtim.tv_nsec >= fileStat->st_mtim.tv_nsec));
+}
+
+// Looks for a sidecar in an encoding which the client accepts and which is fresh for this version of the file.
+// Returns the open sidecar or -1 if there is none.
+static int openSidecar(const char * file, struct stat * fileStat, int encodings, const Sidecar ** sidecar) {
+	char name[strlen(file) + SIDECAR_SUFFIX_MAX];
+	for (int i = 0; i < sizeof(SIDECARS) / sizeof(*SIDECARS); i++) {
+		if (encodings & CONTENT_ENCODING_BIT(SIDECARS[i].encoding)) {
+			sidecarName(name, file, &SIDECARS[i]);
+			int fd = open(name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+			if (fd != -1) {
+				struct stat sidecarStat;
+				if (!fstat(fd, &sidecarStat) && (sidecarStat.st_mode & S_IFMT) == S_IFREG
+						&& isSidecarFresh(&SIDECARS[i], &sidecarStat, fileStat)) {
+					*sidecar = &SIDECARS[i];
+					return fd;
 				}
+				close(fd);
+			}
+		}
+	}
+	return -1;
+}
+
+static void deleteSidecar(const char * file) {
+	char name[strlen(file) + SIDECAR_SUFFIX_MAX];
+	sidecarName(name, file, GENERATED_SIDECAR);
+	unlink(name);
+}
+
+// A sidecar left at the target by whatever was there before is replaced or removed
+static void moveSidecar(const char * sourceFile, const char * targetFile) {
+	char sourceName[strlen(sourceFile) + SIDECAR_SUFFIX_MAX];
+	char targetName[strlen(targetFile) + SIDECAR_SUFFIX_MAX];
+	sidecarName(sourceName, sourceFile, GENERATED_SIDECAR);
+	sidecarName(targetName, targetFile, GENERATED_SIDECAR);
+	if (rename(sourceName, targetName) == -1) {
+		unlink(sourceName);
+		unlink(targetName);
+	}
+}
+
+static int isCompressibleType(const char * mimeType) {
+	for (int i = 0; i < compressibleTypeCount; i++) {
+		if (mimeTypeMatches(compressibleTypes[i], mimeType)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// Writes the gzip sidecar through a temporary file so that a half written sidecar is never served
+static int writeGzipSidecar(const char * file, struct stat * fileStat) {
+	size_t nameSize = strlen(file) + SIDECAR_SUFFIX_MAX;
+	char name[nameSize];
+	char tempName[nameSize + 7];
+	sidecarName(name, file, GENERATED_SIDECAR);
+	sprintf(tempName, "%s.XXXXXX", name);
+
+	int inFd = open(file, O_RDONLY | O_CLOEXEC);
+	if (inFd == -1) {
+		return 0;
+	}
+	int outFd = mkstemp(tempName);
+	if (outFd == -1) {
+		stdLogError(errno, "Could not create temporary sidecar for %s", file);
+		close(inFd);
+		return 0;
+	}
+	fchmod(outFd, fileStat->st_mode & 0777);
+
+	gzFile gz = gzdopen(outFd, "wb6");
+	char * buffer = mallocSafe(BUFFER_SIZE);
+	ssize_t bytesRead;
+	int success = gz != NULL;
+	while (success && (bytesRead = read(inFd, buffer, BUFFER_SIZE)) > 0) {
+		success = gzwrite(gz, buffer, bytesRead) == bytesRead;
+	}
+	freeSafe(buffer);
+	if (gz) {
+		success = gzclose(gz) == Z_OK && success;
+	} else {
+		close(outFd);
+	}
+
+	// Don't publish the sidecar if the file changed while it was compressed
+	struct stat afterStat;
+	success = success && bytesRead == 0 && !fstat(inFd, &afterStat) && afterStat.st_size == fileStat->st_size
+			&& afterStat.st_mtim.tv_sec == fileStat->st_mtim.tv_sec
+			&& afterStat.st_mtim.tv_nsec == fileStat->st_mtim.tv_nsec;
+	close(inFd);
+
+	struct timespec times[2] = { fileStat->st_atim, fileStat->st_mtim };
+	if (success && !utimensat(AT_FDCWD, tempName, times, 0) && !rename(tempName, name)) {
+		return 1;
+	}
+	unlink(tempName);
+	return 0;
+}
+
+// Compresses large files in a low priority child process after they have been served so that later GET requests
+// can be served the sidecar instead.  Only one child runs at a time per RAP.
+static void precompressFile(const char * file, struct stat * fileStat, const char * mimeType) {
+	if (!precompressMinSize || fileStat->st_size < precompressMinSize || !isCompressibleType(mimeType)) {
+		return;
+	}
+	if (precompressPid > 0 && kill(precompressPid, 0) == 0) {
+		return;
+	}
+	pid_t pid = fork();
+	if (pid == 0) {
+		close(RAP_CONTROL_SOCKET);
+		nice(19);
+		_exit(writeGzipSidecar(file, fileStat) ? 0 : 1);
+	} else if (pid < 0) {
+		stdLogError(errno, "Could not fork to precompress %s", file);
+	} else {
+		precompressPid = pid;
+	}
+}
+
+static void initializePrecompression() {
+	const char * minSize = getenv("WEBDAVD_PRECOMPRESS_MIN_SIZE");
+	if (minSize) {
+		precompressMinSize = strtoll(minSize, NULL, 10);
+	}
+	const char * types = getenv("WEBDAVD_COMPRESSIBLE_TYPES");
+	if (precompressMinSize > 0 && types) {
+		char * typesCopy = copyString(types);
+		char * savePtr;
+		for (char * type = strtok_r(typesCopy, " ", &savePtr); type; type = strtok_r(NULL, " ", &savePtr)) {
+			int index = compressibleTypeCount++;
+			compressibleTypes = reallocSafe(compressibleTypes, sizeof(*compressibleTypes) * compressibleTypeCount);
+			compressibleTypes[index] = type;
+		}
+		// Children are never waited for
+		signal(SIGCHLD, SIG_IGN);
+	} else {
+		precompressMinSize = 0;
+	}
+}
+
+///////////////////////
+// End Sidecar Files //
+///////////////////////
+
+////////////
+// DELETE //
+////////////
+
+static ssize_t deleteFile(Message * requestMessage) {
+	if (requestMessage->fd != -1) {
+		// stdLogError(0, "MKCOL request sent incoming data!");
+		close(requestMessage->fd);
+	}
+
+	const char * file = messageParamToString(&requestMessage->params[RAP_PARAM_REQUEST_FILE]);
+
+	int fd = open(file, O_RDONLY);
+	if (fd == -1) goto respond_error;
+
+	struct stat fileStat;
+	if (fstat(fd, &fileStat) == -1) goto respond_error;
+	if ((fileStat.st_mode & S_IFMT) == S_IFDIR) {
+		close(fd);
+		fd = -1;
+		startProgress();
+		if (!deleteTree(file, messageParamSize(requestMessage->params[RAP_PARAM_REQUEST_FILE]))) goto respond_error;
+	} else {
+		// Check if we have the apropriate lock on this file.
+		LockProvisions locks = messageParamTo(LockProvisions, requestMessage->params[RAP_PARAM_REQUEST_LOCK]);
+		if (locks.source != LOCK_TYPE_EXCLUSIVE) {
+			// We have no lock but we need one so acquire it now.
+			if (flock(fd, LOCK_TYPE_EXCLUSIVE | LOCK_NB) == -1) {
+				close(fd);
+				int e = errno;
+				stdLogError(e, "Could not delete locked file %s", file);
+				return writeErrorResponse(RAP_RESPOND_LOCKED, strerror(e), "lock-token-submitted", file);
+			}
+		}
+		if (unlink(file) == -1) goto respond_error;
+		deleteSidecar(file);
+		close(fd);
+	}
+
+	return respond(RAP_RESPOND_OK_NO_CONTENT);
+
+	respond_error: {
+		int e = errno;
+		stdLogError(e, "Could not delete file %s", file);
+		if (fd != -1) close(fd);
+		switch (e) {
+		case EACCES:
+		case EPERM:
+			return writeErrorResponse(RAP_RESPOND_ACCESS_DENIED, strerror(e), NULL, file);
+		case ENOTDIR:
+		case ENOENT:
+			return writeErrorResponse(RAP_RESPOND_NOT_FOUND, strerror(e), NULL, file);
+		default:
+			return writeErrorResponse(RAP_RESPOND_INTERNAL_ERROR, strerror(e), NULL, file);
+		}
+	}
+}
+
+////////////////
+// End DELETE //
+////////////////
+
+/////////
+// PUT //
+/////////
+
+// How much of an upload may be dirty in the page cache in write-behind mode before its writeback is started
+#define WRITE_BEHIND_WINDOW (8 * 1024 * 1024)
+
+static PutDurability putDurability = PUT_DURABILITY_NONE;
+
+// Starts writeback of every full window and then waits for the window before it.  That way the disk is kept busy with
+// one window while the next is being received and no more than two windows of the upload are ever dirty.
+static int writeBehind(int fd, off_t * synced, off_t written) {
+	while (written - *synced >= WRITE_BEHIND_WINDOW) {
+		if (sync_file_range(fd, *synced, WRITE_BEHIND_WINDOW, SYNC_FILE_RANGE_WRITE) == -1) return 0;
+		if (*synced >= WRITE_BEHIND_WINDOW
+				&& sync_file_range(fd, *synced - WRITE_BEHIND_WINDOW, WRITE_BEHIND_WINDOW,
+						SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER) == -1) {
+			return 0;
+		}
+		*synced += WRITE_BEHIND_WINDOW;
+	}
+	return 1;
+}
+
+// Uploads are written to an unnamed O_TMPFILE in the target's directory, or where that isn't supported a hidden
+// temporary name, and only take the target's place once they are complete.  Readers never see a truncated or half
+// written file and the new content is laid out in one go.
+
+static int tmpfileLinkable = 1;
+static unsigned int temporaryNameCounter = 0;
+
+static int openDirectoryOf(const char * file) {
+	const char * lastSlash = strrchr(file, '/');
+	if (!lastSlash) return open(".", O_RDONLY | O_DIRECTORY);
+	size_t dirNameSize = lastSlash == file ? 1 : lastSlash - file;
+	char dirName[dirNameSize + 1];
+	memcpy(dirName, file, dirNameSize);
+	dirName[dirNameSize] = '\0';
+	return open(dirName, O_RDONLY | O_DIRECTORY);
+}
+
+// A new file is not safely on disk until the directory it was created in has been synced too
+static int syncDirectoryOf(const char * file) {
+	int dirFd = openDirectoryOf(file);
+	if (dirFd == -1) return 0;
+	int result = fsync(dirFd);
+	close(dirFd);
+	return result != -1;
+}
+
+// Creates a new hidden file next to file, writing its name into temporaryName
+static int openTemporaryName(const char * file, char * temporaryName, size_t size, mode_t mode) {
+	const char * lastSlash = strrchr(file, '/');
+	int dirNameSize = lastSlash ? lastSlash - file + 1 : 0;
+	for (int attempt = 0; attempt < 100; attempt++) {
+		if (snprintf(temporaryName, size, "%.*s.%s.webdavd-%d-%u", dirNameSize, file, file + dirNameSize,
+				(int) getpid(), temporaryNameCounter++) >= size) {
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+		int fd = open(temporaryName, O_RDWR | O_CREAT | O_EXCL, mode);
+		if (fd != -1 || errno != EEXIST) return fd;
+	}
+	return -1;
+}
+
+// Opens the file an upload is written into, for reading too so that it can be copied from.  temporaryName is left
+// empty for an unnamed O_TMPFILE.
+static int openTemporary(const char * file, char * temporaryName, size_t size, mode_t mode) {
+	temporaryName[0] = '\0';
+	if (tmpfileLinkable) {
+		int dirFd = openDirectoryOf(file);
+		if (dirFd == -1) return -1;
+		int fd = openat(dirFd, ".", O_TMPFILE | O_RDWR, mode);
+		close(dirFd);
+		if (fd != -1 || (errno != EOPNOTSUPP && errno != EISDIR && errno != EINVAL)) return fd;
+	}
+	return openTemporaryName(file, temporaryName, size, mode);
+}
+
+// Gives an O_TMPFILE a name.  Without CAP_DAC_READ_SEARCH or a mounted /proc (eg: in a chroot) this isn't allowed.
+static int linkTemporary(int fd, const char * name) {
+	if (linkat(fd, "", AT_FDCWD, name, AT_EMPTY_PATH) == 0) return 0;
+	if (errno != ENOENT && errno != EPERM) return -1;
+	char procPath[50];
+	snprintf(procPath, sizeof(procPath), "/proc/self/fd/%d", fd);
+	return linkat(AT_FDCWD, procPath, AT_FDCWD, name, AT_SYMLINK_FOLLOW);
+}
+
+// Moves the finished upload into place
+static int publishTemporary(int fd, char * temporaryName, size_t size, const char * file, int replace) {
+	if (!temporaryName[0]) {
+		if (!replace) {
+			if (linkTemporary(fd, file) == 0) return 0;
+			// Someone else created it in the mean time so fall through and replace theirs
+			if (errno != EEXIST && errno != ENOENT && errno != EPERM) return -1;
+		}
+		int namedFd = openTemporaryName(file, temporaryName, size, 0600);
+		if (namedFd == -1) return -1;
+		close(namedFd);
+		unlink(temporaryName);
+		if (linkTemporary(fd, temporaryName) == -1) {
+			if (errno != ENOENT && errno != EPERM) return -1;
+			// This will never work so stop using O_TMPFILE and copy this upload out the slow way
+			tmpfileLinkable = 0;
+			struct stat fileStat;
+			namedFd = open(temporaryName, O_WRONLY | O_CREAT | O_EXCL, 0600);
+			if (namedFd == -1) return -1;
+			if (fstat(fd, &fileStat) == -1 || copyFileData(fd, namedFd, fileStat.st_size) == -1
+					|| fchmod(namedFd, fileStat.st_mode & 07777) == -1 || close(namedFd) == -1) {
+				int e = errno;
+				close(namedFd);
+				unlink(temporaryName);
+				errno = e;
+				return -1;
+			}
+		}
+	}
+	if (rename(temporaryName, file) == -1) {
+		int e = errno;
+		unlink(temporaryName);
+		errno = e;
+		return -1;
+	}
+	return 0;
+}
+
+// Files that can't simply be swapped for a new inode are overwritten in place: symlinks, hard links, files locked by
+// this request's own lock token (the daemon's lock is on the old inode), files owned by someone else (a new inode
+// couldn't keep their owner and a sticky directory wouldn't let it replace them) and files in a directory we can't
+// write to.
+static int mustWriteInPlace(const char * file, struct stat * fileStat, LockType held) {
+	if (!S_ISREG(fileStat->st_mode) || fileStat->st_nlink > 1 || held != LOCK_TYPE_NONE
+			|| fileStat->st_uid != geteuid()) {
+		return 1;
+	}
+	int dirFd = openDirectoryOf(file);
+	if (dirFd == -1) return 1;
+	int writable = (faccessat(dirFd, ".", W_OK, AT_EACCESS) == 0);
+	close(dirFd);
+	return !writable;
+}
+
+// PUT, PATCH, chunked uploads and archive uploads all replace a file the same way.  Whatever is already there is opened
+// to check that we may write to it and to lock it.  The new content then goes to a temporary file that takes the
+// file's place once complete, or straight into the file if it must be written in place.  fd is whichever of those is
+// written to.
+typedef struct Upload {
+	const char * file;
+	struct stat fileStat;
+	int exists;
+	int inPlace;
+	int targetFd;
+	int fd;
+	char temporaryName[PATH_MAX];
+} Upload;
+
+static void closeUpload(Upload * upload) {
+	if (upload->temporaryName[0]) unlink(upload->temporaryName);
+	upload->temporaryName[0] = '\0';
+	if (upload->fd != -1 && upload->fd != upload->targetFd) close(upload->fd);
+	if (upload->targetFd != -1) close(upload->targetFd);
+	upload->fd = upload->targetFd = -1;
+}
+
+// Gives the new content the mode and owner of the file it replaces.  Returns 0 if it can't, in which case the upload
+// must be written in place instead.
+static int keepFileAttributes(Upload * upload) {
+	// O_TMPFILE and open both apply the umask so the mode is put back as it was
+	return fchmod(upload->fd, upload->fileStat.st_mode & 07777) == 0
+			&& fchown(upload->fd, upload->fileStat.st_uid, upload->fileStat.st_gid) == 0;
+}
+
+// Opens and locks what is already at file, unless held says the request's lock token already holds the lock.  flags
+// are those to open it with.  Returns 0 with errno set if it can't, EWOULDBLOCK if it is locked.
+static int openUploadTarget(Upload * upload, const char * file, LockType held, int flags) {
+	upload->file = file;
+	upload->fd = -1;
+	upload->temporaryName[0] = '\0';
+	upload->exists = (lstat(file, &upload->fileStat) == 0);
+	upload->inPlace = upload->exists && mustWriteInPlace(file, &upload->fileStat, held);
+	upload->targetFd = upload->exists ? open(file, flags) : -1;
+	if (upload->exists && (upload->targetFd == -1 || fstat(upload->targetFd, &upload->fileStat) == -1
+			|| (held != LOCK_TYPE_EXCLUSIVE && flock(upload->targetFd, LOCK_EX | LOCK_NB) == -1))) {
+		int e = errno;
+		closeUpload(upload);
+		errno = e;
+		return 0;
+	}
+	return 1;
+}
+
+// Opens the file, as openUploadTarget, and then what the upload is written to.  mode is that of a new file, one that
+// replaces an existing file has its mode and owner.  With scratch the upload is always written to a temporary file,
+// which publishUpload copies into the file if it must be written in place.  Returns 0 with errno set if it can't.
+static int openUpload(Upload * upload, const char * file, LockType held, int flags, mode_t mode, int scratch) {
+	if (!openUploadTarget(upload, file, held, flags)) return 0;
+	if (upload->inPlace && !scratch) {
+		upload->fd = upload->targetFd;
+		return 1;
+	}
+	upload->fd = openTemporary(file, upload->temporaryName, sizeof(upload->temporaryName),
+			upload->exists ? upload->fileStat.st_mode & 07777 : mode);
+	if (upload->fd != -1 && upload->exists && !upload->inPlace && !keepFileAttributes(upload)) {
+		upload->inPlace = 1;
+		if (!scratch) {
+			if (upload->temporaryName[0]) unlink(upload->temporaryName);
+			upload->temporaryName[0] = '\0';
+			close(upload->fd);
+			upload->fd = upload->targetFd;
+		}
+	} else if (upload->fd == -1 && upload->exists && !scratch && (errno == EACCES || errno == EPERM)) {
+		// There's no room for a temporary file beside it, but the file itself can be written
+		upload->inPlace = 1;
+		upload->fd = upload->targetFd;
+	}
+	if (upload->fd == -1) {
+		int e = errno;
+		closeUpload(upload);
+		errno = e;
+		return 0;
+	}
+	return 1;
+}
+
+// Puts the first size bytes written to the upload in place of the file, syncing as putDurability asks.  In place, a
+// scratch copy is copied over the old content, which is only then cut down to size, so the file is never empty on the
+// way.  Returns 0 with errno set if it can't.
+static int publishUpload(Upload * upload, off_t size) {
+	if (upload->inPlace) {
+		return (upload->fd == upload->targetFd || copyFileSpan(upload->fd, 0, upload->targetFd, 0, size) == 0)
+				&& ftruncate(upload->targetFd, size) == 0
+				&& (putDurability == PUT_DURABILITY_NONE || fdatasync(upload->targetFd) == 0);
+	}
+	if (putDurability != PUT_DURABILITY_NONE && fdatasync(upload->fd) == -1) return 0;
+	int published = (publishTemporary(upload->fd, upload->temporaryName, sizeof(upload->temporaryName), upload->file,
+			upload->exists) == 0);
+	upload->temporaryName[0] = '\0';
+	return published && (putDurability == PUT_DURABILITY_NONE || syncDirectoryOf(upload->file));
+}
+
+// PUT with Content-Range lets a client carry on with an upload that was cut off rather than start again.  Pieces are
+// gathered in a hidden staging file next to the target, which replaces the target once every byte has arrived.  The
+// first piece (from byte 0) starts a new upload and the server picks an upload token for it.  The token is sent back
+// in an Upload-Token header and names the staging file, and later pieces and queries must send it too.  Without it two
+// clients uploading the same file would add to each other's pieces.  A piece may overlap what has already been
+// received but must not leave a gap, so the staging file's size is always how much has been received.  "Content-Range:
+// bytes */total" with no body asks how far an upload has got.  The answer to that, and to any piece that doesn't
+// complete the upload, is 308 with a Range header.  An upload whose token is unknown or has expired has received
+// nothing.
+//
+// Each staging file is also linked from RESUMABLE_UPLOAD_NAME, by its token, so that the cleaner can find unfinished
+// ones without walking the tree.
+
+#define RESUMABLE_UPLOAD_NAME ".webdavd-resumable"
+#define UPLOAD_TOKEN_BYTES 16
+
+static char * resumableUploadRoot = NULL;
+
+// Like the chunked upload staging root this is at the top of a chroot, otherwise in the user's home directory
+static void initializeResumableUploads(const char * user) {
+	const char * home = userRootDirectory(user);
+	if (!home) return;
+	size_t rootSize = strlen(home) + sizeof("/" RESUMABLE_UPLOAD_NAME);
+	resumableUploadRoot = mallocSafe(rootSize);
+	snprintf(resumableUploadRoot, rootSize, "%s/" RESUMABLE_UPLOAD_NAME, home);
+}
+
+static int isUploadToken(const char * token) {
+	return strlen(token) == UPLOAD_TOKEN_BYTES * 2 && strspn(token, "0123456789abcdef") == UPLOAD_TOKEN_BYTES * 2;
+}
+
+static int newUploadToken(char * token) {
+	unsigned char bytes[UPLOAD_TOKEN_BYTES];
+	if (gnutls_rnd(GNUTLS_RND_NONCE, bytes, sizeof(bytes))) return 0;
+	for (int i = 0; i < UPLOAD_TOKEN_BYTES; i++) {
+		sprintf(token + i * 2, "%02x", bytes[i]);
+	}
+	return 1;
+}
+
+static int uploadStagingName(char * stagingName, const char * file, off_t total, const char * token) {
+	const char * lastSlash = strrchr(file, '/');
+	int dirNameSize = lastSlash ? lastSlash - file + 1 : 0;
+	return snprintf(stagingName, PATH_MAX, "%.*s.%s.webdavd-upload-%lld-%s", dirNameSize, file, file + dirNameSize,
+			(long long) total, token) < PATH_MAX;
+}
+
+// Without the link the staging file would never expire, so an upload which can't be linked isn't started
+static int linkResumableUpload(const char * stagingName, const char * token) {
+	if (!resumableUploadRoot) return 0;
+	size_t linkSize = strlen(resumableUploadRoot) + UPLOAD_TOKEN_BYTES * 2 + 2;
+	char linkName[linkSize];
+	snprintf(linkName, linkSize, "%s/%s", resumableUploadRoot, token);
+	if (symlink(stagingName, linkName) == 0) return 1;
+	if (errno != ENOENT || (mkdir(resumableUploadRoot, 0700) == -1 && errno != EEXIST)) return 0;
+	return symlink(stagingName, linkName) == 0;
+}
+
+static void unlinkResumableUpload(const char * token) {
+	if (!resumableUploadRoot) return;
+	size_t linkSize = strlen(resumableUploadRoot) + UPLOAD_TOKEN_BYTES * 2 + 2;
+	char linkName[linkSize];
+	snprintf(linkName, linkSize, "%s/%s", resumableUploadRoot, token);
+	unlink(linkName);
+}
+
+static ssize_t respondReceived(off_t received, const char * token) {
+	finishProgress();
+	lastResponse = RAP_RESPOND_RESUME_INCOMPLETE;
+	Message message = { .mID = RAP_RESPOND_RESUME_INCOMPLETE, .fd = -1, .paramCount = token ? 2 : 1 };
+	message.params[RAP_PARAM_RESUME_RECEIVED] = toMessageParam(received);
+	if (token) message.params[RAP_PARAM_RESUME_TOKEN] = stringToMessageParam(token);
+	return sendMessage(RAP_CONTROL_SOCKET, &message);
+}
+
+// Parses "bytes first-last/total" or "bytes */total".  first is -1 for the second form.
+static int parseContentRange(const char * contentRange, off_t * first, off_t * last, off_t * total) {
+	char * end;
+	if (strncmp(contentRange, "bytes ", 6)) return 0;
+	contentRange += 6;
+	if (*contentRange == '*') {
+		*first = -1;
+		*last = -1;
+		end = (char *) contentRange + 1;
+	} else {
+		*first = strtoll(contentRange, &end, 10);
+		if (end == contentRange || *end != '-') return 0;
+		contentRange = end + 1;
+		*last = strtoll(contentRange, &end, 10);
+		if (end == contentRange || *last < *first) return 0;
+	}
+	if (*end != '/') return 0;
+	contentRange = end + 1;
+	*total = strtoll(contentRange, &end, 10);
+	return end != contentRange && *end == '\0' && *total > 0 && *last < *total;
+}
+
+// Creates the staging file for a new upload and picks its token.  Returns -1 with errno set if it can't.
+static int startResumableUpload(char * stagingName, const char * file, off_t total, mode_t mode, char * token) {
+	if (!newUploadToken(token)) {
+		errno = EIO;
+		return -1;
+	}
+	if (!uploadStagingName(stagingName, file, total, token)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	int stagingFd = open(stagingName, O_RDWR | O_CREAT | O_EXCL, mode);
+	if (stagingFd != -1 && !linkResumableUpload(stagingName, token)) {
+		int e = errno;
+		stdLogError(e, "Could not link upload %s", stagingName);
+		unlink(stagingName);
+		close(stagingFd);
+		errno = e;
+		return -1;
+	}
+	return stagingFd;
+}
+
+static ssize_t writeFileRange(Message * requestMessage, const char * file, const char * contentRange,
+		const char * token, off_t length) {
+	off_t first, last, total;
+	if (!parseContentRange(contentRange, &first, &last, &total)
+			|| (length >= 0 && length != (first == -1 ? 0 : last - first + 1))
+			|| (first != -1 && requestMessage->fd == -1)) {
+		if (requestMessage->fd != -1) close(requestMessage->fd);
+		return writeErrorResponse(RAP_RESPOND_BAD_CLIENT_REQUEST, "Invalid Content-Range", NULL, file);
+	}
+	if (token && !isUploadToken(token)) {
+		if (requestMessage->fd != -1) close(requestMessage->fd);
+		return writeErrorResponse(RAP_RESPOND_BAD_CLIENT_REQUEST, "Invalid Upload-Token", NULL, file);
+	}
+	LockProvisions locks = messageParamTo(LockProvisions, requestMessage->params[RAP_PARAM_REQUEST_LOCK]);
+
+	char stagingName[PATH_MAX];
+	char newToken[UPLOAD_TOKEN_BYTES * 2 + 1];
+	if (token && !uploadStagingName(stagingName, file, total, token)) {
+		if (requestMessage->fd != -1) close(requestMessage->fd);
+		return writeErrorResponse(RAP_RESPOND_URI_TOO_LARGE, strerror(ENAMETOOLONG), NULL, file);
+	}
+
+	// As for a plain PUT anything already there is opened to check we may write to it and to lock it
+	Upload upload;
+	if (!openUploadTarget(&upload, file, locks.source, O_WRONLY)) {
+		int e = errno;
+		if (requestMessage->fd != -1) close(requestMessage->fd);
+		stdLogError(e, "PUT could not open %s", file);
+		if (e == EWOULDBLOCK) return writeErrorResponse(RAP_RESPOND_LOCKED, strerror(e), "lock-token-submitted", file);
+		return writeErrorResponse(e == EACCES ? RAP_RESPOND_ACCESS_DENIED : e == ENOENT ? RAP_RESPOND_NOT_FOUND
+				: RAP_RESPOND_INTERNAL_ERROR, strerror(e), NULL, file);
+	}
+	int stagingFd = -1;
+	if (token) {
+		stagingFd = open(stagingName, O_RDWR);
+		if (stagingFd == -1 && errno == ENOENT) token = NULL;
+	}
+	if (!token) {
+		// Nothing has been received for this upload, so only a piece from the start can go anywhere
+		if (first != 0) {
+			closeUpload(&upload);
+			if (requestMessage->fd != -1) close(requestMessage->fd);
+			if (first == -1) return respondReceived(0, NULL);
+			stdLogError(0, "Upload of %s has not started, can't take bytes from %lld", file, (long long) first);
+			return writeErrorResponse(RAP_RESPOND_RANGE_NOT_SATISFIABLE, "Content-Range would leave a gap", NULL,
+					file);
+		}
+		stagingFd = startResumableUpload(stagingName, file, total,
+				upload.exists ? upload.fileStat.st_mode & 07777 : NEW_FILE_PERMISSIONS, newToken);
+		token = newToken;
+	}
+	if (stagingFd == -1) {
+		int e = errno;
+		closeUpload(&upload);
+		if (requestMessage->fd != -1) close(requestMessage->fd);
+		stdLogError(e, "PUT could not open %s", file);
+		return writeErrorResponse(e == EACCES ? RAP_RESPOND_ACCESS_DENIED : e == ENOENT ? RAP_RESPOND_NOT_FOUND
+				: e == ENAMETOOLONG ? RAP_RESPOND_URI_TOO_LARGE : RAP_RESPOND_INTERNAL_ERROR, strerror(e), NULL, file);
+	}
+	// The staging file is what the upload is written to, it is only ever deleted once it has been published
+	upload.fd = stagingFd;
+	if (flock(stagingFd, LOCK_TYPE_EXCLUSIVE | LOCK_NB) == -1) {
+		int e = errno;
+		stdLogError(e, "Could not write locked file %s", file);
+		closeUpload(&upload);
+		if (requestMessage->fd != -1) close(requestMessage->fd);
+		return writeErrorResponse(RAP_RESPOND_LOCKED, strerror(e), "lock-token-submitted", file);
+	}
+
+	struct stat stagingStat;
+	fstat(stagingFd, &stagingStat);
+	off_t received = stagingStat.st_size;
+	ssize_t result;
+
+	if (first > received) {
+		stdLogError(0, "Upload of %s has %lld bytes, can't take bytes from %lld", file, (long long) received,
+				(long long) first);
+		result = writeErrorResponse(RAP_RESPOND_RANGE_NOT_SATISFIABLE, "Content-Range would leave a gap", NULL, file);
+		goto finish;
+	}
+
+	if (first != -1) {
+		// Keeps the size as it is so that it still says how much has been received
+		if (fallocate(stagingFd, FALLOC_FL_KEEP_SIZE, 0, total) == -1
+				&& (errno == ENOSPC || errno == EDQUOT || errno == EFBIG)) {
+			int e = errno;
+			stdLogError(e, "Could not allocate %lld bytes for %s", (long long) total, file);
+			result = writeErrorResponse(RAP_RESPOND_INSUFFICIENT_STORAGE, strerror(e), NULL, file);
+			goto finish;
+		}
+
+		result = respond(RAP_RESPOND_CONTINUE);
+		if (result < 0) goto finish;
+
+		// Whatever arrives is kept even if the connection drops part way through
+		char buffer[BUFFER_SIZE];
+		off_t offset = first;
+		ssize_t bytesRead;
+		while (offset <= last && (bytesRead = read(requestMessage->fd, buffer, sizeof(buffer))) > 0) {
+			if (bytesRead > last + 1 - offset) bytesRead = last + 1 - offset;
+			if (pwrite(stagingFd, buffer, bytesRead, offset) < bytesRead) {
+				stdLogError(errno, "Could wite data to file %s", stagingName);
+				result = respond(RAP_RESPOND_INSUFFICIENT_STORAGE);
+				goto finish;
+			}
+			offset += bytesRead;
+		}
+		if (offset > received) received = offset;
+		if (putDurability != PUT_DURABILITY_NONE && fdatasync(stagingFd) == -1) {
+			stdLogError(errno, "Could not sync %s", stagingName);
+			result = respond(RAP_RESPOND_INSUFFICIENT_STORAGE);
+			goto finish;
+		}
+	}
+
+	if (received < total) {
+		result = respondReceived(received, token);
+		goto finish;
+	}
+
+	// It's all here so put it in place
+	if (upload.exists && !upload.inPlace && !keepFileAttributes(&upload)) upload.inPlace = 1;
+	int published;
+	if (upload.inPlace) {
+		published = (publishUpload(&upload, total) && unlink(stagingName) == 0);
+	} else {
+		published = (rename(stagingName, file) == 0
+				&& (putDurability == PUT_DURABILITY_NONE || syncDirectoryOf(file)));
+	}
+	if (published) {
+		unlinkResumableUpload(token);
+		result = respond(RAP_RESPOND_CREATED);
+	} else {
+		int e = errno;
+		stdLogError(e, "Could not publish upload %s", file);
+		result = writeErrorResponse(RAP_RESPOND_INTERNAL_ERROR, strerror(e), NULL, file);
+	}
+
+	finish: closeUpload(&upload);
+	if (requestMessage->fd != -1) close(requestMessage->fd);
+	return result;
+}
+
+static ssize_t writeFile(Message * requestMessage) {
+	char * file = messageParamToString(&requestMessage->params[RAP_PARAM_REQUEST_FILE]);
+	off_t length = requestMessage->paramCount > RAP_PARAM_REQUEST_LENGTH ?
+			messageParamTo(off_t, requestMessage->params[RAP_PARAM_REQUEST_LENGTH]) : -1;
+	const char * contentRange = requestMessage->paramCount > RAP_PARAM_REQUEST_RANGE ?
+			messageParamToString(&requestMessage->params[RAP_PARAM_REQUEST_RANGE]) : NULL;
+	const char * uploadToken = requestMessage->paramCount > RAP_PARAM_REQUEST_UPLOAD_TOKEN ?
+			messageParamToString(&requestMessage->params[RAP_PARAM_REQUEST_UPLOAD_TOKEN]) : NULL;
+	// A query of how far an upload has got has no body
+	if (contentRange) return writeFileRange(requestMessage, file, contentRange, uploadToken, length);
+
+	if (requestMessage->fd == -1) {
+		stdLogError(0, "PUT request sent without incoming data!");
+		return respond(RAP_RESPOND_INTERNAL_ERROR);
+	}
+	LockProvisions locks = messageParamTo(LockProvisions, requestMessage->params[RAP_PARAM_REQUEST_LOCK]);
+
+	Upload upload;
+	if (!openUpload(&upload, file, locks.source, O_WRONLY, NEW_FILE_PERMISSIONS, 0)) {
+		int e = errno;
+		close(requestMessage->fd);
+		switch (e) {
+		case EWOULDBLOCK:
+			stdLogError(e, "Could not write locked file %s", file);
+			return writeErrorResponse(RAP_RESPOND_LOCKED, strerror(e), "lock-token-submitted", file);
+		case EACCES:
+			stdLogError(e, "PUT access denied %s %s", authenticatedUser, file);
+			return writeErrorResponse(RAP_RESPOND_ACCESS_DENIED, strerror(e), NULL, file);
+		case ENOENT:
+		default:
+			stdLogError(e, "PUT not found %s %s", authenticatedUser, file);
+			return writeErrorResponse(RAP_RESPOND_NOT_FOUND, strerror(e), NULL, file);
+		}
+	}
+	int fd = upload.fd;
+
+	// Reserve the space up front so that an upload that won't fit is turned away before it's sent and the file
+	// isn't fragmented by being grown a piece at a time.
+	int allocated = length > 0 ? fallocate(fd, 0, 0, length) : 0;
+	if (allocated == -1 && errno == EOPNOTSUPP) {
+		// This filesystem can't reserve space so just check that there's enough free
+		struct statvfs fsStat;
+		if (fstatvfs(fd, &fsStat) == 0 && fsStat.f_bavail * fsStat.f_frsize < (unsigned long long) length) {
+			errno = ENOSPC;
+		}
+	}
+	if (allocated == -1 && (errno == ENOSPC || errno == EDQUOT || errno == EFBIG)) {
+		int e = errno;
+		stdLogError(e, "Could not allocate %lld bytes for %s", (long long) length, file);
+		closeUpload(&upload);
+		close(requestMessage->fd);
+		return writeErrorResponse(RAP_RESPOND_INSUFFICIENT_STORAGE, strerror(e), NULL, file);
+	}
+
+	int ret = respond(RAP_RESPOND_CONTINUE);
+	if (ret < 0) {
+		closeUpload(&upload);
+		close(requestMessage->fd);
+		return ret;
+	}
+
+	int failed = 0;
+	int ringFailed = 0;
+	int incomplete = 0;
+	off_t written = URING_NOT_STARTED;
+	if (uringAvailable() && putDurability != PUT_DURABILITY_WRITE_BEHIND) {
+		int failedFd;
+		written = uringCopy(requestMessage->fd, fd, &failedFd);
+		if (written < 0 && written != URING_NOT_STARTED) {
+			// A broken ring is the server's fault, not a full disk
+			ringFailed = (failedFd == -1);
+			failed = (failedFd == fd);
+			incomplete = !failed && !ringFailed;
+		}
+	}
+	if (written == URING_NOT_STARTED) {
+		written = 0;
+		char buffer[BUFFER_SIZE];
+		ssize_t bytesRead;
+		off_t synced = 0;
+
+		while (!failed && (bytesRead = read(requestMessage->fd, buffer, sizeof(buffer))) > 0) {
+			ssize_t bytesWritten = write(fd, buffer, bytesRead);
+			if (bytesWritten < bytesRead) {
+				if (bytesWritten >= 0) errno = ENOSPC;
+				failed = 1;
+			} else {
+				written += bytesWritten;
+				if (putDurability == PUT_DURABILITY_WRITE_BEHIND) failed = !writeBehind(fd, &synced, written);
+			}
+		}
+		incomplete = (bytesRead < 0);
+	}
+
+	if (ringFailed) {
+		stdLogError(errno, "Could not copy upload of %s", file);
+		closeUpload(&upload);
+		close(requestMessage->fd);
+		return respond(RAP_RESPOND_INTERNAL_ERROR);
+	}
+
+	// The upload was cut short.  A partial upload is never published but one written in place has already
+	// replaced the old content so it's trimmed to what arrived.
+	if (!failed && !incomplete && written < length) incomplete = 1;
+	if (incomplete) {
+		stdLogError(0, "Upload of %s ended after %lld bytes", file, (long long) written);
+		if (upload.inPlace && written >= 0) ftruncate(fd, written);
+		closeUpload(&upload);
+		close(requestMessage->fd);
+		return respond(RAP_RESPOND_BAD_CLIENT_REQUEST);
+	}
+
+	if (!failed) failed = !publishUpload(&upload, written);
+	if (failed) stdLogError(errno, "Could wite data to file %s", file);
+	closeUpload(&upload);
+	close(requestMessage->fd);
+	return respond(failed ? RAP_RESPOND_INSUFFICIENT_STORAGE : RAP_RESPOND_CREATED);
+}
+
+/////////////
+// End PUT //
+/////////////
+
+////////////////////
+// Chunked Upload //
+////////////////////
+
+// A single connection rarely fills the link for a very large upload, so a client may instead send the file as numbered
+// chunks over as many connections as it likes (the scheme Nextcloud calls chunking v2).  It makes a collection under
+// the user's staging root with MKCOL, PUTs each chunk into it as a file named by its number and then MOVEs the
+// collection's ".file" to where the upload belongs.  The chunks are joined in order into a new file beside the target,
+// by reflink or copy_file_range where the filesystem allows, which then replaces the target just as a PUT would.
+// Staging collections not touched for WEBDAVD_UPLOAD_EXPIRY seconds are deleted as a RAP starts and when the
+// daemon's cleaner asks.
+
+#define UPLOAD_STAGING_NAME ".webdavd-uploads"
+#define UPLOAD_ASSEMBLE_NAME ".file"
+
+typedef struct UploadChunk {
+	unsigned long long number;
+	off_t size;
+	char * name;
+} UploadChunk;
+
+static char * uploadStagingRoot = NULL;
+static time_t uploadExpiry = 24 * 60 * 60;
+
+// The staging root is at the top of a chroot, otherwise in the user's home directory.  This must be worked out before
+// the RAP chroots.
+static void initializeUploadStaging(const char * user) {
+	const char * home = userRootDirectory(user);
+	if (!home) return;
+	size_t rootSize = strlen(home) + sizeof("/" UPLOAD_STAGING_NAME);
+	uploadStagingRoot = mallocSafe(rootSize);
+	snprintf(uploadStagingRoot, rootSize, "%s/" UPLOAD_STAGING_NAME, home);
+}
+
+// Returns the length of the staging collection's path if file is a staging collection's ".file", otherwise 0
+static size_t uploadCollectionLength(const char * file) {
+	if (!uploadStagingRoot) return 0;
+	size_t rootLength = strlen(uploadStagingRoot);
+	if (strncmp(file, uploadStagingRoot, rootLength) || file[rootLength] != '/') return 0;
+	const char * name = file + rootLength + 1;
+	const char * slash = strchr(name, '/');
+	if (!slash || slash == name || strcmp(slash + 1, UPLOAD_ASSEMBLE_NAME)) return 0;
+	return slash - file;
+}
+
+static int compareUploadChunks(const void * a, const void * b) {
+	const UploadChunk * lhs = a;
+	const UploadChunk * rhs = b;
+	return lhs->number < rhs->number ? -1 : lhs->number > rhs->number;
+}
+
+// held is the lock the request's lock token has on the target
+static ssize_t assembleUpload(const char * collection, const char * targetFile, LockType held) {
+	DIR * dir = opendir(collection);
+	if (!dir) {
+		int e = errno;
+		stdLogError(e, "Could not open upload %s", collection);
+		return writeErrorResponse(e == EACCES ? RAP_RESPOND_ACCESS_DENIED : RAP_RESPOND_NOT_FOUND, strerror(e), NULL,
+				collection);
+	}
+
+	// Names starting with '.' are skipped, which includes any chunk whose PUT hasn't finished yet
+	int dirFd = dirfd(dir);
+	UploadChunk * chunks = NULL;
+	int chunkCount = 0;
+	ssize_t result = 0;
+	struct dirent * dp;
+	while (!result && (dp = readdir(dir)) != NULL) {
+		if (dp->d_name[0] == '.') continue;
+		char * end;
+		struct stat chunkStat;
+		unsigned long long number = strtoull(dp->d_name, &end, 10);
+		if (dp->d_name[0] < '0' || dp->d_name[0] > '9' || *end != '\0'
+				|| fstatat(dirFd, dp->d_name, &chunkStat, AT_SYMLINK_NOFOLLOW) == -1 || !S_ISREG(chunkStat.st_mode)) {
+			stdLogError(0, "%s/%s is not an upload chunk", collection, dp->d_name);
+			result = writeErrorResponse(RAP_RESPOND_CONFLICT, "Upload contains something other than numbered chunks",
+					NULL, collection);
+			break;
+		}
+		if ((chunkCount & 0xFF) == 0) chunks = reallocSafe(chunks, sizeof(*chunks) * (chunkCount + 0x100));
+		chunks[chunkCount].number = number;
+		chunks[chunkCount].size = chunkStat.st_size;
+		chunks[chunkCount].name = copyString(dp->d_name);
+		chunkCount++;
+	}
+
+	if (!result) {
+		qsort(chunks, chunkCount, sizeof(*chunks), &compareUploadChunks);
+		for (int i = 1; i < chunkCount; i++) {
+			if (chunks[i].number != chunks[i - 1].number + 1) {
+				stdLogError(0, "Upload %s is missing chunk %llu", collection, chunks[i - 1].number + 1);
+				result = writeErrorResponse(RAP_RESPOND_CONFLICT, "Upload has a missing chunk", NULL, collection);
+				break;
 			}
+		}
+		if (chunkCount == 0) {
+			result = writeErrorResponse(RAP_RESPOND_CONFLICT, "Upload has no chunks", NULL, collection);
+		}
+	}
+
+	if (!result) {
+		Upload upload;
+		int failed = !openUpload(&upload, targetFile, held, O_WRONLY, NEW_FILE_PERMISSIONS, 0);
+
+		startProgress();
+		off_t offset = 0;
+		for (int i = 0; !failed && i < chunkCount; i++) {
+			int chunkFd = openat(dirFd, chunks[i].name, O_RDONLY);
+			failed = (chunkFd == -1 || copyFileSpan(chunkFd, 0, upload.fd, offset, chunks[i].size) == -1);
+			if (chunkFd != -1) close(chunkFd);
+			offset += chunks[i].size;
+			addProgress(1);
+		}
+		if (!failed) failed = !publishUpload(&upload, offset);
+
+		if (failed) {
+			int e = errno;
+			stdLogError(e, "Could not assemble upload %s into %s", collection, targetFile);
+			result = writeErrorResponse(e == EWOULDBLOCK ? RAP_RESPOND_LOCKED : e == EACCES ? RAP_RESPOND_ACCESS_DENIED
+					: e == ENOENT || e == ENOTDIR ? RAP_RESPOND_CONFLICT : RAP_RESPOND_INSUFFICIENT_STORAGE,
+					strerror(e), e == EWOULDBLOCK ? "lock-token-submitted" : NULL, targetFile);
+		} else {
 			closedir(dir);
-			chmod(toCopy->target, mode);
+			dir = NULL;
+			deleteTree(collection, strlen(collection) + 1);
+			result = respond(upload.exists ? RAP_RESPOND_OK_NO_CONTENT : RAP_RESPOND_CREATED);
+		}
+		closeUpload(&upload);
+	}
+
+	for (int i = 0; i < chunkCount; i++) {
+		freeSafe(chunks[i].name);
+	}
+	freeSafe(chunks);
+	if (dir) closedir(dir);
+	return result;
+}
+
+// Deletes the staging files of uploads resumed with Content-Range that haven't had a piece for uploadExpiry seconds,
+// and the links to staging files that have gone.  One being written to by another RAP is locked and left alone.
+static void cleanResumableUploads(time_t expires) {
+	if (!resumableUploadRoot) return;
+	DIR * dir = opendir(resumableUploadRoot);
+	if (!dir) return;
+	struct dirent * dp;
+	while ((dp = readdir(dir)) != NULL) {
+		if (!IS_DIR_CHILD(dp->d_name)) continue;
+		char stagingName[PATH_MAX];
+		ssize_t nameSize = readlinkat(dirfd(dir), dp->d_name, stagingName, sizeof(stagingName) - 1);
+		if (nameSize == -1) continue;
+		stagingName[nameSize] = '\0';
+		int stagingFd = open(stagingName, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+		struct stat stagingStat;
+		if (stagingFd == -1) {
+			if (errno == ENOENT) unlinkat(dirfd(dir), dp->d_name, 0);
+		} else if (flock(stagingFd, LOCK_EX | LOCK_NB) == 0 && fstat(stagingFd, &stagingStat) == 0
+				&& stagingStat.st_mtime < expires) {
+			if (unlink(stagingName) == -1) stdLogError(errno, "Could not delete expired upload %s", stagingName);
+			unlinkat(dirfd(dir), dp->d_name, 0);
+		}
+		if (stagingFd != -1) close(stagingFd);
+	}
+	closedir(dir);
+}
+
+// Deletes the staging collections that haven't had a chunk added for uploadExpiry seconds, and unfinished uploads
+// resumed with Content-Range.  This is done as the RAP starts and when the daemon's cleaner asks, which, so that the
+// cleaner needn't wait, has no response.
+static void cleanUploads() {
+	time_t expires = time(NULL) - uploadExpiry;
+	cleanResumableUploads(expires);
+	if (!uploadStagingRoot) return;
+	DIR * dir = opendir(uploadStagingRoot);
+	if (!dir) return;
+	size_t rootLength = strlen(uploadStagingRoot);
+	struct dirent * dp;
+	while ((dp = readdir(dir)) != NULL) {
+		struct stat collectionStat;
+		if (IS_DIR_CHILD(dp->d_name) && fstatat(dirfd(dir), dp->d_name, &collectionStat, AT_SYMLINK_NOFOLLOW) == 0
+				&& S_ISDIR(collectionStat.st_mode) && collectionStat.st_mtime < expires) {
+			size_t pathSize = rootLength + strlen(dp->d_name) + 2;
+			char path[pathSize];
+			snprintf(path, pathSize, "%s/%s", uploadStagingRoot, dp->d_name);
+			if (!deleteTree(path, pathSize)) stdLogError(errno, "Could not delete expired upload %s", path);
+		}
+	}
+	closedir(dir);
+}
+
+// Clients may not read, change or lock the server's own files, except within the upload staging root whose
+// collections they fill themselves
+static int isRefusedPath(const char * file) {
+	if (uploadStagingRoot) {
+		size_t rootLength = strlen(uploadStagingRoot);
+		if (!strncmp(file, uploadStagingRoot, rootLength) && (file[rootLength] == '/' || file[rootLength] == '\0')) {
+			file += rootLength;
+		}
+	}
+	return isServerPath(file);
+}
+
+static int requestsServerFile(Message * message) {
+	if (message->mID < RAP_REQUEST_GET || message->mID > RAP_REQUEST_WATCH) return 0;
+	if (message->paramCount > RAP_PARAM_REQUEST_FILE
+			&& isRefusedPath(messageParamToString(&message->params[RAP_PARAM_REQUEST_FILE]))) {
+		return 1;
+	}
+	return (message->mID == RAP_REQUEST_MOVE || message->mID == RAP_REQUEST_COPY)
+			&& message->paramCount > RAP_PARAM_REQUEST_TARGET
+			&& isRefusedPath(messageParamToString(&message->params[RAP_PARAM_REQUEST_TARGET]));
+}
+
+////////////////////////
+// End Chunked Upload //
+////////////////////////
+
+////////////////
+// Delta Sync //
+////////////////
+
+// Lets a client change a few bytes of a large file without uploading all of it, much as rsync does.  A GET which
+// accepts DELTA_SIGNATURE_MIME_TYPE returns the file's signature: a header identifying this version of the file and
+// then, for each block, a checksum which can be rolled along the data one byte at a time and a strong hash.  The
+// client finds the blocks it already shares with the server and sends a PATCH of DELTA_MIME_TYPE which rebuilds the
+// file from those blocks and new data.  It is applied into a temporary file which then replaces the original as a PUT
+// would.  Signatures are cached next to the file in a hidden ".name.webdavd-signature" and are regenerated once the
+// file's size or mtime change.
+//
+// All numbers are big endian.
+//
+// Signature:
+//    "WDSIG001", file size (8), mtime seconds (8), mtime nanoseconds (4), block size (4)
+//    per block: rolling checksum (4), first 16 bytes of SHA-256 (16)
+//    The rolling checksum of bytes x[0] .. x[n-1] is (a & 0xFFFF) | (b << 16) where a = sum(x[i]) and
+//    b = sum((n - i) * x[i]).  The last block may be short.
+//
+// Delta:
+//    "WDDELTA1", then the file size, mtime and block size exactly as in the signature it was made from
+//    'C', first block (8), block count (4):  copy blocks from the current file
+//    'D', length (4), data:                  new data
+//    'E', file size (8):                     end of the delta, the size of the new file
+
+#define SIGNATURE_MAGIC "WDSIG001"
+#define DELTA_MAGIC "WDDELTA1"
+#define SIGNATURE_HEADER_SIZE 32
+#define SIGNATURE_BLOCK_SIZE 20
+#define SIGNATURE_HASH_SIZE 16
+
+static uint32_t getUint32(const unsigned char * data) {
+	uint32_t value;
+	memcpy(&value, data, sizeof(value));
+	return be32toh(value);
+}
+
+static uint64_t getUint64(const unsigned char * data) {
+	uint64_t value;
+	memcpy(&value, data, sizeof(value));
+	return be64toh(value);
+}
+
+static void putUint32(unsigned char * data, uint32_t value) {
+	value = htobe32(value);
+	memcpy(data, &value, sizeof(value));
+}
+
+static void putUint64(unsigned char * data, uint64_t value) {
+	value = htobe64(value);
+	memcpy(data, &value, sizeof(value));
+}
+
+// About the square root of the file size as rsync does, so that neither the signature nor the data resent for each
+// change gets large.  Always a power of two so copied blocks stay aligned for reflinks.
+static uint32_t signatureBlockSize(off_t fileSize) {
+	uint32_t blockSize = 4096;
+	while (blockSize < 1024 * 1024 && (off_t) blockSize * blockSize < fileSize) {
+		blockSize *= 2;
+	}
+	return blockSize;
+}
+
+static void writeSignatureHeader(unsigned char * header, const char * magic, struct stat * fileStat,
+		uint32_t blockSize) {
+	memcpy(header, magic, 8);
+	putUint64(header + 8, fileStat->st_size);
+	putUint64(header + 16, fileStat->st_mtim.tv_sec);
+	putUint32(header + 24, fileStat->st_mtim.tv_nsec);
+	putUint32(header + 28, blockSize);
+}
+
+static uint32_t rollingChecksum(const unsigned char * data, size_t size) {
+	uint32_t a = 0;
+	uint32_t b = 0;
+	for (size_t i = 0; i < size; i++) {
+		a += data[i];
+		b += a;
+	}
+	return (a & 0xFFFF) | (b << 16);
+}
+
+static int writeAll(int fd, const void * data, size_t size) {
+	while (size > 0) {
+		ssize_t written = write(fd, data, size);
+		if (written <= 0) return 0;
+		data = (const char *) data + written;
+		size -= written;
+	}
+	return 1;
+}
+
+static int generateSignature(int fd, struct stat * fileStat, int signatureFd) {
+	uint32_t blockSize = signatureBlockSize(fileStat->st_size);
+	unsigned char header[SIGNATURE_HEADER_SIZE];
+	writeSignatureHeader(header, SIGNATURE_MAGIC, fileStat, blockSize);
+	if (!writeAll(signatureFd, header, sizeof(header))) return 0;
+
+	unsigned char * block = mallocSafe(blockSize);
+	unsigned char signature[SIGNATURE_BLOCK_SIZE * 256];
+	unsigned char hash[32];
+	size_t signatureUsed = 0;
+	off_t offset = 0;
+	int result = 1;
+	while (result && offset < fileStat->st_size) {
+		size_t blockUsed = 0;
+		ssize_t bytesRead;
+		while (blockUsed < blockSize && (bytesRead = pread(fd, block + blockUsed, blockSize - blockUsed,
+				offset + blockUsed)) > 0) {
+			blockUsed += bytesRead;
+		}
+		if (blockUsed == 0) break;
+		putUint32(signature + signatureUsed, rollingChecksum(block, blockUsed));
+		result = (gnutls_hash_fast(GNUTLS_DIG_SHA256, block, blockUsed, hash) == 0);
+		memcpy(signature + signatureUsed + 4, hash, SIGNATURE_HASH_SIZE);
+		signatureUsed += SIGNATURE_BLOCK_SIZE;
+		if (signatureUsed == sizeof(signature)) {
+			result = result && writeAll(signatureFd, signature, signatureUsed);
+			signatureUsed = 0;
+		}
+		offset += blockUsed;
+	}
+	freeSafe(block);
+	return result && writeAll(signatureFd, signature, signatureUsed);
+}
+
+// Returns a readable fd positioned at the start of file's signature, or -1
+static int openSignature(const char * file, int fd, struct stat * fileStat) {
+	const char * lastSlash = strrchr(file, '/');
+	int dirNameSize = lastSlash ? lastSlash - file + 1 : 0;
+	char signatureName[PATH_MAX];
+	if (snprintf(signatureName, sizeof(signatureName), "%.*s.%s.webdavd-signature", dirNameSize, file,
+			file + dirNameSize) >= sizeof(signatureName)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	int signatureFd = open(signatureName, O_RDONLY);
+	if (signatureFd != -1) {
+		unsigned char cachedHeader[SIGNATURE_HEADER_SIZE];
+		unsigned char header[SIGNATURE_HEADER_SIZE];
+		writeSignatureHeader(header, SIGNATURE_MAGIC, fileStat, signatureBlockSize(fileStat->st_size));
+		if (pread(signatureFd, cachedHeader, sizeof(cachedHeader), 0) == sizeof(cachedHeader)
+				&& !memcmp(header, cachedHeader, sizeof(header))) {
+			return signatureFd;
+		}
+		close(signatureFd);
+	}
+
+	// Where the signature can't be cached it is built in memory and thrown away once sent
+	char temporaryName[PATH_MAX];
+	signatureFd = openTemporary(signatureName, temporaryName, sizeof(temporaryName), 0600);
+	int cached = (signatureFd != -1);
+	if (!cached) signatureFd = memfd_create("webdavd-signature", 0);
+	if (signatureFd == -1) return -1;
+	if (!generateSignature(fd, fileStat, signatureFd)) {
+		int e = errno;
+		close(signatureFd);
+		if (cached && temporaryName[0]) unlink(temporaryName);
+		errno = e;
+		return -1;
+	}
+	if (cached) {
+		fchmod(signatureFd, fileStat->st_mode & 0666);
+		if (publishTemporary(signatureFd, temporaryName, sizeof(temporaryName), signatureName, 1) == -1) {
+			stdLogError(errno, "Could not cache signature of %s", file);
+		}
+	}
+	lseek(signatureFd, 0, SEEK_SET);
+	return signatureFd;
+}
+
+static ssize_t sendSignature(Message * requestMessage, const char * file, int fd, struct stat * fileStat) {
+	int signatureFd = openSignature(file, fd, fileStat);
+	close(fd);
+	if (signatureFd == -1) {
+		int e = errno;
+		stdLogError(e, "Could not create signature of %s", file);
+		return writeErrorResponse(RAP_RESPOND_INTERNAL_ERROR, strerror(e), NULL, file);
+	}
+
+	// Dated as the file itself so that the signature's ETag changes with the file
+	Message message = { .mID = RAP_RESPOND_OK, .fd = signatureFd, .paramCount = 3 };
+	message.params[RAP_PARAM_RESPONSE_DATE] = toMessageParam(fileStat->st_mtime);
+	message.params[RAP_PARAM_RESPONSE_MIME] = stringToMessageParam(DELTA_SIGNATURE_MIME_TYPE);
+	message.params[RAP_PARAM_RESPONSE_LOCATION] = requestMessage->params[RAP_PARAM_REQUEST_FILE];
+	return sendMessage(RAP_CONTROL_SOCKET, &message);
+}
+
+typedef struct DeltaReader {
+	int fd;
+	size_t start;
+	size_t end;
+	unsigned char buffer[BUFFER_SIZE];
+} DeltaReader;
+
+// Reads up to size bytes from the request body returning how many were read
+static size_t readDeltaUpTo(DeltaReader * reader, void * data, size_t size) {
+	if (reader->start == reader->end) {
+		ssize_t bytesRead = read(reader->fd, reader->buffer, sizeof(reader->buffer));
+		if (bytesRead <= 0) return 0;
+		reader->start = 0;
+		reader->end = bytesRead;
+	}
+	if (size > reader->end - reader->start) size = reader->end - reader->start;
+	memcpy(data, reader->buffer + reader->start, size);
+	reader->start += size;
+	return size;
+}
+
+static int readDelta(DeltaReader * reader, void * data, size_t size) {
+	while (size > 0) {
+		size_t bytesRead = readDeltaUpTo(reader, data, size);
+		if (!bytesRead) return 0;
+		data = (char *) data + bytesRead;
+		size -= bytesRead;
+	}
+	return 1;
+}
+
+// Rebuilds the file into fd.  Returns 0 on success, otherwise the status to respond with and errno set.
+static RapConstant applyDelta(DeltaReader * reader, int baseFd, struct stat * baseStat, int fd) {
+	unsigned char header[SIGNATURE_HEADER_SIZE];
+	unsigned char expectedHeader[SIGNATURE_HEADER_SIZE];
+	if (!readDelta(reader, header, sizeof(header)) || memcmp(header, DELTA_MAGIC, 8)) {
+		errno = EINVAL;
+		return RAP_RESPOND_BAD_CLIENT_REQUEST;
+	}
+	uint32_t blockSize = getUint32(header + 28);
+	writeSignatureHeader(expectedHeader, DELTA_MAGIC, baseStat, blockSize);
+	if (memcmp(header, expectedHeader, sizeof(header))) {
+		// The file has changed since the client fetched its signature
+		errno = ESTALE;
+		return RAP_RESPOND_PRECONDITION_FAILED;
+	}
+
+	off_t offset = 0;
+	unsigned char op[13];
+	unsigned char data[BUFFER_SIZE];
+	while (readDelta(reader, op, 1)) {
+		switch (op[0]) {
+		case 'C': {
+			if (!readDelta(reader, op + 1, 12)) goto truncated;
+			uint64_t firstBlock = getUint64(op + 1);
+			uint32_t blockCount = getUint32(op + 9);
+			if (!blockSize || firstBlock >= (baseStat->st_size + blockSize - 1) / blockSize) goto invalid;
+			off_t sourceOffset = firstBlock * blockSize;
+			off_t size = (off_t) blockCount * blockSize;
+			if (size > baseStat->st_size - sourceOffset) size = baseStat->st_size - sourceOffset;
+			if (copyFileSpan(baseFd, sourceOffset, fd, offset, size) == -1) return RAP_RESPOND_INSUFFICIENT_STORAGE;
+			offset += size;
+			break;
+		}
+		case 'D': {
+			if (!readDelta(reader, op + 1, 4)) goto truncated;
+			uint32_t length = getUint32(op + 1);
+			while (length > 0) {
+				size_t bytesRead = readDeltaUpTo(reader, data, length < sizeof(data) ? length : sizeof(data));
+				if (!bytesRead) goto truncated;
+				if (pwrite(fd, data, bytesRead, offset) < (ssize_t) bytesRead) return RAP_RESPOND_INSUFFICIENT_STORAGE;
+				offset += bytesRead;
+				length -= bytesRead;
+			}
 			break;
 		}
+		case 'E':
+			if (!readDelta(reader, op + 1, 8)) goto truncated;
+			if (getUint64(op + 1) != offset) goto invalid;
+			if (ftruncate(fd, offset) == -1) return RAP_RESPOND_INSUFFICIENT_STORAGE;
+			return 0;
+		default:
+			goto invalid;
+		}
 	}
 
-	case S_IFLNK: {
-		char linkTarget[4096];
-		if (readlink(toCopy->source, linkTarget, sizeof(linkTarget)) == -1
-				|| symlink(toCopy->target, linkTarget) == -1) {
-			goto error_exit;
+	truncated: errno = EPIPE;
+	return RAP_RESPOND_BAD_CLIENT_REQUEST;
+
+	invalid: errno = EINVAL;
+	return RAP_RESPOND_BAD_CLIENT_REQUEST;
+}
+
+static ssize_t patchFile(Message * requestMessage) {
+	const char * file = messageParamToString(&requestMessage->params[RAP_PARAM_REQUEST_FILE]);
+	LockProvisions locks = messageParamTo(LockProvisions, requestMessage->params[RAP_PARAM_REQUEST_LOCK]);
+	if (requestMessage->fd == -1) {
+		stdLogError(0, "PATCH without a delta %s", file);
+		return writeErrorResponse(RAP_RESPOND_BAD_CLIENT_REQUEST, "No delta sent", NULL, file);
+	}
+
+	// Opened for writing to check we're allowed to and in case it has to be rewritten in place.  The delta is always
+	// applied to a temporary file since it is read from the file as it goes.
+	Upload upload;
+	if (!openUpload(&upload, file, locks.source, O_RDWR, NEW_FILE_PERMISSIONS, 1)) {
+		int e = errno;
+		close(requestMessage->fd);
+		if (e == EWOULDBLOCK) {
+			stdLogError(e, "Could not patch locked file %s", file);
+			return writeErrorResponse(RAP_RESPOND_LOCKED, strerror(e), "lock-token-submitted", file);
+		}
+		stdLogError(e, "PATCH could not open %s", file);
+		return writeErrorResponse(e == EACCES ? RAP_RESPOND_ACCESS_DENIED : e == EISDIR ? RAP_RESPOND_CONFLICT :
+				e == ENOENT ? RAP_RESPOND_NOT_FOUND : RAP_RESPOND_INSUFFICIENT_STORAGE, strerror(e), NULL, file);
+	}
+	if (!upload.exists) {
+		stdLogError(ENOENT, "PATCH could not open %s", file);
+		closeUpload(&upload);
+		close(requestMessage->fd);
+		return writeErrorResponse(RAP_RESPOND_NOT_FOUND, strerror(ENOENT), NULL, file);
+	}
+
+	ssize_t result = respond(RAP_RESPOND_CONTINUE);
+	if (result < 0) {
+		closeUpload(&upload);
+		close(requestMessage->fd);
+		return result;
+	}
+
+	DeltaReader * reader = mallocSafe(sizeof(*reader));
+	reader->fd = requestMessage->fd;
+	reader->start = reader->end = 0;
+	RapConstant failure = applyDelta(reader, upload.targetFd, &upload.fileStat, upload.fd);
+	freeSafe(reader);
+	close(requestMessage->fd);
+
+	struct stat newStat;
+	if (!failure && (fstat(upload.fd, &newStat) == -1 || !publishUpload(&upload, newStat.st_size))) {
+		failure = RAP_RESPOND_INSUFFICIENT_STORAGE;
+	}
+
+	if (failure) {
+		int e = errno;
+		stdLogError(e, "Could not patch %s", file);
+		result = writeErrorResponse(failure, strerror(e), NULL, file);
+	} else {
+		result = respond(RAP_RESPOND_OK_NO_CONTENT);
+	}
+	closeUpload(&upload);
+	return result;
+}
+
+////////////////////
+// End Delta Sync //
+////////////////////
+
+////////////////////
+// Archive Upload //
+////////////////////
+
+// POST of a tar archive to a collection unpacks it there in one request, as though each directory had been made with
+// MKCOL and each file sent with PUT.  Everything runs in the RAP with the user's own permissions and within the
+// chroot, and each file is written through a temporary file just as PUT would.  Names are taken relative to the
+// collection: leading slashes and "." are dropped, any name with ".." is refused and directories are made as they are
+// needed.  Only files and directories can be uploaded, links and devices are refused.  ustar, GNU long names and pax
+// path and size records are understood.  The archive may be gzip or, if built with zstd, zstd compressed.  The result
+// for every entry is returned as a multistatus.
+
+#define TAR_BLOCK_SIZE 512
+#define TAR_PAX_MAX_SIZE (1024 * 1024)
+
+// Reserving space up front, as PUT does, costs more than it saves for small files
+#define TAR_PREALLOCATE_SIZE (1024 * 1024)
+
+typedef struct ArchiveReader {
+	int fd;
+	ContentEncoding encoding;
+	int failed;
+	int ended;
+	z_stream inflater;
+#ifdef WEBDAVD_ZSTD
+	ZSTD_DStream * zstd;
+#endif
+	size_t inputStart;
+	size_t inputEnd;
+	unsigned char input[BUFFER_SIZE];
+} ArchiveReader;
+
+typedef struct TarEntry {
+	char name[PATH_MAX];
+	char type;
+	mode_t mode;
+	off_t size;
+	time_t mtime;
+} TarEntry;
+
+static int fillArchiveInput(ArchiveReader * reader) {
+	ssize_t bytesRead;
+	do {
+		bytesRead = read(reader->fd, reader->input, sizeof(reader->input));
+	} while (bytesRead < 0 && errno == EINTR);
+	if (bytesRead <= 0) return 0;
+	reader->inputStart = 0;
+	reader->inputEnd = bytesRead;
+	return 1;
+}
+
+// Reads up to size bytes of the uncompressed archive returning how many were read
+static size_t readArchiveUpTo(ArchiveReader * reader, void * data, size_t size) {
+	size_t done = 0;
+	while (done < size && !reader->failed) {
+		size_t available = reader->inputEnd - reader->inputStart;
+		size_t produced;
+		switch (reader->encoding) {
+		case CONTENT_ENCODING_GZIP: {
+			reader->inflater.next_in = reader->input + reader->inputStart;
+			reader->inflater.avail_in = available;
+			reader->inflater.next_out = (unsigned char *) data + done;
+			reader->inflater.avail_out = size - done;
+			int result = reader->ended ? Z_STREAM_END : inflate(&reader->inflater, Z_NO_FLUSH);
+			reader->inputStart = reader->inputEnd - reader->inflater.avail_in;
+			produced = size - done - reader->inflater.avail_out;
+			if (result == Z_STREAM_END) reader->ended = 1;
+			else if (result != Z_OK && result != Z_BUF_ERROR) reader->failed = 1;
+			break;
+		}
+#ifdef WEBDAVD_ZSTD
+		case CONTENT_ENCODING_ZSTD: {
+			ZSTD_inBuffer input = { .src = reader->input, .size = reader->inputEnd, .pos = reader->inputStart };
+			ZSTD_outBuffer output = { .dst = (unsigned char *) data + done, .size = size - done, .pos = 0 };
+			size_t result = ZSTD_decompressStream(reader->zstd, &output, &input);
+			reader->inputStart = input.pos;
+			produced = output.pos;
+			if (ZSTD_isError(result)) reader->failed = 1;
+			break;
+		}
+#endif
+		default:
+			produced = available < size - done ? available : size - done;
+			memcpy((unsigned char *) data + done, reader->input + reader->inputStart, produced);
+			reader->inputStart += produced;
+		}
+		done += produced;
+		if (!produced && reader->inputStart == reader->inputEnd && (reader->ended || !fillArchiveInput(reader))) {
+			break;
+		}
+	}
+	return done;
+}
+
+static int readArchive(ArchiveReader * reader, void * data, size_t size) {
+	return readArchiveUpTo(reader, data, size) == size;
+}
+
+// Copies size bytes of the archive into fd, or just reads past them if fd is -1.  Returns false if the archive ended
+// early.  A write error sets writeFailed, with errno, but the data is still read so the next entry can be found.
+static int copyArchiveData(ArchiveReader * reader, int fd, off_t size, int * writeFailed) {
+	char buffer[BUFFER_SIZE];
+	while (size > 0) {
+		size_t wanted = size < sizeof(buffer) ? size : sizeof(buffer);
+		if (!readArchive(reader, buffer, wanted)) return 0;
+		if (fd != -1 && !*writeFailed && !writeAll(fd, buffer, wanted)) *writeFailed = 1;
+		size -= wanted;
+	}
+	return 1;
+}
+
+static int skipArchiveData(ArchiveReader * reader, off_t size) {
+	int ignored = 0;
+	return copyArchiveData(reader, -1, size, &ignored);
+}
+
+// Entries' data is padded out to a whole block
+static int skipArchivePadding(ArchiveReader * reader, off_t size) {
+	return skipArchiveData(reader, (TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE);
+}
+
+// Numeric fields are octal, or for values too large for that, base 256 flagged by the top bit
+static long long parseTarNumber(const unsigned char * field, size_t size) {
+	long long value = 0;
+	if (field[0] & 0x80) {
+		value = field[0] & 0x3F;
+		for (size_t i = 1; i < size; i++) {
+			value = (value << 8) | field[i];
+		}
+		return value;
+	}
+	size_t i = 0;
+	while (i < size && field[i] == ' ') {
+		i++;
+	}
+	for (; i < size && field[i] >= '0' && field[i] <= '7'; i++) {
+		value = (value << 3) | (field[i] - '0');
+	}
+	return value;
+}
+
+static int isTarHeader(const unsigned char * header) {
+	unsigned int sum = 0;
+	for (int i = 0; i < TAR_BLOCK_SIZE; i++) {
+		sum += (i >= 148 && i < 156) ? ' ' : header[i];
+	}
+	return sum == parseTarNumber(header + 148, 8);
+}
+
+static void copyTarString(char * target, size_t targetSize, const void * source, size_t sourceSize) {
+	size_t length = strnlen(source, sourceSize);
+	if (length >= targetSize) length = targetSize - 1;
+	memcpy(target, source, length);
+	target[length] = '\0';
+}
+
+// Picks the path and size out of a pax extended header's "length key=value\n" records
+static void parsePaxRecords(char * records, size_t size, TarEntry * entry, off_t * paxSize) {
+	char * end = records + size;
+	while (records < end) {
+		char * keyStart;
+		long length = strtol(records, &keyStart, 10);
+		if (length <= 0 || length > end - records || *keyStart != ' ') return;
+		char * record = keyStart + 1;
+		char * recordEnd = records + length - 1;
+		char * equals = memchr(record, '=', recordEnd - record);
+		if (equals && *recordEnd == '\n') {
+			*recordEnd = '\0';
+			if (equals - record == 4 && !memcmp(record, "path", 4)) {
+				copyTarString(entry->name, sizeof(entry->name), equals + 1, recordEnd - equals - 1);
+			} else if (equals - record == 4 && !memcmp(record, "size", 4)) {
+				*paxSize = strtoll(equals + 1, NULL, 10);
+			}
+		}
+		records += length;
+	}
+}
+
+// Reads the header of the next file or directory, following any long name records before it.  Returns false at the
+// end of the archive, with reader->failed set if it was cut short or isn't a tar at all.
+static int readTarEntry(ArchiveReader * reader, TarEntry * entry) {
+	unsigned char header[TAR_BLOCK_SIZE];
+	entry->name[0] = '\0';
+	off_t paxSize = -1;
+	for (;;) {
+		if (!readArchive(reader, header, sizeof(header))) {
+			reader->failed = 1;
+			return 0;
+		}
+		if (!header[0] && !memcmp(header, header + 1, sizeof(header) - 1)) return 0;
+		if (!isTarHeader(header)) {
+			reader->failed = 1;
+			return 0;
+		}
+		entry->type = header[156];
+		entry->size = parseTarNumber(header + 124, 12);
+		if (entry->size < 0) {
+			reader->failed = 1;
+			return 0;
+		}
+		if (entry->type != 'L' && entry->type != 'x' && entry->type != 'g' && entry->type != 'K') break;
+
+		// The next entry's long name or pax records.  Global records are not used.
+		char * data = NULL;
+		if ((entry->type == 'L' || entry->type == 'x') && entry->size <= TAR_PAX_MAX_SIZE) {
+			data = mallocSafe(entry->size + 1);
+			if (!readArchive(reader, data, entry->size) || !skipArchivePadding(reader, entry->size)) {
+				freeSafe(data);
+				reader->failed = 1;
+				return 0;
+			}
+			data[entry->size] = '\0';
+			if (entry->type == 'L') copyTarString(entry->name, sizeof(entry->name), data, entry->size);
+			else parsePaxRecords(data, entry->size, entry, &paxSize);
+			freeSafe(data);
+		} else if (!skipArchiveData(reader, entry->size) || !skipArchivePadding(reader, entry->size)) {
+			reader->failed = 1;
+			return 0;
+		}
+	}
+
+	if (!entry->name[0]) {
+		// ustar splits long names into a prefix and a name
+		char name[257];
+		size_t prefixLength = 0;
+		if (!memcmp(header + 257, "ustar", 5) && header[345]) {
+			copyTarString(name, 156, header + 345, 155);
+			prefixLength = strlen(name);
+			name[prefixLength++] = '/';
+		}
+		copyTarString(name + prefixLength, 101, header, 100);
+		copyTarString(entry->name, sizeof(entry->name), name, sizeof(name));
+	}
+	if (paxSize >= 0) entry->size = paxSize;
+	entry->mode = parseTarNumber(header + 100, 8) & 0777;
+	entry->mtime = parseTarNumber(header + 136, 12);
+	return 1;
+}
+
+// Rewrites name as a path relative to the collection.  Returns false if it would climb out of it.
+static int cleanArchivePath(char * name) {
+	char * in = name;
+	char * out = name;
+	while (*in) {
+		char * end = strchrnul(in, '/');
+		size_t length = end - in;
+		if (length == 2 && in[0] == '.' && in[1] == '.') return 0;
+		if (length && (length != 1 || in[0] != '.')) {
+			if (out != name) *(out++) = '/';
+			memmove(out, in, length);
+			out += length;
+		}
+		in = *end ? end + 1 : end;
+	}
+	*out = '\0';
+	return 1;
+}
+
+// Makes every directory above path which doesn't exist yet.  lastMade remembers the last directory made, or found,
+// so that the many files in one directory don't each check the whole path again.
+static int makeArchiveParents(char * path, size_t collectionLength, char * lastMade) {
+	char * lastSlash = strrchr(path + collectionLength + 1, '/');
+	if (!lastSlash) return 1;
+	*lastSlash = '\0';
+	int found = !strcmp(path, lastMade);
+	for (char * slash = path + collectionLength + 1; !found; slash++) {
+		if (*slash == '/' || *slash == '\0') {
+			char c = *slash;
+			*slash = '\0';
+			int made = (mkdir(path, NEW_DIR_PREMISSIONS) == 0 || errno == EEXIST);
+			*slash = c;
+			if (!made) {
+				*lastSlash = '/';
+				return 0;
+			}
+			if (!c) break;
+		}
+	}
+	strcpy(lastMade, path);
+	*lastSlash = '/';
+	return 1;
+}
+
+static RapConstant extractStatusForError(int e) {
+	switch (e) {
+	case EACCES:
+	case EPERM:
+		return RAP_RESPOND_ACCESS_DENIED;
+	case ENOSPC:
+	case EDQUOT:
+	case EFBIG:
+		return RAP_RESPOND_INSUFFICIENT_STORAGE;
+	case EWOULDBLOCK:
+		return RAP_RESPOND_LOCKED;
+	default:
+		return RAP_RESPOND_CONFLICT;
+	}
+}
+
+// Writes one file from the archive as PUT would and returns the status to report for it.  The file's data is always
+// read from the archive, even if it couldn't be written.
+static RapConstant extractArchiveFile(ArchiveReader * reader, const char * file, TarEntry * entry) {
+	// Locked files are left alone, the lock token can't be given for every file in the archive
+	Upload upload;
+	int failed = !openUpload(&upload, file, LOCK_TYPE_NONE, O_WRONLY, entry->mode | S_IRUSR | S_IWUSR, 0);
+	int e = errno;
+	if (!failed && upload.exists && !upload.inPlace) fchmod(upload.fd, entry->mode | S_IRUSR | S_IWUSR);
+
+	if (!failed && entry->size >= TAR_PREALLOCATE_SIZE && fallocate(upload.fd, 0, 0, entry->size) == -1
+			&& (errno == ENOSPC || errno == EDQUOT || errno == EFBIG)) {
+		e = errno;
+		failed = 1;
+	}
+	int writeFailed = failed;
+	if (!copyArchiveData(reader, failed ? -1 : upload.fd, entry->size, &writeFailed)) {
+		reader->failed = 1;
+		failed = 1;
+		e = EIO;
+	} else if (writeFailed && !failed) {
+		e = errno;
+		failed = 1;
+	}
+	if (!failed) {
+		struct timespec times[2] = { { .tv_nsec = UTIME_OMIT }, { .tv_sec = entry->mtime } };
+		if (!publishUpload(&upload, entry->size)) {
+			e = errno;
+			failed = 1;
+		} else {
+			futimens(upload.fd, times);
 		}
+	}
+
+	closeUpload(&upload);
+	if (failed) {
+		stdLogError(e, "Could not extract %s", file);
+		return e == EIO ? RAP_RESPOND_BAD_CLIENT_REQUEST : extractStatusForError(e);
+	}
+	return upload.exists ? RAP_RESPOND_OK_NO_CONTENT : RAP_RESPOND_CREATED;
+}
+
+static void writeExtractResult(FdWriter * writer, const char * file, RapConstant status) {
+	fdWriterWriteLiteral(writer, "<d:response><d:href>");
+	fdWriterWriteURL(writer, file);
+	fdWriterWriteLiteral(writer, "</d:href><d:status>HTTP/1.1 ");
+	switch (status) {
+	case RAP_RESPOND_CREATED:
+		fdWriterWriteLiteral(writer, "201 Created");
+		break;
+	case RAP_RESPOND_OK_NO_CONTENT:
+		fdWriterWriteLiteral(writer, "204 No Content");
+		break;
+	case RAP_RESPOND_BAD_CLIENT_REQUEST:
+		fdWriterWriteLiteral(writer, "400 Bad Request");
+		break;
+	case RAP_RESPOND_ACCESS_DENIED:
+		fdWriterWriteLiteral(writer, "403 Forbidden");
+		break;
+	case RAP_RESPOND_LOCKED:
+		fdWriterWriteLiteral(writer, "423 Locked");
 		break;
-	}
-
-	case S_IFIFO: {
-		if (mkfifo(toCopy->target, 0600) == -1) {
-			goto error_exit;
-		}
-		chmod(toCopy->target, mode);
+	case RAP_RESPOND_INSUFFICIENT_STORAGE:
+		fdWriterWriteLiteral(writer, "507 Insufficient Storage");
 		break;
-	}
-
-		// TODO other file types
-	case S_IFBLK:
-	case S_IFCHR:
-	case S_IFSOCK:
 	default:
-		errno = ENOTSUP;
-		goto error_exit;
+		fdWriterWriteLiteral(writer, "409 Conflict");
 	}
-
-
-	lchown(toCopy->target, fileStat.st_uid, fileStat.st_gid);
-	return 1;
-
-	error_exit: *copied = toCopy;
-	freeSafe(toCopy);
-	return 0;
+	fdWriterWriteLiteral(writer, "</d:status></d:response>");
 }
 
-static ssize_t copyFile(Message * requestMessage) {
-	if (requestMessage->fd != -1) {
-		// stdLogError(0, "MKCOL request sent incoming data!");
-		close(requestMessage->fd);
+static ssize_t extractArchive(Message * requestMessage) {
+	const char * collection = messageParamToString(&requestMessage->params[RAP_PARAM_REQUEST_FILE]);
+	ContentEncoding encoding = messageParamTo(ContentEncoding,
+			requestMessage->params[RAP_PARAM_REQUEST_ARCHIVE_ENCODING]);
+	if (requestMessage->fd == -1) {
+		stdLogError(0, "POST without an archive %s", collection);
+		return writeErrorResponse(RAP_RESPOND_BAD_CLIENT_REQUEST, "No archive sent", NULL, collection);
 	}
 
-	const char * source = messageParamToString(&requestMessage->params[RAP_PARAM_REQUEST_FILE]);
-	const char * target = messageParamToString(&requestMessage->params[RAP_PARAM_REQUEST_TARGET]);
+	struct stat collectionStat;
+	RapConstant refusal = 0;
+	int e = 0;
+	if (stat(collection, &collectionStat) == -1) {
+		e = errno;
+		refusal = (e == EACCES ? RAP_RESPOND_ACCESS_DENIED : RAP_RESPOND_NOT_FOUND);
+	} else if (!S_ISDIR(collectionStat.st_mode)) {
+		e = ENOTDIR;
+		refusal = RAP_RESPOND_CONFLICT;
+	} else if (access(collection, W_OK | X_OK) == -1) {
+		e = errno;
+		refusal = RAP_RESPOND_ACCESS_DENIED;
+#ifndef WEBDAVD_ZSTD
+	} else if (encoding == CONTENT_ENCODING_ZSTD) {
+		e = EPROTONOSUPPORT;
+		refusal = RAP_RESPOND_UNSUPPORTED_MEDIA_TYPE;
+#endif
+	}
+	int resultFd = refusal ? -1 : memfd_create("webdavd-extract", 0);
+	if (!refusal && resultFd == -1) {
+		e = errno;
+		refusal = RAP_RESPOND_INTERNAL_ERROR;
+	}
+	if (refusal) {
+		stdLogError(e, "POST can not extract into %s", collection);
+		close(requestMessage->fd);
+		return writeErrorResponse(refusal, strerror(e), NULL, collection);
+	}
 
-	if (!target) {
-		return writeErrorResponse(RAP_RESPOND_BAD_CLIENT_REQUEST, "No target header specified", NULL, source);
+	ssize_t result = respond(RAP_RESPOND_CONTINUE);
+	if (result < 0) {
+		close(resultFd);
+		close(requestMessage->fd);
+		return result;
+	}
+	startProgress();
+
+	ArchiveReader * reader = mallocSafe(sizeof(*reader));
+	memset(reader, 0, offsetof(ArchiveReader, input));
+	reader->fd = requestMessage->fd;
+	reader->encoding = encoding;
+	if (encoding == CONTENT_ENCODING_GZIP) {
+		// Accepts a gzip or zlib header
+		reader->failed = (inflateInit2(&reader->inflater, 15 + 32) != Z_OK);
+#ifdef WEBDAVD_ZSTD
+	} else if (encoding == CONTENT_ENCODING_ZSTD) {
+		reader->zstd = ZSTD_createDStream();
+		reader->failed = !reader->zstd;
+#endif
 	}
 
-	FileCopyData * copied = mallocSafe(sizeof(FileCopyData));
-	copied->source = source;
-	copied->target = target;
-	copied->sourceNameLength = messageParamSize(requestMessage->params[RAP_PARAM_REQUEST_FILE]);
-	copied->targetNameLength = messageParamSize(requestMessage->params[RAP_PARAM_REQUEST_TARGET]);
-	copied->next = NULL;
-	if (copyFileRecursive(&copied)) {
-		while (copied) {
-			FileCopyData * next = copied->next;
-			freeSafe(copied);
-			copied = next;
+	size_t collectionLength = strlen(collection);
+	while (collectionLength > 0 && collection[collectionLength - 1] == '/') {
+		collectionLength--;
+	}
+	char * path = mallocSafe(collectionLength + PATH_MAX + 1);
+	char * lastMade = mallocSafe(collectionLength + PATH_MAX + 1);
+	memcpy(path, collection, collectionLength);
+	path[collectionLength] = '/';
+	strcpy(lastMade, collection);
+
+	FdWriter * writer = fdWriterNew(resultFd, PROPFIND_BUFFER_SIZE);
+	fdWriterWriteLiteral(writer, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<d:multistatus xmlns:d=\""
+			WEBDAV_NAMESPACE "\">");
+	TarEntry * entry = mallocSafe(sizeof(*entry));
+	size_t entryCount = 0;
+	while (readTarEntry(reader, entry)) {
+		entryCount++;
+		int isFile = (entry->type == '0' || entry->type == '\0' || entry->type == '7');
+		int isDir = (entry->type == '5');
+		int safe = cleanArchivePath(entry->name) && !isServerPath(entry->name);
+		strcpy(path + collectionLength + 1, entry->name);
+		RapConstant status;
+		if (safe && !entry->name[0]) {
+			// The collection itself is not reported
+			status = 0;
+			if (!skipArchiveData(reader, entry->size)) reader->failed = 1;
+		} else if (!safe || (!isFile && !isDir)) {
+			stdLogError(0, "Refusing to extract %s from archive into %s", entry->name, collection);
+			status = RAP_RESPOND_ACCESS_DENIED;
+			if (!skipArchiveData(reader, entry->size)) reader->failed = 1;
+		} else if (!makeArchiveParents(path, collectionLength, lastMade)) {
+			stdLogError(errno, "Could not create directory for %s", path);
+			status = extractStatusForError(errno);
+			if (!skipArchiveData(reader, entry->size)) reader->failed = 1;
+		} else if (isDir) {
+			status = RAP_RESPOND_CREATED;
+			if (mkdir(path, entry->mode | S_IRWXU) == -1) {
+				struct stat existing;
+				if (errno == EEXIST && stat(path, &existing) == 0 && S_ISDIR(existing.st_mode)) {
+					status = RAP_RESPOND_OK_NO_CONTENT;
+				} else {
+					stdLogError(errno, "Could not extract directory %s", path);
+					status = extractStatusForError(errno);
+				}
+			}
+			if (!skipArchiveData(reader, entry->size)) reader->failed = 1;
+		} else {
+			status = extractArchiveFile(reader, path, entry);
 		}
-		return respond(RAP_RESPOND_CREATED);
-	} else {
-		return copyErrorCleanup(copied, "copy", source, target);
+		if (!reader->failed && !skipArchivePadding(reader, entry->size)) reader->failed = 1;
+		if (reader->failed) status = RAP_RESPOND_BAD_CLIENT_REQUEST;
+		if (status) writeExtractResult(writer, path, status);
+		if (status == RAP_RESPOND_CREATED || status == RAP_RESPOND_OK_NO_CONTENT) recordChange(path);
+		addProgress(1);
+		if (reader->failed) break;
+	}
+	int notArchive = reader->failed && !entryCount;
+	if (reader->failed) {
+		stdLogError(0, "Archive sent to %s is damaged or cut short after %zu entries", collection, entryCount);
+	}
+	fdWriterWriteLiteral(writer, "</d:multistatus>");
+	fdWriterFlush(writer);
+
+	// Rather than syncing each new file's directory as PUT does, the whole filesystem is synced once at the end
+	if (putDurability != PUT_DURABILITY_NONE) {
+		int collectionFd = open(collection, O_RDONLY | O_DIRECTORY);
+		if (collectionFd != -1) {
+			syncfs(collectionFd);
+			close(collectionFd);
+		}
+	}
+
+	if (encoding == CONTENT_ENCODING_GZIP) inflateEnd(&reader->inflater);
+#ifdef WEBDAVD_ZSTD
+	if (reader->zstd) ZSTD_freeDStream(reader->zstd);
+#endif
+	freeSafe(reader);
+	freeSafe(entry);
+	freeSafe(lastMade);
+	freeSafe(path);
+	close(requestMessage->fd);
+
+	if (notArchive) {
+		fdWriterFree(writer);
+		return writeErrorResponse(RAP_RESPOND_BAD_CLIENT_REQUEST, "Not a tar archive", NULL, collection);
 	}
 
+	finishProgress();
+	time_t now;
+	time(&now);
+	lseek(writer->fd, 0, SEEK_SET);
+	Message message = { .mID = RAP_RESPOND_MULTISTATUS, .fd = writer->fd, .paramCount = 3 };
+	message.params[RAP_PARAM_RESPONSE_DATE] = toMessageParam(now);
+	message.params[RAP_PARAM_RESPONSE_MIME] = makeMessageParam(XML_MIME_TYPE.type, XML_MIME_TYPE.typeStringSize);
+	message.params[RAP_PARAM_RESPONSE_LOCATION] = requestMessage->params[RAP_PARAM_REQUEST_FILE];
+	freeSafe(writer);
+	return sendMessage(RAP_CONTROL_SOCKET, &message);
 }
 
-//////////////
-// End COPY //
-//////////////
+////////////////////////
+// End Archive Upload //
+////////////////////////
 
 //////////
 // MOVE //
@@ -1096,30 +4685,37 @@ static ssize_t moveFile(Message * requestMessage) {
 		return writeErrorResponse(RAP_RESPOND_BAD_CLIENT_REQUEST, "Target not specified", NULL, sourceFile);
 	}
 
-	FileCopyData * copiedFiles = NULL;
+	size_t collectionLength = uploadCollectionLength(sourceFile);
+	if (collectionLength) {
+		char collection[collectionLength + 1];
+		memcpy(collection, sourceFile, collectionLength);
+		collection[collectionLength] = '\0';
+		LockProvisions locks = messageParamTo(LockProvisions, requestMessage->params[RAP_PARAM_REQUEST_LOCK]);
+		return assembleUpload(collection, targetFile, locks.target);
+	}
+
 	if (rename(sourceFile, targetFile) == -1) {
 		if (errno == EXDEV) {
-			FileCopyData * copiedFiles = mallocSafe(sizeof(FileCopyData));
-			copiedFiles->source = sourceFile;
-			copiedFiles->target = targetFile;
-			copiedFiles->sourceNameLength = messageParamSize(requestMessage->params[RAP_PARAM_REQUEST_FILE]);
-			copiedFiles->targetNameLength = messageParamSize(
-					requestMessage->params[RAP_PARAM_REQUEST_TARGET]);
-			copiedFiles->next = NULL;
-			if (!copyFileRecursive(&copiedFiles)) {
+			startProgress();
+			TreeEntry * copiedFiles;
+			size_t sourceSize = messageParamSize(requestMessage->params[RAP_PARAM_REQUEST_FILE]);
+			if (!copyTree(sourceFile, sourceSize, targetFile,
+					messageParamSize(requestMessage->params[RAP_PARAM_REQUEST_TARGET]), &copiedFiles)) {
 				return copyErrorCleanup(copiedFiles, "move", sourceFile, targetFile);
 			}
-			while (copiedFiles) {
-				if (copiedFiles->type == S_IFDIR) rmdir(copiedFiles->source);
-				else unlink(copiedFiles->source);
-				FileCopyData * next = copiedFiles->next;
-				freeSafe(copiedFiles);
-				copiedFiles = next;
+			// The last entry is the root of what was copied
+			TreeEntry * root = copiedFiles;
+			while (root->next) {
+				root = root->next;
 			}
+			if (root->type == S_IFDIR) deleteTree(sourceFile, sourceSize);
+			else unlink(sourceFile);
+			freeTreeEntries(copiedFiles);
 		} else {
-			return copyErrorCleanup(copiedFiles, "move", sourceFile, targetFile);
+			return copyErrorCleanup(NULL, "move", sourceFile, targetFile);
 		}
 	}
+	moveSidecar(sourceFile, targetFile);
 
 	return respond(RAP_RESPOND_OK_NO_CONTENT);
 
@@ -1129,168 +4725,443 @@ static ssize_t moveFile(Message * requestMessage) {
 // End MOVE //
 //////////////
 
-////////////
-// DELETE //
-////////////
+/////////////////
+// ZIP Archive //
+/////////////////
+
+// GET of a collection with ?format=zip streams the whole tree as one ZIP archive straight into the response pipe.
+// Entries are written in name order, each followed by a data descriptor, so nothing is held in memory beyond a block
+// of data and the entry list needed for the central directory.  ZIP64 records are used wherever a size or offset
+// doesn't fit in 32 bits.  Files are deflated unless they are already compressed or the client asked for
+// compression=none.  Without compression the archive's exact length is known from the walk alone and is sent to the
+// daemon so that it can answer Range requests and downloads can be resumed.  Hidden files are left out as they are
+// from directory listings.
+
+#define ZIP_LOCAL_HEADER_SIGNATURE 0x04034b50
+#define ZIP_DATA_DESCRIPTOR_SIGNATURE 0x08074b50
+#define ZIP_CENTRAL_HEADER_SIGNATURE 0x02014b50
+#define ZIP64_END_SIGNATURE 0x06064b50
+#define ZIP64_LOCATOR_SIGNATURE 0x07064b50
+#define ZIP_END_SIGNATURE 0x06054b50
+
+// General purpose flags: sizes and crc follow the data, names are UTF-8
+#define ZIP_FLAGS 0x0808
+#define ZIP_STORED 0
+#define ZIP_DEFLATED 8
+#define ZIP_VERSION 20
+#define ZIP64_VERSION 45
+#define ZIP_MADE_BY_UNIX 0x0300
+
+// Deflate can make incompressible data slightly bigger so entries approaching 4G use ZIP64 from the start
+#define ZIP64_ENTRY_SIZE 0xF0000000LL
+#define ZIP32_MAX 0xFFFFFFFFLL
+
+typedef struct ZipEntry {
+	char * name;
+	size_t nameLength;
+	off_t size;
+	time_t mtime;
+	mode_t mode;
+	int method;
+
+	// Filled in as the archive is written
+	uint32_t crc;
+	off_t compressedSize;
+	off_t headerOffset;
+} ZipEntry;
+
+typedef struct ZipArchive {
+	ZipEntry * entries;
+	size_t entryCount;
+	time_t newest;
+	int deflate;
+} ZipArchive;
+
+// Data is counted but not written when fd is -1
+typedef struct ZipWriter {
+	int fd;
+	int failed;
+	off_t offset;
+	size_t used;
+	unsigned char buffer[BUFFER_SIZE];
+} ZipWriter;
+
+static const char * PRECOMPRESSED_TYPES[] = {
+		"image/jpeg", "image/png", "image/gif", "image/webp", "video/*", "audio/mpeg", "audio/ogg", "audio/aac",
+		"application/zip", "application/gzip", "application/x-gzip", "application/x-bzip*", "application/x-xz",
+		"application/zstd", "application/x-7z-compressed", "application/x-rar*", "application/vnd.openxmlformats*",
+		"application/vnd.oasis.opendocument*", "application/java-archive", "application/pdf" };
+
+static int isPrecompressedType(const char * mimeType) {
+	for (int i = 0; i < sizeof(PRECOMPRESSED_TYPES) / sizeof(*PRECOMPRESSED_TYPES); i++) {
+		if (mimeTypeMatches(PRECOMPRESSED_TYPES[i], mimeType)) return 1;
+	}
+	return 0;
+}
 
-static ssize_t deleteFileRecursive(int fd, const char * file) {
-	DIR * dir = fdopendir(fd);
+static void putLittle16(unsigned char * data, uint16_t value) {
+	data[0] = value;
+	data[1] = value >> 8;
+}
+
+static void putLittle32(unsigned char * data, uint32_t value) {
+	putLittle16(data, value);
+	putLittle16(data + 2, value >> 16);
+}
+
+static void putLittle64(unsigned char * data, uint64_t value) {
+	putLittle32(data, value);
+	putLittle32(data + 4, value >> 32);
+}
+
+static void zipFlush(ZipWriter * writer) {
+	if (writer->fd != -1 && !writer->failed && writer->used && !writeAll(writer->fd, writer->buffer, writer->used)) {
+		// Usually the client has gone away
+		writer->failed = 1;
+	}
+	writer->used = 0;
+}
+
+static void zipWrite(ZipWriter * writer, const void * data, size_t size) {
+	writer->offset += size;
+	if (writer->fd == -1) return;
+	while (size > 0 && !writer->failed) {
+		size_t toCopy = sizeof(writer->buffer) - writer->used;
+		if (toCopy > size) toCopy = size;
+		memcpy(writer->buffer + writer->used, data, toCopy);
+		writer->used += toCopy;
+		data = (const char *) data + toCopy;
+		size -= toCopy;
+		if (writer->used == sizeof(writer->buffer)) zipFlush(writer);
+	}
+}
+
+static int compareStrings(const void * a, const void * b) {
+	return strcmp(*(char **) a, *(char **) b);
+}
+
+// Adds everything in the directory to the archive, children straight after their parent, each directory in name
+// order.  Symlinks to files are followed but symlinks to directories are not, so a walk can't loop.
+static void collectZipEntries(ZipArchive * archive, int dirFd, const char * prefix, size_t prefixLength) {
+	DIR * dir = fdopendir(dirFd);
+	if (!dir) {
+		close(dirFd);
+		return;
+	}
+	char ** names = NULL;
+	size_t nameCount = 0;
 	struct dirent * dp;
 	while ((dp = readdir(dir)) != NULL) {
-		if (IS_DIR_CHILD(dp->d_name)) {
-			int childFd = openat(fd, dp->d_name, O_RDONLY);
-			if (childFd == -1) goto respond_error;
-			struct stat fileStat;
-			fstat(childFd, &fileStat);
-			// TODO lock
-			if ((fileStat.st_mode & S_IFMT) == S_IFDIR) {
-				deleteFileRecursive(childFd, file);
-			} else {
-				close(childFd);
-			}
-			if (!unlinkat(fd, dp->d_name, AT_REMOVEDIR)) goto respond_error;
-		}
+		if (dp->d_name[0] == '.') continue;
+		if (!(nameCount & 0x7F)) names = reallocSafe(names, sizeof(*names) * (nameCount + 0x80));
+		names[nameCount++] = copyString(dp->d_name);
 	}
-	closedir(dir);
-
-	return 0;
+	qsort(names, nameCount, sizeof(*names), &compareStrings);
+
+	for (size_t i = 0; i < nameCount; i++) {
+		struct stat entryStat;
+		if (fstatat(dirFd, names[i], &entryStat, AT_SYMLINK_NOFOLLOW) == -1
+				|| (S_ISLNK(entryStat.st_mode) && fstatat(dirFd, names[i], &entryStat, 0) == -1)) {
+			freeSafe(names[i]);
+			continue;
+		}
+		int isDirectory = S_ISDIR(entryStat.st_mode);
+		int childFd = -1;
+		if (isDirectory) {
+			childFd = openat(dirFd, names[i], O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+		}
+		if ((!isDirectory && !S_ISREG(entryStat.st_mode)) || (isDirectory && childFd == -1)) {
+			freeSafe(names[i]);
+			continue;
+		}
 
-	respond_error: {
-		int e = errno;
-		closedir(dir);
-		stdLogError(e, "Could not delete file %s", file);
-		if (fd != -1) close(fd);
-		switch (e) {
-		case EACCES:
-		case EPERM:
-			return writeErrorResponse(RAP_RESPOND_ACCESS_DENIED, strerror(e), NULL, file);
-		case ENOTDIR:
-		case ENOENT:
-			return writeErrorResponse(RAP_RESPOND_NOT_FOUND, strerror(e), NULL, file);
-		default:
-			return writeErrorResponse(RAP_RESPOND_INTERNAL_ERROR, strerror(e), NULL, file);
+		if (!(archive->entryCount & 0xFF)) {
+			archive->entries = reallocSafe(archive->entries, sizeof(ZipEntry) * (archive->entryCount + 0x100));
 		}
+		ZipEntry * entry = &archive->entries[archive->entryCount++];
+		size_t nameLength = strlen(names[i]);
+		entry->nameLength = prefixLength + nameLength + isDirectory;
+		entry->name = mallocSafe(entry->nameLength + 1);
+		memcpy(entry->name, prefix, prefixLength);
+		memcpy(entry->name + prefixLength, names[i], nameLength);
+		if (isDirectory) entry->name[entry->nameLength - 1] = '/';
+		entry->name[entry->nameLength] = '\0';
+		entry->size = isDirectory ? 0 : entryStat.st_size;
+		entry->mtime = entryStat.st_mtime;
+		entry->mode = entryStat.st_mode;
+		entry->method = archive->deflate && !isDirectory && !isPrecompressedType(findMimeType(names[i])->type) ?
+				ZIP_DEFLATED : ZIP_STORED;
+		entry->crc = 0;
+		entry->compressedSize = entry->size;
+		if (entryStat.st_mtime > archive->newest) archive->newest = entryStat.st_mtime;
+		freeSafe(names[i]);
+
+		if (isDirectory) collectZipEntries(archive, childFd, entry->name, entry->nameLength);
 	}
+	freeSafe(names);
+	closedir(dir);
 }
 
-static ssize_t deleteFile(Message * requestMessage) {
-	if (requestMessage->fd != -1) {
-		// stdLogError(0, "MKCOL request sent incoming data!");
-		close(requestMessage->fd);
+static void dosDateTime(time_t time, uint16_t * dosDate, uint16_t * dosTime) {
+	struct tm tm;
+	localtime_r(&time, &tm);
+	if (tm.tm_year < 80) {
+		*dosDate = (1 << 5) | 1;
+		*dosTime = 0;
+	} else {
+		*dosDate = ((tm.tm_year - 80) << 9) | ((tm.tm_mon + 1) << 5) | tm.tm_mday;
+		*dosTime = (tm.tm_hour << 11) | (tm.tm_min << 5) | (tm.tm_sec / 2);
 	}
+}
 
-	const char * file = messageParamToString(&requestMessage->params[RAP_PARAM_REQUEST_FILE]);
-
-	int fd = open(file, O_RDONLY);
-	if (fd == -1) goto respond_error;
+static void writeZipLocalHeader(ZipWriter * writer, ZipEntry * entry) {
+	int zip64 = entry->size >= ZIP64_ENTRY_SIZE;
+	unsigned char header[30 + 20];
+	uint16_t dosDate, dosTime;
+	dosDateTime(entry->mtime, &dosDate, &dosTime);
+	entry->headerOffset = writer->offset;
+	memset(header, 0, sizeof(header));
+	putLittle32(header, ZIP_LOCAL_HEADER_SIGNATURE);
+	putLittle16(header + 4, zip64 ? ZIP64_VERSION : ZIP_VERSION);
+	putLittle16(header + 6, ZIP_FLAGS);
+	putLittle16(header + 8, entry->method);
+	putLittle16(header + 10, dosTime);
+	putLittle16(header + 12, dosDate);
+	if (zip64) {
+		// The sizes are in the ZIP64 data descriptor
+		putLittle32(header + 18, ZIP32_MAX);
+		putLittle32(header + 22, ZIP32_MAX);
+	}
+	putLittle16(header + 26, entry->nameLength);
+	putLittle16(header + 28, zip64 ? 20 : 0);
+	zipWrite(writer, header, 30);
+	zipWrite(writer, entry->name, entry->nameLength);
+	if (zip64) {
+		putLittle16(header + 30, 0x0001);
+		putLittle16(header + 32, 16);
+		zipWrite(writer, header + 30, 20);
+	}
+}
 
-	struct stat fileStat;
-	if (fstat(fd, &fileStat) == -1) goto respond_error;
-	if ((fileStat.st_mode & S_IFMT) == S_IFDIR) {
-		ssize_t result = deleteFileRecursive(fd, file);
-		fd = -1;
-		if (result != 0 || rmdir(file) == -1) goto respond_error;
+static void writeZipDataDescriptor(ZipWriter * writer, ZipEntry * entry) {
+	unsigned char descriptor[24];
+	putLittle32(descriptor, ZIP_DATA_DESCRIPTOR_SIGNATURE);
+	putLittle32(descriptor + 4, entry->crc);
+	if (entry->size >= ZIP64_ENTRY_SIZE) {
+		putLittle64(descriptor + 8, entry->compressedSize);
+		putLittle64(descriptor + 16, entry->size);
+		zipWrite(writer, descriptor, 24);
 	} else {
-		// Check if we have the apropriate lock on this file.
-		LockProvisions locks = messageParamTo(LockProvisions, requestMessage->params[RAP_PARAM_REQUEST_LOCK]);
-		if (locks.source != LOCK_TYPE_EXCLUSIVE) {
-			// We have no lock but we need one so acquire it now.
-			if (flock(fd, LOCK_TYPE_EXCLUSIVE | LOCK_NB) == -1) {
-				close(fd);
-				int e = errno;
-				stdLogError(e, "Could not delete locked file %s", file);
-				return writeErrorResponse(RAP_RESPOND_LOCKED, strerror(e), "lock-token-submitted", file);
-			}
-		}
-		if (unlink(file) == -1) goto respond_error;
-		close(fd);
+		putLittle32(descriptor + 8, entry->compressedSize);
+		putLittle32(descriptor + 12, entry->size);
+		zipWrite(writer, descriptor, 16);
 	}
+}
 
-	return respond(RAP_RESPOND_OK_NO_CONTENT);
-
-	respond_error: {
-		int e = errno;
-		stdLogError(e, "Could not delete file %s", file);
-		if (fd != -1) close(fd);
-		switch (e) {
-		case EACCES:
-		case EPERM:
-			return writeErrorResponse(RAP_RESPOND_ACCESS_DENIED, strerror(e), NULL, file);
-		case ENOTDIR:
-		case ENOENT:
-			return writeErrorResponse(RAP_RESPOND_NOT_FOUND, strerror(e), NULL, file);
-		default:
-			return writeErrorResponse(RAP_RESPOND_INTERNAL_ERROR, strerror(e), NULL, file);
+// Writes exactly entry->size bytes.  A file that has shrunk since the walk is padded with zeros, anything added to it
+// since is left out.
+static void writeZipData(ZipWriter * writer, ZipEntry * entry, int fd, z_stream * stream) {
+	unsigned char input[BUFFER_SIZE];
+	unsigned char output[BUFFER_SIZE];
+	off_t remaining = entry->size;
+	off_t start = writer->offset;
+	uLong crc = crc32(0L, Z_NULL, 0);
+	if (stream) deflateReset(stream);
+	while (!writer->failed) {
+		ssize_t bytesRead = 0;
+		if (remaining > 0) {
+			bytesRead = read(fd, input, remaining < sizeof(input) ? remaining : sizeof(input));
+			if (bytesRead <= 0) {
+				bytesRead = remaining < sizeof(input) ? remaining : sizeof(input);
+				memset(input, 0, bytesRead);
+			}
+			remaining -= bytesRead;
+			crc = crc32(crc, input, bytesRead);
+		}
+		if (stream) {
+			stream->next_in = input;
+			stream->avail_in = bytesRead;
+			int result;
+			do {
+				stream->next_out = output;
+				stream->avail_out = sizeof(output);
+				result = deflate(stream, remaining > 0 ? Z_NO_FLUSH : Z_FINISH);
+				zipWrite(writer, output, sizeof(output) - stream->avail_out);
+			} while (stream->avail_out == 0 && !writer->failed);
+			if (result == Z_STREAM_END) break;
+		} else {
+			zipWrite(writer, input, bytesRead);
+			if (remaining == 0) break;
 		}
 	}
+	entry->crc = crc;
+	entry->compressedSize = writer->offset - start;
 }
 
-////////////////
-// End DELETE //
-////////////////
-
-/////////
-// PUT //
-/////////
+static void writeZipCentralDirectory(ZipWriter * writer, ZipArchive * archive) {
+	off_t directoryStart = writer->offset;
+	for (size_t i = 0; i < archive->entryCount; i++) {
+		ZipEntry * entry = &archive->entries[i];
+		unsigned char header[46];
+		unsigned char extra[28];
+		size_t extraLength = 4;
+		if (entry->size >= ZIP32_MAX) {
+			putLittle64(extra + extraLength, entry->size);
+			extraLength += 8;
+		}
+		if (entry->compressedSize >= ZIP32_MAX) {
+			putLittle64(extra + extraLength, entry->compressedSize);
+			extraLength += 8;
+		}
+		if (entry->headerOffset >= ZIP32_MAX) {
+			putLittle64(extra + extraLength, entry->headerOffset);
+			extraLength += 8;
+		}
+		putLittle16(extra, 0x0001);
+		putLittle16(extra + 2, extraLength - 4);
+		if (extraLength == 4) extraLength = 0;
+
+		uint16_t dosDate, dosTime;
+		dosDateTime(entry->mtime, &dosDate, &dosTime);
+		int version = extraLength || entry->size >= ZIP64_ENTRY_SIZE ? ZIP64_VERSION : ZIP_VERSION;
+		putLittle32(header, ZIP_CENTRAL_HEADER_SIGNATURE);
+		putLittle16(header + 4, ZIP_MADE_BY_UNIX | ZIP64_VERSION);
+		putLittle16(header + 6, version);
+		putLittle16(header + 8, ZIP_FLAGS);
+		putLittle16(header + 10, entry->method);
+		putLittle16(header + 12, dosTime);
+		putLittle16(header + 14, dosDate);
+		putLittle32(header + 16, entry->crc);
+		putLittle32(header + 20, entry->compressedSize >= ZIP32_MAX ? ZIP32_MAX : entry->compressedSize);
+		putLittle32(header + 24, entry->size >= ZIP32_MAX ? ZIP32_MAX : entry->size);
+		putLittle16(header + 28, entry->nameLength);
+		putLittle16(header + 30, extraLength);
+		putLittle16(header + 32, 0);
+		putLittle16(header + 34, 0);
+		putLittle16(header + 36, 0);
+		putLittle32(header + 38, ((uint32_t) (entry->mode & 0xFFFF) << 16) | (S_ISDIR(entry->mode) ? 0x10 : 0));
+		putLittle32(header + 42, entry->headerOffset >= ZIP32_MAX ? ZIP32_MAX : entry->headerOffset);
+		zipWrite(writer, header, sizeof(header));
+		zipWrite(writer, entry->name, entry->nameLength);
+		zipWrite(writer, extra, extraLength);
+	}
 
-static ssize_t writeFile(Message * requestMessage) {
-	if (requestMessage->fd == -1) {
-		stdLogError(0, "PUT request sent without incoming data!");
-		return respond(RAP_RESPOND_INTERNAL_ERROR);
+	off_t directorySize = writer->offset - directoryStart;
+	unsigned char end[56];
+	if (archive->entryCount >= 0xFFFF || directoryStart >= ZIP32_MAX || directorySize >= ZIP32_MAX) {
+		off_t zip64EndOffset = writer->offset;
+		putLittle32(end, ZIP64_END_SIGNATURE);
+		putLittle64(end + 4, sizeof(end) - 12);
+		putLittle16(end + 12, ZIP_MADE_BY_UNIX | ZIP64_VERSION);
+		putLittle16(end + 14, ZIP64_VERSION);
+		putLittle32(end + 16, 0);
+		putLittle32(end + 20, 0);
+		putLittle64(end + 24, archive->entryCount);
+		putLittle64(end + 32, archive->entryCount);
+		putLittle64(end + 40, directorySize);
+		putLittle64(end + 48, directoryStart);
+		zipWrite(writer, end, 56);
+		putLittle32(end, ZIP64_LOCATOR_SIGNATURE);
+		putLittle32(end + 4, 0);
+		putLittle64(end + 8, zip64EndOffset);
+		putLittle32(end + 16, 1);
+		zipWrite(writer, end, 20);
 	}
+	putLittle32(end, ZIP_END_SIGNATURE);
+	putLittle16(end + 4, 0);
+	putLittle16(end + 6, 0);
+	putLittle16(end + 8, archive->entryCount >= 0xFFFF ? 0xFFFF : archive->entryCount);
+	putLittle16(end + 10, archive->entryCount >= 0xFFFF ? 0xFFFF : archive->entryCount);
+	putLittle32(end + 12, directorySize >= ZIP32_MAX ? ZIP32_MAX : directorySize);
+	putLittle32(end + 16, directoryStart >= ZIP32_MAX ? ZIP32_MAX : directoryStart);
+	putLittle16(end + 20, 0);
+	zipWrite(writer, end, 22);
+}
 
-	char * file = messageParamToString(&requestMessage->params[RAP_PARAM_REQUEST_FILE]);
-	int fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, NEW_FILE_PERMISSIONS);
-	if (fd == -1) {
-		int e = errno;
-		switch (e) {
-		case EACCES:
-			stdLogError(e, "PUT access denied %s %s", authenticatedUser, file);
-			return writeErrorResponse(RAP_RESPOND_ACCESS_DENIED, strerror(errno), NULL, file);
-		case ENOENT:
-		default:
-			stdLogError(e, "PUT not found %s %s", authenticatedUser, file);
-			return writeErrorResponse(RAP_RESPOND_NOT_FOUND, strerror(errno), NULL, file);
+static void writeZipArchive(ZipWriter * writer, ZipArchive * archive, int dirFd) {
+	z_stream * stream = NULL;
+	if (archive->deflate && writer->fd != -1) {
+		stream = mallocSafe(sizeof(*stream));
+		memset(stream, 0, sizeof(*stream));
+		if (deflateInit2(stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+			stdLogError(0, "Could not initialize deflate");
+			freeSafe(stream);
+			writer->failed = 1;
+			return;
 		}
 	}
-// Check if we have the apropriate lock on this file.
-	LockProvisions locks = messageParamTo(LockProvisions, requestMessage->params[RAP_PARAM_REQUEST_LOCK]);
-	if (locks.source != LOCK_TYPE_EXCLUSIVE) {
-		// We have no lock but we need one so acquire it now.
-		if (flock(fd, LOCK_TYPE_EXCLUSIVE | LOCK_NB) == -1) {
-			close(fd);
-			int e = errno;
-			const char * etxt = strerror(e);
-			stdLogError(e, "Could not write locked file %s", file);
-			return writeErrorResponse(RAP_RESPOND_LOCKED, etxt, "lock-token-submitted", file);
+	for (size_t i = 0; i < archive->entryCount && !writer->failed; i++) {
+		ZipEntry * entry = &archive->entries[i];
+		writeZipLocalHeader(writer, entry);
+		if (writer->fd == -1) {
+			// Only counting: stored data is exactly as big as the file
+			writer->offset += entry->size;
+		} else if (entry->nameLength && entry->name[entry->nameLength - 1] != '/') {
+			int fd = openat(dirFd, entry->name, O_RDONLY);
+			if (fd != -1) posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+			writeZipData(writer, entry, fd, entry->method == ZIP_DEFLATED ? stream : NULL);
+			if (fd != -1) close(fd);
 		}
+		writeZipDataDescriptor(writer, entry);
 	}
-	int ret = respond(RAP_RESPOND_CONTINUE);
-	if (ret < 0) {
-		return ret;
+	if (!writer->failed) writeZipCentralDirectory(writer, archive);
+	zipFlush(writer);
+	if (stream) {
+		deflateEnd(stream);
+		freeSafe(stream);
 	}
+}
 
-	char buffer[BUFFER_SIZE];
-	ssize_t bytesRead;
+static ssize_t sendZipArchive(Message * requestMessage, int dirFd, struct stat * dirStat, ArchiveFormat format) {
+	ZipArchive archive = { .entries = NULL, .entryCount = 0, .newest = dirStat->st_mtime,
+			.deflate = (format == ARCHIVE_ZIP) };
+	int walkFd = dup(dirFd);
+	if (walkFd != -1) collectZipEntries(&archive, walkFd, "", 0);
+
+	ZipWriter * writer = mallocSafe(sizeof(*writer));
+	writer->fd = -1;
+	writer->failed = 0;
+	writer->offset = 0;
+	writer->used = 0;
+	off_t size = -1;
+	if (!archive.deflate) {
+		writeZipArchive(writer, &archive, dirFd);
+		size = writer->offset;
+		writer->offset = 0;
+	}
 
-	while ((bytesRead = read(requestMessage->fd, buffer, sizeof(buffer))) > 0) {
-		ssize_t bytesWritten = write(fd, buffer, bytesRead);
-		if (bytesWritten < bytesRead) {
-			stdLogError(errno, "Could wite data to file %s", file);
-			close(fd);
-			close(requestMessage->fd);
-			return respond(RAP_RESPOND_INSUFFICIENT_STORAGE);
+	ssize_t messageResult;
+	int pipeEnds[2];
+	if (pipe(pipeEnds)) {
+		stdLogError(errno, "Could not create pipe to write content");
+		messageResult = respond(RAP_RESPOND_INTERNAL_ERROR);
+	} else {
+		Message message = { .mID = RAP_RESPOND_OK, .fd = pipeEnds[PIPE_READ], .paramCount = 5 };
+		message.params[RAP_PARAM_RESPONSE_DATE] = toMessageParam(archive.newest);
+		message.params[RAP_PARAM_RESPONSE_MIME] = stringToMessageParam("application/zip");
+		message.params[RAP_PARAM_RESPONSE_LOCATION] = requestMessage->params[RAP_PARAM_REQUEST_FILE];
+		message.params[RAP_PARAM_RESPONSE_ENCODING] = NULL_PARAM;
+		message.params[RAP_PARAM_RESPONSE_SIZE] = toMessageParam(size);
+		messageResult = sendMessage(RAP_CONTROL_SOCKET, &message);
+		if (messageResult > 0) {
+			writer->fd = pipeEnds[PIPE_WRITE];
+			writeZipArchive(writer, &archive, dirFd);
 		}
+		close(pipeEnds[PIPE_WRITE]);
 	}
 
-	close(fd);
-	close(requestMessage->fd);
-	return respond(RAP_RESPOND_CREATED);
+	freeSafe(writer);
+	for (size_t i = 0; i < archive.entryCount; i++) {
+		freeSafe(archive.entries[i].name);
+	}
+	freeSafe(archive.entries);
+	close(dirFd);
+	return messageResult;
 }
 
-/////////////
-// End PUT //
-/////////////
+/////////////////////
+// End ZIP Archive //
+/////////////////////
 
 /////////
 // GET //
@@ -1306,6 +5177,49 @@ static int compareDirent(const void * a, const void * b) {
 	return strcmp(lhs->d_name, rhs->d_name);
 }
 
+static void writeDirectoryRow(xmlTextWriterPtr writer, const char * fileName, struct dirent * dp,
+		struct stat * stat) {
+	char buffer[100];
+
+	xmlTextWriterStartElement(writer, "tr");
+
+	// File or Dir
+	xmlTextWriterWriteElementString(writer, NULL, "td", dp->d_type == DT_DIR ? "dir" : "file");
+
+	// File Name
+	xmlTextWriterStartElement(writer, "td");
+	xmlTextWriterStartElement(writer, "a");
+	xmlTextWriterStartAttribute(writer, "href");
+	xmlTextWriterWriteURL(writer, fileName);
+	xmlTextWriterWriteURL(writer, dp->d_name);
+	if (dp->d_type == DT_DIR) xmlTextWriterWriteString(writer, "/");
+	xmlTextWriterEndAttribute(writer);
+	//xmlTextWriterStartAttribute(writer, "download");
+	//xmlTextWriterEndAttribute(writer);
+	xmlTextWriterWriteString(writer, dp->d_name);
+	if (dp->d_type == DT_DIR) xmlTextWriterWriteString(writer, "/");
+	xmlTextWriterEndElement(writer);
+
+	// File Size
+	if (dp->d_type == DT_REG) {
+		formatFileSize(buffer, sizeof(buffer), stat->st_size);
+		xmlTextWriterWriteElementString(writer, NULL, "td", buffer);
+	} else {
+		xmlTextWriterWriteElementString(writer, NULL, "td", "-");
+	}
+
+	// MimeType
+	xmlTextWriterWriteElementString(writer, NULL, "td",
+			dp->d_type == DT_DIR ? "-" : findMimeType(dp->d_name)->type);
+
+	// Last Modified
+	getLocalDate(stat->st_mtime, buffer, sizeof(buffer));
+	xmlTextWriterWriteElementString(writer, NULL, "td", buffer);
+
+	xmlTextWriterEndElement(writer);
+	xmlTextWriterEndElement(writer);
+}
+
 static void listDir(const char * fileName, int dirFd, int writeFd) {
 	DIR * dir = fdopendir(dirFd);
 	xmlTextWriterPtr writer = xmlNewFdTextWriter(writeFd);
@@ -1318,7 +5232,9 @@ static void listDir(const char * fileName, int dirFd, int writeFd) {
 		if (!(index & 0x7F)) {
 			directoryEntries = reallocSafe(directoryEntries, sizeof(struct dirent **) * (entryCount + 0x7F));
 		}
-		directoryEntries[index] = dp;
+		// readdir() may reuse its buffer so each entry has to be copied
+		size_t direntSize = offsetof(struct dirent, d_name) + strlen(dp->d_name) + 1;
+		directoryEntries[index] = memcpy(mallocSafe(direntSize), dp, direntSize);
 	}
 
 	qsort(directoryEntries, entryCount, sizeof(*directoryEntries), &compareDirent);
@@ -1340,61 +5256,39 @@ static void listDir(const char * fileName, int dirFd, int writeFd) {
 	xmlTextWriterWriteElementString(writer, NULL, "th", "Size");
 	xmlTextWriterWriteElementString(writer, NULL, "th", "Mime Type");
 	xmlTextWriterWriteElementString(writer, NULL, "th", "Last Modified");
-	for (size_t i = 0; i < entryCount; i++) {
-		dp = directoryEntries[i];
-		if (dp->d_name[0] != '.') {
-			struct stat stat;
-			fstatat(dirFd, dp->d_name, &stat, 0);
-			char buffer[100];
-
-			xmlTextWriterStartElement(writer, "tr");
-
-			// File or Dir
-			xmlTextWriterWriteElementString(writer, NULL, "td", dp->d_type == DT_DIR ? "dir" : "file");
-
-			// File Name
-			xmlTextWriterStartElement(writer, "td");
-			xmlTextWriterStartElement(writer, "a");
-			xmlTextWriterStartAttribute(writer, "href");
-			xmlTextWriterWriteURL(writer, fileName);
-			xmlTextWriterWriteURL(writer, dp->d_name);
-			if (dp->d_type == DT_DIR) xmlTextWriterWriteString(writer, "/");
-			xmlTextWriterEndAttribute(writer);
-			//xmlTextWriterStartAttribute(writer, "download");
-			//xmlTextWriterEndAttribute(writer);
-			xmlTextWriterWriteString(writer, dp->d_name);
-			if (dp->d_type == DT_DIR) xmlTextWriterWriteString(writer, "/");
-			xmlTextWriterEndElement(writer);
-
-			// File Size
-			if (dp->d_type == DT_REG) {
-				formatFileSize(buffer, sizeof(buffer), stat.st_size);
-				xmlTextWriterWriteElementString(writer, NULL, "td", buffer);
-			} else {
-				xmlTextWriterWriteElementString(writer, NULL, "td", "-");
+	StatBatch * batch = mallocSafe(sizeof(*batch));
+	startStatBatch(batch, dirFd);
+	size_t next = 0;
+	while (next < entryCount) {
+		struct dirent * batchEntries[STAT_BATCH_SIZE];
+		while (next < entryCount) {
+			dp = directoryEntries[next++];
+			if (dp->d_name[0] != '.') {
+				batchEntries[batch->count] = dp;
+				if (addToStatBatch(batch, dp->d_name)) break;
 			}
-
-			// MimeType
-			xmlTextWriterWriteElementString(writer, NULL, "td",
-					dp->d_type == DT_DIR ? "-" : findMimeType(dp->d_name)->type);
-
-			// Last Modified
-			getLocalDate(stat.st_mtime, buffer, sizeof(buffer));
-			xmlTextWriterWriteElementString(writer, NULL, "td", buffer);
-
-			xmlTextWriterEndElement(writer);
-			xmlTextWriterEndElement(writer);
 		}
+		runStatBatch(batch);
+		for (size_t j = 0; j < batch->count; j++) {
+			StatEntry * entry = getStatEntry(batch, j);
+			if (entry) writeDirectoryRow(writer, fileName, batchEntries[j], &entry->stat);
+		}
+		finishStatBatch(batch);
 	}
+	freeSafe(batch);
 	xmlTextWriterEndElement(writer);
 	xmlTextWriterEndElement(writer);
 	xmlTextWriterEndElement(writer);
 
 	xmlFreeTextWriter(writer);
 	closedir(dir);
+	for (size_t i = 0; i < entryCount; i++) {
+		freeSafe(directoryEntries[i]);
+	}
 	freeSafe(directoryEntries);
 }
 
+
 static ssize_t readFile(Message * requestMessage) {
 	if (requestMessage->fd != -1) {
 		stdLogError(0, "GET request sent incoming data!");
@@ -1418,6 +5312,12 @@ static ssize_t readFile(Message * requestMessage) {
 		struct stat statinfo;
 		fstat(fd, &statinfo);
 		if ((statinfo.st_mode & S_IFMT) == S_IFDIR) {
+			int archive = ARCHIVE_NONE;
+			if (requestMessage->paramCount > RAP_PARAM_REQUEST_ARCHIVE) {
+				archive = messageParamTo(int, requestMessage->params[RAP_PARAM_REQUEST_ARCHIVE]);
+			}
+			if (archive != ARCHIVE_NONE) return sendZipArchive(requestMessage, fd, &statinfo, archive);
+
 			size_t fileNameSize = strlen(file);
 			if (fileNameSize > MAX_VARABLY_DEFINED_ARRAY) {
 				stdLogError(0, "URI was too large to process %zd", fileNameSize);
@@ -1457,13 +5357,41 @@ static ssize_t readFile(Message * requestMessage) {
 			//
 			// We don't need to acquire a lock to handle a GET.
 
+			if (requestMessage->paramCount > RAP_PARAM_REQUEST_SIGNATURE
+					&& messageParamTo(int, requestMessage->params[RAP_PARAM_REQUEST_SIGNATURE])
+					&& (statinfo.st_mode & S_IFMT) == S_IFREG) {
+				return sendSignature(requestMessage, file, fd, &statinfo);
+			}
+
+			int encodings = 0;
+			if (messageParamSize(requestMessage->params[RAP_PARAM_REQUEST_ENCODINGS]) == sizeof(encodings)) {
+				encodings = messageParamTo(int, requestMessage->params[RAP_PARAM_REQUEST_ENCODINGS]);
+			}
+			const Sidecar * sidecar = NULL;
+			if (encodings && (statinfo.st_mode & S_IFMT) == S_IFREG) {
+				int sidecarFd = openSidecar(file, &statinfo, encodings, &sidecar);
+				if (sidecarFd != -1) {
+					close(fd);
+					fd = sidecarFd;
+				}
+			}
+
 			Message message = { .mID = RAP_RESPOND_OK, .fd = fd, .paramCount = 3 };
 			message.params[RAP_PARAM_RESPONSE_DATE] = toMessageParam(statinfo.st_mtime);
 			MimeType * mimeType = findMimeType(file);
 			message.params[RAP_PARAM_RESPONSE_MIME] = makeMessageParam(mimeType->type,
 					mimeType->typeStringSize);
 			message.params[RAP_PARAM_RESPONSE_LOCATION] = requestMessage->params[RAP_PARAM_REQUEST_FILE];
-			return sendMessage(RAP_CONTROL_SOCKET, &message);
+			if (sidecar) {
+				message.paramCount = 4;
+				message.params[RAP_PARAM_RESPONSE_ENCODING] = stringToMessageParam(sidecar->name);
+			}
+			ssize_t messageResult = sendMessage(RAP_CONTROL_SOCKET, &message);
+			if (messageResult > 0 && !sidecar && (encodings & CONTENT_ENCODING_BIT(CONTENT_ENCODING_GZIP))
+					&& (statinfo.st_mode & S_IFMT) == S_IFREG) {
+				precompressFile(file, &statinfo, mimeType->type);
+			}
+			return messageResult;
 		}
 	}
 }
@@ -1555,6 +5483,10 @@ static int pgsqlAuthenticate(const char * user, const char * password, const cha
 		return 0;	
 	}
 	
+	initializeResumableUploads(user);
+	initializeUploadStaging(user);
+	initializeChangeJournal(user);
+
 	// Set up environment and switch user
 	clearenv();
 
@@ -1601,6 +5533,9 @@ static ssize_t authenticatePgsql(Message * message) {
 
 int main(int argCount, char * args[]) {
 	setlocale(LC_ALL, "");
+
+	// A client that goes away part way through a listing or archive must not take the RAP with it
+	signal(SIGPIPE, SIG_IGN);
 	char incomingBuffer[INCOMING_BUFFER_SIZE];
 
 	pamService = getenv("WEBDAVD_PAM_SERVICE");
@@ -1609,6 +5544,12 @@ int main(int argCount, char * args[]) {
 	const char * mimeFile = getenv("WEBDAVD_MIME_FILE");
 	initializeMimeTypes(mimeFile ? mimeFile : "/etc/mime.types");
 
+	const char * durability = getenv("WEBDAVD_PUT_DURABILITY");
+	if (durability) putDurability = atoi(durability);
+
+	const char * expiry = getenv("WEBDAVD_UPLOAD_EXPIRY");
+	if (expiry) uploadExpiry = atoi(expiry);
+
 	chrootPath = getenv("WEBDAVD_CHROOT_PATH");
 	if (chrootPath && !strcmp("", chrootPath)) chrootPath = NULL;
 
@@ -1632,29 +5573,61 @@ int main(int argCount, char * args[]) {
 
 	} while (ioResult > 0 && !authenticated);
 
+	initializePrecompression();
+	initializeStatPool();
+	initializeDirectoryCache();
+	initializeTreeWalk();
+	initializeProgress();
+
+	// The daemon's cleaner only reaches users who have an idle RAP, so each new RAP also clears its user's abandoned
+	// uploads
+	if (authenticated) cleanUploads();
+
 	while (ioResult > 0) {
 		// Read a message
 		ioResult = recvMessage(RAP_CONTROL_SOCKET, &message, incomingBuffer, INCOMING_BUFFER_SIZE);
 		if (ioResult <= 0) return ioResult == 0 ? 0 : 1;
+		newCollectionTagStamp();
+		lastResponse = RAP_RESPOND_INTERNAL_ERROR;
+
+		if (requestsServerFile(&message)) {
+			if (message.fd != -1) close(message.fd);
+			ioResult = writeErrorResponse(RAP_RESPOND_ACCESS_DENIED, "The file belongs to the server", NULL,
+					messageParamToString(&message.params[RAP_PARAM_REQUEST_FILE]));
+			continue;
+		}
 
+		// Requests which change anything record what they changed once they have succeeded
 		switch (message.mID) {
 		case RAP_REQUEST_GET:
 			ioResult = readFile(&message);
 			break;
 		case RAP_REQUEST_PUT:
 			ioResult = writeFile(&message);
+			if (lastResponseSucceeded()) recordRequestChanges(&message, 0);
+			break;
+		case RAP_REQUEST_PATCH:
+			ioResult = patchFile(&message);
+			if (lastResponseSucceeded()) recordRequestChanges(&message, 0);
+			break;
+		case RAP_REQUEST_EXTRACT:
+			ioResult = extractArchive(&message);
 			break;
 		case RAP_REQUEST_MKCOL:
 			ioResult = mkcol(&message);
+			if (lastResponseSucceeded()) recordRequestChanges(&message, 0);
 			break;
 		case RAP_REQUEST_DELETE:
 			ioResult = deleteFile(&message);
+			if (lastResponseSucceeded()) recordRequestChanges(&message, 0);
 			break;
 		case RAP_REQUEST_MOVE: // TODO lock
 			ioResult = moveFile(&message);
+			if (lastResponseSucceeded()) recordRequestChanges(&message, 1);
 			break;
 		case RAP_REQUEST_COPY: // TODO lock
 			ioResult = copyFile(&message);
+			if (lastResponseSucceeded()) recordRequestChanges(&message, 1);
 			break;
 		case RAP_REQUEST_PROPFIND:
 			ioResult = propfind(&message);
@@ -1662,9 +5635,18 @@ int main(int argCount, char * args[]) {
 		case RAP_REQUEST_PROPPATCH:
 			ioResult = proppatch(&message);
 			break;
+		case RAP_REQUEST_REPORT:
+			ioResult = report(&message);
+			break;
+		case RAP_REQUEST_WATCH:
+			ioResult = watchCollection(&message);
+			break;
 		case RAP_REQUEST_LOCK:
 			ioResult = lockFile(&message);
 			break;
+		case RAP_REQUEST_CLEAN_UPLOADS:
+			cleanUploads();
+			break;
 		default:
 			if (message.mID >= 400 && message.mID <= 499) {
 				const char * location = messageParamToString(&message.params[RAP_PARAM_ERROR_LOCATION]);
@@ -1676,6 +5658,7 @@ int main(int argCount, char * args[]) {
 				ioResult = respond(RAP_RESPOND_INTERNAL_ERROR);
 			}
 		}
+		flushChangeJournal();
 	}
 
 	return ioResult < 0 ? 1 : 0;
@@ -1,5 +1,7 @@
 #include "shared.h"
 
+#include <ctype.h>
+#include <fnmatch.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <fcntl.h>
@@ -321,3 +323,28 @@ char * loadFileToBuffer(const char * file, size_t * size) {
 	return buffer;
 }
 
+// Matches a mime type such as "application/xml; charset=utf-8" against a pattern such as "text/*".
+// Parameters are ignored and the comparison is case insensitive.
+int mimeTypeMatches(const char * pattern, const char * mimeType) {
+	size_t length = strcspn(mimeType, "; \t");
+	if (length >= 200) {
+		return 0;
+	}
+	char type[length + 1];
+	for (size_t i = 0; i < length; i++) {
+		type[i] = tolower(mimeType[i]);
+	}
+	type[length] = '\0';
+	return !fnmatch(pattern, type, 0);
+}
+
+// Whether the name, up to the next '/' or the end, is one the server keeps for itself among the user's files: the
+// change journal, the upload staging roots ".webdavd-uploads" and ".webdavd-resumable", and working files beside the
+// user's own such as ".name.webdavd-upload-*", ".name.webdavd-signature", ".name.webdavd-gz" and ".name.webdavd-123-4".
+int isServerFile(const char * name) {
+	if (name[0] != '.') {
+		return 0;
+	}
+	const char * match = strstr(name, ".webdavd-");
+	return match && match < name + strcspn(name, "/");
+}
@@ -18,17 +18,25 @@ typedef enum RapConstant {
 	// sent by startProcessingRequest to start processing an HTTP method
 	RAP_REQUEST_GET,
 	RAP_REQUEST_PUT,
+	RAP_REQUEST_PATCH,
+	RAP_REQUEST_EXTRACT,
 	RAP_REQUEST_PROPFIND,
 	RAP_REQUEST_PROPPATCH,
+	RAP_REQUEST_REPORT,
 	RAP_REQUEST_LOCK,
 	RAP_REQUEST_MKCOL,
 	RAP_REQUEST_MOVE,
 	RAP_REQUEST_COPY,
 	RAP_REQUEST_DELETE,
+	RAP_REQUEST_WATCH,
+
+	// sent by the cleaner to RAPs in the pool, there is no response
+	RAP_REQUEST_CLEAN_UPLOADS,
 
 	// sent by rap, processed by finishProcessingRequest
 	RAP_INTERIM_RESPOND_LOCK,
 	RAP_INTERIM_RESPOND_RELOCK,
+	RAP_INTERIM_PROGRESS,
 
 	// sent by finishProcessingRequest to complete processing a request
 	RAP_COMPLETE_REQUEST_LOCK,
@@ -39,12 +47,16 @@ typedef enum RapConstant {
 	RAP_RESPOND_CREATED = 201,
 	RAP_RESPOND_OK_NO_CONTENT = 204,
 	RAP_RESPOND_MULTISTATUS = 207,
+	RAP_RESPOND_RESUME_INCOMPLETE = 308,
 	RAP_RESPOND_BAD_CLIENT_REQUEST = 400,
 	RAP_RESPOND_AUTH_FAILLED = 401,
 	RAP_RESPOND_ACCESS_DENIED = 403,
 	RAP_RESPOND_NOT_FOUND = 404,
 	RAP_RESPOND_CONFLICT = 409,
+	RAP_RESPOND_PRECONDITION_FAILED = 412,
 	RAP_RESPOND_URI_TOO_LARGE = 414,
+	RAP_RESPOND_UNSUPPORTED_MEDIA_TYPE = 415,
+	RAP_RESPOND_RANGE_NOT_SATISFIABLE = 416,
 	RAP_RESPOND_LOCKED = 423,
 	RAP_RESPOND_HEADER_TOO_LARGE = 431,
 	RAP_RESPOND_INTERNAL_ERROR = 500,
@@ -52,6 +64,34 @@ typedef enum RapConstant {
 
 } RapConstant;
 
+// Content codings in order of preference when a client rates them equally
+typedef enum ContentEncoding {
+	CONTENT_ENCODING_IDENTITY = 0,
+	CONTENT_ENCODING_GZIP,
+	CONTENT_ENCODING_BROTLI,
+	CONTENT_ENCODING_ZSTD
+} ContentEncoding;
+
+#define CONTENT_ENCODING_BIT(encoding) (1 << (encoding))
+
+// GET of a collection can return it as an archive instead of a listing
+typedef enum ArchiveFormat {
+	ARCHIVE_NONE = 0,
+	ARCHIVE_ZIP,
+	ARCHIVE_ZIP_STORED
+} ArchiveFormat;
+
+// Delta sync: a GET accepting the first returns a file's signature, a PATCH of the second applies a delta to it
+#define DELTA_SIGNATURE_MIME_TYPE "application/vnd.webdavd.signature"
+#define DELTA_MIME_TYPE "application/vnd.webdavd.delta"
+
+// How hard PUT works to get an upload onto disk before it is acknowledged
+typedef enum PutDurability {
+	PUT_DURABILITY_NONE = 0,
+	PUT_DURABILITY_CLOSE_SYNC,
+	PUT_DURABILITY_WRITE_BEHIND
+} PutDurability;
+
 // Auth Request
 #define RAP_PARAM_AUTH_USER         0
 #define RAP_PARAM_AUTH_PASSWORD     1
@@ -67,11 +107,20 @@ typedef enum RapConstant {
 #define RAP_PARAM_REQUEST_FILE      1
 #define RAP_PARAM_REQUEST_DEPTH     2
 #define RAP_PARAM_REQUEST_TARGET    2
+#define RAP_PARAM_REQUEST_ENCODINGS 2
+#define RAP_PARAM_REQUEST_LENGTH    2
+#define RAP_PARAM_REQUEST_ARCHIVE_ENCODING 2
+#define RAP_PARAM_REQUEST_RANGE     3
+#define RAP_PARAM_REQUEST_SIGNATURE 3
+#define RAP_PARAM_REQUEST_ARCHIVE   4
+#define RAP_PARAM_REQUEST_UPLOAD_TOKEN 4
 
 // Generic Response
 #define RAP_PARAM_RESPONSE_DATE     0
 #define RAP_PARAM_RESPONSE_MIME     1
 #define RAP_PARAM_RESPONSE_LOCATION 2
+#define RAP_PARAM_RESPONSE_ENCODING 3
+#define RAP_PARAM_RESPONSE_SIZE     4
 
 // Lock interim response
 #define RAP_PARAM_LOCK_LOCATION     0
@@ -79,6 +128,16 @@ typedef enum RapConstant {
 #define RAP_PARAM_LOCK_TOKEN        1
 #define RAP_PARAM_LOCK_TIMEOUT      2
 
+// Resume incomplete response
+#define RAP_PARAM_RESUME_RECEIVED   0
+#define RAP_PARAM_RESUME_TOKEN      1
+
+// Watch response
+#define RAP_PARAM_WATCH_DESCRIPTOR  0
+
+// Progress interim response
+#define RAP_PARAM_PROGRESS_COUNT    0
+
 // Error responses
 #define RAP_PARAM_ERROR_LOCATION    0
 #define RAP_PARAM_ERROR_REASON      1
@@ -153,4 +212,8 @@ int lockToUser(const char * user, const char * chrootDir);
 
 char * loadFileToBuffer(const char * file, size_t * size);
 
+int mimeTypeMatches(const char * pattern, const char * mimeType);
+
+int isServerFile(const char * name);
+
 #endif
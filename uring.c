@@ -0,0 +1,352 @@
+#include "uring.h"
+
+#include "shared.h"
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// Bulk copies in the RAP (PUT bodies into files and file to file COPY) go through one io_uring.  A handful of
+// buffers are registered with the kernel once and kept in flight together.  For a file copy each buffer is a read
+// linked to the write of the same bytes so the kernel moves on to the write without coming back to us.  For a PUT
+// the body is a pipe, so only one read can be outstanding at a time, but the writes of earlier buffers carry on
+// while it waits.  Each io_uring_enter() both submits everything queued and collects whatever has finished.
+//
+// There is no liburing dependency, the ring is set up with the raw system calls.  If the kernel has no io_uring,
+// or it has been turned off, uringAvailable() returns false and the caller uses plain read() and write().
+
+#define URING_ENTRIES 32
+#define URING_BUFFER_COUNT 8
+#define URING_BUFFER_SIZE (128 * 1024)
+
+#define USER_DATA(buffer, isWrite) (((__u64) (buffer) << 1) | (isWrite))
+#define USER_DATA_BUFFER(userData) ((int) ((userData) >> 1))
+#define USER_DATA_IS_WRITE(userData) ((int) ((userData) & 1))
+
+typedef struct Uring {
+	int fd;
+	int fixedBuffers;
+	unsigned sqTail;
+	unsigned pending;
+	unsigned * sqTailPtr;
+	unsigned * sqMask;
+	unsigned * sqArray;
+	unsigned * cqHead;
+	unsigned * cqTail;
+	unsigned * cqMask;
+	struct io_uring_sqe * sqes;
+	struct io_uring_cqe * cqes;
+	char * buffers;
+} Uring;
+
+static Uring ring;
+
+// 0 not tried yet, 1 ready, -1 not available
+static int ringState = 0;
+
+////////////////
+// Ring Setup //
+////////////////
+
+static int setupRing() {
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	ring.fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+	if (ring.fd == -1) return 0;
+
+	// Older kernels can do io_uring but not everything needed here (5.6 onwards)
+	if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP)
+			|| !(params.features & IORING_FEAT_RW_CUR_POS)) {
+		close(ring.fd);
+		return 0;
+	}
+
+	size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	size_t cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	size_t ringSize = sqSize > cqSize ? sqSize : cqSize;
+	char * rings = mmap(NULL, ringSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd,
+			IORING_OFF_SQ_RING);
+	if (rings == MAP_FAILED) {
+		close(ring.fd);
+		return 0;
+	}
+	ring.sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+	ring.buffers = mmap(NULL, URING_BUFFER_COUNT * URING_BUFFER_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ring.sqes == MAP_FAILED || ring.buffers == MAP_FAILED) {
+		munmap(rings, ringSize);
+		if (ring.sqes != MAP_FAILED) munmap(ring.sqes, params.sq_entries * sizeof(struct io_uring_sqe));
+		close(ring.fd);
+		return 0;
+	}
+
+	ring.sqTailPtr = (unsigned *) (rings + params.sq_off.tail);
+	ring.sqMask = (unsigned *) (rings + params.sq_off.ring_mask);
+	ring.sqArray = (unsigned *) (rings + params.sq_off.array);
+	ring.cqHead = (unsigned *) (rings + params.cq_off.head);
+	ring.cqTail = (unsigned *) (rings + params.cq_off.tail);
+	ring.cqMask = (unsigned *) (rings + params.cq_off.ring_mask);
+	ring.cqes = (struct io_uring_cqe *) (rings + params.cq_off.cqes);
+	ring.sqTail = *ring.sqTailPtr;
+	ring.pending = 0;
+
+	// Registered buffers count against RLIMIT_MEMLOCK so this may fail, the plain ops work as well without it
+	struct iovec iov[URING_BUFFER_COUNT];
+	for (int i = 0; i < URING_BUFFER_COUNT; i++) {
+		iov[i].iov_base = ring.buffers + i * URING_BUFFER_SIZE;
+		iov[i].iov_len = URING_BUFFER_SIZE;
+	}
+	ring.fixedBuffers = !syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_BUFFERS, iov,
+			URING_BUFFER_COUNT);
+	return 1;
+}
+
+int uringAvailable() {
+	if (!ringState) {
+		ringState = setupRing() ? 1 : -1;
+		if (ringState == -1) {
+			stdLogError(errno, "io_uring is not available, using read and write");
+		}
+	}
+	return ringState == 1;
+}
+
+////////////////////
+// End Ring Setup //
+////////////////////
+
+////////////////
+// Submission //
+////////////////
+
+static void queueIo(int isWrite, int fd, int buffer, size_t size, off_t offset, int link) {
+	unsigned index = ring.sqTail & *ring.sqMask;
+	struct io_uring_sqe * sqe = &ring.sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	if (ring.fixedBuffers) {
+		sqe->opcode = isWrite ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+		sqe->buf_index = buffer;
+	} else {
+		sqe->opcode = isWrite ? IORING_OP_WRITE : IORING_OP_READ;
+	}
+	sqe->fd = fd;
+	sqe->addr = (unsigned long) (ring.buffers + buffer * URING_BUFFER_SIZE);
+	sqe->len = size;
+	sqe->off = offset;
+	sqe->flags = link ? IOSQE_IO_LINK : 0;
+	sqe->user_data = USER_DATA(buffer, isWrite);
+	ring.sqArray[index] = index;
+	ring.sqTail++;
+	ring.pending++;
+}
+
+// Submits everything queued and waits until at least one completion is ready
+static int submitAndWait() {
+	__atomic_store_n(ring.sqTailPtr, ring.sqTail, __ATOMIC_RELEASE);
+	int result;
+	do {
+		result = syscall(__NR_io_uring_enter, ring.fd, ring.pending, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+	} while (result == -1 && errno == EINTR);
+	if (result == -1) {
+		// Whatever is still in flight may still write into the buffers so the ring can't be trusted again
+		stdLogError(errno, "io_uring_enter failed");
+		ringState = -1;
+		return 0;
+	}
+	ring.pending -= result;
+	return 1;
+}
+
+static int nextCompletion(struct io_uring_cqe * cqe) {
+	unsigned head = *ring.cqHead;
+	if (head == __atomic_load_n(ring.cqTail, __ATOMIC_ACQUIRE)) return 0;
+	*cqe = ring.cqes[head & *ring.cqMask];
+	__atomic_store_n(ring.cqHead, head + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+////////////////////
+// End Submission //
+////////////////////
+
+//////////
+// Copy //
+//////////
+
+// Finishes a copy with pread and pwrite from offset to the end of the source
+static ssize_t finishCopy(int sourceFd, int targetFd, off_t offset, int * failedFd) {
+	char * buffer = ring.buffers;
+	ssize_t bytesRead;
+	while ((bytesRead = pread(sourceFd, buffer, URING_BUFFER_SIZE, offset)) > 0) {
+		ssize_t bytesWritten = pwrite(targetFd, buffer, bytesRead, offset);
+		if (bytesWritten < bytesRead) {
+			if (bytesWritten >= 0) errno = ENOSPC;
+			*failedFd = targetFd;
+			return -1;
+		}
+		offset += bytesRead;
+	}
+	if (bytesRead < 0) {
+		*failedFd = sourceFd;
+		return -1;
+	}
+	// The source may have shrunk while it was being copied
+	ftruncate(targetFd, offset);
+	return offset;
+}
+
+static ssize_t copyFromFile(int sourceFd, int targetFd, off_t size, int * failedFd) {
+	off_t chunkOffset[URING_BUFFER_COUNT];
+	size_t chunkSize[URING_BUFFER_COUNT];
+	off_t nextOffset = 0;
+	off_t resumeOffset = -1;
+	int inFlight = 0;
+	int error = 0;
+
+	for (int buffer = 0; buffer < URING_BUFFER_COUNT && nextOffset < size; buffer++) {
+		chunkOffset[buffer] = nextOffset;
+		chunkSize[buffer] = size - nextOffset < URING_BUFFER_SIZE ? size - nextOffset : URING_BUFFER_SIZE;
+		queueIo(0, sourceFd, buffer, chunkSize[buffer], nextOffset, 1);
+		queueIo(1, targetFd, buffer, chunkSize[buffer], nextOffset, 0);
+		nextOffset += chunkSize[buffer];
+		inFlight++;
+	}
+
+	int started = 0;
+	while (inFlight) {
+		if (!submitAndWait()) {
+			*failedFd = -1;
+			return started ? -1 : URING_NOT_STARTED;
+		}
+		started = 1;
+		struct io_uring_cqe cqe;
+		while (nextCompletion(&cqe)) {
+			int buffer = USER_DATA_BUFFER(cqe.user_data);
+			int ok = (cqe.res == chunkSize[buffer]);
+			if (!ok) {
+				// A short read means the file changed under us.  Its write is cancelled and the rest is finished
+				// off the slow way.
+				if (cqe.res < 0 && cqe.res != -ECANCELED && !error) {
+					error = -cqe.res;
+					*failedFd = USER_DATA_IS_WRITE(cqe.user_data) ? targetFd : sourceFd;
+				} else if (cqe.res >= 0 && USER_DATA_IS_WRITE(cqe.user_data) && !error) {
+					error = ENOSPC;
+					*failedFd = targetFd;
+				}
+				if (resumeOffset == -1 || chunkOffset[buffer] < resumeOffset) resumeOffset = chunkOffset[buffer];
+			}
+			if (!USER_DATA_IS_WRITE(cqe.user_data)) continue;
+
+			if (ok && !error && resumeOffset == -1 && nextOffset < size) {
+				chunkOffset[buffer] = nextOffset;
+				chunkSize[buffer] = size - nextOffset < URING_BUFFER_SIZE ? size - nextOffset : URING_BUFFER_SIZE;
+				queueIo(0, sourceFd, buffer, chunkSize[buffer], nextOffset, 1);
+				queueIo(1, targetFd, buffer, chunkSize[buffer], nextOffset, 0);
+				nextOffset += chunkSize[buffer];
+			} else {
+				inFlight--;
+			}
+		}
+	}
+
+	if (error) {
+		errno = error;
+		return -1;
+	}
+	if (resumeOffset == -1) {
+		// The file may also have grown
+		resumeOffset = size;
+	}
+	return finishCopy(sourceFd, targetFd, resumeOffset, failedFd);
+}
+
+static ssize_t copyFromStream(int sourceFd, int targetFd, int * failedFd) {
+	int freeBuffers[URING_BUFFER_COUNT];
+	size_t chunkSize[URING_BUFFER_COUNT];
+	int freeCount = URING_BUFFER_COUNT;
+	for (int i = 0; i < URING_BUFFER_COUNT; i++) {
+		freeBuffers[i] = i;
+	}
+	off_t writeOffset = 0;
+	int reading = 0;
+	int writing = 0;
+	int endOfStream = 0;
+	int error = 0;
+	int started = 0;
+
+	for (;;) {
+		if (!reading && !endOfStream && !error && freeCount) {
+			queueIo(0, sourceFd, freeBuffers[--freeCount], URING_BUFFER_SIZE, -1, 0);
+			reading = 1;
+		}
+		if (!reading && !writing) break;
+
+		if (!submitAndWait()) {
+			// Until the first read has been submitted nothing has been taken from the stream
+			*failedFd = -1;
+			return started ? -1 : URING_NOT_STARTED;
+		}
+		started = 1;
+		struct io_uring_cqe cqe;
+		while (nextCompletion(&cqe)) {
+			int buffer = USER_DATA_BUFFER(cqe.user_data);
+			if (!USER_DATA_IS_WRITE(cqe.user_data)) {
+				reading = 0;
+				if (cqe.res > 0 && !error) {
+					chunkSize[buffer] = cqe.res;
+					queueIo(1, targetFd, buffer, cqe.res, writeOffset, 0);
+					writeOffset += cqe.res;
+					writing++;
+				} else {
+					if (cqe.res < 0 && !error) {
+						error = -cqe.res;
+						*failedFd = sourceFd;
+					}
+					endOfStream = 1;
+					freeBuffers[freeCount++] = buffer;
+				}
+			} else {
+				writing--;
+				if (cqe.res != chunkSize[buffer] && !error) {
+					error = cqe.res < 0 ? -cqe.res : ENOSPC;
+					*failedFd = targetFd;
+				}
+				freeBuffers[freeCount++] = buffer;
+			}
+		}
+	}
+
+	if (error) {
+		errno = error;
+		return -1;
+	}
+	return writeOffset;
+}
+
+// Copies sourceFd to the start of targetFd.  A regular file is copied from its start, anything else from wherever
+// it's up to.  Returns the number of bytes copied or -1 with errno
+// set and failedFd set to whichever of the two it came from.  If the ring itself fails failedFd is set to -1, and
+// if that happens before anything was submitted URING_NOT_STARTED is returned so the caller can copy some other
+// way.  Only call this if uringAvailable().
+ssize_t uringCopy(int sourceFd, int targetFd, int * failedFd) {
+	struct stat sourceStat;
+	if (fstat(sourceFd, &sourceStat) == -1) {
+		*failedFd = sourceFd;
+		return -1;
+	}
+	if ((sourceStat.st_mode & S_IFMT) == S_IFREG) {
+		return copyFromFile(sourceFd, targetFd, sourceStat.st_size, failedFd);
+	} else {
+		return copyFromStream(sourceFd, targetFd, failedFd);
+	}
+}
+
+//////////////
+// End Copy //
+//////////////
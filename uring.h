@@ -0,0 +1,11 @@
+#ifndef WEBDAV_URING_H
+#define WEBDAV_URING_H
+
+#include <sys/types.h>
+
+#define URING_NOT_STARTED -2
+
+int uringAvailable();
+ssize_t uringCopy(int sourceFd, int targetFd, int * failedFd);
+
+#endif
@@ -0,0 +1,337 @@
+#include "url.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define URL_X86
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define URL_NEON
+#endif
+
+// Every href in a PROPFIND and every Destination/If header goes through here.  Most paths are long runs of safe
+// characters so the vector versions check 16 or 32 bytes at a time and copy the whole block across, only stopping
+// at the odd character which needs to change.  target always has room for the block to be stored before it's
+// known how much of it is needed.  The version is picked at runtime from what the CPU supports.
+
+static const char HEX[] = "0123456789ABCDEF";
+
+static const char URL_SAFE[256] = { ['0' ... '9'] = 1, ['A' ... 'Z'] = 1, ['a' ... 'z'] = 1, ['-'] = 1, ['_'] = 1,
+		['.'] = 1, ['~'] = 1, ['/'] = 1 };
+
+static const signed char HEX_VALUE[256] = { [0 ... 255] = -1, ['0'] = 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, ['A'] = 10, 11,
+		12, 13, 14, 15, ['a'] = 10, 11, 12, 13, 14, 15 };
+
+////////////
+// Scalar //
+////////////
+
+static size_t encodeScalar(char * target, const char * url, const char * end) {
+	char * writePtr = target;
+	while (url < end) {
+		unsigned char c = *(url++);
+		if (URL_SAFE[c]) {
+			*(writePtr++) = c;
+		} else {
+			*(writePtr++) = '%';
+			*(writePtr++) = HEX[c >> 4];
+			*(writePtr++) = HEX[c & 0x0F];
+		}
+	}
+	*writePtr = '\0';
+	return writePtr - target;
+}
+
+// A '%' not followed by two hex digits is copied as it is
+static const char * decodeEscape(char ** writePtr, const char * url, const char * end) {
+	int high, low;
+	if (end - url > 2 && (high = HEX_VALUE[(unsigned char) url[1]]) >= 0
+			&& (low = HEX_VALUE[(unsigned char) url[2]]) >= 0) {
+		*((*writePtr)++) = (char) ((high << 4) | low);
+		return url + 3;
+	} else {
+		*((*writePtr)++) = '%';
+		return url + 1;
+	}
+}
+
+static size_t decodeScalar(char * target, const char * url, const char * end) {
+	char * writePtr = target;
+	while (url < end) {
+		if (*url == '%') {
+			url = decodeEscape(&writePtr, url, end);
+		} else {
+			*(writePtr++) = *(url++);
+		}
+	}
+	*writePtr = '\0';
+	return writePtr - target;
+}
+
+#define writeEscape(writePtr, c) do { \
+	unsigned char __c = (c); \
+	*((writePtr)++) = '%'; \
+	*((writePtr)++) = HEX[__c >> 4]; \
+	*((writePtr)++) = HEX[__c & 0x0F]; \
+} while (0)
+
+////////////////
+// End Scalar //
+////////////////
+
+/////////
+// x86 //
+/////////
+
+#ifdef URL_X86
+
+// Signed comparisons, bytes over 0x7F are negative and so never fall in any of the ranges
+__attribute__ ((target("sse2")))
+static inline int unsafeMaskSSE2(__m128i block) {
+	__m128i safe = _mm_and_si128(_mm_cmpgt_epi8(block, _mm_set1_epi8('0' - 1)),
+			_mm_cmplt_epi8(block, _mm_set1_epi8('9' + 1)));
+	safe = _mm_or_si128(safe,
+			_mm_and_si128(_mm_cmpgt_epi8(block, _mm_set1_epi8('A' - 1)), _mm_cmplt_epi8(block, _mm_set1_epi8('Z' + 1))));
+	safe = _mm_or_si128(safe,
+			_mm_and_si128(_mm_cmpgt_epi8(block, _mm_set1_epi8('a' - 1)), _mm_cmplt_epi8(block, _mm_set1_epi8('z' + 1))));
+	safe = _mm_or_si128(safe,
+			_mm_or_si128(_mm_cmpeq_epi8(block, _mm_set1_epi8('-')), _mm_cmpeq_epi8(block, _mm_set1_epi8('_'))));
+	safe = _mm_or_si128(safe,
+			_mm_or_si128(_mm_cmpeq_epi8(block, _mm_set1_epi8('.')), _mm_cmpeq_epi8(block, _mm_set1_epi8('~'))));
+	safe = _mm_or_si128(safe, _mm_cmpeq_epi8(block, _mm_set1_epi8('/')));
+	return ~_mm_movemask_epi8(safe) & 0xFFFF;
+}
+
+__attribute__ ((target("sse2")))
+static size_t encodeSSE2(char * target, const char * url, const char * end) {
+	char * writePtr = target;
+	while (end - url >= 16) {
+		__m128i block = _mm_loadu_si128((const __m128i *) url);
+		_mm_storeu_si128((__m128i *) writePtr, block);
+		int mask = unsafeMaskSSE2(block);
+		if (!mask) {
+			url += 16;
+			writePtr += 16;
+		} else {
+			int safe = __builtin_ctz(mask);
+			writePtr += safe;
+			url += safe;
+			writeEscape(writePtr, *(url++));
+		}
+	}
+	return (writePtr - target) + encodeScalar(writePtr, url, end);
+}
+
+__attribute__ ((target("sse2")))
+static size_t decodeSSE2(char * target, const char * url, const char * end) {
+	const __m128i percent = _mm_set1_epi8('%');
+	char * writePtr = target;
+	while (end - url >= 16) {
+		__m128i block = _mm_loadu_si128((const __m128i *) url);
+		_mm_storeu_si128((__m128i *) writePtr, block);
+		int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, percent));
+		if (!mask) {
+			url += 16;
+			writePtr += 16;
+		} else {
+			int plain = __builtin_ctz(mask);
+			writePtr += plain;
+			url = decodeEscape(&writePtr, url + plain, end);
+		}
+	}
+	return (writePtr - target) + decodeScalar(writePtr, url, end);
+}
+
+__attribute__ ((target("avx2")))
+static inline unsigned int unsafeMaskAVX2(__m256i block) {
+	__m256i safe = _mm256_and_si256(_mm256_cmpgt_epi8(block, _mm256_set1_epi8('0' - 1)),
+			_mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), block));
+	safe = _mm256_or_si256(safe,
+			_mm256_and_si256(_mm256_cmpgt_epi8(block, _mm256_set1_epi8('A' - 1)),
+					_mm256_cmpgt_epi8(_mm256_set1_epi8('Z' + 1), block)));
+	safe = _mm256_or_si256(safe,
+			_mm256_and_si256(_mm256_cmpgt_epi8(block, _mm256_set1_epi8('a' - 1)),
+					_mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), block)));
+	safe = _mm256_or_si256(safe,
+			_mm256_or_si256(_mm256_cmpeq_epi8(block, _mm256_set1_epi8('-')),
+					_mm256_cmpeq_epi8(block, _mm256_set1_epi8('_'))));
+	safe = _mm256_or_si256(safe,
+			_mm256_or_si256(_mm256_cmpeq_epi8(block, _mm256_set1_epi8('.')),
+					_mm256_cmpeq_epi8(block, _mm256_set1_epi8('~'))));
+	safe = _mm256_or_si256(safe, _mm256_cmpeq_epi8(block, _mm256_set1_epi8('/')));
+	return ~(unsigned int) _mm256_movemask_epi8(safe);
+}
+
+__attribute__ ((target("avx2")))
+static size_t encodeAVX2(char * target, const char * url, const char * end) {
+	char * writePtr = target;
+	while (end - url >= 32) {
+		__m256i block = _mm256_loadu_si256((const __m256i *) url);
+		_mm256_storeu_si256((__m256i *) writePtr, block);
+		unsigned int mask = unsafeMaskAVX2(block);
+		if (!mask) {
+			url += 32;
+			writePtr += 32;
+		} else {
+			int safe = __builtin_ctz(mask);
+			writePtr += safe;
+			url += safe;
+			writeEscape(writePtr, *(url++));
+		}
+	}
+	return (writePtr - target) + encodeSSE2(writePtr, url, end);
+}
+
+__attribute__ ((target("avx2")))
+static size_t decodeAVX2(char * target, const char * url, const char * end) {
+	const __m256i percent = _mm256_set1_epi8('%');
+	char * writePtr = target;
+	while (end - url >= 32) {
+		__m256i block = _mm256_loadu_si256((const __m256i *) url);
+		_mm256_storeu_si256((__m256i *) writePtr, block);
+		unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, percent));
+		if (!mask) {
+			url += 32;
+			writePtr += 32;
+		} else {
+			int plain = __builtin_ctz(mask);
+			writePtr += plain;
+			url = decodeEscape(&writePtr, url + plain, end);
+		}
+	}
+	return (writePtr - target) + decodeSSE2(writePtr, url, end);
+}
+
+#endif
+
+/////////////
+// End x86 //
+/////////////
+
+//////////
+// NEON //
+//////////
+
+#ifdef URL_NEON
+
+// Returns the number of leading bytes in block which match
+static inline int leadingMatches(uint8x16_t matches) {
+	// Narrow each byte to a nibble so the result fits in 64 bits
+	uint64_t bits = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(matches), 4)), 0);
+	return bits == ~0ULL ? 16 : __builtin_ctzll(~bits) >> 2;
+}
+
+// Unsigned here, so bytes over 0x7F are simply above every range
+static inline uint8x16_t safeMaskNEON(uint8x16_t block) {
+	uint8x16_t safe = vandq_u8(vcgeq_u8(block, vdupq_n_u8('0')), vcleq_u8(block, vdupq_n_u8('9')));
+	safe = vorrq_u8(safe, vandq_u8(vcgeq_u8(block, vdupq_n_u8('A')), vcleq_u8(block, vdupq_n_u8('Z'))));
+	safe = vorrq_u8(safe, vandq_u8(vcgeq_u8(block, vdupq_n_u8('a')), vcleq_u8(block, vdupq_n_u8('z'))));
+	safe = vorrq_u8(safe, vorrq_u8(vceqq_u8(block, vdupq_n_u8('-')), vceqq_u8(block, vdupq_n_u8('_'))));
+	safe = vorrq_u8(safe, vorrq_u8(vceqq_u8(block, vdupq_n_u8('.')), vceqq_u8(block, vdupq_n_u8('~'))));
+	return vorrq_u8(safe, vceqq_u8(block, vdupq_n_u8('/')));
+}
+
+static size_t encodeNEON(char * target, const char * url, const char * end) {
+	char * writePtr = target;
+	while (end - url >= 16) {
+		uint8x16_t block = vld1q_u8((const uint8_t *) url);
+		vst1q_u8((uint8_t *) writePtr, block);
+		int safe = leadingMatches(safeMaskNEON(block));
+		writePtr += safe;
+		url += safe;
+		if (safe < 16) {
+			writeEscape(writePtr, *(url++));
+		}
+	}
+	return (writePtr - target) + encodeScalar(writePtr, url, end);
+}
+
+static size_t decodeNEON(char * target, const char * url, const char * end) {
+	char * writePtr = target;
+	while (end - url >= 16) {
+		uint8x16_t block = vld1q_u8((const uint8_t *) url);
+		vst1q_u8((uint8_t *) writePtr, block);
+		int plain = leadingMatches(vmvnq_u8(vceqq_u8(block, vdupq_n_u8('%'))));
+		writePtr += plain;
+		url += plain;
+		if (plain < 16) {
+			url = decodeEscape(&writePtr, url, end);
+		}
+	}
+	return (writePtr - target) + decodeScalar(writePtr, url, end);
+}
+
+#endif
+
+//////////////
+// End NEON //
+//////////////
+
+///////////////
+// Selection //
+///////////////
+
+typedef struct UrlCodec {
+	const char * name;
+	size_t (*encode)(char * target, const char * url, const char * end);
+	size_t (*decode)(char * target, const char * url, const char * end);
+} UrlCodec;
+
+static const UrlCodec SCALAR_CODEC = { "scalar", &encodeScalar, &decodeScalar };
+#ifdef URL_X86
+static const UrlCodec SSE2_CODEC = { "sse2", &encodeSSE2, &decodeSSE2 };
+static const UrlCodec AVX2_CODEC = { "avx2", &encodeAVX2, &decodeAVX2 };
+#endif
+#ifdef URL_NEON
+static const UrlCodec NEON_CODEC = { "neon", &encodeNEON, &decodeNEON };
+#endif
+
+static const UrlCodec * codec = NULL;
+
+// Every thread which races here picks the same codec so no lock is needed
+static const UrlCodec * getCodec() {
+	if (!codec) {
+#if defined(URL_X86)
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx2")) {
+			codec = &AVX2_CODEC;
+		} else if (__builtin_cpu_supports("sse2")) {
+			codec = &SSE2_CODEC;
+		} else {
+			codec = &SCALAR_CODEC;
+		}
+#elif defined(URL_NEON)
+		codec = &NEON_CODEC;
+#else
+		codec = &SCALAR_CODEC;
+#endif
+	}
+	return codec;
+}
+
+///////////////////
+// End Selection //
+///////////////////
+
+///////////
+// Codec //
+///////////
+
+// Anything shorter than a vector isn't worth the indirect call
+
+// target must have room for URL_ENCODED_SIZE(size).  Returns the length written, not counting the '\0'.
+size_t urlEncode(char * target, const char * url, size_t size) {
+	if (size < 16) return encodeScalar(target, url, url + size);
+	return getCodec()->encode(target, url, url + size);
+}
+
+// target must have room for size + 1.  Returns the length written, not counting the '\0'.
+size_t urlDecode(char * target, const char * url, size_t size) {
+	if (size < 16) return decodeScalar(target, url, url + size);
+	return getCodec()->decode(target, url, url + size);
+}
+
+///////////////
+// End Codec //
+///////////////
@@ -0,0 +1,14 @@
+#ifndef WEBDAV_URL_H
+#define WEBDAV_URL_H
+
+#include <stddef.h>
+
+// Paths are encoded leaving 0-9 A-Z a-z - _ . ~ and / as they are, everything else is written %XX
+
+// The most urlEncode() can write for size bytes of input, including the '\0'
+#define URL_ENCODED_SIZE(size) ((size) * 3 + 1)
+
+size_t urlEncode(char * target, const char * url, size_t size);
+size_t urlDecode(char * target, const char * url, size_t size);
+
+#endif
@@ -0,0 +1,65 @@
+// Times a COPY of one tree by the RAP, without the daemon or a database.
+//
+//    gcc -O2 -std=gnu99 -pthread -I. -I/usr/include/libxml2 -I/usr/include/postgresql -o copy-tree \
+//        useful/benchmarks/copy-tree.c shared.c xml.c davxml.c url.c uring.c -lpam -lxml2 -lz -lpq -lgnutls
+//    ./copy-tree <source> <target>
+//
+// To time an older RAP build with -DRAP_SOURCE='"old/rap.c"'.  RAPs from before COPY was walked on a thread pool
+// also need -DNO_TREE_WALK.
+
+#ifndef RAP_SOURCE
+#define RAP_SOURCE "../../rap.c"
+#endif
+
+#define main rapMain
+#include RAP_SOURCE
+#undef main
+
+#include <sys/time.h>
+
+static int controlSockets[2];
+static int responseCode;
+
+// Stands in for the daemon, skipping progress reports
+static void * receiveResponse(void * unused) {
+	Message message;
+	char incomingBuffer[65536];
+	while (recvMessage(controlSockets[1], &message, incomingBuffer, sizeof(incomingBuffer)) > 0) {
+		if (message.fd != -1) close(message.fd);
+		if (message.mID >= RAP_RESPOND_OK) {
+			responseCode = message.mID;
+			break;
+		}
+	}
+	return NULL;
+}
+
+int main(int argCount, char ** args) {
+	if (argCount != 3) {
+		fprintf(stderr, "Usage: %s <source> <target>\n", args[0]);
+		return 1;
+	}
+#ifndef NO_TREE_WALK
+	initializeTreeWalk();
+	initializeProgress();
+#endif
+	socketpair(PF_LOCAL, SOCK_SEQPACKET, 0, controlSockets);
+	dup2(controlSockets[0], RAP_CONTROL_SOCKET);
+	pthread_t thread;
+	pthread_create(&thread, NULL, &receiveResponse, NULL);
+
+	LockProvisions locks = { 0 };
+	Message message = { .mID = RAP_REQUEST_COPY, .fd = -1, .paramCount = 3 };
+	message.params[RAP_PARAM_REQUEST_LOCK] = toMessageParam(locks);
+	message.params[RAP_PARAM_REQUEST_FILE] = stringToMessageParam(args[1]);
+	message.params[RAP_PARAM_REQUEST_TARGET] = stringToMessageParam(args[2]);
+
+	struct timeval start, end;
+	gettimeofday(&start, NULL);
+	copyFile(&message);
+	pthread_join(thread, NULL);
+	gettimeofday(&end, NULL);
+
+	printf("%d in %.1fms\n", responseCode, (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_usec - start.tv_usec) / 1e3);
+	return responseCode != RAP_RESPOND_CREATED;
+}
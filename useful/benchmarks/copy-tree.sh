@@ -0,0 +1,69 @@
+#!/bin/bash
+# Times COPY of a tree of many small files and of a tree of a few huge ones, one of them sparse, and checks that the
+# copies match.  Run it from the top of the source tree:
+#
+#    useful/benchmarks/copy-tree.sh <scratch directory> [git revision to compare with]
+#
+# The scratch directory needs about 3G free and is where the trees are copied, so put it on the filesystem being
+# measured.  A second scratch directory can be given as COPY_TARGET to copy across filesystems.
+
+set -e
+
+scratch=${1:?Usage: $0 <scratch directory> [git revision]}
+revision=$2
+target=${COPY_TARGET:-$scratch}
+build="gcc -O2 -std=gnu99 -pthread -I. -I/usr/include/libxml2 -I/usr/include/postgresql $CFLAGS"
+libs="shared.c xml.c davxml.c url.c uring.c -lpam -lxml2 -lz -lpq -lgnutls $LDFLAGS"
+
+mkdir -p "$scratch/bin"
+$build -o "$scratch/bin/copy-tree-new" useful/benchmarks/copy-tree.c $libs
+builds=new
+if [ -n "$revision" ]; then
+	mkdir -p "$scratch/old"
+	git show "$revision:rap.c" > "$scratch/old/rap.c"
+	# Revisions from before the tree walk have no thread pool to start
+	walk=
+	grep -q initializeTreeWalk "$scratch/old/rap.c" || walk=-DNO_TREE_WALK
+	$build $walk -DRAP_SOURCE="\"$scratch/old/rap.c\"" -o "$scratch/bin/copy-tree-old" useful/benchmarks/copy-tree.c \
+			$libs
+	builds="old new"
+fi
+
+# 10,000 files of 4K in 100 directories
+if [ ! -d "$scratch/small" ]; then
+	for dir in $(seq 100); do
+		mkdir -p "$scratch/small/$dir"
+		for file in $(seq 100); do
+			head -c 4096 /dev/urandom > "$scratch/small/$dir/$file"
+		done
+	done
+fi
+
+# Two 300M files and a 2G file holding 20M of data
+if [ ! -d "$scratch/large" ]; then
+	mkdir -p "$scratch/large"
+	head -c 300M /dev/urandom > "$scratch/large/a"
+	head -c 300M /dev/urandom > "$scratch/large/b"
+	truncate -s 2G "$scratch/large/sparse"
+	for offset in 0 500 1000 1500 2040; do
+		head -c 4M /dev/urandom | dd of="$scratch/large/sparse" bs=1M seek=$offset conv=notrunc status=none
+	done
+fi
+
+# The builds take turns, and dirty pages are written out before each run, so no run pays for the writeback of the one
+# before it
+for tree in small large; do
+	for run in 1 2 3; do
+		for which in $builds; do
+			rm -rf "$target/$tree-copy"
+			sync
+			echo -n "$tree $which: "
+			"$scratch/bin/copy-tree-$which" "$scratch/$tree" "$target/$tree-copy"
+			if [ $run = 3 ]; then
+				diff -r "$scratch/$tree" "$target/$tree-copy"
+				echo "$tree $which: copy uses $(du -sh "$target/$tree-copy" | cut -f1) on disk"
+			fi
+		done
+	done
+	rm -rf "$target/$tree-copy"
+done
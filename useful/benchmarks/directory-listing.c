@@ -0,0 +1,74 @@
+// Times a depth 1 PROPFIND and an HTML listing of one directory as the RAP produces them, without the daemon or a
+// database.  The responses are written to files so that runs with different settings can be compared.
+//
+//    gcc -O2 -std=gnu99 -pthread -I/usr/include/libxml2 -I/usr/include/postgresql -o directory-listing \
+//        useful/benchmarks/directory-listing.c shared.c xml.c davxml.c url.c uring.c -lpam -lxml2 -lz -lpq -lgnutls
+//    WEBDAVD_STAT_THREADS=8 ./directory-listing <directory> <propfind output> <listing output> [repeats]
+
+#define main rapMain
+#include "../../rap.c"
+#undef main
+
+#include <sys/time.h>
+
+static int controlSockets[2];
+static const char * propFindOutput;
+
+// Stands in for the daemon, saving the body of the PROPFIND response
+static void * receivePropFind(void * unused) {
+	Message message;
+	char incomingBuffer[4096];
+	if (recvMessage(controlSockets[1], &message, incomingBuffer, sizeof(incomingBuffer)) <= 0) return NULL;
+	FILE * output = fopen(propFindOutput, "w");
+	char buffer[65536];
+	ssize_t bytesRead;
+	while ((bytesRead = read(message.fd, buffer, sizeof(buffer))) > 0) {
+		fwrite(buffer, 1, bytesRead, output);
+	}
+	fclose(output);
+	close(message.fd);
+	return NULL;
+}
+
+static double milliseconds() {
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return now.tv_sec * 1e3 + now.tv_usec / 1e3;
+}
+
+int main(int argCount, char ** args) {
+	if (argCount < 4) {
+		fprintf(stderr, "Usage: %s <directory> <propfind output> <listing output> [repeats]\n", args[0]);
+		return 1;
+	}
+	const char * directory = args[1];
+	propFindOutput = args[2];
+	int repeats = argCount > 4 ? atoi(args[4]) : 1;
+
+	initializeMimeTypes("/etc/mime.types");
+	initializeStatPool();
+	socketpair(PF_LOCAL, SOCK_SEQPACKET, 0, controlSockets);
+	dup2(controlSockets[0], RAP_CONTROL_SOCKET);
+
+	PropertySet properties;
+	memset(&properties, 1, sizeof(properties));
+	double start = milliseconds();
+	for (int i = 0; i < repeats; i++) {
+		pthread_t thread;
+		pthread_create(&thread, NULL, &receivePropFind, NULL);
+		PropertySet requested = properties;
+		respondToPropFind(directory, LOCK_TYPE_NONE, &requested, 2);
+		pthread_join(thread, NULL);
+	}
+	printf("PROPFIND depth 1 %.1fms\n", (milliseconds() - start) / repeats);
+
+	start = milliseconds();
+	for (int i = 0; i < repeats; i++) {
+		int dirFd = open(directory, O_RDONLY);
+		int output = open(args[3], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		listDir(directory, dirFd, output);
+		close(output);
+	}
+	printf("HTML listing     %.1fms\n", (milliseconds() - start) / repeats);
+	return 0;
+}
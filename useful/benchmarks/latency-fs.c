@@ -0,0 +1,211 @@
+// A read-only FUSE filesystem which serves the files of one flat directory, waiting a fixed time before answering
+// every LOOKUP and GETATTR.  It stands in for a network filesystem, where each stat is a round trip to the server.
+// It speaks the kernel's FUSE protocol itself so it needs no libfuse, but it must be run as root.
+//
+//    gcc -O2 -pthread -o latency-fs useful/benchmarks/latency-fs.c
+//    ./latency-fs <directory> <mount point> <delay in microseconds> &
+//
+// Unmount with umount <mount point>.
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fuse.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define SERVER_THREADS 32
+#define REQUEST_BUFFER_SIZE (1024 * 1024)
+#define READDIR_BUFFER_SIZE 65536
+
+// Node 1 is the directory itself and node n + 2 is names[n]
+static int fuseFd;
+static const char * backing;
+static int delay;
+static char ** names;
+static int nameCount;
+
+static void reply(uint64_t unique, int error, const void * data, size_t size) {
+	struct fuse_out_header header = { .len = sizeof(header) + (error ? 0 : size), .error = -error, .unique = unique };
+	struct iovec iov[2] = { { &header, sizeof(header) }, { (void *) data, error ? 0 : size } };
+	writev(fuseFd, iov, 2);
+}
+
+static int statNode(uint64_t node, struct stat * fileStat) {
+	if (node == 1) return stat(backing, fileStat);
+	if (node < 2 || node - 2 >= nameCount) return -1;
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%s", backing, names[node - 2]);
+	return stat(path, fileStat);
+}
+
+static void fillAttr(struct fuse_attr * attr, struct stat * fileStat, uint64_t node) {
+	memset(attr, 0, sizeof(*attr));
+	attr->ino = node;
+	attr->size = fileStat->st_size;
+	attr->blocks = fileStat->st_blocks;
+	attr->atime = fileStat->st_atime;
+	attr->mtime = fileStat->st_mtime;
+	attr->ctime = fileStat->st_ctime;
+	attr->mode = fileStat->st_mode;
+	attr->nlink = fileStat->st_nlink;
+	attr->blksize = 4096;
+}
+
+static void lookup(struct fuse_in_header * in, const char * name) {
+	usleep(delay);
+	int i = 0;
+	while (i < nameCount && strcmp(names[i], name)) i++;
+	struct stat fileStat;
+	if (in->nodeid != 1 || i == nameCount || statNode(i + 2, &fileStat)) {
+		reply(in->unique, ENOENT, NULL, 0);
+		return;
+	}
+	// Names aren't cached so every stat of a name comes back here, but the attributes it returns are good for a second
+	struct fuse_entry_out out = { .nodeid = i + 2, .generation = 1, .attr_valid = 1 };
+	fillAttr(&out.attr, &fileStat, i + 2);
+	reply(in->unique, 0, &out, sizeof(out));
+}
+
+static void getAttr(struct fuse_in_header * in) {
+	usleep(delay);
+	struct stat fileStat;
+	if (statNode(in->nodeid, &fileStat)) {
+		reply(in->unique, ENOENT, NULL, 0);
+		return;
+	}
+	struct fuse_attr_out out = { .attr_valid = 1 };
+	fillAttr(&out.attr, &fileStat, in->nodeid);
+	reply(in->unique, 0, &out, sizeof(out));
+}
+
+static void readDir(struct fuse_in_header * in, struct fuse_read_in * read) {
+	char out[READDIR_BUFFER_SIZE];
+	size_t used = 0;
+	size_t max = read->size < sizeof(out) ? read->size : sizeof(out);
+	for (uint64_t offset = read->offset; offset < nameCount + 2; offset++) {
+		const char * name = offset == 0 ? "." : offset == 1 ? ".." : names[offset - 2];
+		size_t nameSize = strlen(name);
+		size_t recordSize = FUSE_DIRENT_ALIGN(FUSE_NAME_OFFSET + nameSize);
+		if (used + recordSize > max) break;
+		struct fuse_dirent * entry = (struct fuse_dirent *) (out + used);
+		memset(entry, 0, recordSize);
+		entry->ino = offset < 2 ? 1 : offset;
+		entry->off = offset + 1;
+		entry->namelen = nameSize;
+		entry->type = offset < 2 ? DT_DIR : DT_REG;
+		memcpy(entry->name, name, nameSize);
+		used += recordSize;
+	}
+	reply(in->unique, 0, out, used);
+}
+
+static void * serve(void * unused) {
+	char * buffer = malloc(REQUEST_BUFFER_SIZE);
+	for (;;) {
+		ssize_t size = read(fuseFd, buffer, REQUEST_BUFFER_SIZE);
+		if (size < 0) {
+			// ENODEV once it has been unmounted
+			if (errno == ENODEV) exit(0);
+			continue;
+		}
+		struct fuse_in_header * in = (struct fuse_in_header *) buffer;
+		void * arg = buffer + sizeof(*in);
+		switch (in->opcode) {
+		case FUSE_INIT: {
+			struct fuse_init_in * init = arg;
+			struct fuse_init_out out = { .major = FUSE_KERNEL_VERSION,
+					.minor = init->minor < FUSE_KERNEL_MINOR_VERSION ? init->minor : FUSE_KERNEL_MINOR_VERSION,
+					.max_readahead = init->max_readahead, .max_write = 65536, .max_background = 16,
+					.congestion_threshold = 12 };
+			reply(in->unique, 0, &out, sizeof(out));
+			break;
+		}
+		case FUSE_LOOKUP:
+			lookup(in, arg);
+			break;
+		case FUSE_GETATTR:
+			getAttr(in);
+			break;
+		case FUSE_OPEN:
+		case FUSE_OPENDIR: {
+			struct fuse_open_out out = { 0 };
+			reply(in->unique, 0, &out, sizeof(out));
+			break;
+		}
+		case FUSE_READDIR:
+			readDir(in, arg);
+			break;
+		case FUSE_STATFS: {
+			struct fuse_statfs_out out = { .st = { .bsize = 4096, .namelen = 255, .frsize = 4096 } };
+			reply(in->unique, 0, &out, sizeof(out));
+			break;
+		}
+		case FUSE_RELEASE:
+		case FUSE_RELEASEDIR:
+		case FUSE_FLUSH:
+		case FUSE_DESTROY:
+			reply(in->unique, 0, NULL, 0);
+			break;
+		case FUSE_FORGET:
+		case FUSE_BATCH_FORGET:
+			break;
+		default:
+			reply(in->unique, ENOSYS, NULL, 0);
+		}
+	}
+	return NULL;
+}
+
+static int compareNames(const void * a, const void * b) {
+	return strcmp(*(char **) a, *(char **) b);
+}
+
+int main(int argCount, char ** args) {
+	if (argCount != 4) {
+		fprintf(stderr, "Usage: %s <directory> <mount point> <delay in microseconds>\n", args[0]);
+		return 1;
+	}
+	backing = args[1];
+	delay = atoi(args[3]);
+
+	DIR * dir = opendir(backing);
+	if (!dir) {
+		perror(backing);
+		return 1;
+	}
+	struct dirent * dp;
+	while ((dp = readdir(dir)) != NULL) {
+		if (dp->d_name[0] == '.') continue;
+		names = realloc(names, sizeof(*names) * (nameCount + 1));
+		names[nameCount++] = strdup(dp->d_name);
+	}
+	closedir(dir);
+	qsort(names, nameCount, sizeof(*names), &compareNames);
+
+	fuseFd = open("/dev/fuse", O_RDWR);
+	if (fuseFd == -1) {
+		perror("/dev/fuse");
+		return 1;
+	}
+	char options[128];
+	snprintf(options, sizeof(options), "fd=%d,rootmode=40000,user_id=0,group_id=0,allow_other", fuseFd);
+	if (mount("latency-fs", args[2], "fuse.latency-fs", MS_NODEV | MS_NOSUID, options)) {
+		perror("mount");
+		return 1;
+	}
+
+	pthread_t thread;
+	for (int i = 1; i < SERVER_THREADS; i++) {
+		pthread_create(&thread, NULL, &serve, NULL);
+	}
+	serve(NULL);
+	return 0;
+}
@@ -0,0 +1,71 @@
+#ifndef WEBDAV_NEON_EMULATION_H
+#define WEBDAV_NEON_EMULATION_H
+
+// Plain C versions of the few NEON intrinsics url.c uses, so that its NEON codec can be checked on a machine without
+// NEON.  They follow the ARM definitions lane for lane on a little endian machine.  Speed means nothing here.
+
+#include <stdint.h>
+#include <string.h>
+
+typedef struct { uint8_t lane[16]; } uint8x16_t;
+typedef struct { uint16_t lane[8]; } uint16x8_t;
+typedef struct { uint8_t lane[8]; } uint8x8_t;
+typedef struct { uint64_t lane[1]; } uint64x1_t;
+
+static inline uint8x16_t vld1q_u8(const uint8_t * source) {
+	uint8x16_t result;
+	memcpy(result.lane, source, 16);
+	return result;
+}
+
+static inline void vst1q_u8(uint8_t * target, uint8x16_t value) {
+	memcpy(target, value.lane, 16);
+}
+
+static inline uint8x16_t vdupq_n_u8(uint8_t value) {
+	uint8x16_t result;
+	memset(result.lane, value, 16);
+	return result;
+}
+
+#define NEON_EMULATION_LANEWISE(name, expression) \
+	static inline uint8x16_t name(uint8x16_t a, uint8x16_t b) { \
+		uint8x16_t result; \
+		for (int i = 0; i < 16; i++) result.lane[i] = (expression); \
+		return result; \
+	}
+
+NEON_EMULATION_LANEWISE(vcgeq_u8, a.lane[i] >= b.lane[i] ? 0xFF : 0)
+NEON_EMULATION_LANEWISE(vcleq_u8, a.lane[i] <= b.lane[i] ? 0xFF : 0)
+NEON_EMULATION_LANEWISE(vceqq_u8, a.lane[i] == b.lane[i] ? 0xFF : 0)
+NEON_EMULATION_LANEWISE(vandq_u8, a.lane[i] & b.lane[i])
+NEON_EMULATION_LANEWISE(vorrq_u8, a.lane[i] | b.lane[i])
+
+static inline uint8x16_t vmvnq_u8(uint8x16_t a) {
+	for (int i = 0; i < 16; i++) a.lane[i] = ~a.lane[i];
+	return a;
+}
+
+static inline uint16x8_t vreinterpretq_u16_u8(uint8x16_t a) {
+	uint16x8_t result;
+	memcpy(result.lane, a.lane, 16);
+	return result;
+}
+
+// Shift each 16 bit lane right and keep its low 8 bits
+#define vshrn_n_u16(a, n) neonEmulationShiftNarrow((a), (n))
+static inline uint8x8_t neonEmulationShiftNarrow(uint16x8_t a, int n) {
+	uint8x8_t result;
+	for (int i = 0; i < 8; i++) result.lane[i] = (uint8_t) (a.lane[i] >> n);
+	return result;
+}
+
+static inline uint64x1_t vreinterpret_u64_u8(uint8x8_t a) {
+	uint64x1_t result;
+	memcpy(result.lane, a.lane, 8);
+	return result;
+}
+
+#define vget_lane_u64(a, n) ((a).lane[n])
+
+#endif
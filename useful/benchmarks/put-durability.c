@@ -0,0 +1,143 @@
+// Times PUT under each <put-durability> mode, without the daemon or a database: first 500 files of 4K, then four of
+// 256M.  For the large files it also samples Dirty in /proc/meminfo to show how much is left for the kernel to write.
+//
+//    gcc -O2 -std=gnu99 -pthread -I. -I/usr/include/libxml2 -I/usr/include/postgresql -o put-durability
+//        useful/benchmarks/put-durability.c shared.c xml.c davxml.c url.c uring.c -lpam -lxml2 -lz -lpq -lgnutls
+//    ./put-durability <empty directory on the filesystem to measure>
+
+#define main rapMain
+#include "../../rap.c"
+#undef main
+
+#include <sys/time.h>
+
+#define SMALL_FILE_COUNT 500
+#define SMALL_FILE_SIZE 4096
+#define LARGE_FILE_COUNT 4
+#define LARGE_FILE_SIZE (256 * 1024 * 1024)
+
+static const char * MODE_NAMES[] = { "none", "close-sync", "write-behind" };
+
+static char data[1024 * 1024];
+static size_t bodySize;
+static int bodyFd;
+static volatile int sampling;
+static long peakDirty;
+
+// Stands in for the client
+static void * sendBody(void * unused) {
+	size_t sent = 0;
+	while (sent < bodySize) {
+		size_t size = bodySize - sent < sizeof(data) ? bodySize - sent : sizeof(data);
+		if (write(bodyFd, data, size) <= 0) break;
+		sent += size;
+	}
+	close(bodyFd);
+	return NULL;
+}
+
+// Stands in for the daemon
+static void * receiveResponses(void * controlSocket) {
+	Message message;
+	char incomingBuffer[65536];
+	while (recvMessage(*((int *) controlSocket), &message, incomingBuffer, sizeof(incomingBuffer)) > 0) {
+		if (message.fd != -1) close(message.fd);
+	}
+	return NULL;
+}
+
+static long dirtyKilobytes() {
+	FILE * meminfo = fopen("/proc/meminfo", "r");
+	char line[256];
+	long dirty = 0;
+	while (fgets(line, sizeof(line), meminfo)) {
+		if (!strncmp(line, "Dirty:", 6)) dirty = atol(line + 6);
+	}
+	fclose(meminfo);
+	return dirty;
+}
+
+static void * sampleDirty(void * unused) {
+	while (sampling) {
+		long dirty = dirtyKilobytes();
+		if (dirty > peakDirty) peakDirty = dirty;
+		usleep(20000);
+	}
+	return NULL;
+}
+
+static double milliseconds() {
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return now.tv_sec * 1e3 + now.tv_usec / 1e3;
+}
+
+static double put(const char * file, size_t size) {
+	int pipeEnds[2];
+	pipe(pipeEnds);
+	bodyFd = pipeEnds[PIPE_WRITE];
+	bodySize = size;
+	pthread_t thread;
+	pthread_create(&thread, NULL, &sendBody, NULL);
+
+	LockProvisions locks = { 0 };
+	Message message = { .mID = RAP_REQUEST_PUT, .fd = pipeEnds[PIPE_READ], .paramCount = 2 };
+	message.params[RAP_PARAM_REQUEST_LOCK] = toMessageParam(locks);
+	message.params[RAP_PARAM_REQUEST_FILE] = stringToMessageParam(file);
+	double start = milliseconds();
+	writeFile(&message);
+	double time = milliseconds() - start;
+	pthread_join(thread, NULL);
+	return time;
+}
+
+int main(int argCount, char ** args) {
+	if (argCount != 2) {
+		fprintf(stderr, "Usage: %s <empty directory>\n", args[0]);
+		return 1;
+	}
+	const char * directory = args[1];
+	int controlSockets[2];
+	socketpair(PF_LOCAL, SOCK_SEQPACKET, 0, controlSockets);
+	dup2(controlSockets[0], RAP_CONTROL_SOCKET);
+	pthread_t thread;
+	pthread_create(&thread, NULL, &receiveResponses, &controlSockets[1]);
+	memset(data, 'z', sizeof(data));
+
+	char file[PATH_MAX];
+	for (putDurability = PUT_DURABILITY_NONE; putDurability <= PUT_DURABILITY_WRITE_BEHIND; putDurability++) {
+		sync();
+		double total = 0;
+		for (int i = 0; i < SMALL_FILE_COUNT; i++) {
+			snprintf(file, sizeof(file), "%s/small-%d", directory, i);
+			total += put(file, SMALL_FILE_SIZE);
+		}
+		printf("%-12s %4d x 4K    %6.0f files/s  mean %.2fms\n", MODE_NAMES[putDurability], SMALL_FILE_COUNT,
+				SMALL_FILE_COUNT / (total / 1000), total / SMALL_FILE_COUNT);
+
+		sync();
+		sampling = 1;
+		peakDirty = 0;
+		pthread_t sampler;
+		pthread_create(&sampler, NULL, &sampleDirty, NULL);
+		total = 0;
+		for (int i = 0; i < LARGE_FILE_COUNT; i++) {
+			snprintf(file, sizeof(file), "%s/large-%d", directory, i);
+			total += put(file, LARGE_FILE_SIZE);
+		}
+		sampling = 0;
+		pthread_join(sampler, NULL);
+		printf("%-12s %4d x 256M  %6.0f MB/s     peak dirty %ldM\n", MODE_NAMES[putDurability], LARGE_FILE_COUNT,
+				LARGE_FILE_COUNT * 256 / (total / 1000), peakDirty / 1024);
+
+		for (int i = 0; i < SMALL_FILE_COUNT; i++) {
+			snprintf(file, sizeof(file), "%s/small-%d", directory, i);
+			unlink(file);
+		}
+		for (int i = 0; i < LARGE_FILE_COUNT; i++) {
+			snprintf(file, sizeof(file), "%s/large-%d", directory, i);
+			unlink(file);
+		}
+	}
+	return 0;
+}
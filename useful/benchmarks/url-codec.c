@@ -0,0 +1,196 @@
+// Checks every URL codec in url.c against the encoder and decoder it replaced, then times them.  On x86 the NEON
+// codec is built on top of neon-emulation.h so that its logic is checked too (its timings mean nothing there).
+//
+//    gcc -O2 -std=gnu99 -o url-codec useful/benchmarks/url-codec.c && ./url-codec
+//
+// Add -fsanitize=address to catch reads or writes outside the buffers.
+
+#if !defined(__aarch64__)
+#include "neon-emulation.h"
+#define URL_NEON
+#endif
+
+#include "../../url.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define FUZZ_ROUNDS 2000000
+#define TIMING_ROUNDS 5000000
+
+// The decoder parseHeaderFilePath() used before url.c
+static size_t oldDecode(char * resultBuffer, size_t urlLength, const char * url) {
+	size_t read = 0;
+	size_t write = 0;
+	while (read < urlLength) {
+		if (url[read] != '%' || read >= urlLength - 2) {
+			resultBuffer[write++] = url[read++];
+		} else {
+			unsigned char c;
+			unsigned char c1 = url[read + 1];
+			if (c1 >= '0' && c1 <= '9') c = ((c1 - '0') << 4);
+			else if (c1 >= 'a' && c1 <= 'f') c = ((c1 - 'a' + 10) << 4);
+			else if (c1 >= 'A' && c1 <= 'F') c = ((c1 - 'A' + 10) << 4);
+			else {
+				resultBuffer[write++] = url[read++];
+				continue;
+			}
+
+			c1 = url[read + 2];
+			if (c1 >= '0' && c1 <= '9') c |= c1 - '0';
+			else if (c1 >= 'a' && c1 <= 'f') c |= c1 - 'a' + 10;
+			else if (c1 >= 'A' && c1 <= 'F') c |= c1 - 'A' + 10;
+			else {
+				resultBuffer[write++] = url[read++];
+				continue;
+			}
+
+			resultBuffer[write++] = c;
+			read += 3;
+		}
+	}
+	resultBuffer[write] = '\0';
+	return write;
+}
+
+// The encoder xmlTextWriterWriteURL() used before url.c
+static size_t oldEncode(char * buffer, const char * url) {
+	const char * urlPtr = url;
+	char * writePtr = buffer;
+	unsigned char c;
+	while ((c = *(urlPtr++))) {
+		if ((c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '-' || c == '_'
+				|| c == '.' || c == '~' || c == '/') {
+			*(writePtr++) = c;
+		} else {
+			static const char * lookup = "0123456789ABCDEF";
+			*(writePtr++) = '%';
+			*(writePtr++) = lookup[(c & 0xF0) >> 4];
+			*(writePtr++) = lookup[c & 0x0F];
+		}
+	}
+	*writePtr = '\0';
+	return writePtr - buffer;
+}
+
+static const UrlCodec * CODECS[] = { &SCALAR_CODEC,
+#ifdef URL_X86
+		&SSE2_CODEC, &AVX2_CODEC,
+#endif
+		&NEON_CODEC };
+
+#define CODEC_COUNT (sizeof(CODECS) / sizeof(*CODECS))
+
+static int codecRuns(const UrlCodec * c) {
+#ifdef URL_X86
+	__builtin_cpu_init();
+	if (c == &AVX2_CODEC) return __builtin_cpu_supports("avx2");
+#endif
+	return 1;
+}
+
+// Mostly safe characters with runs of escapes, stray '%' and bytes over 0x7F
+static size_t randomUrl(char * url, size_t maxSize) {
+	static const char common[] = "abcXYZ09-_.~/ ";
+	size_t size = rand() % maxSize;
+	for (size_t i = 0; i < size; i++) {
+		int r = rand() % 20;
+		if (r == 0) url[i] = '%';
+		else if (r == 1) url[i] = 1 + rand() % 255;
+		else if (r < 4) url[i] = "0aF9g/"[rand() % 6];
+		else url[i] = common[rand() % (sizeof(common) - 1)];
+	}
+	url[size] = '\0';
+	return size;
+}
+
+static int checkCodecs() {
+	char url[300];
+	char encoded[URL_ENCODED_SIZE(sizeof(url))];
+	char decoded[sizeof(url)];
+	char actual[URL_ENCODED_SIZE(sizeof(url)) + 32];
+	srand(1);
+	for (int round = 0; round < FUZZ_ROUNDS; round++) {
+		size_t size = randomUrl(url, 200);
+		size_t encodedSize = oldEncode(encoded, url);
+		size_t decodedSize = size < 2 ? 0 : oldDecode(decoded, size, url);
+		for (int i = 0; i < CODEC_COUNT; i++) {
+			if (!codecRuns(CODECS[i])) continue;
+			size_t actualSize = CODECS[i]->encode(actual, url, url + size);
+			if (actualSize != encodedSize || strcmp(encoded, actual)) {
+				printf("%s encode differs for \"%s\"\n", CODECS[i]->name, url);
+				return 0;
+			}
+			// The old decoder can't take less than two bytes
+			if (size < 2) continue;
+			actualSize = CODECS[i]->decode(actual, url, url + size);
+			if (actualSize != decodedSize || memcmp(decoded, actual, decodedSize + 1)) {
+				printf("%s decode differs for \"%s\"\n", CODECS[i]->name, url);
+				return 0;
+			}
+		}
+	}
+	return 1;
+}
+
+static double nanoseconds() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1e9 + now.tv_nsec;
+}
+
+#define TIME_CALLS(result, call) do { \
+		double start = nanoseconds(); \
+		for (int round = 0; round < TIMING_ROUNDS; round++) { \
+			call; \
+			__asm__ volatile("" : : "r"(target) : "memory"); \
+		} \
+		result = (nanoseconds() - start) / TIMING_ROUNDS; \
+	} while (0)
+
+static void timeCodecs() {
+	static const char * encodeSamples[] = { "/home/alice/Documents/Projects/webdav-daemon/src/configuration.c",
+			"/home/alice/Photos/2019/Summer Holiday/IMG_0042 (copy).JPG", "/short" };
+	static const char * decodeSamples[] = { "/home/alice/Documents/Projects/webdav-daemon/src/configuration.c",
+			"/home/alice/Photos/2019/Summer%20Holiday/IMG_0042%20%28copy%29.JPG" };
+	char target[URL_ENCODED_SIZE(100) + 32];
+	double time;
+
+	for (int s = 0; s < sizeof(encodeSamples) / sizeof(*encodeSamples); s++) {
+		const char * url = encodeSamples[s];
+		size_t size = strlen(url);
+		TIME_CALLS(time, oldEncode(target, url));
+		printf("encode %2zu bytes  old %5.1fns", size, time);
+		for (int i = 0; i < CODEC_COUNT; i++) {
+			if (!codecRuns(CODECS[i])) continue;
+			codec = CODECS[i];
+			TIME_CALLS(time, urlEncode(target, url, size));
+			printf("  %s %5.1fns", CODECS[i]->name, time);
+		}
+		printf("\n");
+	}
+
+	for (int s = 0; s < sizeof(decodeSamples) / sizeof(*decodeSamples); s++) {
+		const char * url = decodeSamples[s];
+		size_t size = strlen(url);
+		TIME_CALLS(time, oldDecode(target, size, url));
+		printf("decode %2zu bytes  old %5.1fns", size, time);
+		for (int i = 0; i < CODEC_COUNT; i++) {
+			if (!codecRuns(CODECS[i])) continue;
+			codec = CODECS[i];
+			TIME_CALLS(time, urlDecode(target, url, size));
+			printf("  %s %5.1fns", CODECS[i]->name, time);
+		}
+		printf("\n");
+	}
+}
+
+int main() {
+	codec = NULL;
+	printf("Codec picked for this CPU: %s\n", getCodec()->name);
+	if (!checkCodecs()) return 1;
+	printf("All codecs match the old encoder and decoder on %d random paths\n", FUZZ_ROUNDS);
+	timeCodecs();
+	return 0;
+}
@@ -1,7 +1,11 @@
 // TODO accept suggested timeout values from clients during LOCK requests
 
+#define _GNU_SOURCE
+
 #include "shared.h"
 #include "configuration.h"
+#include "compression.h"
+#include "url.h"
 
 #include <errno.h>
 #include <fcntl.h>
@@ -12,6 +16,9 @@
 #include <semaphore.h>
 #include <string.h>
 #include <stdio.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
@@ -20,6 +27,7 @@
 #include <unistd.h>
 #include <uuid/uuid.h>
 #include <inttypes.h>
+#include <limits.h>
 
 ////////////////
 // Structures //
@@ -65,6 +73,11 @@ typedef struct RAP {
 	int requestLockCount;
 	Lock * requestLock[MAX_SESSION_LOCKS];
 
+	// A PROPFIND body held back until it has all arrived, see holdPropFind()
+	int requestHeldBodyFd;
+	const char * requestHeldUrl;
+	LockProvisions requestHeldLocks;
+
 } RAP;
 
 typedef struct RapList {
@@ -85,12 +98,42 @@ typedef struct SSLCertificate {
 
 typedef struct FDResponseData {
 	int fd;
-	off_t pos;
 	off_t offset;
 	off_t size;
 	RAP * session;
+
+	// Pipes are read in order rather than with pread()
+	int stream;
+
+	// Page cache policy for large files, see applyReadPolicy()
+	int sequential;
+	int dropBehind;
+	off_t prefetchedTo;
+	off_t droppedTo;
+	off_t readTo;
 } FDResponseData;
 
+typedef struct ByteRange {
+	off_t start;
+	off_t end; // inclusive
+} ByteRange;
+
+typedef struct ByteRangePart {
+	off_t responseOffset;
+	off_t fileOffset;
+	off_t size;
+	const char * text; // NULL for parts served from the file
+} ByteRangePart;
+
+typedef struct MultipartResponseData {
+	int fd;
+	int partCount;
+	int currentPart;
+	ByteRangePart * parts;
+	char * partText;
+	RAP * session;
+} MultipartResponseData;
+
 ////////////////////
 // End Structures //
 ////////////////////
@@ -102,6 +145,7 @@ static const RAP AUTH_FAILED_RAP = {
 		.user = "<auth failed>",
 		.requestWriteDataFd = -1,
 		.requestReadDataFd = -1,
+		.requestHeldBodyFd = -1,
 		.requestResponseAlreadyGiven = 401,
 		.requestLockCount = 0,
 		.next = NULL,
@@ -114,17 +158,33 @@ static const RAP AUTH_ERROR_RAP = {
 		.user = "<auth error>",
 		.requestWriteDataFd = -1,
 		.requestReadDataFd = -1,
+		.requestHeldBodyFd = -1,
 		.requestResponseAlreadyGiven = 500,
 		.requestLockCount = 0,
 		.next = NULL,
 		.prevPtr = NULL };
 
+// Used as a place holder for requests which were answered before their body was read.  The RAP has already gone back
+// to the pool (or been destroyed) by the time any of the body arrives.
+static const RAP REQUEST_ANSWERED_RAP = {
+		.pid = 0,
+		.socketFd = -1,
+		.user = "<request answered>",
+		.requestWriteDataFd = -1,
+		.requestReadDataFd = -1,
+		.requestHeldBodyFd = -1,
+		.requestResponseAlreadyGiven = 0,
+		.requestLockCount = 0,
+		.next = NULL,
+		.prevPtr = NULL };
+
 static pthread_key_t rapDBThreadKey;
 static sem_t rapPoolLock;
 static RapList rapPool;
 
 #define AUTH_FAILED ( ( RAP *) &AUTH_FAILED_RAP )
 #define AUTH_ERROR ( ( RAP *) &AUTH_ERROR_RAP )
+#define REQUEST_ANSWERED ( ( RAP *) &REQUEST_ANSWERED_RAP )
 
 #define AUTH_SUCCESS(rap) (rap != AUTH_FAILED && rap != AUTH_ERROR)
 
@@ -135,7 +195,8 @@ static Lock ** readyForRelease;
 // TODO create shutdown routine
 static int shuttingDown = 0;
 
-#define ACCEPT_HEADER "OPTIONS, GET, HEAD, DELETE, PROPFIND, PUT, PROPPATCH, COPY, MOVE, LOCK, UNLOCK"
+#define ACCEPT_HEADER "OPTIONS, GET, HEAD, DELETE, PROPFIND, PUT, PATCH, POST, PROPPATCH, REPORT, COPY, MOVE, LOCK, UNLOCK"
+#define AUTHENTICATE_HEADER "Basic realm=\"My Server\""
 
 static Response * INTERNAL_SERVER_ERROR_PAGE;
 static Response * UNAUTHORIZED_PAGE;
@@ -313,37 +374,7 @@ static void parseHeaderFilePath(char * resultBuffer, size_t urlLength, const cha
 		urlLength -= start;
 	}
 
-	// Decode the % encoded characters
-	size_t read = 0;
-	size_t write = 0;
-	while (read < urlLength) {
-		if (url[read] != '%' || read >= urlLength - 2) {
-			resultBuffer[write++] = url[read++];
-		} else {
-			unsigned char c;
-			unsigned char c1 = url[read + 1];
-			if (c1 >= '0' && c1 <= '9') c = ((c1 - '0') << 4);
-			else if (c1 >= 'a' && c1 <= 'f') c = ((c1 - 'a' + 10) << 4);
-			else if (c1 >= 'A' && c1 <= 'F') c = ((c1 - 'A' + 10) << 4);
-			else {
-				resultBuffer[write++] = url[read++];
-				continue;
-			}
-
-			c1 = url[read + 2];
-			if (c1 >= '0' && c1 <= '9') c |= c1 - '0';
-			else if (c1 >= 'a' && c1 <= 'f') c |= c1 - 'a' + 10;
-			else if (c1 >= 'A' && c1 <= 'F') c |= c1 - 'A' + 10;
-			else {
-				resultBuffer[write++] = url[read++];
-				continue;
-			}
-
-			resultBuffer[write++] = c;
-			read += 3;
-		}
-	}
-	resultBuffer[write] = '\0';
+	urlDecode(resultBuffer, url, urlLength);
 }
 
 /////////////////
@@ -459,6 +490,10 @@ static void destroyRap(RAP * rapSession) {
 		stdLogError(0, "writeDataFd was not properly closed before destroying rap");
 		close(rapSession->requestWriteDataFd);
 	}
+	if (rapSession->requestHeldBodyFd != -1) {
+		close(rapSession->requestHeldBodyFd);
+		freeSafe((void *) rapSession->requestHeldUrl);
+	}
 
 	freeSafe((void *) rapSession->user);
 	freeSafe((void *) rapSession->password);
@@ -520,6 +555,7 @@ static RAP * createRap(RapList * db, const char * user, const char * password, c
 	time(&newRap->rapCreated);
 	newRap->requestWriteDataFd = -1;
 	newRap->requestReadDataFd = -1;
+	newRap->requestHeldBodyFd = -1;
 	addRapToList(db, newRap);
 	// newRap->responseAlreadyGiven // this is set elsewhere
 	return newRap;
@@ -628,6 +664,10 @@ static void runCleanRapPool() {
 			RAP * next = rap->next;
 			if (rap->rapCreated < expires) {
 				destroyRap(rap);
+			} else {
+				// Idle RAPs remove abandoned chunked uploads on their user's behalf
+				Message message = { .mID = RAP_REQUEST_CLEAN_UPLOADS, .fd = -1, .paramCount = 0 };
+				sendMessage(rap->socketFd, &message);
 			}
 			rap = next;
 		}
@@ -1155,65 +1195,139 @@ static void addHeader(Response * response, const char * headerKey, const char *
 	}
 }
 
-static ssize_t fdContentReader(void *cls, uint64_t pos, char *buf, size_t max) {
-	FDResponseData * fdResponsedata = cls;
-	if (pos != fdResponsedata->pos) {
-		off_t seekTo = pos + fdResponsedata->offset;
-		off_t result = lseek(fdResponsedata->fd, pos + fdResponsedata->offset, SEEK_SET);
-		if (result != seekTo) {
-			stdLogError(errno, "Could not file seek for response");
-			return MHD_CONTENT_READER_END_WITH_ERROR;
-		} else {
-			fdResponsedata->pos = seekTo;
+// Big files streamed to one client would otherwise fill the page cache and evict everyone else's small hot
+// files.  So files over sequentialReadSize are prefetched well ahead of the reader and files over
+// dropBehindSize have pages dropped from the cache once they have been sent.
+static void applyReadPolicy(FDResponseData * fdResponseData) {
+	if (fdResponseData->sequential) {
+		off_t end = fdResponseData->offset + fdResponseData->size;
+		if (fdResponseData->prefetchedTo < end
+				&& fdResponseData->prefetchedTo - fdResponseData->readTo < (off_t) config.readaheadSize / 2) {
+			off_t length = end - fdResponseData->prefetchedTo;
+			if (length > (off_t) config.readaheadSize) {
+				length = config.readaheadSize;
+			}
+			posix_fadvise(fdResponseData->fd, fdResponseData->prefetchedTo, length, POSIX_FADV_WILLNEED);
+			fdResponseData->prefetchedTo += length;
 		}
 	}
-	if (fdResponsedata->size > 0 && fdResponsedata->size - pos < max) {
-		max = fdResponsedata->size - pos;
+	if (fdResponseData->dropBehind
+			&& fdResponseData->readTo - fdResponseData->droppedTo >= (off_t) config.readaheadSize) {
+		posix_fadvise(fdResponseData->fd, fdResponseData->droppedTo,
+				fdResponseData->readTo - fdResponseData->droppedTo, POSIX_FADV_DONTNEED);
+		fdResponseData->droppedTo = fdResponseData->readTo;
 	}
+}
 
-	size_t bytesRead = read(fdResponsedata->fd, buf, max);
-	if (bytesRead <= 0) {
-		if (bytesRead == 0) {
-			return MHD_CONTENT_READER_END_OF_STREAM;
-		} else {
-			stdLogError(errno, "Could not read content from fd");
-			return MHD_CONTENT_READER_END_WITH_ERROR;
+static void initializeReadPolicy(FDResponseData * fdResponseData) {
+	fdResponseData->sequential = fdResponseData->size >= (off_t) config.sequentialReadSize;
+	fdResponseData->dropBehind = fdResponseData->size >= (off_t) config.dropBehindSize;
+	fdResponseData->prefetchedTo = fdResponseData->offset;
+	fdResponseData->droppedTo = fdResponseData->offset;
+	fdResponseData->readTo = fdResponseData->offset;
+	if (fdResponseData->sequential) {
+		posix_fadvise(fdResponseData->fd, fdResponseData->offset, fdResponseData->size, POSIX_FADV_SEQUENTIAL);
+		applyReadPolicy(fdResponseData);
+	}
+}
+
+// MHD hands us buffers of this size.  Small files only need a buffer big enough for the whole file, large files
+// get bigger buffers so they are read with fewer, larger reads.
+static size_t responseBlockSize(uint64_t size) {
+	size_t blockSize;
+	if (size == MHD_SIZE_UNKNOWN || size < config.sequentialReadSize) {
+		blockSize = BUFFER_SIZE;
+		if (size < blockSize) {
+			blockSize = size < 4096 ? 4096 : size;
 		}
+	} else {
+		blockSize = config.maxReadBufferSize;
 	}
-	while (bytesRead < max) {
-		size_t newBytesRead = read(fdResponsedata->fd, buf + bytesRead, max - bytesRead);
-		if (newBytesRead <= 0) {
-			break;
+	return blockSize;
+}
+
+static ssize_t fdContentReader(void *cls, uint64_t pos, char *buf, size_t max) {
+	FDResponseData * fdResponsedata = cls;
+	ssize_t bytesRead;
+	if (fdResponsedata->size >= 0 && !fdResponsedata->stream) {
+		// Files are read with pread() so there's no file position to keep in step with MHD's pos
+		if (pos >= fdResponsedata->size) {
+			return MHD_CONTENT_READER_END_OF_STREAM;
+		}
+		if (fdResponsedata->size - pos < max) {
+			max = fdResponsedata->size - pos;
+		}
+		off_t filePos = pos + fdResponsedata->offset;
+		bytesRead = pread(fdResponsedata->fd, buf, max, filePos);
+		if (bytesRead <= 0) {
+			if (bytesRead == 0) {
+				return MHD_CONTENT_READER_END_OF_STREAM;
+			} else {
+				stdLogError(errno, "Could not read content from fd");
+				return MHD_CONTENT_READER_END_WITH_ERROR;
+			}
+		}
+		while (bytesRead < max) {
+			ssize_t newBytesRead = pread(fdResponsedata->fd, buf + bytesRead, max - bytesRead,
+					filePos + bytesRead);
+			if (newBytesRead <= 0) {
+				break;
+			}
+			bytesRead += newBytesRead;
+		}
+		fdResponsedata->readTo = filePos + bytesRead;
+		applyReadPolicy(fdResponsedata);
+	} else {
+		// A range of a pipe starts by reading past everything before it
+		while (fdResponsedata->offset > 0) {
+			bytesRead = read(fdResponsedata->fd, buf, fdResponsedata->offset < max ? fdResponsedata->offset : max);
+			if (bytesRead <= 0) {
+				stdLogError(bytesRead < 0 ? errno : 0, "Could not skip to range in fd");
+				return MHD_CONTENT_READER_END_WITH_ERROR;
+			}
+			fdResponsedata->offset -= bytesRead;
+		}
+		if (fdResponsedata->size >= 0) {
+			if (pos >= fdResponsedata->size) {
+				return MHD_CONTENT_READER_END_OF_STREAM;
+			}
+			if (fdResponsedata->size - pos < max) {
+				max = fdResponsedata->size - pos;
+			}
+		}
+		bytesRead = read(fdResponsedata->fd, buf, max);
+		if (bytesRead <= 0) {
+			if (bytesRead == 0) {
+				return MHD_CONTENT_READER_END_OF_STREAM;
+			} else {
+				stdLogError(errno, "Could not read content from fd");
+				return MHD_CONTENT_READER_END_WITH_ERROR;
+			}
+		}
+		while (bytesRead < max) {
+			ssize_t newBytesRead = read(fdResponsedata->fd, buf + bytesRead, max - bytesRead);
+			if (newBytesRead <= 0) {
+				break;
+			}
+			bytesRead += newBytesRead;
 		}
-		bytesRead += newBytesRead;
 	}
-	fdResponsedata->pos += bytesRead;
 	return bytesRead;
 }
 
 static void fdContentReaderCleanup(void *cls) {
 	FDResponseData * fdResponseData = cls;
+	if (fdResponseData->dropBehind && fdResponseData->readTo > fdResponseData->droppedTo) {
+		posix_fadvise(fdResponseData->fd, fdResponseData->droppedTo,
+				fdResponseData->readTo - fdResponseData->droppedTo, POSIX_FADV_DONTNEED);
+	}
 	close(fdResponseData->fd);
 	unuseSessionLocks(fdResponseData->session);
 	freeSafe(fdResponseData);
 }
 
-static Response * createFdResponse(int fd, uint64_t offset, uint64_t size, const char * mimeType, time_t date,
-		RAP * rapSession, const char * fileName) {
-
-	FDResponseData * fdResponseData = mallocSafe(sizeof(*fdResponseData));
-	fdResponseData->fd = fd;
-	fdResponseData->pos = 0;
-	fdResponseData->offset = offset;
-	fdResponseData->size = size;
-	fdResponseData->session = rapSession;
-	Response * response = MHD_create_response_from_callback(size, 40960, &fdContentReader, fdResponseData,
-			&fdContentReaderCleanup);
-	if (!response) {
-		stdLogError(errno, "Could not create response");
-		exit(255);
-	}
-
+static void addFileResponseHeaders(Response * response, const char * mimeType, time_t date, uint64_t size,
+		const char * fileName) {
 	char dateBuf[100];
 	char sizeBuf[100];
 	char fileNameBuf[100];
@@ -1225,7 +1339,9 @@ static Response * createFdResponse(int fd, uint64_t offset, uint64_t size, const
 		sprintf(fileNameBuf, "inline; filename=\"%s\"", fileName);
 		addHeader(response, "Content-disposition", fileNameBuf);
 		addHeader(response, "Content-Transfer-Encoding", "binary");
-		addHeader(response, "Content-Length", sizeBuf);
+		if (size != MHD_SIZE_UNKNOWN) {
+			addHeader(response, "Content-Length", sizeBuf);
+		}
 	}
 	addHeader(response, "Accept-Ranges", "bytes");
 	addHeader(response, "Last-Modified", dateBuf);
@@ -1233,6 +1349,32 @@ static Response * createFdResponse(int fd, uint64_t offset, uint64_t size, const
 	addHeader(response, "Expires", "Thu, 19 Nov 1980 00:00:00 GMT");
 	addHeader(response, "Cache-Control", "no-store, no-cache, must-revalidate, post-check=0, pre-check=0");
 	addHeader(response, "Pragma", "no-cache");
+}
+
+static Response * createFdResponse(int fd, uint64_t offset, uint64_t size, const char * mimeType, time_t date,
+		RAP * rapSession, const char * fileName) {
+
+	FDResponseData * fdResponseData = mallocSafe(sizeof(*fdResponseData));
+	fdResponseData->fd = fd;
+	fdResponseData->offset = offset;
+	fdResponseData->size = size;
+	fdResponseData->session = rapSession;
+	struct stat fdStat;
+	fdResponseData->stream = fstat(fd, &fdStat) == 0 && (fdStat.st_mode & S_IFMT) != S_IFREG;
+	if (size != MHD_SIZE_UNKNOWN && !fdResponseData->stream) {
+		initializeReadPolicy(fdResponseData);
+	} else {
+		fdResponseData->sequential = 0;
+		fdResponseData->dropBehind = 0;
+	}
+	Response * response = MHD_create_response_from_callback(size, responseBlockSize(size), &fdContentReader,
+			fdResponseData, &fdContentReaderCleanup);
+	if (!response) {
+		stdLogError(errno, "Could not create response");
+		exit(255);
+	}
+
+	addFileResponseHeaders(response, mimeType, date, size, fileName);
 	return response;
 }
 
@@ -1248,51 +1390,374 @@ static Response * createFileResponse(const char * fileName, const char * mimeTyp
 	return createFdResponse(fd, 0, statBuffer.st_size, mimeType, statBuffer.st_mtime, session, fileName);
 }
 
-static int processRangeHeader(off_t * offset, size_t * fileSize, const char *range) {
-	int result = strncmp(range, "bytes=", sizeof("bytes=") - 1);
-	if (result) {
+////////////
+// Ranges //
+////////////
+
+// RFC 9110 lets a server ignore a Range header it considers abusive.  Anything with more specs than this is
+// served as a normal 200 response.
+#define MAX_BYTE_RANGES 32
+
+typedef enum RangeResult {
+	RANGE_IGNORE = 0,
+	RANGE_SATISFIABLE,
+	RANGE_NOT_SATISFIABLE
+} RangeResult;
+
+static int parseRangeNumber(const char ** range, off_t * value) {
+	const char * ptr = *range;
+	if (*ptr < '0' || *ptr > '9') {
 		return 0;
 	}
+	off_t result = 0;
+	while (*ptr >= '0' && *ptr <= '9') {
+		// Saturate rather than overflow. Nothing can be that big so the range is clamped later.
+		if (result <= (INT64_MAX - 9) / 10) {
+			result = result * 10 + (*ptr - '0');
+		} else {
+			result = INT64_MAX;
+		}
+		ptr++;
+	}
+	*range = ptr;
+	*value = result;
+	return 1;
+}
 
-	long long from, to;
+static int compareByteRange(const void * a, const void * b) {
+	const ByteRange * lhs = a;
+	const ByteRange * rhs = b;
+	return lhs->start < rhs->start ? -1 : (lhs->start > rhs->start ? 1 : 0);
+}
 
+// Parses a Range header (RFC 9110 section 14.2) against a file of fileSize bytes.
+// Satisfiable ranges are written to ranges[] (which must have room for MAX_BYTE_RANGES) sorted with any
+// overlapping or adjacent ranges coalesced.  Syntactically invalid headers are ignored as the RFC requires.
+static RangeResult parseRangeHeader(const char * range, off_t fileSize, ByteRange * ranges, int * rangeCount) {
+	if (strncasecmp(range, "bytes=", sizeof("bytes=") - 1)) {
+		return RANGE_IGNORE;
+	}
 	range += sizeof("bytes=") - 1;
-	if (*range == '\0') {
-		return 0;
+
+	int specCount = 0;
+	int count = 0;
+	while (1) {
+		SKIP_WHITE_SPACE(range);
+		if (*range == ',') {
+			range++;
+			continue;
+		} else if (*range == '\0') {
+			break;
+		}
+
+		off_t first, last;
+		if (*range == '-') {
+			// suffix-range: the last N bytes of the file
+			off_t suffixLength;
+			range++;
+			if (!parseRangeNumber(&range, &suffixLength)) {
+				return RANGE_IGNORE;
+			}
+			first = suffixLength < fileSize ? fileSize - suffixLength : 0;
+			last = suffixLength > 0 ? fileSize - 1 : -1;
+		} else {
+			// int-range: first-pos "-" [ last-pos ]
+			if (!parseRangeNumber(&range, &first) || *range != '-') {
+				return RANGE_IGNORE;
+			}
+			range++;
+			if (parseRangeNumber(&range, &last)) {
+				if (last < first) {
+					return RANGE_IGNORE;
+				}
+				if (last >= fileSize) {
+					last = fileSize - 1;
+				}
+			} else {
+				last = fileSize - 1;
+			}
+		}
+
+		SKIP_WHITE_SPACE(range);
+		if (*range != ',' && *range != '\0') {
+			return RANGE_IGNORE;
+		}
+
+		if (++specCount > MAX_BYTE_RANGES) {
+			return RANGE_IGNORE;
+		}
+		if (first <= last && first < fileSize) {
+			ranges[count].start = first;
+			ranges[count].end = last;
+			count++;
+		}
 	}
 
-	if (*range == '-') {
-		from = 0;
-	} else {
-		char * endPtr;
-		from = strtoll(range, &endPtr, 10);
-		if (endPtr == range) {
-			return 0;
+	if (specCount == 0) {
+		return RANGE_IGNORE;
+	}
+	if (count == 0) {
+		return RANGE_NOT_SATISFIABLE;
+	}
+
+	qsort(ranges, count, sizeof(*ranges), &compareByteRange);
+	int merged = 0;
+	for (int i = 1; i < count; i++) {
+		if (ranges[i].start <= ranges[merged].end + 1) {
+			if (ranges[i].end > ranges[merged].end) {
+				ranges[merged].end = ranges[i].end;
+			}
 		} else {
-			range = endPtr;
+			ranges[++merged] = ranges[i];
 		}
 	}
+	*rangeCount = merged + 1;
+	return RANGE_SATISFIABLE;
+}
+
+static size_t formatETag(char * buffer, size_t bufferSize, struct stat * fileStat) {
+	// Matches the getetag property given in PROPFIND responses
+	return snprintf(buffer, bufferSize, "\"%lld-%lld\"", (long long) fileStat->st_size,
+			(long long) fileStat->st_mtime);
+}
 
-	if (*range == '\0') {
+// If-Range (RFC 9110 section 13.1.5).  The range is only honoured if the validator matches what we would send
+// now. Weak entity tags never match.
+static int ifRangeMatches(Request * request, const char * etag, const char * lastModified) {
+	const char * ifRange = getHeader(request, "If-Range");
+	if (!ifRange) {
+		return 1;
+	}
+	SKIP_WHITE_SPACE(ifRange);
+	if (ifRange[0] == '"') {
+		return !strcmp(ifRange, etag);
+	} else if (ifRange[0] == 'W' && ifRange[1] == '/') {
 		return 0;
+	} else {
+		return !strcmp(ifRange, lastModified);
 	}
+}
 
-	range++;
+static ssize_t multipartContentReader(void *cls, uint64_t pos, char *buf, size_t max) {
+	MultipartResponseData * multipartData = cls;
+	if (multipartData->currentPart >= multipartData->partCount
+			|| pos < multipartData->parts[multipartData->currentPart].responseOffset) {
+		multipartData->currentPart = 0;
+	}
 
-	if (*range == '\0') {
-		to = *fileSize;
-	} else {
-		char * endPtr;
-		to = strtoll(range, &endPtr, 10);
-		if (endPtr == range) {
-			return 0;
+	size_t bytesWritten = 0;
+	while (bytesWritten < max) {
+		while (multipartData->currentPart < multipartData->partCount
+				&& pos >= multipartData->parts[multipartData->currentPart].responseOffset
+						+ multipartData->parts[multipartData->currentPart].size) {
+			multipartData->currentPart++;
 		}
+		if (multipartData->currentPart == multipartData->partCount) {
+			break;
+		}
+
+		ByteRangePart * part = &multipartData->parts[multipartData->currentPart];
+		off_t partPos = pos - part->responseOffset;
+		size_t toWrite = max - bytesWritten;
+		if (part->size - partPos < toWrite) {
+			toWrite = part->size - partPos;
+		}
+		if (part->text) {
+			memcpy(buf + bytesWritten, part->text + partPos, toWrite);
+		} else {
+			ssize_t bytesRead = pread(multipartData->fd, buf + bytesWritten, toWrite, part->fileOffset + partPos);
+			if (bytesRead <= 0) {
+				if (bytesWritten > 0) {
+					break;
+				}
+				stdLogError(bytesRead < 0 ? errno : 0, "Could not read content from fd for multipart range");
+				return MHD_CONTENT_READER_END_WITH_ERROR;
+			}
+			toWrite = bytesRead;
+		}
+		bytesWritten += toWrite;
+		pos += toWrite;
 	}
 
-	*offset = from;
-	*fileSize = to - from;
+	return bytesWritten > 0 ? bytesWritten : MHD_CONTENT_READER_END_OF_STREAM;
+}
 
-	return 1;
+static void multipartContentReaderCleanup(void *cls) {
+	MultipartResponseData * multipartData = cls;
+	close(multipartData->fd);
+	unuseSessionLocks(multipartData->session);
+	freeSafe(multipartData->partText);
+	freeSafe(multipartData->parts);
+	freeSafe(multipartData);
+}
+
+// Creates a multipart/byteranges (RFC 9110 section 14.6) response streamed straight from the file.
+// Every part header is generated up front so the total length is known and can be sent as Content-Length.
+static Response * createMultipartResponse(int fd, off_t fileSize, ByteRange * ranges, int rangeCount,
+		const char * mimeType, time_t date, RAP * rapSession) {
+	char boundary[sizeof("webdavd-") + 36];
+	uuid_t uuid;
+	uuid_generate(uuid);
+	strcpy(boundary, "webdavd-");
+	uuid_unparse_lower(uuid, boundary + sizeof("webdavd-") - 1);
+
+	MultipartResponseData * multipartData = mallocSafe(sizeof(*multipartData));
+	multipartData->fd = fd;
+	multipartData->session = rapSession;
+	multipartData->currentPart = 0;
+	multipartData->partCount = rangeCount * 2 + 1;
+	multipartData->parts = mallocSafe(sizeof(*multipartData->parts) * multipartData->partCount);
+
+	size_t partTextSize = (rangeCount + 1) * (strlen(mimeType) + sizeof(boundary) + 150);
+	multipartData->partText = mallocSafe(partTextSize);
+	char * partText = multipartData->partText;
+	off_t responseOffset = 0;
+	for (int i = 0; i < rangeCount; i++) {
+		ByteRangePart * header = &multipartData->parts[i * 2];
+		int textSize = snprintf(partText, partTextSize - (partText - multipartData->partText),
+				"%s--%s\r\nContent-Type: %s\r\nContent-Range: bytes %lld-%lld/%lld\r\n\r\n", i > 0 ? "\r\n" : "",
+				boundary, mimeType, (long long) ranges[i].start, (long long) ranges[i].end,
+				(long long) fileSize);
+		header->text = partText;
+		header->size = textSize;
+		header->fileOffset = -1;
+		header->responseOffset = responseOffset;
+		responseOffset += textSize;
+		partText += textSize + 1;
+
+		ByteRangePart * body = &multipartData->parts[i * 2 + 1];
+		body->text = NULL;
+		body->fileOffset = ranges[i].start;
+		body->size = ranges[i].end - ranges[i].start + 1;
+		body->responseOffset = responseOffset;
+		responseOffset += body->size;
+	}
+	ByteRangePart * trailer = &multipartData->parts[rangeCount * 2];
+	trailer->text = partText;
+	trailer->size = snprintf(partText, partTextSize - (partText - multipartData->partText), "\r\n--%s--\r\n",
+			boundary);
+	trailer->fileOffset = -1;
+	trailer->responseOffset = responseOffset;
+	responseOffset += trailer->size;
+
+	Response * response = MHD_create_response_from_callback(responseOffset, 40960, &multipartContentReader,
+			multipartData, &multipartContentReaderCleanup);
+	if (!response) {
+		stdLogError(errno, "Could not create response");
+		exit(255);
+	}
+
+	char contentType[sizeof(boundary) + 50];
+	snprintf(contentType, sizeof(contentType), "multipart/byteranges; boundary=%s", boundary);
+	addFileResponseHeaders(response, contentType, date, responseOffset, "");
+	return response;
+}
+
+// Creates the response for a GET on a regular file honouring Range and If-Range.
+static int createFileRangeResponse(Request * request, int fd, struct stat * fileStat, const char * mimeType,
+		time_t date, RAP * rapSession, Response ** response) {
+	char etag[100];
+	char lastModified[100];
+	formatETag(etag, sizeof(etag), fileStat);
+	getWebDate(date, lastModified, sizeof(lastModified));
+
+	ByteRange ranges[MAX_BYTE_RANGES];
+	int rangeCount = 0;
+	RangeResult rangeResult = RANGE_IGNORE;
+	const char * rangeHeader = getHeader(request, "Range");
+	if (rangeHeader && ifRangeMatches(request, etag, lastModified)) {
+		rangeResult = parseRangeHeader(rangeHeader, fileStat->st_size, ranges, &rangeCount);
+	}
+	// A pipe can only be read forwards once so it can't give several ranges
+	if (rangeResult == RANGE_SATISFIABLE && rangeCount > 1 && (fileStat->st_mode & S_IFMT) != S_IFREG) {
+		rangeResult = RANGE_IGNORE;
+	}
+
+	int statusCode;
+	char contentRangeHeader[200];
+	switch (rangeResult) {
+	case RANGE_NOT_SATISFIABLE:
+		*response = createFdResponse(fd, 0, 0, mimeType, date, rapSession, "");
+		snprintf(contentRangeHeader, sizeof(contentRangeHeader), "bytes */%lld", (long long) fileStat->st_size);
+		addHeader(*response, "Content-Range", contentRangeHeader);
+		statusCode = RAP_RESPOND_RANGE_NOT_SATISFIABLE;
+		break;
+
+	case RANGE_SATISFIABLE:
+		if (rangeCount == 1) {
+			*response = createFdResponse(fd, ranges[0].start, ranges[0].end - ranges[0].start + 1, mimeType, date,
+					rapSession, "");
+			snprintf(contentRangeHeader, sizeof(contentRangeHeader), "bytes %lld-%lld/%lld",
+					(long long) ranges[0].start, (long long) ranges[0].end, (long long) fileStat->st_size);
+			addHeader(*response, "Content-Range", contentRangeHeader);
+		} else {
+			*response = createMultipartResponse(fd, fileStat->st_size, ranges, rangeCount, mimeType, date,
+					rapSession);
+		}
+		statusCode = MHD_HTTP_PARTIAL_CONTENT;
+		break;
+
+	default:
+		*response = createFdResponse(fd, 0, fileStat->st_size, mimeType, date, rapSession, "");
+		statusCode = RAP_RESPOND_OK;
+		break;
+	}
+
+	addHeader(*response, "ETag", etag);
+	return statusCode;
+}
+
+////////////////
+// End Ranges //
+////////////////
+
+// Directory listings and multistatus responses compress very well.  They come from the RAP through a pipe so their
+// size isn't known up front.  The first compressionMinSize bytes are read to decide if compression is worthwhile.
+// Returns NULL on error.
+static Response * createCompressedResponse(Request * request, int fd, const char * mimeType, time_t date,
+		RAP * session) {
+	Response * response;
+	ContentEncoding encoding = negotiateContentEncoding(getHeader(request, "Accept-Encoding"));
+	if (encoding == CONTENT_ENCODING_IDENTITY || !reserveCompressionWorker()) {
+		response = createFdResponse(fd, 0, -1, mimeType, date, session, "");
+		addHeader(response, "Vary", "Accept-Encoding");
+		return response;
+	}
+
+	char * prefix = mallocSafe(config.compressionMinSize);
+	size_t prefixSize = 0;
+	ssize_t bytesRead;
+	while (prefixSize < config.compressionMinSize
+			&& (bytesRead = read(fd, prefix + prefixSize, config.compressionMinSize - prefixSize)) > 0) {
+		prefixSize += bytesRead;
+	}
+
+	if (prefixSize < config.compressionMinSize) {
+		releaseCompressionWorker();
+		close(fd);
+		if (bytesRead < 0) {
+			stdLogError(errno, "Could not read content from fd");
+			freeSafe(prefix);
+			return NULL;
+		}
+		// The whole body has already been read so any locks can be released now, there's no fd to clean up later
+		unuseSessionLocks(session);
+		response = MHD_create_response_from_buffer(prefixSize, prefix, MHD_RESPMEM_MUST_FREE);
+		if (!response) {
+			stdLogError(errno, "Could not create response");
+			exit(255);
+		}
+		addFileResponseHeaders(response, mimeType, date, prefixSize, "");
+	} else {
+		int compressedFd = startCompressionWorker(encoding, fd, prefix, prefixSize);
+		if (compressedFd == -1) {
+			return NULL;
+		}
+		response = createFdResponse(compressedFd, 0, -1, mimeType, date, session, "");
+		addHeader(response, "Content-Encoding", contentEncodingName(encoding));
+	}
+	addHeader(response, "Vary", "Accept-Encoding");
+	return response;
 }
 
 static int createResponseFromMessage(Request * request, Message * message, Response ** response,
@@ -1333,6 +1798,21 @@ static int createResponseFromMessage(Request * request, Message * message, Respo
 			*response = createFileResponse(CONFLICT_PAGE, "text/html", session);
 			break;
 
+		case RAP_RESPOND_RESUME_INCOMPLETE: {
+			// Tells a client resuming an upload how much of it has already been received
+			off_t received = messageParamTo(off_t, message->params[RAP_PARAM_RESUME_RECEIVED]);
+			*response = MHD_create_response_from_buffer(0, NULL, MHD_RESPMEM_MUST_COPY);
+			if (received > 0) {
+				char rangeHeader[50];
+				snprintf(rangeHeader, sizeof(rangeHeader), "bytes=0-%lld", (long long) received - 1);
+				addHeader(*response, "Range", rangeHeader);
+			}
+			if (message->paramCount > RAP_PARAM_RESUME_TOKEN) {
+				addHeader(*response, "Upload-Token", messageParamToString(&message->params[RAP_PARAM_RESUME_TOKEN]));
+			}
+			break;
+		}
+
 		default:
 			*response = 0;
 		}
@@ -1344,28 +1824,38 @@ static int createResponseFromMessage(Request * request, Message * message, Respo
 		struct stat stat;
 		fstat(message->fd, &stat);
 		if ((stat.st_mode & S_IFMT) == S_IFREG) {
-			if (statusCode == 200) {
-				off_t offset = 0;
-				size_t fileSize = stat.st_size;
-				if (request) {
-					const char * rangeHeader = getHeader(request, "Range");
-					if (rangeHeader && processRangeHeader(&offset, &fileSize, rangeHeader)) {
-						statusCode = MHD_HTTP_PARTIAL_CONTENT;
-					}
-				}
-				*response = createFdResponse(message->fd, offset, fileSize, mimeType, date, session, "");
-
-				char contentRangeHeader[200];
-				snprintf(contentRangeHeader, sizeof(contentRangeHeader), "bytes %lld-%lld/%lld",
-						(long long) offset, (long long) (fileSize + offset), (long long) stat.st_size);
-
-				addHeader(*response, "Content-Range", contentRangeHeader);
+			if (statusCode == RAP_RESPOND_OK && request) {
+				statusCode = createFileRangeResponse(request, message->fd, &stat, mimeType, date, session,
+						response);
+			} else {
+				*response = createFdResponse(message->fd, 0, stat.st_size, mimeType, date, session, "");
+			}
+		} else if (message->paramCount > RAP_PARAM_RESPONSE_SIZE
+				&& messageParamTo(off_t, message->params[RAP_PARAM_RESPONSE_SIZE]) >= 0) {
+			// Generated content whose length the RAP knows up front, eg: an uncompressed ZIP archive
+			stat.st_size = messageParamTo(off_t, message->params[RAP_PARAM_RESPONSE_SIZE]);
+			stat.st_mtime = date;
+			if (statusCode == RAP_RESPOND_OK && request) {
+				statusCode = createFileRangeResponse(request, message->fd, &stat, mimeType, date, session,
+						response);
 			} else {
 				*response = createFdResponse(message->fd, 0, stat.st_size, mimeType, date, session, "");
 			}
+		} else if (request && isCompressibleType(mimeType)) {
+			*response = createCompressedResponse(request, message->fd, mimeType, date, session);
+			if (!*response) {
+				statusCode = RAP_RESPOND_INTERNAL_ERROR;
+			}
 		} else {
 			*response = createFdResponse(message->fd, 0, -1, mimeType, date, session, "");
 		}
+
+		// Set when the RAP has found a precompressed copy of the file
+		const char * contentEncoding = messageParamToString(&message->params[RAP_PARAM_RESPONSE_ENCODING]);
+		if (contentEncoding && *response) {
+			addHeader(*response, "Content-Encoding", contentEncoding);
+			addHeader(*response, "Vary", "Accept-Encoding");
+		}
 	}
 	return statusCode;
 }
@@ -1392,10 +1882,778 @@ static RapConstant writeErrorResponse(RapConstant responseCode, const char * tex
 // Main Handler Methods //
 //////////////////////////
 
+// Long COPY, MOVE and DELETE requests send RAP_INTERIM_PROGRESS while they work.  Each of these is a fresh recv so the
+// rap-timeout starts again with every one and only a RAP that stops reporting is taken to be hung.
+static ssize_t recvRapResponse(RAP * processor, Message * message, char * incomingBuffer, size_t incomingBufferSize) {
+	ssize_t readResult;
+	do {
+		readResult = recvMessage(processor->socketFd, message, incomingBuffer, incomingBufferSize);
+	} while (readResult > 0 && message->mID == RAP_INTERIM_PROGRESS);
+	return readResult;
+}
+
+static ssize_t sendRecvRapMessage(RAP * processor, Message * message, char * incomingBuffer,
+		size_t incomingBufferSize) {
+	ssize_t result = sendMessage(processor->socketFd, message);
+	if (result > 0) {
+		result = recvRapResponse(processor, message, incomingBuffer, incomingBufferSize);
+		if (result == 0) {
+			stdLogError(0, "RAP closed socket unexpectedly while waiting for response");
+		}
+	}
+	return result;
+}
+
+////////////////////////
+// Coalesced PROPFIND //
+////////////////////////
+
+// Desktop clients often send the same PROPFIND from several connections at once.  Rather than have every RAP list the
+// same directory, the first request becomes the leader and any identical request arriving while it is in flight waits
+// for its answer.  Requests are only identical if they match on user, path, Depth and body so nobody is given a
+// listing their own RAP could not have produced.  The answer is only copied if someone has joined the flight by the
+// time it arrives, otherwise it streams straight to the client.  Nothing is kept once the last waiter has its copy.
+
+#define PROPFIND_MAX_HELD_BODY (16 * 1024)
+
+typedef struct PropFindFlight {
+	struct PropFindFlight * next;
+	char * key;
+	size_t keySize;
+	int users;
+	sem_t answered; // Posted once by the leader, each waiter passes it on to the next
+	RapConstant statusCode;
+	time_t date;
+	char * mimeType;
+	int bodyFd;     // memfd holding the response body or -1 if the RAP sent none
+	off_t bodySize;
+} PropFindFlight;
+
+static sem_t propFindFlightLock;
+static PropFindFlight * propFindFlights = NULL;
+
+static void initializePropFindFlights() {
+	if (sem_init(&propFindFlightLock, 0, 1) == -1) {
+		stdLogError(errno, "Could not create lock for PROPFIND coalescing");
+		exit(255);
+	}
+}
+
+static PropFindFlight * newPropFindFlight(char * key, size_t keySize) {
+	PropFindFlight * flight = mallocSafe(sizeof(*flight));
+	flight->next = NULL;
+	flight->key = key;
+	flight->keySize = keySize;
+	flight->users = 1;
+	flight->statusCode = RAP_RESPOND_INTERNAL_ERROR;
+	flight->date = 0;
+	flight->mimeType = NULL;
+	flight->bodyFd = -1;
+	flight->bodySize = 0;
+	if (sem_init(&flight->answered, 0, 0) == -1) {
+		stdLogError(errno, "Could not create semaphore for PROPFIND coalescing");
+		exit(255);
+	}
+	return flight;
+}
+
+static void releasePropFindFlight(PropFindFlight * flight) {
+	sem_wait(&propFindFlightLock);
+	int lastUser = !--flight->users;
+	sem_post(&propFindFlightLock);
+	if (lastUser) {
+		if (flight->bodyFd != -1) close(flight->bodyFd);
+		sem_destroy(&flight->answered);
+		freeSafe(flight->mimeType);
+		freeSafe(flight->key);
+		freeSafe(flight);
+	}
+}
+
+// Sends the PROPFIND to this RAP and waits for its answer.  Returns 0 if the RAP failed to give one.
+static int sendPropFind(RAP * rapSession, const char * url, const char * depth, const char * body, size_t bodySize,
+		LockProvisions locks, Message * message, char * incomingBuffer, size_t incomingBufferSize) {
+	int bodyFd = -1;
+	if (body) {
+		// The body is never bigger than PROPFIND_MAX_HELD_BODY so it fits in the socket without blocking
+		int pipeEnds[2];
+		if (socketpair(PF_LOCAL, SOCK_STREAM | SOCK_CLOEXEC, 0, pipeEnds)) {
+			stdLogError(errno, "Could not create pipe for PROPFIND body");
+			return 0;
+		}
+		ssize_t bytesWritten = write(pipeEnds[PARENT_SOCKET], body, bodySize);
+		close(pipeEnds[PARENT_SOCKET]);
+		if (bytesWritten != bodySize) {
+			stdLogError(errno, "Could not write PROPFIND body");
+			close(pipeEnds[CHILD_SOCKET]);
+			return 0;
+		}
+		bodyFd = pipeEnds[CHILD_SOCKET];
+	}
+
+	message->mID = RAP_REQUEST_PROPFIND;
+	message->fd = bodyFd;
+	message->paramCount = 3;
+	message->params[RAP_PARAM_REQUEST_LOCK] = toMessageParam(locks);
+	message->params[RAP_PARAM_REQUEST_FILE] = stringToMessageParam(url);
+	message->params[RAP_PARAM_REQUEST_DEPTH] = stringToMessageParam(depth);
+	if (sendRecvRapMessage(rapSession, message, incomingBuffer, incomingBufferSize) <= 0) return 0;
+	if (message->mID == RAP_RESPOND_CONTINUE) {
+		// Sent before the RAP reads the body, the real answer follows
+		ssize_t readResult = recvRapResponse(rapSession, message, incomingBuffer, incomingBufferSize);
+		if (readResult <= 0) {
+			if (readResult == 0) stdLogError(0, "RAP closed socket unexpectedly while waiting for response");
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// Copies the RAP's answer into a memfd so that it can be shared between everyone waiting for it
+static void keepPropFind(Message * message, PropFindFlight * flight) {
+	if (message->mID < RAP_RESPOND_CONTINUE || message->mID >= 600) {
+		if (message->fd != -1) close(message->fd);
+		stdLogError(0, "Response from RAP %d", (int) message->mID);
+		return;
+	}
+
+	if (message->fd != -1) {
+		int memFd = memfd_create("webdavd-propfind", MFD_CLOEXEC);
+		if (memFd == -1) {
+			stdLogError(errno, "Could not create memfd for PROPFIND response");
+			close(message->fd);
+			return;
+		}
+		char buffer[BUFFER_SIZE];
+		ssize_t bytesRead;
+		off_t bodySize = 0;
+		while ((bytesRead = read(message->fd, buffer, sizeof(buffer))) > 0) {
+			if (write(memFd, buffer, bytesRead) != bytesRead) {
+				bytesRead = -1;
+				break;
+			}
+			bodySize += bytesRead;
+		}
+		close(message->fd);
+		if (bytesRead < 0) {
+			stdLogError(errno, "Could not copy PROPFIND response");
+			close(memFd);
+			return;
+		}
+		flight->bodyFd = memFd;
+		flight->bodySize = bodySize;
+		flight->date = messageParamTo(time_t, message->params[RAP_PARAM_RESPONSE_DATE]);
+		flight->mimeType = copyString(messageParamToString(&message->params[RAP_PARAM_RESPONSE_MIME]));
+	}
+	flight->statusCode = message->mID;
+}
+
+// Sends the PROPFIND to this RAP and streams its answer straight to the client
+static int directPropFind(Request * request, RAP * rapSession, const char * url, const char * depth,
+		const char * body, size_t bodySize, LockProvisions locks, Response ** response) {
+	Message message;
+	char incomingBuffer[INCOMING_BUFFER_SIZE];
+	if (!sendPropFind(rapSession, url, depth, body, bodySize, locks, &message, incomingBuffer,
+			sizeof(incomingBuffer))) {
+		return RAP_RESPOND_INTERNAL_ERROR;
+	}
+	return createResponseFromMessage(request, &message, response, rapSession);
+}
+
+static int answerPropFind(Request * request, RAP * rapSession, PropFindFlight * flight, Response ** response) {
+	if (flight->statusCode == RAP_RESPOND_INTERNAL_ERROR) return RAP_RESPOND_INTERNAL_ERROR;
+	Message message = { .mID = flight->statusCode, .fd = -1, .paramCount = 0 };
+	if (flight->bodyFd == -1) return createResponseFromMessage(request, &message, response, rapSession);
+
+	// Every request needs its own file offset so each one opens the memfd afresh
+	char fdPath[50];
+	snprintf(fdPath, sizeof(fdPath), "/proc/self/fd/%d", flight->bodyFd);
+	int fd = open(fdPath, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		stdLogError(errno, "Could not reopen PROPFIND response");
+		return RAP_RESPOND_INTERNAL_ERROR;
+	}
+	if (isCompressibleType(flight->mimeType)) {
+		*response = createCompressedResponse(request, fd, flight->mimeType, flight->date, rapSession);
+		if (!*response) return RAP_RESPOND_INTERNAL_ERROR;
+	} else {
+		*response = createFdResponse(fd, 0, flight->bodySize, flight->mimeType, flight->date, rapSession, "");
+	}
+	return flight->statusCode;
+}
+
+static int coalescePropFind(Request * request, RAP * rapSession, const char * url, const char * body,
+		size_t bodySize, LockProvisions locks, Response ** response) {
+	// The key is user, url, depth and body each separated by '\0'
+	const char * depth = getHeader(request, HEADER_DEPTH);
+	size_t userSize = strlen(rapSession->user) + 1;
+	size_t urlSize = strlen(url) + 1;
+	size_t depthSize = (depth ? strlen(depth) : 0) + 1;
+	size_t keySize = userSize + urlSize + depthSize + bodySize;
+	char * key = mallocSafe(keySize);
+	memcpy(key, rapSession->user, userSize);
+	memcpy(key + userSize, url, urlSize);
+	memcpy(key + userSize + urlSize, depth ? depth : "", depthSize);
+	if (bodySize) memcpy(key + userSize + urlSize + depthSize, body, bodySize);
+
+	sem_wait(&propFindFlightLock);
+	PropFindFlight * flight = propFindFlights;
+	while (flight && (flight->keySize != keySize || memcmp(flight->key, key, keySize))) {
+		flight = flight->next;
+	}
+	if (flight) {
+		flight->users++;
+		sem_post(&propFindFlightLock);
+		freeSafe(key);
+		sem_wait(&flight->answered);
+		sem_post(&flight->answered);
+		if (flight->statusCode == RAP_RESPOND_INTERNAL_ERROR) {
+			// The leader's RAP failing says nothing about this one so ask it directly
+			releasePropFindFlight(flight);
+			return directPropFind(request, rapSession, url, depth, body, bodySize, locks, response);
+		}
+	} else {
+		flight = newPropFindFlight(key, keySize);
+		flight->next = propFindFlights;
+		propFindFlights = flight;
+		sem_post(&propFindFlightLock);
+
+		Message message;
+		char incomingBuffer[INCOMING_BUFFER_SIZE];
+		int answered = sendPropFind(rapSession, url, depth, body, bodySize, locks, &message, incomingBuffer,
+				sizeof(incomingBuffer));
+
+		// Nobody can join once the flight is off the list
+		sem_wait(&propFindFlightLock);
+		PropFindFlight ** link = &propFindFlights;
+		while (*link != flight) {
+			link = &(*link)->next;
+		}
+		*link = flight->next;
+		int shared = flight->users > 1;
+		sem_post(&propFindFlightLock);
+
+		if (!shared) {
+			// Nobody is waiting so there's no need to keep a copy
+			releasePropFindFlight(flight);
+			if (!answered) return RAP_RESPOND_INTERNAL_ERROR;
+			return createResponseFromMessage(request, &message, response, rapSession);
+		}
+		if (answered) keepPropFind(&message, flight);
+		sem_post(&flight->answered);
+	}
+
+	int statusCode = answerPropFind(request, rapSession, flight, response);
+	releasePropFindFlight(flight);
+	return statusCode;
+}
+
+// A PROPFIND body can only be compared once it has all arrived.  Small bodies are left in the upload socket until
+// finishProcessingRequest(), larger ones are passed straight to the RAP without coalescing.
+static int holdPropFind(Request * request, RAP * rapSession, const char * url, LockProvisions locks) {
+	const char * contentLength = getHeader(request, "Content-Length");
+	if (!contentLength || strtoll(contentLength, NULL, 10) > PROPFIND_MAX_HELD_BODY) return 0;
+	rapSession->requestHeldBodyFd = rapSession->requestReadDataFd;
+	rapSession->requestReadDataFd = -1;
+	rapSession->requestHeldUrl = copyString(url);
+	rapSession->requestHeldLocks = locks;
+	return 1;
+}
+
+static int finishHeldPropFind(Request * request, RAP * rapSession, Response ** response) {
+	char body[PROPFIND_MAX_HELD_BODY + 1];
+	size_t bodySize = 0;
+	ssize_t bytesRead;
+	while (bodySize < sizeof(body)
+			&& (bytesRead = read(rapSession->requestHeldBodyFd, body + bodySize, sizeof(body) - bodySize)) > 0) {
+		bodySize += bytesRead;
+	}
+	close(rapSession->requestHeldBodyFd);
+	rapSession->requestHeldBodyFd = -1;
+
+	int statusCode;
+	if (bytesRead < 0 || bodySize > PROPFIND_MAX_HELD_BODY) {
+		stdLogError(bytesRead < 0 ? errno : 0, "Could not read PROPFIND body");
+		statusCode = RAP_RESPOND_INTERNAL_ERROR;
+	} else {
+		statusCode = coalescePropFind(request, rapSession, rapSession->requestHeldUrl, bodySize ? body : NULL,
+				bodySize, rapSession->requestHeldLocks, response);
+	}
+	freeSafe((void *) rapSession->requestHeldUrl);
+	rapSession->requestHeldUrl = NULL;
+	return statusCode;
+}
+
+////////////////////////////
+// End Coalesced PROPFIND //
+////////////////////////////
+
+/////////////////////////
+// Change Notification //
+/////////////////////////
+
+// Instead of polling a collection with PROPFIND a client can GET it with "Accept: text/event-stream" and be sent an
+// event (text/event-stream) each time something under it changes.  Each user has one inotify instance which all of
+// their streams share.  Only the user's RAP can add watches to it but one thread here reads every instance.
+//
+// Streams are served on their own port (<event-stream-port>) by a daemon with no threads of its own.  The thread which
+// reads inotify also runs the daemon's connections, and a stream with nothing to send is suspended until it has.  So a
+// waiting stream costs its socket, an inotify watch and nothing else.  Setting a stream up (authenticating and asking
+// the RAP for a watch) blocks, so that is done on a thread of its own which ends as soon as the stream starts.  Its RAP
+// goes back to the pool then.
+
+// Comments are sent this often so that proxies leave the connection open and dead clients are noticed
+#define CHANGE_STREAM_KEEP_ALIVE 25
+
+typedef struct ChangeWatchGroup {
+	struct ChangeWatchGroup * next;
+	char * user;
+	int inotifyFd;
+	int users;         // Streams, including those still being set up
+	sem_t addingWatch; // Held while a RAP adds a watch so that it can't be removed under it
+	int unwatchedCount;
+	int * unwatched;   // Watches finished with while a RAP was adding one, see finishAddingWatch()
+	struct ChangeStream * streams;
+} ChangeWatchGroup;
+
+typedef struct ChangeStream {
+	struct ChangeStream * next;
+	ChangeWatchGroup * group;
+	Request * request;
+	int watch;
+	int changes;       // Changes not yet sent
+	int gone;          // The collection has been deleted or moved away
+	int ignored;       // The kernel has already dropped the watch (IN_IGNORED)
+	int started;
+	int finished;
+	int suspended;     // Waiting for notifyChangeStreams() or keepChangeStreamsAlive() to resume it
+	time_t keepAlive;  // When a comment is next due (CLOCK_MONOTONIC)
+	char * data;       // The url, encoded so that it fits on one line
+	size_t dataSize;
+} ChangeStream;
+
+// A stream request while it is set up by setUpChangeStream()
+typedef struct ChangeStreamSetup {
+	Request * request;
+	char * url;
+	char * user;
+	char * password;
+	char clientIp[100];
+	int statusCode;
+	Response * response;
+} ChangeStreamSetup;
+
+static sem_t changeWatchLock;
+static ChangeWatchGroup * changeWatchGroups = NULL;
+static int changeWatchEpollFd;
+
+// Only the change watcher thread may run these
+static int changeStreamDaemonCount = 0;
+static struct MHD_Daemon ** changeStreamDaemons = NULL;
+
+// Must hold changeWatchLock
+static void resumeChangeStream(ChangeStream * stream) {
+	if (stream->suspended) {
+		stream->suspended = 0;
+		MHD_resume_connection(stream->request);
+	}
+}
+
+// Must hold changeWatchLock
+static void notifyChangeStreams(ChangeWatchGroup * group, struct inotify_event * event) {
+	// Changes to the server's own files aren't anything anyone needs to hear about
+	if (event->len && isServerFile(event->name)) return;
+	for (ChangeStream * stream = group->streams; stream; stream = stream->next) {
+		// The queue overflowing (watch -1) may have lost a change for anyone
+		if (stream->watch == event->wd || event->wd == -1) {
+			if (event->mask & IN_IGNORED) {
+				stream->ignored = 1;
+			}
+			if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED | IN_UNMOUNT)) {
+				stream->gone = 1;
+			}
+			stream->changes++;
+			resumeChangeStream(stream);
+		}
+	}
+}
+
+// Resumes the streams which are due a keep alive.  Returns how long the change watcher may wait before it must run
+// again in milliseconds, or -1 if it may wait until something happens.
+static int keepChangeStreamsAlive() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	time_t next = 0;
+	sem_wait(&changeWatchLock);
+	for (ChangeWatchGroup * group = changeWatchGroups; group; group = group->next) {
+		for (ChangeStream * stream = group->streams; stream; stream = stream->next) {
+			if (!stream->suspended) continue;
+			if (stream->keepAlive <= now.tv_sec) {
+				resumeChangeStream(stream);
+			} else if (!next || stream->keepAlive < next) {
+				next = stream->keepAlive;
+			}
+		}
+	}
+	sem_post(&changeWatchLock);
+	long long timeout = next ? (next - now.tv_sec) * 1000LL : -1;
+
+	// The daemons may have connections which are ready but which they haven't got to yet
+	for (int i = 0; i < changeStreamDaemonCount; i++) {
+		MHD_UNSIGNED_LONG_LONG daemonTimeout;
+		if (MHD_get_timeout(changeStreamDaemons[i], &daemonTimeout) == MHD_YES
+				&& (timeout == -1 || daemonTimeout < timeout)) {
+			timeout = daemonTimeout;
+		}
+	}
+	return timeout > INT_MAX ? INT_MAX : timeout;
+}
+
+static void * changeWatcher(void * ignored) {
+	char buffer[BUFFER_SIZE] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	struct epoll_event ready[16];
+	while (1) {
+		int readyCount = epoll_wait(changeWatchEpollFd, ready, sizeof(ready) / sizeof(*ready),
+				keepChangeStreamsAlive());
+		if (readyCount == -1) {
+			if (errno == EINTR) continue;
+			stdLogError(errno, "Could not wait for changes");
+			return NULL;
+		}
+		sem_wait(&changeWatchLock);
+		for (int i = 0; i < readyCount; i++) {
+			// The group may have been freed since epoll_wait() returned.  The daemons are added without one.
+			ChangeWatchGroup * group = changeWatchGroups;
+			while (group && group != ready[i].data.ptr) {
+				group = group->next;
+			}
+			if (!group || group->inotifyFd == -1) continue;
+
+			ssize_t bytesRead;
+			while ((bytesRead = read(group->inotifyFd, buffer, sizeof(buffer))) > 0) {
+				char * event = buffer;
+				while (event < buffer + bytesRead) {
+					notifyChangeStreams(group, (struct inotify_event *) event);
+					event += sizeof(struct inotify_event) + ((struct inotify_event *) event)->len;
+				}
+			}
+		}
+		sem_post(&changeWatchLock);
+
+		// This sends whatever the streams have to send (see changeStreamReader()) and accepts new streams
+		for (int i = 0; i < changeStreamDaemonCount; i++) {
+			MHD_run(changeStreamDaemons[i]);
+		}
+	}
+}
+
+static void initializeChangeStreams() {
+	if (sem_init(&changeWatchLock, 0, 1) == -1) {
+		stdLogError(errno, "Could not create lock for change streams");
+		exit(255);
+	}
+	changeWatchEpollFd = epoll_create1(EPOLL_CLOEXEC);
+	if (changeWatchEpollFd == -1) {
+		stdLogError(errno, "Could not create epoll instance for change streams");
+		exit(255);
+	}
+}
+
+// The daemon must have been started with MHD_USE_EPOLL and no thread of its own
+static void addChangeStreamDaemon(struct MHD_Daemon * daemon) {
+	const union MHD_DaemonInfo * info = MHD_get_daemon_info(daemon, MHD_DAEMON_INFO_EPOLL_FD);
+	struct epoll_event event = { .events = EPOLLIN, .data.ptr = NULL };
+	if (!info || epoll_ctl(changeWatchEpollFd, EPOLL_CTL_ADD, info->epoll_fd, &event) == -1) {
+		stdLogError(errno, "Could not add event stream daemon to the change watcher");
+		exit(255);
+	}
+	changeStreamDaemons = reallocSafe(changeStreamDaemons,
+			sizeof(*changeStreamDaemons) * (changeStreamDaemonCount + 1));
+	changeStreamDaemons[changeStreamDaemonCount++] = daemon;
+}
+
+// Called once every daemon has been started
+static void startChangeWatcher() {
+	if (!changeStreamDaemonCount) return;
+	pthread_t thread;
+	pthread_attr_t attributes;
+	pthread_attr_init(&attributes);
+	pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+	int result = pthread_create(&thread, &attributes, &changeWatcher, NULL);
+	pthread_attr_destroy(&attributes);
+	if (result != 0) {
+		stdLogError(result, "Could not start change watcher");
+		exit(255);
+	}
+}
+
+static ChangeWatchGroup * joinChangeWatchGroup(const char * user) {
+	sem_wait(&changeWatchLock);
+	ChangeWatchGroup * group = changeWatchGroups;
+	while (group && strcmp(group->user, user)) {
+		group = group->next;
+	}
+	if (!group) {
+		group = mallocSafe(sizeof(*group));
+		group->user = copyString(user);
+		group->inotifyFd = -1;
+		group->users = 0;
+		group->unwatchedCount = 0;
+		group->unwatched = NULL;
+		group->streams = NULL;
+		sem_init(&group->addingWatch, 0, 1);
+		group->next = changeWatchGroups;
+		changeWatchGroups = group;
+	}
+	group->users++;
+	sem_post(&changeWatchLock);
+	return group;
+}
+
+static void leaveChangeWatchGroup(ChangeWatchGroup * group) {
+	sem_wait(&changeWatchLock);
+	if (!--group->users) {
+		ChangeWatchGroup ** link = &changeWatchGroups;
+		while (*link != group) {
+			link = &(*link)->next;
+		}
+		*link = group->next;
+		// Closing the instance takes it out of the epoll set and drops all of its watches
+		if (group->inotifyFd != -1) close(group->inotifyFd);
+		sem_destroy(&group->addingWatch);
+		if (group->unwatched) freeSafe(group->unwatched);
+		freeSafe(group->user);
+		freeSafe(group);
+	}
+	sem_post(&changeWatchLock);
+}
+
+// Releases addingWatch.  Streams which ended while it was held could not remove their watches in case the RAP was
+// being given the same one again, so that is done here unless a stream is now using it.
+static void finishAddingWatch(ChangeWatchGroup * group) {
+	sem_wait(&changeWatchLock);
+	for (int i = 0; i < group->unwatchedCount; i++) {
+		ChangeStream * stream = group->streams;
+		while (stream && stream->watch != group->unwatched[i]) {
+			stream = stream->next;
+		}
+		if (!stream) inotify_rm_watch(group->inotifyFd, group->unwatched[i]);
+	}
+	group->unwatchedCount = 0;
+	sem_post(&changeWatchLock);
+	sem_post(&group->addingWatch);
+}
+
+static size_t writeChangeEvent(ChangeStream * stream, char * buffer, size_t bufferSize, const char * event) {
+	int written = snprintf(buffer, bufferSize, "event: %s\ndata: %s\n\n", event, stream->data);
+	if (written < 0 || written >= bufferSize) {
+		written = snprintf(buffer, bufferSize, "event: %s\ndata:\n\n", event);
+	}
+	return written;
+}
+
+// Runs on the change watcher thread so it must never block
+static ssize_t changeStreamReader(void *cls, uint64_t pos, char *buf, size_t max) {
+	ChangeStream * stream = cls;
+	if (stream->finished) return MHD_CONTENT_READER_END_OF_STREAM;
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	sem_wait(&changeWatchLock);
+	int started = stream->started;
+	int changes = stream->changes;
+	int gone = stream->gone;
+	if (started && !changes && !gone && now.tv_sec < stream->keepAlive) {
+		// Nothing to send so stop polling the connection until there is
+		stream->suspended = 1;
+		MHD_suspend_connection(stream->request);
+		sem_post(&changeWatchLock);
+		return 0;
+	}
+	stream->started = 1;
+	stream->changes = 0;
+	stream->keepAlive = now.tv_sec + CHANGE_STREAM_KEEP_ALIVE;
+	sem_post(&changeWatchLock);
+
+	if (!started) {
+		// The first thing sent tells the client its stream is open (MHD holds back the headers until then)
+		return snprintf(buf, max, ": watching\n\n");
+	} else if (gone) {
+		stream->finished = 1;
+		return writeChangeEvent(stream, buf, max, "gone");
+	} else if (changes) {
+		return writeChangeEvent(stream, buf, max, "change");
+	} else {
+		return snprintf(buf, max, ": keep-alive\n\n");
+	}
+}
+
+// Runs on the change watcher thread so it must never block
+static void changeStreamCleanup(void *cls) {
+	ChangeStream * stream = cls;
+	ChangeWatchGroup * group = stream->group;
+	sem_wait(&changeWatchLock);
+	ChangeStream ** link = &group->streams;
+	while (*link != stream) {
+		link = &(*link)->next;
+	}
+	*link = stream->next;
+	// Every stream on the same collection shares one watch.  Once the kernel has sent IN_IGNORED the watch is already
+	// gone.  IN_DELETE_SELF is always followed by IN_IGNORED but IN_MOVE_SELF is not.
+	ChangeStream * other = group->streams;
+	while (other && other->watch != stream->watch) {
+		other = other->next;
+	}
+	if (!other && !stream->ignored) {
+		if (sem_trywait(&group->addingWatch) == 0) {
+			inotify_rm_watch(group->inotifyFd, stream->watch);
+			sem_post(&group->addingWatch);
+		} else {
+			group->unwatched = reallocSafe(group->unwatched,
+					sizeof(*group->unwatched) * (group->unwatchedCount + 1));
+			group->unwatched[group->unwatchedCount++] = stream->watch;
+		}
+	}
+	sem_post(&changeWatchLock);
+	leaveChangeWatchGroup(group);
+
+	freeSafe(stream->data);
+	freeSafe(stream);
+}
+
+static int watchForChanges(Request * request, RAP * rapSession, const char * url, Response ** response) {
+	ChangeWatchGroup * group = joinChangeWatchGroup(rapSession->user);
+	sem_wait(&group->addingWatch);
+
+	Message message = { .mID = RAP_REQUEST_WATCH, .fd = -1, .paramCount = 2 };
+	if (group->inotifyFd != -1) {
+		message.fd = fcntl(group->inotifyFd, F_DUPFD_CLOEXEC, 0);
+		if (message.fd == -1) {
+			stdLogError(errno, "Could not duplicate inotify instance to watch %s", url);
+			finishAddingWatch(group);
+			leaveChangeWatchGroup(group);
+			return RAP_RESPOND_INTERNAL_ERROR;
+		}
+	}
+	LockProvisions locks = { .source = LOCK_TYPE_NONE, .target = LOCK_TYPE_NONE };
+	message.params[RAP_PARAM_REQUEST_LOCK] = toMessageParam(locks);
+	message.params[RAP_PARAM_REQUEST_FILE] = stringToMessageParam(url);
+	char incomingBuffer[INCOMING_BUFFER_SIZE];
+	if (sendRecvRapMessage(rapSession, &message, incomingBuffer, sizeof(incomingBuffer)) <= 0) {
+		finishAddingWatch(group);
+		leaveChangeWatchGroup(group);
+		return RAP_RESPOND_INTERNAL_ERROR;
+	}
+	if (message.mID != RAP_RESPOND_OK || message.fd == -1) {
+		finishAddingWatch(group);
+		leaveChangeWatchGroup(group);
+		// The RAP is back in the pool before this is sent so the response mustn't refer to it
+		return createResponseFromMessage(request, &message, response, NULL);
+	}
+
+	int watch = messageParamTo(int, message.params[RAP_PARAM_WATCH_DESCRIPTOR]);
+	if (group->inotifyFd == -1) {
+		struct epoll_event event = { .events = EPOLLIN, .data.ptr = group };
+		if (epoll_ctl(changeWatchEpollFd, EPOLL_CTL_ADD, message.fd, &event) == -1) {
+			stdLogError(errno, "Could not add inotify instance to watch %s", url);
+			close(message.fd);
+			finishAddingWatch(group);
+			leaveChangeWatchGroup(group);
+			return RAP_RESPOND_INTERNAL_ERROR;
+		}
+		sem_wait(&changeWatchLock);
+		group->inotifyFd = message.fd;
+		sem_post(&changeWatchLock);
+	} else {
+		close(message.fd);
+	}
+
+	ChangeStream * stream = mallocSafe(sizeof(*stream));
+	stream->group = group;
+	stream->request = request;
+	stream->watch = watch;
+	stream->changes = 0;
+	stream->gone = 0;
+	stream->ignored = 0;
+	stream->started = 0;
+	stream->finished = 0;
+	stream->suspended = 0;
+	stream->keepAlive = 0;
+	size_t urlSize = strlen(url);
+	stream->data = mallocSafe(URL_ENCODED_SIZE(urlSize));
+	stream->dataSize = urlEncode(stream->data, url, urlSize);
+	sem_wait(&changeWatchLock);
+	stream->next = group->streams;
+	group->streams = stream;
+	sem_post(&changeWatchLock);
+	finishAddingWatch(group);
+
+	*response = MHD_create_response_from_callback(MHD_SIZE_UNKNOWN, stream->dataSize + 64, &changeStreamReader,
+			stream, &changeStreamCleanup);
+	if (!*response) {
+		stdLogError(errno, "Could not create response");
+		exit(255);
+	}
+	addHeader(*response, "Content-Type", "text/event-stream");
+	addHeader(*response, "Cache-Control", "no-cache");
+	addHeader(*response, "Server", "couling-webdavd");
+	return RAP_RESPOND_OK;
+}
+
+// Runs on a thread of its own for each stream.  The connection stays suspended until this is done.
+static void * setUpChangeStream(void * data) {
+	ChangeStreamSetup * setup = data;
+	RAP * rapSession = acquireRap(setup->user, setup->password, setup->clientIp);
+	if (AUTH_SUCCESS(rapSession)) {
+		setup->statusCode = watchForChanges(setup->request, rapSession, setup->url, &setup->response);
+		logAccess(setup->statusCode, "GET", rapSession->user, setup->url, setup->clientIp);
+		// Otherwise the RAP goes back to the pool when this thread ends
+		if (setup->statusCode == RAP_RESPOND_INTERNAL_ERROR) destroyRap(rapSession);
+	} else {
+		setup->statusCode = rapSession == AUTH_FAILED ? RAP_RESPOND_AUTH_FAILLED : RAP_RESPOND_INTERNAL_ERROR;
+		logAccess(setup->statusCode, "GET", rapSession->user, setup->url, setup->clientIp);
+	}
+	MHD_resume_connection(setup->request);
+	return NULL;
+}
+
+static void startSettingUpChangeStream(ChangeStreamSetup * setup) {
+	MHD_suspend_connection(setup->request);
+	pthread_t thread;
+	pthread_attr_t attributes;
+	pthread_attr_init(&attributes);
+	pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+	int result = pthread_create(&thread, &attributes, &setUpChangeStream, setup);
+	pthread_attr_destroy(&attributes);
+	if (result != 0) {
+		stdLogError(result, "Could not start thread to set up change stream");
+		setup->statusCode = RAP_RESPOND_INTERNAL_ERROR;
+		MHD_resume_connection(setup->request);
+	}
+}
+
+static void freeChangeStreamSetup(void * cls, Request * request, void ** s, enum MHD_RequestTerminationCode toe) {
+	ChangeStreamSetup * setup = *s;
+	if (!setup || setup == cls) return;
+	// The response holds the stream so this is how a stream is ended if its connection closes before it starts
+	if (setup->response) MHD_destroy_response(setup->response);
+	if (setup->user) free(setup->user);
+	if (setup->password) free(setup->password);
+	freeSafe(setup->url);
+	freeSafe(setup);
+	*s = NULL;
+}
+
+/////////////////////////////
+// End Change Notification //
+/////////////////////////////
+
 static int finishProcessingRequest(Request * request, RAP * processor, Response ** response) {
+	if (processor->requestHeldBodyFd != -1) return finishHeldPropFind(request, processor, response);
+
 	Message message;
 	char incomingBuffer[INCOMING_BUFFER_SIZE];
-	ssize_t readResult = recvMessage(processor->socketFd, &message, incomingBuffer, INCOMING_BUFFER_SIZE);
+	ssize_t readResult = recvRapResponse(processor, &message, incomingBuffer, INCOMING_BUFFER_SIZE);
 	if (readResult <= 0) {
 		if (readResult == 0) {
 			stdLogError(0, "RAP closed socket unexpectedly while waiting for response");
@@ -1446,6 +2704,59 @@ static int finishProcessingRequest(Request * request, RAP * processor, Response
 
 }
 
+// GET folder/?format=zip downloads the whole collection, deflated unless compression=none is also given
+static int requestedArchiveFormat(Request * request) {
+	const char * format = MHD_lookup_connection_value(request, MHD_GET_ARGUMENT_KIND, "format");
+	if (!format || strcmp(format, "zip")) return ARCHIVE_NONE;
+	const char * compression = MHD_lookup_connection_value(request, MHD_GET_ARGUMENT_KIND, "compression");
+	return compression && !strcmp(compression, "none") ? ARCHIVE_ZIP_STORED : ARCHIVE_ZIP;
+}
+
+static int isMediaType(const char * contentType, size_t length, const char * mediaType) {
+	return length == strlen(mediaType) && !strncasecmp(contentType, mediaType, length);
+}
+
+// Change streams are served by their own daemon, see Change Notification
+static int isChangeStreamRequest(Request * request, const char * method) {
+	const char * accept = getHeader(request, "Accept");
+	return !strcmp("GET", method) && accept && isMediaType(accept, strcspn(accept, ",; "), "text/event-stream");
+}
+
+// POST folder/ with a tar archive unpacks it into the folder.  Returns how the archive is compressed, or -1 if the
+// body isn't an archive that can be unpacked.
+static int uploadedArchiveEncoding(Request * request) {
+	const char * contentType = getHeader(request, "Content-Type");
+	if (!contentType) return -1;
+	size_t length = strcspn(contentType, "; ");
+	ContentEncoding encoding;
+	if (isMediaType(contentType, length, "application/x-tar")) {
+		encoding = CONTENT_ENCODING_IDENTITY;
+	} else if (isMediaType(contentType, length, "application/gzip")
+			|| isMediaType(contentType, length, "application/x-gzip")
+			|| isMediaType(contentType, length, "application/x-compressed-tar")) {
+		encoding = CONTENT_ENCODING_GZIP;
+	} else if (isMediaType(contentType, length, "application/zstd")
+			|| isMediaType(contentType, length, "application/x-zstd-compressed-tar")) {
+		encoding = CONTENT_ENCODING_ZSTD;
+	} else {
+		return -1;
+	}
+
+	// Or a tar sent with Content-Encoding
+	const char * contentEncoding = getHeader(request, "Content-Encoding");
+	if (contentEncoding && strcasecmp(contentEncoding, "identity")) {
+		if (encoding != CONTENT_ENCODING_IDENTITY) return -1;
+		if (!strcasecmp(contentEncoding, "gzip") || !strcasecmp(contentEncoding, "x-gzip")) {
+			encoding = CONTENT_ENCODING_GZIP;
+		} else if (!strcasecmp(contentEncoding, "zstd")) {
+			encoding = CONTENT_ENCODING_ZSTD;
+		} else {
+			return -1;
+		}
+	}
+	return encoding;
+}
+
 static int startProcessingRequest(Request * request, const char * url, const char * method, RAP * rapSession,
 		Response ** response) {
 
@@ -1468,14 +2779,49 @@ static int startProcessingRequest(Request * request, const char * url, const cha
 	//stdLog("%s %s data", method, writeHandle ? "with" : "without");
 
 	Message message;
+	int acceptedEncodings;
+	int wantSignature;
+	int archiveFormat;
+	int archiveEncoding;
+	off_t requestLength;
 	// These methods are all passed to the RAP in a very similar way
+	const char * accept = getHeader(request, "Accept");
 	if (!strcmp("GET", method) || !strcmp("HEAD", method)) {
 		message.mID = RAP_REQUEST_GET;
-		message.paramCount = 2;
+		message.paramCount = 5;
+		acceptedEncodings = acceptedContentEncodings(getHeader(request, "Accept-Encoding"));
+		message.params[RAP_PARAM_REQUEST_ENCODINGS] = toMessageParam(acceptedEncodings);
+		wantSignature = accept && strstr(accept, DELTA_SIGNATURE_MIME_TYPE);
+		message.params[RAP_PARAM_REQUEST_SIGNATURE] = toMessageParam(wantSignature);
+		archiveFormat = requestedArchiveFormat(request);
+		message.params[RAP_PARAM_REQUEST_ARCHIVE] = toMessageParam(archiveFormat);
 	} else if (!strcmp("PUT", method)) {
 		message.mID = RAP_REQUEST_PUT;
+		message.paramCount = 5;
+		const char * contentLength = getHeader(request, "Content-Length");
+		requestLength = contentLength ? strtoll(contentLength, NULL, 10) : -1;
+		message.params[RAP_PARAM_REQUEST_LENGTH] = toMessageParam(requestLength);
+		message.params[RAP_PARAM_REQUEST_RANGE] = stringToMessageParam(getHeader(request, "Content-Range"));
+		message.params[RAP_PARAM_REQUEST_UPLOAD_TOKEN] = stringToMessageParam(getHeader(request, "Upload-Token"));
+	} else if (!strcmp("PATCH", method)) {
+		const char * contentType = getHeader(request, "Content-Type");
+		if (!contentType || strncmp(contentType, DELTA_MIME_TYPE, sizeof(DELTA_MIME_TYPE) - 1)) {
+			return RAP_RESPOND_UNSUPPORTED_MEDIA_TYPE;
+		}
+		message.mID = RAP_REQUEST_PATCH;
 		message.paramCount = 2;
+	} else if (!strcmp("POST", method)) {
+		archiveEncoding = uploadedArchiveEncoding(request);
+		if (archiveEncoding == -1) return RAP_RESPOND_UNSUPPORTED_MEDIA_TYPE;
+		message.mID = RAP_REQUEST_EXTRACT;
+		message.paramCount = 3;
+		message.params[RAP_PARAM_REQUEST_ARCHIVE_ENCODING] = toMessageParam(archiveEncoding);
 	} else if (!strcmp("PROPFIND", method)) {
+		if (rapSession->requestReadDataFd == -1) {
+			return coalescePropFind(request, rapSession, url, NULL, 0, requestLocks, response);
+		} else if (holdPropFind(request, rapSession, url, requestLocks)) {
+			return RAP_RESPOND_CONTINUE;
+		}
 		message.mID = RAP_REQUEST_PROPFIND;
 		message.paramCount = 3;
 		message.params[RAP_PARAM_REQUEST_DEPTH] = stringToMessageParam(getHeader(request, HEADER_DEPTH));
@@ -1483,6 +2829,10 @@ static int startProcessingRequest(Request * request, const char * url, const cha
 		message.mID = RAP_REQUEST_PROPPATCH;
 		message.paramCount = 3;
 		message.params[RAP_PARAM_REQUEST_DEPTH] = stringToMessageParam(getHeader(request, HEADER_DEPTH));
+	} else if (!strcmp("REPORT", method)) {
+		message.mID = RAP_REQUEST_REPORT;
+		message.paramCount = 3;
+		message.params[RAP_PARAM_REQUEST_DEPTH] = stringToMessageParam(getHeader(request, HEADER_DEPTH));
 	} else if (!strcmp("MKCOL", method)) {
 		message.mID = RAP_REQUEST_MKCOL;
 		message.paramCount = 2;
@@ -1514,7 +2864,7 @@ static int startProcessingRequest(Request * request, const char * url, const cha
 			}
 		}
 
-		if (sendRecvMessage(rapSession->socketFd, &message, incomingBuffer, sizeof(incomingBuffer)) <= 0) {
+		if (sendRecvRapMessage(rapSession, &message, incomingBuffer, sizeof(incomingBuffer)) <= 0) {
 			return RAP_RESPOND_INTERNAL_ERROR;
 		}
 
@@ -1541,7 +2891,7 @@ static int startProcessingRequest(Request * request, const char * url, const cha
 			}
 		}
 
-		if (sendRecvMessage(rapSession->socketFd, &message, incomingBuffer, sizeof(incomingBuffer)) <= 0) {
+		if (sendRecvRapMessage(rapSession, &message, incomingBuffer, sizeof(incomingBuffer)) <= 0) {
 			return RAP_RESPOND_INTERNAL_ERROR;
 		}
 
@@ -1571,6 +2921,7 @@ static int startProcessingRequest(Request * request, const char * url, const cha
 	} else if (!strcmp("OPTIONS", method)) {
 		*response = createFileResponse(OPTIONS_PAGE, "text/html", rapSession);
 		addHeader(*response, "Accept", ACCEPT_HEADER);
+		addHeader(*response, "Accept-Patch", DELTA_MIME_TYPE);
 		return RAP_RESPOND_OK;
 
 	} else {
@@ -1585,7 +2936,7 @@ static int startProcessingRequest(Request * request, const char * url, const cha
 	message.params[RAP_PARAM_REQUEST_LOCK] = toMessageParam(requestLocks);
 	message.params[RAP_PARAM_REQUEST_FILE] = stringToMessageParam(url);
 
-	if (sendRecvMessage(rapSession->socketFd, &message, incomingBuffer, sizeof(incomingBuffer)) <= 0) {
+	if (sendRecvRapMessage(rapSession, &message, incomingBuffer, sizeof(incomingBuffer)) <= 0) {
 		return RAP_RESPOND_INTERNAL_ERROR;
 	}
 
@@ -1644,6 +2995,37 @@ static int sendResponse(Request * request, int statusCode, Response * response,
 
 }
 
+// The size of host without its port, if it has one ("example.com:80" or "[::1]:80")
+static size_t hostNameSize(const char * host) {
+	const char * bracket = strrchr(host, ']');
+	const char * colon = strrchr(bracket ? bracket : host, ':');
+	return colon ? colon - host : strlen(host);
+}
+
+// Sends the client to another of its listen's ports on the same host, eg: to and from <event-stream-port>
+static int redirectToPort(Request * request, DaemonConfig * daemon, int port, const char * url) {
+	const char * host = getHeader(request, "Host");
+	if (!host) host = daemon->host;
+	if (!host) return sendResponse(request, RAP_RESPOND_INTERNAL_ERROR, NULL, NULL);
+
+	size_t hostSize = hostNameSize(host);
+	size_t urlSize = strlen(url);
+	size_t bufferSize = hostSize + URL_ENCODED_SIZE(urlSize) + 20;
+	if (bufferSize > MAX_VARABLY_DEFINED_ARRAY) return sendResponse(request, RAP_RESPOND_URI_TOO_LARGE, NULL, NULL);
+	char buffer[bufferSize];
+	size_t written = snprintf(buffer, bufferSize, "%s://%.*s:%d", daemon->sslEnabled ? "https" : "http",
+			(int) hostSize, host, port);
+	urlEncode(buffer + written, url, urlSize);
+
+	Response * response = MHD_create_response_from_buffer(0, NULL, MHD_RESPMEM_MUST_COPY);
+	if (!response) {
+		stdLogError(errno, "Unable to create 307 response");
+		return sendResponse(request, RAP_RESPOND_INTERNAL_ERROR, NULL, NULL);
+	}
+	addHeader(response, "Location", buffer);
+	return sendResponse(request, MHD_HTTP_TEMPORARY_REDIRECT, response, NULL);
+}
+
 /**
  * Main handler method for handling requests.  This method does quite a lot to make libmicrohttp easier to
  * work with. Primarily this wraps up libmicrohttp's quirky multi-call aproach to handling request bodies.
@@ -1676,7 +3058,11 @@ static int answerToRequest(void *cls, Request *request, const char *url, const c
 
 	RAP * rapSession = *((RAP **) s);
 
-	if (rapSession) {
+	if (rapSession == REQUEST_ANSWERED) {
+		// Anything libmicrohttpd still passes on of a refused body is dropped
+		*upload_data_size = 0;
+		return MHD_YES;
+	} else if (rapSession) {
 		if (*upload_data_size) {
 			// Uploading more data
 			if (rapSession->requestWriteDataFd != -1) {
@@ -1715,6 +3101,9 @@ static int answerToRequest(void *cls, Request *request, const char *url, const c
 			}
 			return result;
 		}
+	} else if (isChangeStreamRequest(request, method) && ((DaemonConfig *) cls)->eventStreamPort) {
+		*s = REQUEST_ANSWERED;
+		return redirectToPort(request, cls, ((DaemonConfig *) cls)->eventStreamPort, url);
 	} else {
 		// All requests must be Authenticated
 		char * password;
@@ -1757,10 +3146,20 @@ static int answerToRequest(void *cls, Request *request, const char *url, const c
 						close(rapSession->requestWriteDataFd);
 						rapSession->requestWriteDataFd = -1;
 					}
-					rapSession->requestResponseAlreadyGiven = statusCode;
-					rapSession->requestResponseObjectAlreadyGiven = response;
-					logAccess(RAP_RESPOND_INTERNAL_ERROR, method, rapSession->user, url, clientIp);
-					return MHD_YES;
+					// The RAP has already refused the request so answer now rather than accepting a body that would
+					// only be thrown away.  A response queued this early stops libmicrohttpd sending 100 Continue and
+					// it closes the connection instead of reading the rest of the upload.  Only PUT, POST and PATCH
+					// are checked before the RAP asks for the body.  Other methods read the body first, so their
+					// bodies are still accepted before they are refused.
+					logAccess(statusCode, method, rapSession->user, url, clientIp);
+					int result = sendResponse(request, statusCode, response, rapSession);
+					if (statusCode == RAP_RESPOND_INTERNAL_ERROR) {
+						destroyRap(rapSession);
+					} else {
+						releaseRap(rapSession);
+					}
+					*s = REQUEST_ANSWERED;
+					return result;
 				}
 			} else {
 				rapSession->requestReadDataFd = -1;
@@ -1793,11 +3192,8 @@ static int answerToRequest(void *cls, Request *request, const char *url, const c
 			}
 		} else if (rapSession == AUTH_FAILED) {
 			logAccess(RAP_RESPOND_AUTH_FAILLED, method, rapSession->user, url, clientIp);
-			if (requestHasData(request)) {
-				return MHD_YES;
-
 			// If configured, OPTIONS should be returned even if authentication fails
-			} else if ( !strcmp("OPTIONS", method) && config.unprotectOptions ) {
+			if ( !strcmp("OPTIONS", method) && config.unprotectOptions ) {
 				Response * response = NULL;
 				response = createFileResponse(OPTIONS_PAGE, "text/html", rapSession);
 				addHeader(response, "Accept", ACCEPT_HEADER);
@@ -1809,12 +3205,91 @@ static int answerToRequest(void *cls, Request *request, const char *url, const c
 			}
 		} else /*if (*rapSession == AUTH_ERROR)*/{
 			logAccess(RAP_RESPOND_INTERNAL_ERROR, method, rapSession->user, url, clientIp);
-			if (requestHasData(request)) {
-				return MHD_YES;
-			} else {
-				return sendResponse(request, RAP_RESPOND_INTERNAL_ERROR, NULL, rapSession);
+			return sendResponse(request, RAP_RESPOND_INTERNAL_ERROR, NULL, rapSession);
+		}
+	}
+}
+
+// A page on another port of the same host (eg: the listen's own port) may read change streams with the user's
+// credentials.  Returns the request's Origin if it is such a page.  Browsers send "null" after a redirect from
+// another origin, so pages must connect to <event-stream-port> directly.
+static const char * allowedOrigin(Request * request) {
+	const char * origin = getHeader(request, "Origin");
+	const char * host = getHeader(request, "Host");
+	if (!origin || !host) return NULL;
+	const char * originHost = strstr(origin, "://");
+	if (!originHost) return NULL;
+	originHost += sizeof("://") - 1;
+	size_t hostSize = hostNameSize(host);
+	return hostNameSize(originHost) == hostSize && !strncasecmp(originHost, host, hostSize) ? origin : NULL;
+}
+
+static void addCrossOriginHeaders(Response * response, const char * origin) {
+	addHeader(response, "Access-Control-Allow-Origin", origin);
+	addHeader(response, "Access-Control-Allow-Credentials", "true");
+	addHeader(response, "Vary", "Origin");
+}
+
+// Browsers ask first before sending a stream request with headers of its own, eg: Authorization from fetch()
+static int answerChangeStreamPreflight(Request * request, const char * origin) {
+	Response * response = MHD_create_response_from_buffer(0, NULL, MHD_RESPMEM_MUST_COPY);
+	if (!response) {
+		stdLogError(errno, "Unable to create preflight response");
+		return sendResponse(request, RAP_RESPOND_INTERNAL_ERROR, NULL, NULL);
+	}
+	addCrossOriginHeaders(response, origin);
+	addHeader(response, "Access-Control-Allow-Methods", "GET");
+	const char * headers = getHeader(request, "Access-Control-Request-Headers");
+	if (headers) addHeader(response, "Access-Control-Allow-Headers", headers);
+	addHeader(response, "Access-Control-Max-Age", "600");
+	return sendResponse(request, RAP_RESPOND_OK_NO_CONTENT, response, NULL);
+}
+
+// Handler for <event-stream-port>.  This runs on the change watcher thread so anything that blocks is done by
+// setUpChangeStream() while the connection is suspended.  Anything other than a change stream is sent back to the
+// listen's own port.
+static int answerToChangeStreamRequest(void *cls, Request *request, const char *url, const char *method,
+		const char *version, const char *upload_data, size_t *upload_data_size, void ** s) {
+	ChangeStreamSetup * setup = *s;
+	if (setup == cls) {
+		// Already sent back, anything libmicrohttpd still passes on of a body is dropped
+		*upload_data_size = 0;
+		return MHD_YES;
+	} else if (setup) {
+		// Set up and resumed
+		Response * response = setup->response;
+		setup->response = NULL;
+		const char * origin = allowedOrigin(request);
+		if (origin) {
+			// Static responses are shared by every request so they can't be given this one's headers
+			if (!response) {
+				response = MHD_create_response_from_buffer(0, NULL, MHD_RESPMEM_MUST_COPY);
+				if (response && setup->statusCode == RAP_RESPOND_AUTH_FAILLED) {
+					addHeader(response, "WWW-Authenticate", AUTHENTICATE_HEADER);
+				}
 			}
+			if (response) addCrossOriginHeaders(response, origin);
 		}
+		return sendResponse(request, setup->statusCode, response, NULL);
+	} else if (!strcmp("OPTIONS", method) && getHeader(request, "Access-Control-Request-Method")
+			&& allowedOrigin(request)) {
+		*s = cls;
+		return answerChangeStreamPreflight(request, allowedOrigin(request));
+	} else if (!isChangeStreamRequest(request, method) || requestHasData(request)) {
+		*s = cls;
+		return redirectToPort(request, cls, ((DaemonConfig *) cls)->port, url);
+	} else {
+		setup = mallocSafe(sizeof(*setup));
+		setup->request = request;
+		setup->url = copyString(url);
+		setup->password = NULL;
+		setup->user = MHD_basic_auth_get_username_password(request, &setup->password);
+		getRequestIP(setup->clientIp, sizeof(setup->clientIp), request);
+		setup->statusCode = 0;
+		setup->response = NULL;
+		*s = setup;
+		startSettingUpChangeStream(setup);
+		return MHD_YES;
 	}
 }
 
@@ -1903,7 +3378,7 @@ static void initializeStaticResponses() {
 
 	string = createStaticFileName("HTTP_UNAUTHORIZED.html");
 	initializeStaticResponse(&UNAUTHORIZED_PAGE, string, "text/html");
-	addHeader(UNAUTHORIZED_PAGE, "WWW-Authenticate", "Basic realm=\"My Server\"");
+	addHeader(UNAUTHORIZED_PAGE, "WWW-Authenticate", AUTHENTICATE_HEADER);
 	freeSafe(string);
 
 	string = createStaticFileName("HTTP_METHOD_NOT_SUPPORTED.html");
@@ -1927,6 +3402,32 @@ static void initializeEnvVariables() {
 	setenv("WEBDAVD_MIME_FILE", config.mimeTypesFile, 1);
 	if (config.chrootPath) setenv("WEBDAVD_CHROOT_PATH", config.chrootPath, 1);
 	else unsetenv("WEBDAVD_CHROOT_PATH");
+
+	char buffer[BUFFER_SIZE];
+	snprintf(buffer, sizeof(buffer), "%zu", config.precompressMinSize);
+	setenv("WEBDAVD_PRECOMPRESS_MIN_SIZE", buffer, 1);
+	size_t length = 0;
+	buffer[0] = '\0';
+	for (int i = 0; i < config.compressionMimeTypeCount && length < sizeof(buffer); i++) {
+		length += snprintf(buffer + length, sizeof(buffer) - length, i ? " %s" : "%s",
+				config.compressionMimeTypes[i]);
+	}
+	setenv("WEBDAVD_COMPRESSIBLE_TYPES", buffer, 1);
+	snprintf(buffer, sizeof(buffer), "%d", config.statThreads);
+	setenv("WEBDAVD_STAT_THREADS", buffer, 1);
+	snprintf(buffer, sizeof(buffer), "%zu", config.directoryCacheSize);
+	setenv("WEBDAVD_DIRECTORY_CACHE_SIZE", buffer, 1);
+	snprintf(buffer, sizeof(buffer), "%d", config.directoryCacheDirectories);
+	setenv("WEBDAVD_DIRECTORY_CACHE_DIRECTORIES", buffer, 1);
+	snprintf(buffer, sizeof(buffer), "%d", config.treeThreads);
+	setenv("WEBDAVD_TREE_THREADS", buffer, 1);
+	snprintf(buffer, sizeof(buffer), "%d", config.putDurability);
+	setenv("WEBDAVD_PUT_DURABILITY", buffer, 1);
+	snprintf(buffer, sizeof(buffer), "%ld", (long) config.uploadExpiry);
+	setenv("WEBDAVD_UPLOAD_EXPIRY", buffer, 1);
+	// Report progress often enough that the daemon never times out a RAP that is still working
+	snprintf(buffer, sizeof(buffer), "%d", config.rapTimeoutRead >= 8 ? (int) config.rapTimeoutRead / 4 : 1);
+	setenv("WEBDAVD_PROGRESS_INTERVAL", buffer, 1);
 }
 
 ////////////////////////
@@ -1962,6 +3463,38 @@ static int getBindAddress(struct sockaddr_in6 * address, DaemonConfig * daemon)
 	return 1;
 }
 
+// Serves <event-stream-port>.  It has no threads, its connections are run by the change watcher.
+static void startChangeStreamDaemon(DaemonConfig * daemon, struct sockaddr_in6 * address) {
+	struct sockaddr_in6 streamAddress = *address;
+	streamAddress.sin6_port = htons(daemon->eventStreamPort);
+	struct MHD_Daemon * streamDaemon;
+	if (daemon->sslEnabled) {
+		streamDaemon = MHD_start_daemon(
+				MHD_USE_EPOLL | MHD_ALLOW_SUSPEND_RESUME | MHD_USE_DUAL_STACK | MHD_USE_PEDANTIC_CHECKS
+						| MHD_USE_SSL, 0 /* ignored */, NULL, NULL,                  //
+				(MHD_AccessHandlerCallback) &answerToChangeStreamRequest, daemon,   //
+				MHD_OPTION_NOTIFY_COMPLETED, &freeChangeStreamSetup, daemon,        //
+				MHD_OPTION_SOCK_ADDR, &streamAddress,                               // Specifies both host and port
+				MHD_OPTION_HTTPS_CERT_CALLBACK, &sslSNICallback,                    // enable ssl
+				MHD_OPTION_PER_IP_CONNECTION_LIMIT, config.maxConnectionsPerIp,     //
+				MHD_OPTION_END);
+	} else {
+		streamDaemon = MHD_start_daemon(
+				MHD_USE_EPOLL | MHD_ALLOW_SUSPEND_RESUME | MHD_USE_DUAL_STACK | MHD_USE_PEDANTIC_CHECKS,
+				0 /* ignored */, NULL, NULL,                                        //
+				(MHD_AccessHandlerCallback) &answerToChangeStreamRequest, daemon,   //
+				MHD_OPTION_NOTIFY_COMPLETED, &freeChangeStreamSetup, daemon,        //
+				MHD_OPTION_SOCK_ADDR, &streamAddress,                               // Specifies both host and port
+				MHD_OPTION_PER_IP_CONNECTION_LIMIT, config.maxConnectionsPerIp,     //
+				MHD_OPTION_END);
+	}
+	if (!streamDaemon) {
+		stdLogError(errno, "Unable to initialise event stream daemon on port %d", daemon->eventStreamPort);
+	} else {
+		addChangeStreamDaemon(streamDaemon);
+	}
+}
+
 void cleaner() {
 	while (!shuttingDown) {
 		int total = 60;
@@ -1982,7 +3515,10 @@ static void runServer() {
 	initializeStaticResponses();
 	initializeRapDatabase();
 	initializeLockDB();
+	initializePropFindFlights();
+	initializeChangeStreams();
 	initializeSSL();
+	initializeCompression();
 	initializeEnvVariables();
 
 	// Start up the daemons
@@ -2025,9 +3561,12 @@ static void runServer() {
 			}
 			if (!daemons[i]) {
 				stdLogError(errno, "Unable to initialise daemon on port %d", config.daemons[i].port);
+			} else if (config.daemons[i].eventStreamPort && !config.daemons[i].forwardToPort) {
+				startChangeStreamDaemon(&config.daemons[i], &address);
 			}
 		}
 	}
+	startChangeWatcher();
 }
 
 int main(int argCount, char ** args) {
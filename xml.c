@@ -1,11 +1,17 @@
 #include "xml.h"
 
 #include "shared.h"
+#include "url.h"
 
+#include <errno.h>
 #include <stddef.h>
 #include <string.h>
 #include <unistd.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 ////////////////
 // XML Reader //
 ////////////////
@@ -165,31 +171,150 @@ int xmlTextWriterWriteElementString(xmlTextWriterPtr writer, const char * prefix
 }
 
 void xmlTextWriterWriteURL(xmlTextWriterPtr writer, const char * url) {
+	// The encoded url is all safe characters and '%' so there is nothing left for the writer to escape
 	char buffer[1024];
-	const char * urlPtr = url;
-	char * writePtr = buffer;
-	unsigned char c;
-	while ((c = *(urlPtr++))) {
-		if ((c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '-' || c == '_'
-				|| c == '.' || c == '~' || c == '/') {
-			*(writePtr++) = c;
+	size_t size = strlen(url);
+	char * encoded = URL_ENCODED_SIZE(size) > sizeof(buffer) ? mallocSafe(URL_ENCODED_SIZE(size)) : buffer;
+	size = urlEncode(encoded, url, size);
+	xmlTextWriterWriteRawLen(writer, encoded, size);
+	if (encoded != buffer) freeSafe(encoded);
+}
+
+/////////////////////////
+// End XML Text Writer //
+/////////////////////////
+
+/////////////////////
+// Buffered Writer //
+/////////////////////
+
+// A plain output buffer for documents simple enough to be written without xmlTextWriter. Everything is collected
+// in one large buffer and written with as few write() calls as possible.
+
+FdWriter * fdWriterNew(int fd, size_t bufferSize) {
+	FdWriter * writer = mallocSafe(sizeof(*writer) + bufferSize);
+	writer->fd = fd;
+	writer->size = 0;
+	writer->bufferSize = bufferSize;
+	writer->failed = 0;
+	return writer;
+}
+
+void fdWriterFlush(FdWriter * writer) {
+	size_t written = 0;
+	while (written < writer->size && !writer->failed) {
+		ssize_t result = write(writer->fd, writer->buffer + written, writer->size - written);
+		if (result < 0) {
+			if (errno != EINTR) {
+				// The reader has gone away.  Keep accepting output but don't try to write it anywhere.
+				writer->failed = 1;
+			}
 		} else {
-			static const char * lookup = "0123456789ABCDEF";
-			*(writePtr++) = '%';
-			*(writePtr++) = lookup[(c & 0xF0) >> 4];
-			*(writePtr++) = lookup[c & 0x0F];
+			written += result;
 		}
-		if (writePtr > buffer + sizeof(buffer) - 5) {
-			*writePtr = '\0';
-			xmlTextWriterWriteString(writer, buffer);
-			writePtr = buffer;
+	}
+	writer->size = 0;
+}
+
+void fdWriterFree(FdWriter * writer) {
+	fdWriterFlush(writer);
+	close(writer->fd);
+	freeSafe(writer);
+}
+
+void fdWriterWrite(FdWriter * writer, const char * data, size_t size) {
+	while (writer->size + size > writer->bufferSize) {
+		size_t chunk = writer->bufferSize - writer->size;
+		memcpy(writer->buffer + writer->size, data, chunk);
+		writer->size += chunk;
+		data += chunk;
+		size -= chunk;
+		fdWriterFlush(writer);
+	}
+	memcpy(writer->buffer + writer->size, data, size);
+	writer->size += size;
+}
+
+// Finds the first character in text which must be escaped in XML content, or end if there are none
+static const char * findXmlEscape(const char * text, const char * end) {
+#ifdef __SSE2__
+	const __m128i amp = _mm_set1_epi8('&');
+	const __m128i lt = _mm_set1_epi8('<');
+	const __m128i gt = _mm_set1_epi8('>');
+	const __m128i quot = _mm_set1_epi8('"');
+	const __m128i cr = _mm_set1_epi8('\r');
+	while (end - text >= 16) {
+		__m128i block = _mm_loadu_si128((const __m128i *) text);
+		__m128i match = _mm_or_si128(
+				_mm_or_si128(_mm_cmpeq_epi8(block, amp), _mm_cmpeq_epi8(block, lt)),
+				_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(block, gt), _mm_cmpeq_epi8(block, quot)),
+						_mm_cmpeq_epi8(block, cr)));
+		int mask = _mm_movemask_epi8(match);
+		if (mask) {
+			return text + __builtin_ctz(mask);
 		}
+		text += 16;
 	}
-	*writePtr = '\0';
-	xmlTextWriterWriteString(writer, buffer);
+#endif
+	while (text < end && *text != '&' && *text != '<' && *text != '>' && *text != '"' && *text != '\r') {
+		text++;
+	}
+	return text;
+}
+
+// Writes text escaped exactly as xmlTextWriterWriteString() would
+void fdWriterWriteEscaped(FdWriter * writer, const char * text) {
+	const char * end = text + strlen(text);
+	while (text < end) {
+		const char * next = findXmlEscape(text, end);
+		fdWriterWrite(writer, text, next - text);
+		if (next == end) break;
+		switch (*next) {
+		case '&':
+			fdWriterWriteLiteral(writer, "&amp;");
+			break;
+		case '<':
+			fdWriterWriteLiteral(writer, "&lt;");
+			break;
+		case '>':
+			fdWriterWriteLiteral(writer, "&gt;");
+			break;
+		case '"':
+			fdWriterWriteLiteral(writer, "&quot;");
+			break;
+		default:
+			fdWriterWriteLiteral(writer, "&#13;");
+			break;
+		}
+		text = next + 1;
+	}
+}
+
+// Writes url percent encoded exactly as xmlTextWriterWriteURL() would
+void fdWriterWriteURL(FdWriter * writer, const char * url) {
+	size_t size = strlen(url);
+	if (URL_ENCODED_SIZE(size) > writer->bufferSize - writer->size) {
+		fdWriterFlush(writer);
+	}
+	if (URL_ENCODED_SIZE(size) <= writer->bufferSize) {
+		writer->size += urlEncode(writer->buffer + writer->size, url, size);
+	} else {
+		char * encoded = mallocSafe(URL_ENCODED_SIZE(size));
+		fdWriterWrite(writer, encoded, urlEncode(encoded, url, size));
+		freeSafe(encoded);
+	}
+}
+
+void fdWriterWriteNumber(FdWriter * writer, unsigned long long number) {
+	char buffer[24];
+	char * ptr = buffer + sizeof(buffer);
+	do {
+		*(--ptr) = '0' + (number % 10);
+		number /= 10;
+	} while (number);
+	fdWriterWrite(writer, ptr, buffer + sizeof(buffer) - ptr);
 }
 
 /////////////////////////
-// End XML Text Writer //
+// End Buffered Writer //
 /////////////////////////
-
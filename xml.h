@@ -21,4 +21,22 @@ int xmlTextWriterWriteElementString(xmlTextWriterPtr writer, const char * prefix
 		const char * string);
 void xmlTextWriterWriteURL(xmlTextWriterPtr writer, const char * url);
 
+// Buffered Writer
+typedef struct FdWriter {
+	int fd;
+	int failed;
+	size_t size;
+	size_t bufferSize;
+	char buffer[];
+} FdWriter;
+
+FdWriter * fdWriterNew(int fd, size_t bufferSize);
+void fdWriterFlush(FdWriter * writer);
+void fdWriterFree(FdWriter * writer);
+void fdWriterWrite(FdWriter * writer, const char * data, size_t size);
+#define fdWriterWriteLiteral(writer, literal) fdWriterWrite(writer, literal, sizeof(literal) - 1)
+void fdWriterWriteEscaped(FdWriter * writer, const char * text);
+void fdWriterWriteURL(FdWriter * writer, const char * url);
+void fdWriterWriteNumber(FdWriter * writer, unsigned long long number);
+
 #endif